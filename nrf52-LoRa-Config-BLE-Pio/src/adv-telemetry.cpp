@@ -0,0 +1,232 @@
+/**
+ * @file adv-telemetry.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Node status in the BLE scan response
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * The scan response carries the status of the node as manufacturer specific
+ * data, a phone can read it from every node in range without connecting.
+ * The advertising packet is full with flags, service UUID, name and TX power.
+ *
+ * The SoftDevice does not allow to change advertising data that is in use.
+ * New data is written into the other one of two buffer sets and handed to
+ * the SoftDevice without stopping the advertising. The scan response of
+ * Bluefruit is updated as well, it is used when advertising restarts after
+ * a disconnect.
+ */
+
+#include "main.h"
+
+/** Company ID for tests, no company ID is assigned for this payload */
+#define ADV_COMPANY_ID 0xFFFF
+/** Version of the payload layout */
+#define ADV_LAYOUT 1
+/** Bluefruit configures the only advertising set of the SoftDevice, it gets handle 0 */
+#define ADV_SET_HANDLE 0
+/** Minimum time between two battery measurements in ms */
+#define ADV_BATT_INTERVAL 60000
+
+/** Flags of the status */
+#define ADV_FLAG_LORAWAN 0x01
+#define ADV_FLAG_JOINED 0x02
+#define ADV_FLAG_P2P_LISTEN 0x04
+
+/** Battery voltage divider and ADC reference of the RAK4631 */
+#define VBAT_MV_PER_LSB (3000.0F / 4096.0F)
+#define VBAT_DIVIDER_COMP 1.73F
+#define PIN_VBAT WB_A0
+
+/** Status payload of the manufacturer specific data */
+struct s_adv_telemetry
+{
+	uint16_t company_id;
+	uint8_t layout;
+	uint8_t flags;
+	int8_t rssi;
+	int8_t snr;
+	uint8_t battery;
+	uint16_t tx_count;
+	uint16_t rx_count;
+	uint16_t fw_version;
+	uint32_t config_hash;
+} __attribute__((packed));
+
+/** Status in the scan response */
+static s_adv_telemetry adv_status;
+/** Values collected for the next update */
+static volatile uint16_t adv_tx_count = 0;
+static volatile uint16_t adv_rx_count = 0;
+static volatile int8_t adv_rssi = 0;
+static volatile int8_t adv_snr = 0;
+static uint8_t adv_battery = 0xFF;
+/** Double buffered advertising and scan response data */
+static uint8_t adv_data[2][BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+static uint8_t adv_scan[2][BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+/** Buffer set for the next update */
+static uint8_t adv_buf = 0;
+/** Flag if advertising was started and the advertising set exists */
+static bool adv_started = false;
+/** Time of the last battery measurement */
+static uint32_t adv_batt_time = 0;
+/** Protects the buffers, updates come from the loop, LoRa and BLE tasks */
+static SemaphoreHandle_t adv_mutex = NULL;
+
+/**
+ * @brief Convert the battery voltage into the charge level
+ *
+ * @param mvolts battery voltage in mV
+ * @return uint8_t level in percent
+ */
+static uint8_t adv_mv_to_percent(float mvolts)
+{
+	if (mvolts < 3300)
+	{
+		return 0;
+	}
+	if (mvolts < 3600)
+	{
+		return (mvolts - 3300) / 30;
+	}
+	mvolts = 10 + ((mvolts - 3600) * 0.15F);
+	return mvolts > 100 ? 100 : mvolts;
+}
+
+/**
+ * @brief Hash of the settings without the keys
+ *
+ * @return uint32_t FNV-1a hash
+ */
+static uint32_t adv_config_hash(void)
+{
+	s_lorawan_settings settings = g_lorawan_settings;
+	memset(settings.node_app_key, 0, sizeof(settings.node_app_key));
+	memset(settings.node_nws_key, 0, sizeof(settings.node_nws_key));
+	memset(settings.node_apps_key, 0, sizeof(settings.node_apps_key));
+
+	uint8_t *data = (uint8_t *)&settings;
+	uint32_t hash = 2166136261UL;
+	for (int idx = 0; idx < sizeof(s_lorawan_settings); idx++)
+	{
+		hash = (hash ^ data[idx]) * 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * @brief Add the status to the scan response and prepare the battery measurement
+ * Called from init_ble() before advertising starts
+ */
+void init_adv_telemetry(void)
+{
+	adv_mutex = xSemaphoreCreateMutex();
+
+	analogReference(AR_INTERNAL_3_0);
+	analogReadResolution(12);
+
+	adv_status.company_id = ADV_COMPANY_ID;
+	adv_status.layout = ADV_LAYOUT;
+	adv_status.battery = adv_battery;
+	adv_status.fw_version = (uint16_t)(SW_VERSION * 100);
+	adv_status.config_hash = adv_config_hash();
+	Bluefruit.ScanResponse.addData(BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &adv_status, sizeof(adv_status));
+}
+
+/**
+ * @brief Mark the advertising as started, updates go to the SoftDevice from now on
+ *
+ */
+void adv_telemetry_started(void)
+{
+	adv_started = true;
+	adv_telemetry_update();
+}
+
+/**
+ * @brief Collect the status and update the scan response if it changed
+ *
+ */
+void adv_telemetry_update(void)
+{
+	if (adv_mutex == NULL)
+	{
+		return;
+	}
+	xSemaphoreTake(adv_mutex, portMAX_DELAY);
+
+	s_adv_telemetry status = adv_status;
+	status.flags = (g_lorawan_settings.lorawan_enable ? ADV_FLAG_LORAWAN : 0) |
+				   (lpwan_has_joined ? ADV_FLAG_JOINED : 0) |
+				   (g_lorawan_settings.p2p_listen ? ADV_FLAG_P2P_LISTEN : 0);
+	status.rssi = adv_rssi;
+	status.snr = adv_snr;
+	status.tx_count = adv_tx_count;
+	status.rx_count = adv_rx_count;
+	status.config_hash = adv_config_hash();
+	if ((adv_batt_time == 0) || ((millis() - adv_batt_time) > ADV_BATT_INTERVAL))
+	{
+		adv_batt_time = millis();
+		adv_battery = adv_mv_to_percent(analogRead(PIN_VBAT) * VBAT_MV_PER_LSB * VBAT_DIVIDER_COMP);
+	}
+	status.battery = adv_battery;
+
+	if (!adv_started || (memcmp(&status, &adv_status, sizeof(s_adv_telemetry)) == 0))
+	{
+		adv_status = status;
+		xSemaphoreGive(adv_mutex);
+		return;
+	}
+	adv_status = status;
+
+	// Advertising data is unchanged, but must be in a new buffer as well
+	uint8_t adv_len = Bluefruit.Advertising.count();
+	memcpy(adv_data[adv_buf], Bluefruit.Advertising.getData(), adv_len);
+	adv_scan[adv_buf][0] = sizeof(s_adv_telemetry) + 1;
+	adv_scan[adv_buf][1] = BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA;
+	memcpy(&adv_scan[adv_buf][2], &adv_status, sizeof(s_adv_telemetry));
+
+	ble_gap_adv_data_t gap_adv;
+	gap_adv.adv_data.p_data = adv_data[adv_buf];
+	gap_adv.adv_data.len = adv_len;
+	gap_adv.scan_rsp_data.p_data = adv_scan[adv_buf];
+	gap_adv.scan_rsp_data.len = sizeof(s_adv_telemetry) + 2;
+	uint8_t handle = ADV_SET_HANDLE;
+	uint32_t result = sd_ble_gap_adv_set_configure(&handle, &gap_adv, NULL);
+	if (result != NRF_SUCCESS)
+	{
+		MYLOG("ADV", "Scan response update failed %ld", result);
+	}
+	adv_buf = adv_buf ? 0 : 1;
+
+	// The SoftDevice uses our buffer now, Bluefruit's data is used at the next start
+	Bluefruit.ScanResponse.clearData();
+	Bluefruit.ScanResponse.addData(BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &adv_status, sizeof(adv_status));
+
+	xSemaphoreGive(adv_mutex);
+}
+
+/**
+ * @brief Count a sent packet and update the status
+ *
+ */
+void adv_telemetry_tx(void)
+{
+	adv_tx_count++;
+	adv_telemetry_update();
+}
+
+/**
+ * @brief Record the signal of a received packet and update the status
+ *
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void adv_telemetry_rx(int16_t rssi, int8_t snr)
+{
+	adv_rx_count++;
+	adv_rssi = rssi < -128 ? -128 : rssi;
+	adv_snr = snr;
+	adv_telemetry_update();
+}
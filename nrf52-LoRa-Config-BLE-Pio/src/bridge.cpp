@@ -0,0 +1,447 @@
+/**
+ * @file bridge.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Bridge from the BLE UART to LoRaWAN or LoRa P2P
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Centrals send small messages with the CMD_BRIDGE_DATA command. The
+ * messages are queued and packed into one frame up to the maximum payload
+ * of the current data rate (LoRaWAN) or the maximum P2P packet size.
+ * A frame is sent when it is full or when the oldest message has waited
+ * BRIDGE_LATENCY ms.
+ *
+ * Frame on port BRIDGE_PORT: length, message, length, message, ...
+ *
+ * When the radio reports TX done, or the send failed, every message of the
+ * frame gets a receipt on the connection it came from. TX done only means
+ * the frame was sent. For confirmed LoRaWAN uplinks a second receipt
+ * reports if the network server acknowledged the frame (lmh_conf_result),
+ * the messages stay in the queue until then.
+ */
+
+#include "main.h"
+
+/** Longest message */
+#define BRIDGE_MAX_MSG 64
+/** Number of queued messages */
+#define BRIDGE_QUEUE 16
+/** Maximum time a message waits for more data in ms */
+#define BRIDGE_LATENCY 5000
+/** Time to wait for TX done of a frame in ms */
+#define BRIDGE_TX_TIMEOUT 20000
+/** Time to wait for the ACK result of a confirmed frame in ms, covers 8 transmissions with their receive windows */
+#define BRIDGE_CONFIRM_TIMEOUT 60000
+/** Retry time if LoRaWAN is busy in ms */
+#define BRIDGE_RETRY 1000
+/** LoRaWAN port of the bridge frames */
+#define BRIDGE_PORT 10
+/** Largest P2P packet */
+#define BRIDGE_P2P_MAX 255
+
+/** Queued message */
+struct s_bridge_msg
+{
+	uint16_t id;
+	uint16_t conn_handle;
+	uint32_t queued;
+	uint8_t len;
+	uint8_t data[BRIDGE_MAX_MSG];
+};
+
+/** Message queue, filled by the callback task, emptied by the loop task */
+static s_bridge_msg bridge_queue[BRIDGE_QUEUE];
+static uint8_t bridge_head = 0;
+static uint8_t bridge_tail = 0;
+static volatile uint8_t bridge_count = 0;
+/** Number of messages in the frame that is sent, 0 => no frame in the air */
+static volatile uint8_t bridge_in_flight = 0;
+/** Time the frame was handed to the radio */
+static uint32_t bridge_tx_start = 0;
+/** TX result from the LoRa task, 0 => none, 1 => sent, 2 => failed */
+static volatile uint8_t bridge_result = 0;
+/** ACK result from the LoRa task, 0 => none, 1 => acknowledged, 2 => not acknowledged */
+static volatile uint8_t bridge_confirm = 0;
+/** Flag if the frame in the air is a confirmed uplink */
+static bool bridge_wait_confirm = false;
+/** Flag if the sent receipts of a confirmed frame are out */
+static bool bridge_sent = false;
+/** ID of the next message */
+static uint16_t bridge_next_id = 1;
+
+/** Timer for the latency deadline and retries */
+SoftwareTimer g_bridge_timer;
+/** Flag if the bridge timer was created */
+static bool bridge_timer_init = false;
+
+/** Metrics */
+static s_bridge_stats bridge_stats;
+/** Start of the metrics in ms */
+static uint32_t bridge_stats_start = 0;
+
+/**
+ * @brief Wake up the loop task to handle the bridge
+ *
+ */
+static void bridge_wake_loop(void)
+{
+	task_event(6);
+}
+
+/**
+ * @brief Timer callback for the latency deadline
+ *
+ * @param unused
+ */
+void bridge_timer_cb(TimerHandle_t unused)
+{
+	task_event(6);
+}
+
+/**
+ * @brief Start or restart the one shot bridge timer
+ *
+ * @param time_ms delay in milliseconds
+ */
+static void bridge_start_timer(uint32_t time_ms)
+{
+	if (time_ms == 0)
+	{
+		time_ms = 1;
+	}
+	if (!bridge_timer_init)
+	{
+		g_bridge_timer.begin(time_ms, bridge_timer_cb, NULL, false);
+		bridge_timer_init = true;
+	}
+	else
+	{
+		g_bridge_timer.stop();
+		g_bridge_timer.setPeriod(time_ms);
+	}
+	g_bridge_timer.start();
+}
+
+/**
+ * @brief Get the maximum frame size for the current mode and data rate
+ *
+ * @return uint8_t maximum payload
+ */
+static uint8_t bridge_max_frame(void)
+{
+	return g_lorawan_settings.lorawan_enable ? lpwan_max_payload() : BRIDGE_P2P_MAX;
+}
+
+/**
+ * @brief Queue a message for the bridge
+ * Called by the command handler
+ *
+ * @param conn_handle connection of the sender
+ * @param data message
+ * @param len length of the message
+ * @param id set to the ID of the message, used in the receipt
+ * @return uint8_t CMD_STATUS_xxx
+ */
+uint8_t bridge_queue_msg(uint16_t conn_handle, uint8_t *data, uint8_t len, uint16_t *id)
+{
+	if (!g_lorawan_initialized)
+	{
+		return CMD_STATUS_NOT_AVAILABLE;
+	}
+	if ((len == 0) || (len > BRIDGE_MAX_MSG))
+	{
+		return CMD_STATUS_BAD_LENGTH;
+	}
+	if (bridge_count >= BRIDGE_QUEUE)
+	{
+		bridge_stats.rejected++;
+		return CMD_STATUS_BUSY;
+	}
+
+	s_bridge_msg *msg = &bridge_queue[bridge_head];
+	msg->id = bridge_next_id++;
+	msg->conn_handle = conn_handle;
+	msg->queued = millis();
+	msg->len = len;
+	memcpy(msg->data, data, len);
+	bridge_head = (bridge_head + 1) % BRIDGE_QUEUE;
+	*id = msg->id;
+
+	taskENTER_CRITICAL();
+	bridge_count++;
+	taskEXIT_CRITICAL();
+
+	if (bridge_stats_start == 0)
+	{
+		bridge_stats_start = millis();
+	}
+	bridge_stats.queued++;
+	bridge_wake_loop();
+	return CMD_STATUS_OK;
+}
+
+/**
+ * @brief Report the TX result of the radio
+ * Called from the LoRa task for every TX done, TX timeout or busy channel
+ * Only the first result of a frame counts, retransmissions are covered by bridge_mac_result()
+ *
+ * @param sent true if the frame was sent
+ */
+void bridge_tx_result(bool sent)
+{
+	if ((bridge_in_flight == 0) || (bridge_result != 0))
+	{
+		return;
+	}
+	bridge_result = sent ? 1 : 2;
+	bridge_wake_loop();
+}
+
+/**
+ * @brief Report the ACK result of a confirmed uplink
+ * Called from the LoRa task by the lmh_conf_result callback
+ *
+ * @param acked true if the network server acknowledged the uplink
+ */
+void bridge_mac_result(bool acked)
+{
+	if ((bridge_in_flight == 0) || !bridge_wait_confirm)
+	{
+		return;
+	}
+	bridge_confirm = acked ? 1 : 2;
+	bridge_wake_loop();
+}
+
+/**
+ * @brief Check if a bridge frame is in the air
+ *
+ * @return true if the radio is used by the bridge
+ */
+bool bridge_busy(void)
+{
+	return bridge_in_flight != 0;
+}
+
+/**
+ * @brief Send the receipts of the frame and keep the messages in the queue
+ *
+ * @param result BRIDGE_RECEIPT_xxx
+ * @param num number of messages
+ */
+static void bridge_receipts(uint8_t result, uint8_t num)
+{
+	uint32_t now = millis();
+	uint8_t pos = bridge_tail;
+	for (int idx = 0; idx < num; idx++)
+	{
+		s_bridge_msg *msg = &bridge_queue[pos];
+		cmd_bridge_receipt(msg->conn_handle, msg->id, result, now - msg->queued);
+		pos = (pos + 1) % BRIDGE_QUEUE;
+	}
+}
+
+/**
+ * @brief Remove the messages of the sent frame and send the receipts
+ *
+ * @param result BRIDGE_RECEIPT_xxx
+ * @param num number of messages
+ */
+static void bridge_complete(uint8_t result, uint8_t num)
+{
+	uint32_t now = millis();
+	for (int idx = 0; idx < num; idx++)
+	{
+		s_bridge_msg *msg = &bridge_queue[bridge_tail];
+		uint32_t delay_ms = now - msg->queued;
+		cmd_bridge_receipt(msg->conn_handle, msg->id, result, delay_ms);
+
+		if ((result == BRIDGE_RECEIPT_SENT) || (result == BRIDGE_RECEIPT_DELIVERED))
+		{
+			bridge_stats.delivered++;
+			bridge_stats.bytes += msg->len;
+			bridge_stats.delay_sum += delay_ms;
+			if (delay_ms > bridge_stats.delay_max)
+			{
+				bridge_stats.delay_max = delay_ms;
+			}
+		}
+		else
+		{
+			bridge_stats.failed++;
+		}
+
+		bridge_tail = (bridge_tail + 1) % BRIDGE_QUEUE;
+		taskENTER_CRITICAL();
+		bridge_count--;
+		taskEXIT_CRITICAL();
+	}
+}
+
+/**
+ * @brief Pack the queued messages into a frame and send it
+ *
+ */
+static void bridge_send(void)
+{
+	uint8_t max_len = bridge_max_frame();
+
+	// A message that does not fit into an empty frame can never be sent
+	while ((bridge_count != 0) && ((bridge_queue[bridge_tail].len + 1) > max_len))
+	{
+		MYLOG("BRIDGE", "Message %d too long for frame of %d bytes", bridge_queue[bridge_tail].id, max_len);
+		bridge_complete(BRIDGE_RECEIPT_TOO_LONG, 1);
+	}
+	if (bridge_count == 0)
+	{
+		return;
+	}
+
+	uint8_t frame[256];
+	uint8_t len = 0;
+	uint8_t num = 0;
+	uint8_t pos = bridge_tail;
+	while ((num < bridge_count) && ((len + bridge_queue[pos].len + 1) <= max_len))
+	{
+		frame[len++] = bridge_queue[pos].len;
+		memcpy(&frame[len], bridge_queue[pos].data, bridge_queue[pos].len);
+		len += bridge_queue[pos].len;
+		num++;
+		pos = (pos + 1) % BRIDGE_QUEUE;
+	}
+
+	bool result;
+	if (g_lorawan_settings.lorawan_enable)
+	{
+		result = send_lpwan_data(BRIDGE_PORT, frame, len);
+	}
+	else
+	{
+		result = send_lora_data(frame, len);
+	}
+	if (!result)
+	{
+		// MAC busy, not joined or radio busy, try again later
+		MYLOG("BRIDGE", "Send failed, retry in %d ms", BRIDGE_RETRY);
+		bridge_start_timer(BRIDGE_RETRY);
+		return;
+	}
+
+	bridge_result = 0;
+	bridge_confirm = 0;
+	bridge_sent = false;
+	bridge_wait_confirm = g_lorawan_settings.lorawan_enable && g_lorawan_settings.confirmed_msg_enabled;
+	bridge_tx_start = millis();
+	bridge_in_flight = num;
+	bridge_stats.frames++;
+	bridge_stats.frame_bytes += len;
+	bridge_stats.frame_capacity += max_len;
+	bridge_start_timer(BRIDGE_TX_TIMEOUT);
+	MYLOG("BRIDGE", "Frame with %d messages, %d of %d bytes", num, len, max_len);
+}
+
+/**
+ * @brief Handle the bridge queue
+ * Called from the loop task after new data, a TX result or the timer
+ */
+void bridge_process(void)
+{
+	if (bridge_in_flight != 0)
+	{
+		uint32_t wait = millis() - bridge_tx_start;
+		if ((bridge_result == 1) && bridge_wait_confirm && !bridge_sent)
+		{
+			// The frame is sent, the ACK result follows
+			bridge_receipts(BRIDGE_RECEIPT_SENT, bridge_in_flight);
+			bridge_sent = true;
+		}
+
+		if (bridge_result == 2)
+		{
+			bridge_complete(BRIDGE_RECEIPT_FAILED, bridge_in_flight);
+		}
+		else if (bridge_confirm != 0)
+		{
+			bridge_complete(bridge_confirm == 1 ? BRIDGE_RECEIPT_DELIVERED : BRIDGE_RECEIPT_NOT_DELIVERED, bridge_in_flight);
+		}
+		else if ((bridge_result == 1) && !bridge_wait_confirm)
+		{
+			bridge_complete(BRIDGE_RECEIPT_SENT, bridge_in_flight);
+		}
+		else if (!bridge_sent && (wait > BRIDGE_TX_TIMEOUT))
+		{
+			MYLOG("BRIDGE", "No TX done for the frame");
+			bridge_complete(BRIDGE_RECEIPT_FAILED, bridge_in_flight);
+		}
+		else if (bridge_sent && (wait > BRIDGE_CONFIRM_TIMEOUT))
+		{
+			MYLOG("BRIDGE", "No ACK result for the frame");
+			bridge_complete(BRIDGE_RECEIPT_NOT_DELIVERED, bridge_in_flight);
+		}
+		else
+		{
+			bridge_start_timer((bridge_sent ? BRIDGE_CONFIRM_TIMEOUT : BRIDGE_TX_TIMEOUT) - wait);
+			return;
+		}
+		bridge_in_flight = 0;
+		bridge_result = 0;
+		bridge_confirm = 0;
+		bridge_sent = false;
+	}
+
+	if (bridge_count == 0)
+	{
+		return;
+	}
+
+	// Send if the frame is full or the oldest message reached the deadline
+	uint16_t queued_len = 0;
+	uint8_t pos = bridge_tail;
+	for (int idx = 0; idx < bridge_count; idx++)
+	{
+		queued_len += bridge_queue[pos].len + 1;
+		pos = (pos + 1) % BRIDGE_QUEUE;
+	}
+	uint32_t age = millis() - bridge_queue[bridge_tail].queued;
+	if ((queued_len >= bridge_max_frame()) || (age >= BRIDGE_LATENCY) || (bridge_count == BRIDGE_QUEUE))
+	{
+		bridge_send();
+	}
+	else
+	{
+		bridge_start_timer(BRIDGE_LATENCY - age);
+	}
+}
+
+/**
+ * @brief Get the bridge metrics
+ *
+ * @param stats filled with the metrics since the first message
+ */
+void bridge_get_stats(s_bridge_stats *stats)
+{
+	*stats = bridge_stats;
+	stats->time = bridge_stats_start ? (millis() - bridge_stats_start) / 1000 : 0;
+	stats->queue = bridge_count;
+}
+
+/**
+ * @brief Log the bridge throughput and queueing delay
+ *
+ */
+void bridge_log_stats(void)
+{
+	if (bridge_stats_start == 0)
+	{
+		return;
+	}
+	uint32_t time = (millis() - bridge_stats_start) / 1000;
+	MYLOG("BRIDGE", "%ld msgs %ld bytes in %ld s = %ld B/min, failed %ld rejected %ld",
+		  bridge_stats.delivered, bridge_stats.bytes, time, time ? (bridge_stats.bytes * 60) / time : 0,
+		  bridge_stats.failed, bridge_stats.rejected);
+	MYLOG("BRIDGE", "Delay avg %ld ms max %ld ms, %ld frames filled %ld%%",
+		  bridge_stats.delivered ? bridge_stats.delay_sum / bridge_stats.delivered : 0, bridge_stats.delay_max,
+		  bridge_stats.frames, bridge_stats.frame_capacity ? (bridge_stats.frame_bytes * 100) / bridge_stats.frame_capacity : 0);
+}
@@ -41,7 +41,8 @@ void init_flash(void)
 		flash_reset();
 		return;
 	}
-	file.read((uint8_t *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+	// Files of older versions are shorter, the later settings keep their defaults
+	file.read((uint8_t *)&g_lorawan_settings, file.size() < sizeof(s_lorawan_settings) ? LORAWAN_LEGACY_DATA : sizeof(s_lorawan_settings));
 	file.close();
 	// Check if it is LoRa P2P settings
 	if ((g_lorawan_settings.valid_mark_1 != 0xAA) || (g_lorawan_settings.valid_mark_2 != LORAWAN_DATA_MARKER))
@@ -93,6 +94,7 @@ boolean save_settings(void)
 		file.close();
 	}
 	log_settings();
+	adv_telemetry_update();
 	return result;
 }
 
@@ -209,4 +211,23 @@ void log_settings(void)
 	MYLOG("FLASH", "%03d P2P Preamble %d", index, g_lorawan_settings.p2p_preamble_len);
 	index += 1;
 	MYLOG("FLASH", "%03d P2P Timeout %d", index, g_lorawan_settings.p2p_symbol_timeout);
+	index += 3;
+	MYLOG("FLASH", "%03d P2P listen %s", index, g_lorawan_settings.p2p_listen ? "enabled" : "disabled");
+	index += 1;
+	MYLOG("FLASH", "%03d Adv fast %d s", index, g_lorawan_settings.adv_fast_time);
+	index += 2;
+	MYLOG("FLASH", "%03d Adv slow %d s", index, g_lorawan_settings.adv_slow_time);
+	index += 2;
+	MYLOG("FLASH", "%03d Adv slow interval %d", index, g_lorawan_settings.adv_slow_interval);
+	index += 2;
+	MYLOG("FLASH", "%03d Adv wake pin %d", index, g_lorawan_settings.adv_wake_pin);
+	index += 1;
+	MYLOG("FLASH", "%03d Scanner %s", index, g_lorawan_settings.scan_enable ? "enabled" : "disabled");
+	index += 1;
+	MYLOG("FLASH", "%03d Scan interval %d", index, g_lorawan_settings.scan_interval);
+	index += 2;
+	MYLOG("FLASH", "%03d Scan window %d", index, g_lorawan_settings.scan_window);
+	index += 2;
+	MYLOG("FLASH", "%03d Scan allow %04X %04X %04X %04X", index, g_lorawan_settings.scan_allow[0], g_lorawan_settings.scan_allow[1],
+		  g_lorawan_settings.scan_allow[2], g_lorawan_settings.scan_allow[3]);
 }
\ No newline at end of file
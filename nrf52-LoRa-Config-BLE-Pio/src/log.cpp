@@ -0,0 +1,294 @@
+/**
+ * @file log.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Log ring buffer streamed over the BLE UART
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * MYLOG writes every line into a ring buffer in addition to the USB Serial.
+ * The ring is lock free, the writers reserve space with a compare and swap
+ * on the head index and never wait. If the ring is full the line is dropped
+ * and counted.
+ *
+ * Entry in the ring: length (1 byte, 0 => not yet written), text
+ * Free space in the ring is always 0.
+ *
+ * A low priority task drains the ring over the BLE UART in frames of the
+ * command protocol (CMD_LOG_DATA), each filled up to the negotiated MTU.
+ * The centrals grant credits with CMD_DUMP_LOG, each frame uses one
+ * credit of every connection it is sent to. Without credits nothing is
+ * sent and the ring keeps the lines. With several centrals a frame goes
+ * to all connections with credits, the same frame buffer is used for all.
+ */
+
+#include "main.h"
+
+/** Size of the ring buffer, must be a power of 2 */
+#define LOG_RING_SIZE 4096
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+/** Longest log line, longer lines are cut */
+#define LOG_MAX_LINE 160
+/** Largest payload of a frame */
+#define LOG_MAX_PAYLOAD (BLE_GATT_ATT_MTU_MAX - 3 - CMD_FRAME_OVERHEAD)
+
+/** Ring buffer */
+static uint8_t log_ring[LOG_RING_SIZE];
+/** Next free position, reserved by the writers */
+static uint32_t log_head = 0;
+/** Next entry to send, only changed by the log task */
+static uint32_t log_tail = 0;
+/** Number of dropped lines */
+static uint32_t log_dropped = 0;
+/** Number of dropped lines already reported to the central */
+static uint32_t log_dropped_sent = 0;
+/** Bytes of the entry at log_tail that are already sent */
+static uint8_t log_part = 0;
+
+/** Credits granted by the centrals, one frame per credit */
+static volatile uint32_t log_credits[BLE_MAX_CONN] = {0};
+/** Sequence number of the log frames */
+static uint8_t log_seq = 0;
+/** Bytes sent and time spent sending them */
+static uint32_t log_sent = 0;
+static uint32_t log_send_ms = 0;
+
+/** Semaphore to wake up the log task */
+static SemaphoreHandle_t log_sem = NULL;
+TaskHandle_t logTaskHandle;
+
+/**
+ * @brief Check if any connection has credits
+ *
+ * @return true if a log frame can be sent
+ */
+static bool log_has_credits(void)
+{
+	for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+	{
+		if (log_credits[idx] != 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Write a log line into the ring buffer
+ * Never blocks, the line is dropped if the ring is full
+ *
+ * @param tag tag of the line or NULL
+ * @param fmt printf format
+ */
+void log_write(const char *tag, const char *fmt, ...)
+{
+	char line[LOG_MAX_LINE];
+	int len = 0;
+	if (tag)
+	{
+		len = snprintf(line, sizeof(line), "[%s] ", tag);
+	}
+	va_list args;
+	va_start(args, fmt);
+	len += vsnprintf(&line[len], sizeof(line) - len - 1, fmt, args);
+	va_end(args);
+	if (len > (int)sizeof(line) - 2)
+	{
+		len = sizeof(line) - 2;
+	}
+	line[len++] = '\n';
+
+	// Reserve space for the length and the text
+	uint32_t need = len + 1;
+	uint32_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	do
+	{
+		if ((head + need - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE)) > LOG_RING_SIZE)
+		{
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&log_head, &head, head + need, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	for (int idx = 0; idx < len; idx++)
+	{
+		log_ring[(head + 1 + idx) & LOG_RING_MASK] = line[idx];
+	}
+	// The length marks the entry as complete
+	__atomic_store_n(&log_ring[head & LOG_RING_MASK], (uint8_t)len, __ATOMIC_RELEASE);
+
+	if ((log_sem != NULL) && log_has_credits())
+	{
+		xSemaphoreGive(log_sem);
+	}
+}
+
+/**
+ * @brief Copy entries from the ring into a frame payload
+ * Entries that do not fit are continued in the next frame
+ *
+ * @param buffer payload buffer
+ * @param size size of the buffer
+ * @return uint16_t number of bytes copied
+ */
+static uint16_t log_fill(uint8_t *buffer, uint16_t size)
+{
+	uint16_t pos = 0;
+
+	uint32_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if ((dropped != log_dropped_sent) && (log_part == 0))
+	{
+		int len = snprintf((char *)buffer, size, "[LOG] %ld lines dropped\n", dropped - log_dropped_sent);
+		pos = len < size ? len : size - 1;
+		log_dropped_sent = dropped;
+	}
+
+	uint32_t tail = log_tail;
+	while (pos < size)
+	{
+		uint8_t len = __atomic_load_n(&log_ring[tail & LOG_RING_MASK], __ATOMIC_ACQUIRE);
+		if (len == 0)
+		{
+			break;
+		}
+		uint8_t copy = (len - log_part) < (size - pos) ? len - log_part : size - pos;
+		for (int idx = 0; idx < copy; idx++)
+		{
+			buffer[pos++] = log_ring[(tail + 1 + log_part + idx) & LOG_RING_MASK];
+		}
+		log_part += copy;
+		if (log_part < len)
+		{
+			break;
+		}
+
+		// Free space must be 0 to detect entries that are not yet complete
+		for (int idx = 0; idx <= len; idx++)
+		{
+			log_ring[(tail + idx) & LOG_RING_MASK] = 0;
+		}
+		log_part = 0;
+		tail += len + 1;
+		__atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+	}
+	return pos;
+}
+
+/**
+ * @brief Task to send the log to the central
+ * Blocks in the BLE UART write if the SoftDevice has no free
+ * notification buffers, never the writers of the log.
+ *
+ * @param pvParameters unused
+ */
+static void log_task(void *pvParameters)
+{
+	static uint8_t frame[BLE_GATT_ATT_MTU_MAX];
+	while (true)
+	{
+		xSemaphoreTake(log_sem, portMAX_DELAY);
+		while (ble_uart_is_connected && log_has_credits())
+		{
+			// The frame must fit into the smallest MTU of the receivers
+			uint16_t size = LOG_MAX_PAYLOAD;
+			for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONN; conn_handle++)
+			{
+				uint16_t payload = ble_payload_size(conn_handle) - CMD_FRAME_OVERHEAD;
+				if ((log_credits[conn_handle] != 0) && (payload < size))
+				{
+					size = payload;
+				}
+			}
+			uint32_t start = millis();
+			uint16_t len = log_fill(&frame[CMD_PAYLOAD_OFFSET], size);
+			if (len == 0)
+			{
+				break;
+			}
+			uint16_t frame_len = cmd_log_frame(frame, log_seq++, len);
+			for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONN; conn_handle++)
+			{
+				if (log_credits[conn_handle] == 0)
+				{
+					continue;
+				}
+				if (ble_uart.write(conn_handle, frame, frame_len) != 0)
+				{
+					ble_activity(conn_handle);
+				}
+				taskENTER_CRITICAL();
+				if (log_credits[conn_handle] != 0)
+				{
+					log_credits[conn_handle]--;
+				}
+				taskEXIT_CRITICAL();
+			}
+			log_sent += len;
+			log_send_ms += millis() - start;
+		}
+	}
+}
+
+/**
+ * @brief Create the log task
+ *
+ */
+void init_log(void)
+{
+	log_sem = xSemaphoreCreateBinary();
+	if (!xTaskCreate(log_task, "LOG", 1024, NULL, TASK_PRIO_LOW, &logTaskHandle))
+	{
+		MYLOG("LOG", "Failed to start log task");
+	}
+}
+
+/**
+ * @brief Grant credits to send the log
+ *
+ * @param conn_handle connection that receives the log
+ * @param credits number of frames the central accepts, 0 => stop sending
+ */
+void log_credit(uint16_t conn_handle, uint16_t credits)
+{
+	if (conn_handle >= BLE_MAX_CONN)
+	{
+		return;
+	}
+	taskENTER_CRITICAL();
+	log_credits[conn_handle] = credits == 0 ? 0 : log_credits[conn_handle] + credits;
+	taskEXIT_CRITICAL();
+	if ((credits != 0) && (log_sem != NULL))
+	{
+		xSemaphoreGive(log_sem);
+	}
+}
+
+/**
+ * @brief Stop sending the log when the central disconnects
+ *
+ * @param conn_handle connection handle
+ */
+void log_disconnect(uint16_t conn_handle)
+{
+	if (conn_handle < BLE_MAX_CONN)
+	{
+		log_credits[conn_handle] = 0;
+	}
+}
+
+/**
+ * @brief Get the log statistics
+ *
+ * @param conn_handle connection that asks for the statistics
+ * @param stats filled with the state of the ring and the sent bytes
+ */
+void log_get_stats(uint16_t conn_handle, s_log_stats *stats)
+{
+	stats->credits = conn_handle < BLE_MAX_CONN ? log_credits[conn_handle] : 0;
+	stats->used = __atomic_load_n(&log_head, __ATOMIC_RELAXED) - __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	stats->sent = log_sent;
+	stats->rate = log_send_ms ? (uint32_t)(((uint64_t)log_sent * 1000) / log_send_ms) : 0;
+}
@@ -15,18 +15,34 @@
 
 // Debug output set to 0 to disable app debug output
 #define MY_DEBUG 1
+// Log over BLE set to 0 to disable, independent of MY_DEBUG
+#define MY_BLE_LOG 1
+
+// Log ring buffer, streamed over BLE
+void log_write(const char *tag, const char *fmt, ...);
+
+#if MY_BLE_LOG > 0
+#define BLELOG(tag, ...) log_write(tag, __VA_ARGS__)
+#else
+#define BLELOG(...)
+#endif
 
 #if MY_DEBUG > 0
-#define MYLOG(tag, ...)           \
-	do                            \
-	{                             \
-		if (tag)                  \
-			PRINTF("[%s] ", tag); \
-		PRINTF(__VA_ARGS__);      \
-		PRINTF("\n");             \
+#define MYLOG(tag, ...)               \
+	do                                \
+	{                                 \
+		if (tag)                      \
+			PRINTF("[%s] ", tag);     \
+		PRINTF(__VA_ARGS__);          \
+		PRINTF("\n");                 \
+		BLELOG(tag, __VA_ARGS__);     \
 	} while (0)
 #else
-#define MYLOG(...)
+#define MYLOG(tag, ...)               \
+	do                                \
+	{                                 \
+		BLELOG(tag, __VA_ARGS__);     \
+	} while (0)
 #endif
 
 #include <Arduino.h>
@@ -34,24 +50,193 @@
 
 // Main loop stuff
 void periodic_wakeup(TimerHandle_t unused);
-extern SemaphoreHandle_t g_task_sem;
-extern uint8_t g_task_event_type;
+void task_event(uint8_t event);
+void task_event_from_isr(uint8_t event);
 extern SoftwareTimer g_task_wakeup_timer;
 
 // BLE
 #include <bluefruit.h>
+/** Maximum number of simultaneous BLE connections */
+#define BLE_MAX_CONN 3
+/** Notification subscriptions of a connection */
+#define BLE_SUB_UART 0x01
+#define BLE_SUB_SETTINGS 0x02
+#define BLE_SUB_RX_STREAM 0x04
 void init_ble(void);
 void init_settings_characteristic(void);
+void settings_tlv_request(uint16_t conn_hdl, uint8_t *data, uint16_t len);
 extern BLECharacteristic lorawan_data;
 extern BLEUart ble_uart;
 extern bool ble_uart_is_connected;
+void ble_link_update(uint16_t conn_handle);
+uint16_t ble_payload_size(uint16_t conn_handle);
+void ble_speed_test(uint16_t conn_handle, uint32_t bytes);
+void ble_activity(uint16_t conn_handle);
+void ble_subscribe(uint16_t conn_handle, uint8_t flag, bool enabled);
+bool ble_subscribed(uint16_t conn_handle, uint8_t flag);
+void ble_uart_broadcast(const uint8_t *data, uint16_t len);
+void settings_notify_all(const void *data, uint16_t len);
+void ble_settings_written(uint16_t conn_handle);
 
 // LoRa
 #include <LoRaWan-RAK4630.h>
 int8_t init_lora(void);
 bool send_lpwan_packet(void);
+bool send_lpwan_data(uint8_t port, uint8_t *data, uint8_t len);
+uint8_t lpwan_max_payload(void);
 void send_lora_packet(void);
+bool send_lora_data(uint8_t *data, uint8_t len);
 extern bool lpwan_has_joined;
+extern uint8_t packet_counter;
+
+// Radio arbiter
+void arb_process(void);
+void arb_mac_request(void);
+void arb_mac_done(void);
+bool arb_irq(void);
+void arb_log_stats(void);
+bool arb_p2p_listening(void);
+struct s_arb_stats
+{
+	uint32_t total_ms;
+	uint32_t listen_ms;
+	uint16_t windows;
+	uint16_t skipped;
+	uint16_t p2p_rx;
+	uint16_t p2p_err;
+	uint16_t cut_rx;
+	uint16_t mac_conflicts;
+};
+void arb_get_stats(s_arb_stats *stats);
+
+// Binary command protocol
+/** Bytes of a frame around the payload, SOF, len, cmd, seq, status, CRC16 */
+#define CMD_FRAME_OVERHEAD 7
+/** Position of the payload in a response frame */
+#define CMD_PAYLOAD_OFFSET 5
+/** Response status */
+#define CMD_STATUS_OK 0x00
+#define CMD_STATUS_UNKNOWN 0x01
+#define CMD_STATUS_BAD_LENGTH 0x02
+#define CMD_STATUS_BUSY 0x03
+#define CMD_STATUS_NOT_AVAILABLE 0x04
+#define CMD_STATUS_CRC 0x05
+#define CMD_STATUS_FAILED 0x06
+void cmd_rx_copy(uint16_t conn_handle);
+void cmd_rx(uint16_t conn_handle);
+void cmd_disconnect(uint16_t conn_handle);
+void cmd_process(void);
+uint16_t cmd_log_frame(uint8_t *frame, uint8_t seq, uint8_t len);
+void cmd_bridge_receipt(uint16_t conn_handle, uint16_t id, uint8_t result, uint32_t delay_ms);
+
+// BLE to LoRa bridge
+/** Results in the delivery receipt */
+#define BRIDGE_RECEIPT_SENT 0
+#define BRIDGE_RECEIPT_FAILED 1
+#define BRIDGE_RECEIPT_TOO_LONG 2
+#define BRIDGE_RECEIPT_DELIVERED 3
+#define BRIDGE_RECEIPT_NOT_DELIVERED 4
+uint8_t bridge_queue_msg(uint16_t conn_handle, uint8_t *data, uint8_t len, uint16_t *id);
+void bridge_tx_result(bool sent);
+void bridge_mac_result(bool acked);
+bool bridge_busy(void);
+void bridge_process(void);
+void bridge_log_stats(void);
+struct s_bridge_stats
+{
+	// Seconds since the first message
+	uint32_t time;
+	uint32_t queued;
+	uint32_t delivered;
+	uint32_t failed;
+	// Rejected because the queue was full
+	uint32_t rejected;
+	// Delivered message bytes
+	uint32_t bytes;
+	uint32_t frames;
+	// Sum of frame sizes and of the maximum frame sizes
+	uint32_t frame_bytes;
+	uint32_t frame_capacity;
+	// Queueing delay until the final receipt in ms
+	uint32_t delay_sum;
+	uint32_t delay_max;
+	// Messages in the queue
+	uint32_t queue;
+};
+void bridge_get_stats(s_bridge_stats *stats);
+
+// Log streaming
+void init_log(void);
+void log_credit(uint16_t conn_handle, uint16_t credits);
+void log_disconnect(uint16_t conn_handle);
+struct s_log_stats
+{
+	uint32_t credits;
+	uint32_t used;
+	uint32_t dropped;
+	uint32_t sent;
+	uint32_t rate;
+};
+void log_get_stats(uint16_t conn_handle, s_log_stats *stats);
+
+// Status in the BLE scan response
+void init_adv_telemetry(void);
+void adv_telemetry_started(void);
+void adv_telemetry_update(void);
+void adv_telemetry_tx(void);
+void adv_telemetry_rx(int16_t rssi, int8_t snr);
+
+// Received data notifications
+/** Port in the record of a LoRa P2P packet, LoRaWAN never uses port 0 for data */
+#define RX_STREAM_PORT_P2P 0
+void init_rx_stream(void);
+void rx_stream_count_subscribers(void);
+void rx_stream_queue(uint8_t port, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+void rx_stream_log_stats(void);
+
+// Advertising power schedule
+/** adv_slow_time to advertise slow without stopping */
+#define ADV_SLOW_FOREVER 0xFFFF
+/** adv_wake_pin without a wake pin */
+#define ADV_WAKE_PIN_NONE 0xFF
+/** LoRaWAN port of the advertising downlink command */
+#define ADV_DOWNLINK_PORT 4
+void init_adv_schedule(void);
+void adv_schedule_start(void);
+void adv_schedule_wake(void);
+void adv_schedule_process(void);
+void adv_schedule_downlink(uint8_t *data, uint8_t len);
+
+// BLE beacon scanner
+/** Number of entries in the scanner allowlist */
+#define SCAN_ALLOW_NUM 4
+void init_scanner(void);
+void scan_process(void);
+void scan_log_stats(void);
+struct s_scan_stats
+{
+	// Seconds since scanning started
+	uint32_t time;
+	// Received advertisements and advertisements passing the allowlist
+	uint32_t reports;
+	uint32_t accepted;
+	// Readings with changed data
+	uint32_t changed;
+	// Devices added to and removed from the table
+	uint32_t devices;
+	uint32_t evicted;
+	// Time spent in the scan callback in us
+	uint32_t process_us;
+	// Bytes of the accepted advertisements with address and RSSI
+	uint32_t raw_bytes;
+	// Uplinks, forwarded readings and uplink bytes
+	uint32_t frames;
+	uint32_t records;
+	uint32_t frame_bytes;
+	// Readings skipped because they do not fit into an uplink of the current data rate
+	uint32_t too_long;
+};
+void scan_get_stats(s_scan_stats *stats);
 
 #define LORAWAN_DATA_MARKER 0x55
 struct s_lorawan_settings
@@ -116,8 +301,29 @@ struct s_lorawan_settings
 	uint16_t p2p_symbol_timeout = 0;
 	// Command from BLE to reset device
 	bool resetRequest = true;
+	// Flag to listen for LoRa P2P between LoRaWAN Class A uplinks
+	bool p2p_listen = false;
+	// Seconds of fast advertising after boot, disconnect or a wake event
+	uint16_t adv_fast_time = 15;
+	// Seconds of slow advertising after the fast advertising, ADV_SLOW_FOREVER => never stop
+	uint16_t adv_slow_time = ADV_SLOW_FOREVER;
+	// Slow advertising interval in 0.625 ms units
+	uint16_t adv_slow_interval = 244;
+	// Pin that restarts advertising on a falling edge, ADV_WAKE_PIN_NONE => no pin
+	uint8_t adv_wake_pin = ADV_WAKE_PIN_NONE;
+	// Flag to scan for BLE sensor beacons and forward their readings over LoRa
+	bool scan_enable = false;
+	// Scan interval and scan window in 0.625 ms units, the duty is window / interval
+	uint16_t scan_interval = 160;
+	uint16_t scan_window = 16;
+	// Allowed company IDs or 16 bit service UUIDs, 0 => unused, all 0 => allow all
+	uint16_t scan_allow[SCAN_ALLOW_NUM] = {0, 0, 0, 0};
 };
 
+/** Settings of the first release end with resetRequest, apps and settings files of it use the padded length */
+#define LORAWAN_LEGACY_DATA offsetof(s_lorawan_settings, p2p_listen)
+#define LORAWAN_LEGACY_LEN ((LORAWAN_LEGACY_DATA + 3) & ~3)
+
 extern s_lorawan_settings g_lorawan_settings;
 extern uint8_t g_rx_lora_data[];
 extern uint8_t g_rx_data_len;
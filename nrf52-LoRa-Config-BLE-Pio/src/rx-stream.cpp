@@ -0,0 +1,294 @@
+/**
+ * @file rx-stream.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Notify received LoRaWAN downlinks and LoRa P2P packets as binary records
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Every received packet is written as a record into a buffer. The records
+ * are sent as notifications of the characteristic 0xF0A3, packed into
+ * notifications of the negotiated MTU size. A record can be split over two
+ * notifications, the centrals read the notifications as one byte stream.
+ * Full notifications are sent at once, a partial one after RX_STREAM_FLUSH_TIME.
+ * Each central has its own read index. If a notification can not be sent,
+ * the records stay in the buffer and are sent again after RX_STREAM_FLUSH_TIME.
+ *
+ * Nothing is buffered or sent while no central has enabled the notifications.
+ */
+
+#include "main.h"
+
+/** Size of the record buffer, must be a power of 2 */
+#define RX_STREAM_BUFFER_SIZE 2048
+/** Maximum time a partial notification waits for more records in milliseconds */
+#define RX_STREAM_FLUSH_TIME 50
+
+/**
+ * Record layout, all values little endian
+ * 0      LoRaWAN port, RX_STREAM_PORT_P2P for LoRa P2P packets
+ * 1      length of the payload
+ * 2..3   RSSI
+ * 4      SNR
+ * 5..8   timestamp in milliseconds since boot
+ * 9..    payload
+ */
+#define RX_STREAM_HEADER_LEN 9
+
+/** Received data characteristic 0xF0A3 */
+BLECharacteristic rx_stream_data = BLECharacteristic(0xF0A3);
+
+// Notify enable callback
+void rx_stream_cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t value);
+
+/** Buffer for records waiting to be sent */
+static uint8_t rx_stream_buffer[RX_STREAM_BUFFER_SIZE];
+/** Write index, only changed by the LoRa task */
+static volatile uint16_t rx_stream_head = 0;
+/** Read index of the slowest central, only changed by the BLE callback task */
+static volatile uint16_t rx_stream_tail = 0;
+/** Read index of each central */
+static uint16_t rx_stream_conn_tail[BLE_MAX_CONN];
+
+/** Number of centrals that enabled the notifications */
+static volatile uint8_t rx_stream_subscribers = 0;
+
+/** Number of queued records */
+static uint32_t rx_stream_records = 0;
+/** Number of records dropped because the buffer was full */
+static uint32_t rx_stream_dropped = 0;
+/** Number of sent notifications */
+static uint32_t rx_stream_notifications = 0;
+/** Number of notifications that failed and were retried */
+static uint32_t rx_stream_retries = 0;
+
+/** Timer to send a partial notification */
+SoftwareTimer g_rx_stream_timer;
+
+/**
+ * @brief Move the shared read index to the slowest subscribed central
+ * Without subscribers the buffer is emptied
+ */
+static void rx_stream_update_tail(void)
+{
+	uint16_t used = 0;
+	uint16_t tail = rx_stream_head;
+	for (uint16_t conn_hdl = 0; conn_hdl < BLE_MAX_CONN; conn_hdl++)
+	{
+		if (!ble_subscribed(conn_hdl, BLE_SUB_RX_STREAM))
+		{
+			continue;
+		}
+		uint16_t conn_used = (rx_stream_head - rx_stream_conn_tail[conn_hdl]) & (RX_STREAM_BUFFER_SIZE - 1);
+		if (conn_used > used)
+		{
+			used = conn_used;
+			tail = rx_stream_conn_tail[conn_hdl];
+		}
+	}
+	rx_stream_tail = tail;
+}
+
+/**
+ * @brief Send the buffered records to the subscribed centrals
+ * Called in the BLE callback task
+ *
+ * @param force true to send a partial notification as well
+ */
+static void rx_stream_flush(bool force)
+{
+	uint8_t batch[BLE_GATT_ATT_MTU_MAX];
+	bool retry = false;
+
+	for (uint16_t conn_hdl = 0; conn_hdl < BLE_MAX_CONN; conn_hdl++)
+	{
+		if (!ble_subscribed(conn_hdl, BLE_SUB_RX_STREAM))
+		{
+			continue;
+		}
+		uint16_t batch_size = ble_payload_size(conn_hdl);
+		while (true)
+		{
+			uint16_t tail = rx_stream_conn_tail[conn_hdl];
+			uint16_t used = (rx_stream_head - tail) & (RX_STREAM_BUFFER_SIZE - 1);
+			if ((used == 0) || ((used < batch_size) && !force))
+			{
+				break;
+			}
+			uint16_t batch_len = used < batch_size ? used : batch_size;
+			for (int idx = 0; idx < batch_len; idx++)
+			{
+				batch[idx] = rx_stream_buffer[(tail + idx) & (RX_STREAM_BUFFER_SIZE - 1)];
+			}
+			// Keep the records of this central until the notification went out
+			if (!rx_stream_data.notify(conn_hdl, batch, batch_len))
+			{
+				rx_stream_retries++;
+				retry = true;
+				break;
+			}
+			ble_activity(conn_hdl);
+			rx_stream_notifications++;
+			rx_stream_conn_tail[conn_hdl] = (tail + batch_len) & (RX_STREAM_BUFFER_SIZE - 1);
+		}
+	}
+	rx_stream_update_tail();
+
+	if (retry)
+	{
+		g_rx_stream_timer.stop();
+		g_rx_stream_timer.start();
+	}
+}
+
+/**
+ * @brief Send the full notifications
+ * Called in the BLE callback task
+ */
+static void rx_stream_send_full(void)
+{
+	rx_stream_flush(false);
+}
+
+/**
+ * @brief Send all buffered records
+ * Called in the BLE callback task
+ */
+static void rx_stream_send_all(void)
+{
+	rx_stream_flush(true);
+}
+
+/**
+ * @brief Timer event to send a partial notification
+ *
+ * @param unused
+ */
+void rx_stream_timeout(TimerHandle_t unused)
+{
+	ada_callback(NULL, 0, rx_stream_send_all);
+}
+
+/**
+ * @brief Initialize the received data characteristic
+ * Called from init_ble() after the LoRaWAN service is started
+ */
+void init_rx_stream(void)
+{
+	rx_stream_data.setProperties(CHR_PROPS_NOTIFY);
+	rx_stream_data.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+	rx_stream_data.setMaxLen(BLE_GATT_ATT_MTU_MAX - 3);
+	rx_stream_data.setCccdWriteCallback(rx_stream_cccd_callback);
+	rx_stream_data.begin();
+
+	g_rx_stream_timer.begin(RX_STREAM_FLUSH_TIME, rx_stream_timeout, NULL, false);
+}
+
+/**
+ * @brief Callback if a central enables or disables the received data notifications
+ *
+ * @param conn_hdl connection handle
+ * @param chr the characteristic
+ * @param value new CCCD value
+ */
+void rx_stream_cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t value)
+{
+	// A new subscriber gets the records received from now on
+	if ((conn_hdl < BLE_MAX_CONN) && (value & BLE_GATT_HVX_NOTIFICATION) && !ble_subscribed(conn_hdl, BLE_SUB_RX_STREAM))
+	{
+		rx_stream_conn_tail[conn_hdl] = rx_stream_head;
+	}
+	ble_subscribe(conn_hdl, BLE_SUB_RX_STREAM, value & BLE_GATT_HVX_NOTIFICATION);
+	rx_stream_count_subscribers();
+}
+
+/**
+ * @brief Count the centrals that enabled the notifications
+ * Called after a CCCD write and after a disconnect
+ */
+void rx_stream_count_subscribers(void)
+{
+	uint8_t count = 0;
+	for (uint16_t conn_hdl = 0; conn_hdl < BLE_MAX_CONN; conn_hdl++)
+	{
+		if (ble_subscribed(conn_hdl, BLE_SUB_RX_STREAM))
+		{
+			count++;
+		}
+	}
+	rx_stream_subscribers = count;
+	rx_stream_update_tail();
+}
+
+/**
+ * @brief Put a byte into the record buffer
+ *
+ * @param data byte to add
+ */
+static inline void rx_stream_put(uint8_t data)
+{
+	rx_stream_buffer[rx_stream_head] = data;
+	rx_stream_head = (rx_stream_head + 1) & (RX_STREAM_BUFFER_SIZE - 1);
+}
+
+/**
+ * @brief Queue a received packet for the subscribed centrals
+ * Called from the LoRa task for every LoRaWAN downlink and LoRa P2P packet
+ *
+ * @param port LoRaWAN port or RX_STREAM_PORT_P2P
+ * @param data received packet
+ * @param len length of the packet
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void rx_stream_queue(uint8_t port, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr)
+{
+	if (rx_stream_subscribers == 0)
+	{
+		return;
+	}
+
+	uint16_t used = (rx_stream_head - rx_stream_tail) & (RX_STREAM_BUFFER_SIZE - 1);
+	if ((RX_STREAM_BUFFER_SIZE - 1 - used) < (RX_STREAM_HEADER_LEN + len))
+	{
+		rx_stream_dropped++;
+		MYLOG("RXS", "Buffer full, records %ld, dropped %ld", rx_stream_records, rx_stream_dropped);
+		return;
+	}
+
+	uint32_t timestamp = millis();
+	rx_stream_put(port);
+	rx_stream_put(len);
+	rx_stream_put(rssi);
+	rx_stream_put(rssi >> 8);
+	rx_stream_put(snr);
+	rx_stream_put(timestamp);
+	rx_stream_put(timestamp >> 8);
+	rx_stream_put(timestamp >> 16);
+	rx_stream_put(timestamp >> 24);
+	for (int idx = 0; idx < len; idx++)
+	{
+		rx_stream_put(data[idx]);
+	}
+	rx_stream_records++;
+
+	// Full notifications go out now, the rest waits for more records
+	ada_callback(NULL, 0, rx_stream_send_full);
+	g_rx_stream_timer.stop();
+	g_rx_stream_timer.start();
+}
+
+/**
+ * @brief Log the number of records and notifications
+ *
+ */
+void rx_stream_log_stats(void)
+{
+	if (rx_stream_records == 0)
+	{
+		return;
+	}
+	MYLOG("RXS", "Records %ld in %ld notifications, dropped %ld, retries %ld, subscribers %d",
+		  rx_stream_records, rx_stream_notifications, rx_stream_dropped, rx_stream_retries, rx_stream_subscribers);
+}
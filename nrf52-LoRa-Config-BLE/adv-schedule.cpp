@@ -0,0 +1,192 @@
+/**
+   @file adv-schedule.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Advertising power schedule
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+   After boot, a disconnect or a wake event the node advertises fast for
+   adv_fast_time seconds, then slow with adv_slow_interval for adv_slow_time
+   seconds and then stops advertising. The fast to slow switch and the stop
+   are done by Bluefruit.
+
+   Wake events restart the schedule:
+   - a falling edge on adv_wake_pin (button, reed switch or the INT pin of an
+     accelerometer, active low)
+   - a LoRaWAN downlink on ADV_DOWNLINK_PORT with the payload 1
+   A downlink with the payload 0 stops advertising at once.
+*/
+
+#include "main.h"
+
+/** Fast advertising interval, 20 ms in 0.625 ms units */
+#define ADV_FAST_INTERVAL 32
+/** Slowest advertising interval, 10.24 s in 0.625 ms units */
+#define ADV_SLOW_MAX 16384
+/** Estimated charge of one advertising event on 3 channels with scan response window in nC, +8 dBm TX */
+#define ADV_EVENT_CHARGE_NC 15000
+
+/** Flag if a wake event is waiting for the loop task */
+static volatile bool adv_wake_pending = false;
+
+// Stop callback
+void adv_stop_callback(void);
+
+/**
+   @brief Estimate the average current of advertising
+
+   @param interval advertising interval in 0.625 ms units
+   @return uint32_t current in 0.1 uA
+*/
+static uint32_t adv_current(uint16_t interval)
+{
+  if (interval == 0)
+  {
+    return 0;
+  }
+  // nC per ms is uA, 10000 / 625 converts the interval into ms and the result into 0.1 uA
+  return ((uint32_t)ADV_EVENT_CHARGE_NC * 16) / interval;
+}
+
+/**
+   @brief Get the slow advertising interval from the settings
+
+   @return uint16_t interval in 0.625 ms units
+*/
+static uint16_t adv_slow_interval(void)
+{
+  uint16_t interval = g_lorawan_settings.adv_slow_interval;
+  if (interval < ADV_FAST_INTERVAL)
+  {
+    return ADV_FAST_INTERVAL;
+  }
+  return interval > ADV_SLOW_MAX ? ADV_SLOW_MAX : interval;
+}
+
+/**
+   @brief Interrupt of the wake pin
+
+*/
+void adv_wake_isr(void)
+{
+  adv_wake_pending = true;
+  task_event_from_isr(7);
+}
+
+/**
+   @brief Set up the advertising schedule and the wake pin
+   Called from init_ble() after the advertising data is set
+*/
+void init_adv_schedule(void)
+{
+  // Restarted by disconnect_callback() with the schedule of the current settings
+  Bluefruit.Advertising.restartOnDisconnect(false);
+  Bluefruit.Advertising.setStopCallback(adv_stop_callback);
+
+  if (g_lorawan_settings.adv_wake_pin != ADV_WAKE_PIN_NONE)
+  {
+    pinMode(g_lorawan_settings.adv_wake_pin, INPUT_PULLUP);
+    attachInterrupt(g_lorawan_settings.adv_wake_pin, adv_wake_isr, FALLING);
+    MYLOG("ADV", "Wake on pin %d", g_lorawan_settings.adv_wake_pin);
+  }
+}
+
+/**
+   @brief Start advertising with the schedule from the settings
+   Fast for adv_fast_time, then slow for adv_slow_time, then stop.
+*/
+void adv_schedule_start(void)
+{
+  uint16_t slow_interval = adv_slow_interval();
+  uint32_t timeout = 0;
+  if (g_lorawan_settings.adv_slow_time != ADV_SLOW_FOREVER)
+  {
+    timeout = (uint32_t)g_lorawan_settings.adv_fast_time + g_lorawan_settings.adv_slow_time;
+    // 0 would advertise forever
+    if (timeout == 0)
+    {
+      MYLOG("ADV", "Schedule without advertising time");
+      return;
+    }
+    if (timeout > 0xFFFE)
+    {
+      timeout = 0xFFFE;
+    }
+  }
+
+  Bluefruit.Advertising.stop();
+  Bluefruit.Advertising.setInterval(ADV_FAST_INTERVAL, slow_interval);
+  Bluefruit.Advertising.setFastTimeout(g_lorawan_settings.adv_fast_time);
+  Bluefruit.Advertising.start(timeout);
+
+  uint32_t fast_current = adv_current(ADV_FAST_INTERVAL);
+  uint32_t slow_current = adv_current(slow_interval);
+  MYLOG("ADV", "Fast %d s ~%ld.%ld uA, slow %d.%03d ms ~%ld.%ld uA, stop after %ld s", g_lorawan_settings.adv_fast_time,
+        fast_current / 10, fast_current % 10, (slow_interval * 625) / 1000, (slow_interval * 625) % 1000,
+        slow_current / 10, slow_current % 10, timeout);
+}
+
+/**
+   @brief Callback when advertising stopped after the schedule
+
+*/
+void adv_stop_callback(void)
+{
+  MYLOG("ADV", "Advertising stopped, ~0 uA until the next wake event");
+}
+
+/**
+   @brief Request a restart of the schedule from the LoRa task
+
+*/
+void adv_schedule_wake(void)
+{
+  adv_wake_pending = true;
+  task_event(7);
+}
+
+/**
+   @brief Restart the schedule after a wake event
+   Called from the loop task
+*/
+void adv_schedule_process(void)
+{
+  if (!adv_wake_pending)
+  {
+    return;
+  }
+  adv_wake_pending = false;
+  MYLOG("ADV", "Wake event");
+  // With all connections in use the schedule starts with the next disconnect
+  if (Bluefruit.connected() < BLE_MAX_CONN)
+  {
+    adv_schedule_start();
+  }
+}
+
+/**
+   @brief Handle the advertising downlink command
+   Called from the LoRa task for a downlink on ADV_DOWNLINK_PORT
+
+   @param data payload, 0 => stop advertising, 1 => restart the schedule
+   @param len length of the payload
+*/
+void adv_schedule_downlink(uint8_t *data, uint8_t len)
+{
+  if (len != 1)
+  {
+    return;
+  }
+  if (data[0] == 0)
+  {
+    MYLOG("ADV", "Stop advertising by downlink");
+    Bluefruit.Advertising.stop();
+  }
+  else if (data[0] == 1)
+  {
+    MYLOG("ADV", "Wake by downlink");
+    adv_schedule_wake();
+  }
+}
@@ -0,0 +1,312 @@
+/**
+   @file arbiter.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Radio arbiter to listen for LoRa P2P packets in the idle gaps of LoRaWAN Class A
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+   LoRaWAN owns the radio. A Class A node only uses it for the uplink and
+   the two receive windows that follow it. When the MAC reports the end of
+   the uplink (lmh_unconf_finished or lmh_conf_result, after the last
+   retransmission of a confirmed message) the radio is switched to the P2P
+   settings and kept in continuous RX until the next uplink is due.
+
+   Schedule of one send interval:
+   | uplink | RX1 | RX2 | (retries) |       P2P listen        | uplink | ...
+
+   A Class A MAC only uses the radio for an uplink requested by lmh_send().
+   All uplinks go through send_lpwan_data(), which takes the radio back and
+   restores the LoRaWAN setup before the MAC gets the request, so the MAC
+   never transmits with the P2P sync word or channel.
+
+   While P2P is listening the SX126x IRQs are handled here and not by the
+   LoRaMac callbacks, the LoRaMac never sees the P2P packets.
+*/
+
+#include "main.h"
+
+/** Minimum gap to the next uplink to start a P2P listen window in ms */
+#define ARB_MIN_WINDOW 2000
+
+
+/** SX126x IRQ flags not in the IRQ list of the LoRaWAN library */
+#ifndef IRQ_HEADER_VALID
+#define IRQ_HEADER_VALID 0x0010
+#endif
+#ifndef IRQ_HEADER_ERROR
+#define IRQ_HEADER_ERROR 0x0020
+#endif
+#ifndef IRQ_CAD_DONE
+#define IRQ_CAD_DONE 0x0080
+#endif
+
+/** Arbiter states */
+enum arb_state
+{
+  ARB_MAC = 0, // Radio is owned by the LoRaWAN MAC
+  ARB_HOLD = 1, // MAC finished the uplink, waiting for the loop to start listening
+  ARB_P2P = 2 // Radio is listening with P2P settings
+};
+
+/** Current owner of the radio */
+static volatile uint8_t arb_state = ARB_MAC;
+/** Flag if a P2P packet header was received and the payload is pending */
+static volatile bool arb_rx_pending = false;
+
+/** Time of the last uplink request in ms */
+static uint32_t arb_last_uplink = 0;
+/** Start of the current P2P listen window in ms */
+static uint32_t arb_listen_start = 0;
+/** Start of the statistics in ms */
+static uint32_t arb_stats_start = 0;
+
+/** Accumulated time the radio was listening for P2P in ms */
+static uint32_t arb_listen_ms = 0;
+/** Number of P2P listen windows */
+static uint16_t arb_windows = 0;
+/** Number of skipped windows because the gap was too short */
+static uint16_t arb_skipped = 0;
+/** Number of received P2P packets */
+static uint16_t arb_p2p_rx = 0;
+/** Number of P2P packets with CRC or header error */
+static uint16_t arb_p2p_err = 0;
+/** Number of P2P receptions cut by an uplink */
+static uint16_t arb_cut_rx = 0;
+/** Number of MAC radio events seen while P2P was listening, expected to stay 0 */
+static uint16_t arb_mac_conflicts = 0;
+
+/**
+   @brief Check if P2P listening is possible with the current settings
+
+   @return true if LoRaWAN Class A is joined and P2P listen is enabled
+*/
+static bool arb_enabled(void)
+{
+  return g_lorawan_settings.lorawan_enable && g_lorawan_settings.p2p_listen &&
+       (g_lorawan_settings.lora_class == CLASS_A) && lpwan_has_joined;
+}
+
+/**
+   @brief Switch the radio back to the LoRaWAN setup
+   The LoRaMac sets channel and modulation before each TX and RX window,
+   only the sync word and the sleep state have to be restored.
+*/
+static void arb_stop_listen(void)
+{
+  Radio.Standby();
+  SX126xClearIrqStatus(IRQ_RADIO_ALL);
+  arb_state = ARB_MAC;
+  Radio.SetPublicNetwork(g_lorawan_settings.public_network);
+  Radio.Sleep();
+
+  uint32_t window = millis() - arb_listen_start;
+  arb_listen_ms += window;
+  if (arb_rx_pending)
+  {
+    arb_cut_rx++;
+    arb_rx_pending = false;
+  }
+  MYLOG("ARB", "P2P listen stopped after %ld ms", window);
+}
+
+/**
+   @brief Start the P2P listen window if the gap to the next uplink is long enough
+   Called from the loop after the MAC finished the uplink
+*/
+void arb_process(void)
+{
+  if (!arb_enabled() || (arb_state != ARB_HOLD))
+  {
+    return;
+  }
+
+  int32_t gap = (int32_t)(arb_last_uplink + g_lorawan_settings.send_repeat_time - millis());
+  if (gap < ARB_MIN_WINDOW)
+  {
+    MYLOG("ARB", "Gap of %ld ms too short, skip P2P listen", gap);
+    arb_skipped++;
+    arb_state = ARB_MAC;
+    return;
+  }
+
+  Radio.Standby();
+  Radio.SetPublicNetwork(false);
+  Radio.SetChannel(g_lorawan_settings.p2p_frequency);
+  Radio.SetRxConfig(MODEM_LORA, g_lorawan_settings.p2p_bandwidth, g_lorawan_settings.p2p_sf,
+                    g_lorawan_settings.p2p_cr, 0, g_lorawan_settings.p2p_preamble_len,
+                    g_lorawan_settings.p2p_symbol_timeout, false,
+                    0, true, 0, 0, false, true);
+  SX126xClearIrqStatus(IRQ_RADIO_ALL);
+  arb_rx_pending = false;
+  arb_listen_start = millis();
+  arb_windows++;
+  arb_state = ARB_P2P;
+  Radio.Rx(0);
+
+  MYLOG("ARB", "P2P listen for %ld ms until next uplink", gap);
+}
+
+/**
+   @brief Hand the radio to the LoRaWAN MAC before an uplink
+   Called by send_lpwan_data() before lmh_send()
+*/
+void arb_mac_request(void)
+{
+  if (arb_state == ARB_P2P)
+  {
+    arb_stop_listen();
+  }
+  arb_state = ARB_MAC;
+  arb_last_uplink = millis();
+  if (arb_stats_start == 0)
+  {
+    arb_stats_start = arb_last_uplink;
+  }
+}
+
+/**
+   @brief Take the radio back from the LoRaWAN MAC after an uplink
+   Called from the LoRa task when the MAC finished the uplink with its
+   receive windows and retransmissions, or when lmh_send() failed
+*/
+void arb_mac_done(void)
+{
+  if (!arb_enabled() || (arb_state != ARB_MAC))
+  {
+    return;
+  }
+  arb_state = ARB_HOLD;
+  task_event(3);
+}
+
+/**
+   @brief Handle a SX126x IRQ before it is given to the LoRaMac
+   Called from the LoRa task after the DIO1 interrupt
+
+   @return true if the IRQ was a P2P event and is handled
+   @return false if the IRQ belongs to the LoRaMac
+*/
+bool arb_irq(void)
+{
+  uint16_t irq = SX126xGetIrqStatus();
+
+  // Frames of the BLE bridge are sent when the MAC reports TX done
+  if ((irq & IRQ_TX_DONE) && (arb_state != ARB_P2P))
+  {
+    bridge_tx_result(true);
+  }
+
+  if (!g_lorawan_settings.p2p_listen || (arb_state != ARB_P2P))
+  {
+    return false;
+  }
+
+  if (irq & (IRQ_TX_DONE | IRQ_CAD_DONE))
+  {
+    // Not expected, every uplink takes the radio back with arb_mac_request()
+    arb_mac_conflicts++;
+    arb_listen_ms += millis() - arb_listen_start;
+    arb_rx_pending = false;
+    arb_state = ARB_MAC;
+    Radio.SetPublicNetwork(g_lorawan_settings.public_network);
+    MYLOG("ARB", "MAC event during P2P listen");
+    return false;
+  }
+
+  if (irq & IRQ_HEADER_VALID)
+  {
+    arb_rx_pending = true;
+  }
+
+  if (irq & (IRQ_CRC_ERROR | IRQ_HEADER_ERROR))
+  {
+    arb_p2p_err++;
+    arb_rx_pending = false;
+  }
+  else if (irq & IRQ_RX_DONE)
+  {
+    PacketStatus_t pkt_status;
+    uint8_t size = 0;
+    SX126xGetPayload(g_rx_lora_data, &size, 255);
+    SX126xGetPacketStatus(&pkt_status);
+    g_rx_data_len = size;
+    arb_p2p_rx++;
+    adv_telemetry_rx(pkt_status.Params.LoRa.RssiPkt, pkt_status.Params.LoRa.SnrPkt);
+    rx_stream_queue(RX_STREAM_PORT_P2P, g_rx_lora_data, size, pkt_status.Params.LoRa.RssiPkt, pkt_status.Params.LoRa.SnrPkt);
+    arb_rx_pending = false;
+
+    MYLOG("ARB", "P2P packet size:%d, rssi:%d, snr:%d", size,
+          pkt_status.Params.LoRa.RssiPkt, pkt_status.Params.LoRa.SnrPkt);
+
+    // Notify task about the event
+    task_event(4);
+  }
+
+  SX126xClearIrqStatus(IRQ_RADIO_ALL);
+  return true;
+}
+
+/**
+   @brief Check if the radio is listening for P2P between LoRaWAN uplinks
+
+   @return true if the radio is in RX with the P2P settings
+*/
+bool arb_p2p_listening(void)
+{
+  return arb_state == ARB_P2P;
+}
+
+/**
+   @brief Get the arbiter statistics
+
+   @param stats filled with the statistics since the first uplink
+*/
+void arb_get_stats(s_arb_stats *stats)
+{
+  stats->total_ms = arb_stats_start ? millis() - arb_stats_start : 0;
+  stats->listen_ms = arb_listen_ms;
+  if (arb_state == ARB_P2P)
+  {
+    stats->listen_ms += millis() - arb_listen_start;
+  }
+  stats->windows = arb_windows;
+  stats->skipped = arb_skipped;
+  stats->p2p_rx = arb_p2p_rx;
+  stats->p2p_err = arb_p2p_err;
+  stats->cut_rx = arb_cut_rx;
+  stats->mac_conflicts = arb_mac_conflicts;
+}
+
+/**
+   @brief Log the share of time the radio listened for P2P
+   and the conflicts between LoRaWAN and P2P
+*/
+void arb_log_stats(void)
+{
+  if (!g_lorawan_settings.p2p_listen || (arb_stats_start == 0))
+  {
+    return;
+  }
+
+  uint32_t total = millis() - arb_stats_start;
+  uint32_t listen = arb_listen_ms;
+  if (arb_state == ARB_P2P)
+  {
+    listen += millis() - arb_listen_start;
+  }
+  uint32_t share = total ? (uint32_t)((uint64_t)listen * 1000 / total) : 0;
+
+  MYLOG("ARB", "P2P listen %ld.%ld%% of %ld s, windows %d skipped %d",
+        share / 10, share % 10, total / 1000, arb_windows, arb_skipped);
+  MYLOG("ARB", "P2P rx %d err %d, cut by uplink %d, MAC conflicts %d",
+        arb_p2p_rx, arb_p2p_err, arb_cut_rx, arb_mac_conflicts);
+  if (ble_uart_is_connected)
+  {
+    char line[80];
+    int len = snprintf(line, sizeof(line), "P2P listen %ld.%ld%% rx %d err %d cut %d conflicts %d\n",
+                       share / 10, share % 10, arb_p2p_rx, arb_p2p_err, arb_cut_rx, arb_mac_conflicts);
+    ble_uart_broadcast((uint8_t *)line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+  }
+}
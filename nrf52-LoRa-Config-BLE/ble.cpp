@@ -20,15 +20,186 @@ BLEDis ble_dis;
 
 extern BLEService lorawan_service;
 
-/** Flag if BLE UART is connected */
+/** Flag if at least one central is connected */
 bool ble_uart_is_connected = false;
 
+/** Start of the application RAM, the SoftDevice uses the RAM below */
+extern uint32_t __data_start__[];
+/** Connection configuration tag Bluefruit uses for peripheral links */
+#define BLE_PRPH_CFG_TAG 1
+/** Attribute table size and vendor UUID count, the defaults of Bluefruit */
+#define BLE_ATTR_TAB_SIZE 0xC00
+#define BLE_VS_UUID_COUNT 10
+
+/** Connection event length in 1.25 ms units, long enough for several packets per event */
+#define BLE_CONN_EVENT_LEN 12
+/** Notification and write command queue sizes of each connection */
+#define BLE_HVN_QUEUE 16
+#define BLE_WRITE_QUEUE 16
+/** Default size of the BLE UART throughput test */
+#define BLE_SPEED_DEFAULT 10000
+/** Maximum time the throughput test waits for the last notification to be sent in ms */
+#define BLE_SPEED_TIMEOUT 10000
+
+/** Connection interval while settings or data are transferred, 15 to 30 ms in 1.25 ms units */
+#define BLE_FAST_MIN 12
+#define BLE_FAST_MAX 24
+/** Connection interval and slave latency while idle, 300 to 320 ms in 1.25 ms units */
+#define BLE_IDLE_MIN 240
+#define BLE_IDLE_MAX 256
+#define BLE_IDLE_LATENCY 4
+/** Supervision timeout in 10 ms units, iOS accepts max 6 s */
+#define BLE_SUP_TIMEOUT 600
+/** Time without transfers before the idle parameters are requested in ms */
+#define BLE_IDLE_TIME 10000
+/** Estimated charge of one connection event without data in nC, +8 dBm TX */
+#define BLE_EVENT_CHARGE_NC 6000
+
+/** Negotiated link parameters of a connection */
+struct s_ble_link
+{
+  // ATT MTU
+  uint16_t mtu;
+  // LL data length in bytes
+  uint16_t data_len;
+  // BLE_GAP_PHY_xxx
+  uint8_t phy;
+  // Connection interval in 1.25 ms units
+  uint16_t interval;
+  // BLE_SUB_xxx flags of the enabled notifications
+  uint8_t subscribed;
+  // Flag if the connection is up
+  bool connected;
+  // Slave latency
+  uint16_t latency;
+  // Flag if the fast connection parameters are requested
+  bool fast;
+  // Time of the last transfer in ms
+  uint32_t last_activity;
+  // Start of the current transfer in ms
+  uint32_t burst_start;
+};
+/** Link parameters per connection handle */
+static s_ble_link ble_links[BLE_MAX_CONN];
+
+/** Timer to switch to the idle connection parameters */
+SoftwareTimer g_ble_idle_timer;
+
+/** Connection of the running throughput test */
+static volatile uint16_t ble_speed_conn = BLE_CONN_HANDLE_INVALID;
+/** Number of test notifications the SoftDevice has sent */
+static volatile uint32_t ble_speed_sent = 0;
+/** Time the last test notification was sent in ms */
+static volatile uint32_t ble_speed_end = 0;
+
 // Connect callback
 void connect_callback(uint16_t conn_handle);
 // Disconnect callback
 void disconnect_callback(uint16_t conn_handle, uint8_t reason);
 // Uart RX callback
 void bleuart_rx_callback(uint16_t conn_handle);
+// Uart notify enable callback
+void bleuart_notify_callback(uint16_t conn_handle, bool enabled);
+// SoftDevice event callback
+void ble_event_callback(ble_evt_t *event);
+// Idle timer callback
+void ble_idle_cb(TimerHandle_t unused);
+
+/**
+   @brief SoftDevice fault handler for the RAM probe
+
+*/
+static void ble_probe_fault(uint32_t id, uint32_t pc, uint32_t info)
+{
+}
+
+/**
+   @brief Ask the SoftDevice how much RAM a peripheral configuration needs
+   Sets the connection configuration of init_ble() and calls sd_ble_enable(),
+   which returns the lowest possible start of the application RAM.
+   The SoftDevice is disabled again, must be called before Bluefruit.begin().
+
+   @param conn_count number of peripheral connections
+   @return uint32_t SoftDevice RAM in bytes, 0 if the probe failed
+*/
+static uint32_t ble_sd_ram(uint8_t conn_count)
+{
+  nrf_clock_lf_cfg_t clock_cfg = {NRF_CLOCK_LF_SRC_XTAL, 0, 0, NRF_CLOCK_LF_ACCURACY_20_PPM};
+  if (sd_softdevice_enable(&clock_cfg, ble_probe_fault) != NRF_SUCCESS)
+  {
+    return 0;
+  }
+
+  uint32_t ram_start = (uint32_t)(uintptr_t)__data_start__;
+  uint32_t result = NRF_SUCCESS;
+  ble_cfg_t cfg;
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.gap_cfg.role_count_cfg.adv_set_count = 1;
+  cfg.gap_cfg.role_count_cfg.periph_role_count = conn_count;
+  result |= sd_ble_cfg_set(BLE_GAP_CFG_ROLE_COUNT, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.common_cfg.vs_uuid_cfg.vs_uuid_count = BLE_VS_UUID_COUNT;
+  result |= sd_ble_cfg_set(BLE_COMMON_CFG_VS_UUID, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.gatts_cfg.attr_tab_size.attr_tab_size = BLE_ATTR_TAB_SIZE;
+  result |= sd_ble_cfg_set(BLE_GATTS_CFG_ATTR_TAB_SIZE, &cfg, ram_start);
+
+  // Same values as configPrphConn() in init_ble()
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.conn_cfg.conn_cfg_tag = BLE_PRPH_CFG_TAG;
+  cfg.conn_cfg.params.gap_conn_cfg.conn_count = conn_count;
+  cfg.conn_cfg.params.gap_conn_cfg.event_length = BLE_CONN_EVENT_LEN;
+  result |= sd_ble_cfg_set(BLE_CONN_CFG_GAP, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.conn_cfg.conn_cfg_tag = BLE_PRPH_CFG_TAG;
+  cfg.conn_cfg.params.gatt_conn_cfg.att_mtu = BLE_GATT_ATT_MTU_MAX;
+  result |= sd_ble_cfg_set(BLE_CONN_CFG_GATT, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.conn_cfg.conn_cfg_tag = BLE_PRPH_CFG_TAG;
+  cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = BLE_HVN_QUEUE;
+  result |= sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &cfg, ram_start);
+
+  memset(&cfg, 0, sizeof(ble_cfg_t));
+  cfg.conn_cfg.conn_cfg_tag = BLE_PRPH_CFG_TAG;
+  cfg.conn_cfg.params.gattc_conn_cfg.write_cmd_tx_queue_size = BLE_WRITE_QUEUE;
+  result |= sd_ble_cfg_set(BLE_CONN_CFG_GATTC, &cfg, ram_start);
+
+  // Returns the required RAM start, on success and if the reserved RAM is too small
+  if (result == NRF_SUCCESS)
+  {
+    result = sd_ble_enable(&ram_start);
+  }
+  sd_softdevice_disable();
+
+  if ((result != NRF_SUCCESS) && (result != NRF_ERROR_NO_MEM))
+  {
+    return 0;
+  }
+  return ram_start - 0x20000000;
+}
+
+/**
+   @brief Log the SoftDevice RAM needed for BLE_MAX_CONN connections and for one connection
+
+*/
+static void ble_log_sd_ram(void)
+{
+  uint8_t enabled = 0;
+  sd_softdevice_is_enabled(&enabled);
+  if (enabled)
+  {
+    return;
+  }
+  uint32_t ram_max = ble_sd_ram(BLE_MAX_CONN);
+  uint32_t ram_one = ble_sd_ram(1);
+  MYLOG("BLE", "SoftDevice RAM %ld bytes for %d connections, %ld bytes for 1 connection, %ld bytes reserved",
+        ram_max, BLE_MAX_CONN, ram_one, (uint32_t)(uintptr_t)__data_start__ - 0x20000000);
+}
 
 /**
    @brief Initialize BLE and start advertising
@@ -36,14 +207,17 @@ void bleuart_rx_callback(uint16_t conn_handle);
 */
 void init_ble(void)
 {
+  // Show the RAM cost of the additional connections
+  ble_log_sd_ram();
+
   // Config the peripheral connection with maximum bandwidth
   // more SRAM required by SoftDevice
   // Note: All config***() function must be called before begin()
   Bluefruit.configPrphBandwidth(BANDWIDTH_MAX);
-  Bluefruit.configPrphConn(131, BLE_GAP_EVENT_LENGTH_MIN, 16, 16);
+  Bluefruit.configPrphConn(BLE_GATT_ATT_MTU_MAX, BLE_CONN_EVENT_LEN, BLE_HVN_QUEUE, BLE_WRITE_QUEUE);
 
-  // Start BLE
-  Bluefruit.begin(1, 0);
+  // Start BLE, several centrals can connect at the same time, the beacon scanner needs the central role
+  Bluefruit.begin(BLE_MAX_CONN, g_lorawan_settings.scan_enable ? 1 : 0);
 
   // Set max power. Accepted values are: (min) -40, -20, -16, -12, -8, -4, 0, 2, 3, 4, 5, 6, 7, 8 (max)
   Bluefruit.setTxPower(8);
@@ -62,6 +236,10 @@ void init_ble(void)
   // Set connection/disconnect callbacks
   Bluefruit.Periph.setConnectCallback(connect_callback);
   Bluefruit.Periph.setDisconnectCallback(disconnect_callback);
+  // Start connections with the fast parameters, relaxed when idle
+  Bluefruit.Periph.setConnInterval(BLE_FAST_MIN, BLE_FAST_MAX);
+  Bluefruit.setEventCallback(ble_event_callback);
+  g_ble_idle_timer.begin(BLE_IDLE_TIME, ble_idle_cb, NULL, false);
 
   // Configure and Start Device Information Service
   ble_dis.setManufacturer("RAKwireless");
@@ -79,11 +257,19 @@ void init_ble(void)
 
   // Start the UART service
   ble_uart.begin();
-  ble_uart.setRxCallback(bleuart_rx_callback);
+  // Not deferred, the RX FIFO is shared by all connections
+  ble_uart.setRxCallback(bleuart_rx_callback, false);
+  ble_uart.setNotifyCallback(bleuart_notify_callback);
 
   // Initialize the LoRaWAN setting service
   init_settings_characteristic();
 
+  // Received data notifications in the LoRaWAN setting service
+  init_rx_stream();
+
+  // Node status in the scan response
+  init_adv_telemetry();
+
   // Advertising packet
   Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE); //
   Bluefruit.Advertising.addService(lorawan_service);
@@ -91,18 +277,19 @@ void init_ble(void)
   Bluefruit.Advertising.addTxPower();
 
   /* Start Advertising
-     - Enable auto advertising if disconnected
-     - Interval:  fast mode = 20 ms, slow mode = 152.5 ms
-     - Timeout for fast mode is 30 seconds
-     - Start(timeout) with timeout = 0 will advertise forever (until connected)
+     - Restarted by the disconnect callback and by wake events
+     - Interval:  fast mode = 20 ms, slow mode = adv_slow_interval
+     - Fast for adv_fast_time, slow for adv_slow_time, then stop
 
      For recommended advertising interval
      https://developer.apple.com/library/content/qa/qa1931/_index.html
   */
-  Bluefruit.Advertising.restartOnDisconnect(true);
-  Bluefruit.Advertising.setInterval(32, 244); // in unit of 0.625 ms
-  Bluefruit.Advertising.setFastTimeout(15);	// number of seconds in fast mode
-  Bluefruit.Advertising.start(0); // 0 = Don't stop advertising
+  init_adv_schedule();
+  adv_schedule_start();
+  adv_telemetry_started();
+
+  // Scan for BLE sensor beacons if enabled
+  init_scanner();
 }
 
 /**
@@ -111,8 +298,381 @@ void init_ble(void)
 */
 void connect_callback(uint16_t conn_handle)
 {
-  (void)conn_handle;
   ble_uart_is_connected = true;
+
+  BLEConnection *connection = Bluefruit.Connection(conn_handle);
+  if ((connection == NULL) || (conn_handle >= BLE_MAX_CONN))
+  {
+    return;
+  }
+  ble_links[conn_handle].connected = true;
+  MYLOG("BLE", "Link %d connected, %d of %d connections", conn_handle, Bluefruit.connected(), BLE_MAX_CONN);
+
+  // Advertising stops with every connection, keep it going while connections are free
+  if (Bluefruit.connected() < BLE_MAX_CONN)
+  {
+    adv_schedule_start();
+  }
+
+  // Settings are usually read right after connecting
+  ble_activity(conn_handle);
+
+  // The central decides, but many phones only switch if asked
+  // The results of the PHY, data length and MTU requests are recorded by ble_event_callback()
+  connection->requestPHY(BLE_GAP_PHY_2MBPS);
+  connection->requestDataLengthUpdate();
+  // Only start the MTU exchange, requestMtuExchange() would block this task until the central answered
+  uint32_t result = sd_ble_gattc_exchange_mtu_request(conn_handle, BLE_GATT_ATT_MTU_MAX);
+  if (result != NRF_SUCCESS)
+  {
+    MYLOG("BLE", "Link %d: MTU exchange request failed %ld", conn_handle, result);
+  }
+  ble_link_update(conn_handle);
+}
+
+/**
+   @brief Record the negotiated link parameters of a connection
+
+   @param conn_handle connection handle
+*/
+void ble_link_update(uint16_t conn_handle)
+{
+  BLEConnection *connection = Bluefruit.Connection(conn_handle);
+  if ((connection == NULL) || (conn_handle >= BLE_MAX_CONN))
+  {
+    return;
+  }
+  s_ble_link *link = &ble_links[conn_handle];
+  link->mtu = connection->getMtu();
+  link->data_len = connection->getDataLength();
+  link->phy = connection->getPHY();
+  link->interval = connection->getConnectionInterval();
+  link->latency = connection->getSlaveLatency();
+
+  MYLOG("BLE", "Link %d: MTU %d, data length %d, PHY %s, interval %d.%02d ms", conn_handle,
+        link->mtu, link->data_len, link->phy == BLE_GAP_PHY_2MBPS ? "2M" : link->phy == BLE_GAP_PHY_CODED ? "Coded" : "1M",
+        (link->interval * 125) / 100, (link->interval * 125) % 100);
+}
+
+/**
+   @brief Get the maximum number of bytes that fit into one notification
+
+   @param conn_handle connection handle
+   @return uint16_t negotiated ATT MTU - 3
+*/
+uint16_t ble_payload_size(uint16_t conn_handle)
+{
+  BLEConnection *connection = Bluefruit.Connection(conn_handle);
+  if (connection == NULL)
+  {
+    return BLE_GATT_ATT_MTU_DEFAULT - 3;
+  }
+  return connection->getMtu() - 3;
+}
+
+/**
+   @brief Estimate the throughput limit of the link for notifications
+   Assumes the connection event is extended over the whole interval
+   and every packet is acknowledged with an empty packet.
+
+   @param link negotiated link parameters
+   @return uint32_t payload bytes per second
+*/
+static uint32_t ble_link_limit(s_ble_link *link)
+{
+  if ((link->interval == 0) || (link->data_len == 0))
+  {
+    return 0;
+  }
+  // Bits per microsecond and preamble length
+  uint32_t rate = (link->phy == BLE_GAP_PHY_2MBPS) ? 2 : 1;
+  uint32_t preamble = rate;
+  // Preamble, access address, header, payload, CRC
+  uint32_t data_us = ((preamble + 4 + 2 + link->data_len + 3) * 8) / rate;
+  uint32_t empty_us = ((preamble + 4 + 2 + 3) * 8) / rate;
+  uint32_t packet_us = data_us + 150 + empty_us + 150;
+  uint32_t interval_us = link->interval * 1250;
+  uint32_t packets = interval_us / packet_us;
+
+  // A notification has 7 bytes L2CAP and ATT header and can span several LL packets
+  uint32_t notify_len = link->mtu - 3;
+  uint32_t ll_per_notify = (link->mtu + 4 + link->data_len - 1) / link->data_len;
+  return (uint32_t)(((uint64_t)packets * notify_len * 1000000) / ll_per_notify / interval_us);
+}
+
+/**
+   @brief Send test data over the BLE UART and report the throughput
+   The test data is sent in chunks of the negotiated payload size.
+   The time is measured until the SoftDevice reports the last notification as sent.
+
+   @param conn_handle connection handle
+   @param bytes number of bytes to send, 0 => BLE_SPEED_DEFAULT
+*/
+void ble_speed_test(uint16_t conn_handle, uint32_t bytes)
+{
+  if (bytes == 0)
+  {
+    bytes = BLE_SPEED_DEFAULT;
+  }
+  uint8_t chunk[BLE_GATT_ATT_MTU_MAX];
+  uint16_t chunk_len = ble_payload_size(conn_handle);
+  if (chunk_len > sizeof(chunk))
+  {
+    chunk_len = sizeof(chunk);
+  }
+  for (int idx = 0; idx < chunk_len; idx++)
+  {
+    chunk[idx] = '0' + (idx % 10);
+  }
+  chunk[chunk_len - 1] = '\n';
+
+  ble_link_update(conn_handle);
+  ble_activity(conn_handle);
+
+  uint32_t sent = 0;
+  uint32_t notifications = 0;
+  ble_speed_sent = 0;
+  ble_speed_conn = conn_handle;
+  uint32_t start = millis();
+  while (sent < bytes)
+  {
+    uint16_t len = (bytes - sent) < chunk_len ? (bytes - sent) : chunk_len;
+    if (ble_uart.write(conn_handle, chunk, len) == 0)
+    {
+      break;
+    }
+    sent += len;
+    notifications++;
+  }
+
+  // write() returns when the notification is queued, wait until the last one is in the air
+  uint32_t wait_start = millis();
+  while ((ble_speed_sent < notifications) && ((millis() - wait_start) < BLE_SPEED_TIMEOUT))
+  {
+    delay(1);
+  }
+  ble_speed_conn = BLE_CONN_HANDLE_INVALID;
+  if (ble_speed_sent < notifications)
+  {
+    MYLOG("BLE", "Link %d: %ld of %ld notifications sent", conn_handle, ble_speed_sent, notifications);
+  }
+  uint32_t time = (notifications != 0) ? ble_speed_end - start : 0;
+  if (time == 0)
+  {
+    time = 1;
+  }
+
+  s_ble_link *link = &ble_links[conn_handle < BLE_MAX_CONN ? conn_handle : 0];
+  char line[128];
+  snprintf(line, sizeof(line), "SPEED %ld bytes in %ld ms = %ld B/s, limit %ld B/s, MTU %d DL %d PHY %dM CI %d.%02d ms",
+           sent, time, (sent * 1000) / time, ble_link_limit(link), link->mtu, link->data_len,
+           link->phy == BLE_GAP_PHY_2MBPS ? 2 : 1, (link->interval * 125) / 100, (link->interval * 125) % 100);
+  MYLOG("BLE", "%s", line);
+  ble_uart.write(conn_handle, (uint8_t *)"\n", 1);
+  ble_uart.write(conn_handle, (uint8_t *)line, strlen(line));
+  ble_uart.write(conn_handle, (uint8_t *)"\n", 1);
+}
+
+/**
+   @brief Estimate the current of a connection without data
+
+   @param link link parameters
+   @return uint32_t current in 0.1 uA
+*/
+static uint32_t ble_link_current(s_ble_link *link)
+{
+  if (link->interval == 0)
+  {
+    return 0;
+  }
+  // nC per ms is uA, the interval is in 1.25 ms units
+  return ((uint32_t)BLE_EVENT_CHARGE_NC * 1000) / ((uint32_t)link->interval * 125 * (link->latency + 1));
+}
+
+/**
+   @brief Request fast or idle connection parameters
+
+   @param conn_handle connection handle
+   @param fast true for the fast parameters, false for the idle parameters
+*/
+static void ble_request_params(uint16_t conn_handle, bool fast)
+{
+  ble_gap_conn_params_t params;
+  params.min_conn_interval = fast ? BLE_FAST_MIN : BLE_IDLE_MIN;
+  params.max_conn_interval = fast ? BLE_FAST_MAX : BLE_IDLE_MAX;
+  params.slave_latency = fast ? 0 : BLE_IDLE_LATENCY;
+  params.conn_sup_timeout = BLE_SUP_TIMEOUT;
+  ble_links[conn_handle].fast = fast;
+
+  uint32_t result = sd_ble_gap_conn_param_update(conn_handle, &params);
+  MYLOG("BLE", "Link %d: request %s parameters, interval %d-%d, latency %d, result %ld", conn_handle,
+        fast ? "fast" : "idle", params.min_conn_interval, params.max_conn_interval, params.slave_latency, result);
+}
+
+/**
+   @brief Mark a transfer on a connection
+   Requests the fast connection parameters if the link is idle.
+   Called for every settings write, command and log frame.
+
+   @param conn_handle connection handle
+*/
+void ble_activity(uint16_t conn_handle)
+{
+  if ((conn_handle >= BLE_MAX_CONN) || (Bluefruit.Connection(conn_handle) == NULL))
+  {
+    return;
+  }
+  s_ble_link *link = &ble_links[conn_handle];
+  link->last_activity = millis();
+  if (!link->fast)
+  {
+    link->burst_start = link->last_activity;
+    ble_request_params(conn_handle, true);
+    g_ble_idle_timer.stop();
+    g_ble_idle_timer.setPeriod(BLE_IDLE_TIME);
+    g_ble_idle_timer.start();
+  }
+}
+
+/**
+   @brief Log the time from the first request until the settings are written
+
+   @param conn_handle connection handle
+*/
+void ble_settings_written(uint16_t conn_handle)
+{
+  if (conn_handle >= BLE_MAX_CONN)
+  {
+    return;
+  }
+  s_ble_link *link = &ble_links[conn_handle];
+  MYLOG("BLE", "Link %d: settings written %ld ms after the first request, interval %d.%02d ms", conn_handle,
+        millis() - link->burst_start, (link->interval * 125) / 100, (link->interval * 125) % 100);
+}
+
+/**
+   @brief Relax the connection parameters of links idle since the last transfer
+   Runs in the callback task, the SoftDevice calls and the log
+   are too slow for the timer task.
+*/
+static void ble_idle_process(void)
+{
+  uint32_t next = 0;
+  for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONN; conn_handle++)
+  {
+    s_ble_link *link = &ble_links[conn_handle];
+    if (!link->fast || (Bluefruit.Connection(conn_handle) == NULL))
+    {
+      continue;
+    }
+    uint32_t idle = millis() - link->last_activity;
+    if (idle >= BLE_IDLE_TIME)
+    {
+      ble_request_params(conn_handle, false);
+    }
+    else if ((next == 0) || ((BLE_IDLE_TIME - idle) < next))
+    {
+      next = BLE_IDLE_TIME - idle;
+    }
+  }
+  // A link had a transfer after the timer was started
+  if (next != 0)
+  {
+    g_ble_idle_timer.setPeriod(next);
+    g_ble_idle_timer.start();
+  }
+}
+
+/**
+   @brief Timer callback to relax the connection parameters after a transfer
+
+   @param unused
+*/
+void ble_idle_cb(TimerHandle_t unused)
+{
+  ada_callback(NULL, 0, ble_idle_process);
+}
+
+/**
+   @brief SoftDevice event callback
+   Records the connection parameter, PHY, data length and MTU updates
+   and counts the sent notifications of the throughput test
+
+   @param event SoftDevice event
+*/
+void ble_event_callback(ble_evt_t *event)
+{
+  switch (event->header.evt_id)
+  {
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+    {
+      uint16_t conn_handle = event->evt.gap_evt.conn_handle;
+      if (conn_handle >= BLE_MAX_CONN)
+      {
+        return;
+      }
+      ble_gap_conn_params_t *params = &event->evt.gap_evt.params.conn_param_update.conn_params;
+      s_ble_link *link = &ble_links[conn_handle];
+      link->interval = params->max_conn_interval;
+      link->latency = params->slave_latency;
+
+      uint32_t current = ble_link_current(link);
+      MYLOG("BLE", "Link %d: interval %d.%02d ms, latency %d, timeout %d ms, idle link current ~%ld.%ld uA", conn_handle,
+            (link->interval * 125) / 100, (link->interval * 125) % 100, link->latency,
+            params->conn_sup_timeout * 10, current / 10, current % 10);
+      break;
+    }
+    case BLE_GAP_EVT_PHY_UPDATE:
+    {
+      uint16_t conn_handle = event->evt.gap_evt.conn_handle;
+      if (conn_handle >= BLE_MAX_CONN)
+      {
+        return;
+      }
+      s_ble_link *link = &ble_links[conn_handle];
+      if (event->evt.gap_evt.params.phy_update.status == 0)
+      {
+        link->phy = event->evt.gap_evt.params.phy_update.tx_phy;
+      }
+      MYLOG("BLE", "Link %d: PHY %s, status %d", conn_handle,
+            link->phy == BLE_GAP_PHY_2MBPS ? "2M" : link->phy == BLE_GAP_PHY_CODED ? "Coded" : "1M",
+            event->evt.gap_evt.params.phy_update.status);
+      break;
+    }
+    case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+    {
+      uint16_t conn_handle = event->evt.gap_evt.conn_handle;
+      if (conn_handle >= BLE_MAX_CONN)
+      {
+        return;
+      }
+      ble_links[conn_handle].data_len = event->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
+      MYLOG("BLE", "Link %d: data length %d", conn_handle, ble_links[conn_handle].data_len);
+      break;
+    }
+    case BLE_GATTC_EVT_EXCHANGE_MTU_RSP:
+    {
+      uint16_t conn_handle = event->evt.gattc_evt.conn_handle;
+      if (conn_handle >= BLE_MAX_CONN)
+      {
+        return;
+      }
+      // Bluefruit updates the MTU of the connection from the same event
+      uint16_t mtu = event->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu;
+      ble_links[conn_handle].mtu = mtu < BLE_GATT_ATT_MTU_MAX ? mtu : BLE_GATT_ATT_MTU_MAX;
+      MYLOG("BLE", "Link %d: MTU %d", conn_handle, ble_links[conn_handle].mtu);
+      break;
+    }
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+      if (event->evt.gatts_evt.conn_handle == ble_speed_conn)
+      {
+        ble_speed_sent += event->evt.gatts_evt.params.hvn_tx_complete.count;
+        ble_speed_end = millis();
+      }
+      break;
+    default:
+      break;
+  }
 }
 
 /**
@@ -122,24 +682,100 @@ void connect_callback(uint16_t conn_handle)
 */
 void disconnect_callback(uint16_t conn_handle, uint8_t reason)
 {
-  (void)conn_handle;
-  (void)reason;
+  log_disconnect(conn_handle);
+  cmd_disconnect(conn_handle);
+  if (conn_handle < BLE_MAX_CONN)
+  {
+    memset(&ble_links[conn_handle], 0, sizeof(s_ble_link));
+  }
+
   ble_uart_is_connected = false;
+  for (int idx = 0; idx < BLE_MAX_CONN; idx++)
+  {
+    ble_uart_is_connected |= ble_links[idx].connected;
+  }
+  rx_stream_count_subscribers();
+  MYLOG("BLE", "Link %d disconnected, reason 0x%02X", conn_handle, reason);
+
+  // Start the schedule again, the settings may have changed
+  adv_schedule_start();
 }
 
 /**
-   Callback if data has been sent from the connected client
+   Callback if data has been sent from a connected client
+   Called in the BLE event task, the shared RX FIFO holds only
+   the data of this connection.
    @param conn_handle
   		The connection handle
 */
 void bleuart_rx_callback(uint16_t conn_handle)
 {
-  (void)conn_handle;
+  // Move the data to the connection, parsed by the callback task
+  cmd_rx_copy(conn_handle);
+  ada_callback(NULL, 0, cmd_rx, conn_handle);
+}
+
+/**
+   @brief Callback if a central enables or disables the BLE UART notifications
+
+   @param conn_handle connection handle
+   @param enabled true if notifications are enabled
+*/
+void bleuart_notify_callback(uint16_t conn_handle, bool enabled)
+{
+  ble_subscribe(conn_handle, BLE_SUB_UART, enabled);
+}
 
-  String uart_rx_buff = "";
-  uart_rx_buff = ble_uart.readStringUntil('\n');
+/**
+   @brief Record the notifications a central has enabled
 
-  uart_rx_buff.toUpperCase();
+   @param conn_handle connection handle
+   @param flag BLE_SUB_xxx
+   @param enabled true if the notifications are enabled
+*/
+void ble_subscribe(uint16_t conn_handle, uint8_t flag, bool enabled)
+{
+  if (conn_handle >= BLE_MAX_CONN)
+  {
+    return;
+  }
+  if (enabled)
+  {
+    ble_links[conn_handle].subscribed |= flag;
+  }
+  else
+  {
+    ble_links[conn_handle].subscribed &= ~flag;
+  }
+  MYLOG("BLE", "Link %d: %s notifications %s", conn_handle, flag == BLE_SUB_UART ? "UART" : flag == BLE_SUB_SETTINGS ? "settings" : "RX stream", enabled ? "on" : "off");
+}
+
+/**
+   @brief Check if a central has enabled notifications
 
-  MYLOG("BLE", "BLE Received %s", uart_rx_buff.c_str());
+   @param conn_handle connection handle
+   @param flag BLE_SUB_xxx
+   @return true if the notifications are enabled
+*/
+bool ble_subscribed(uint16_t conn_handle, uint8_t flag)
+{
+  return (conn_handle < BLE_MAX_CONN) && ble_links[conn_handle].connected && (ble_links[conn_handle].subscribed & flag);
+}
+
+/**
+   @brief Send data over the BLE UART to all subscribed centrals
+   Every connection gets the same buffer, the SoftDevice copies it into its queue.
+
+   @param data data to send
+   @param len length of the data
+*/
+void ble_uart_broadcast(const uint8_t *data, uint16_t len)
+{
+  for (uint16_t conn_handle = 0; conn_handle < BLE_MAX_CONN; conn_handle++)
+  {
+    if (ble_subscribed(conn_handle, BLE_SUB_UART))
+    {
+      ble_uart.write(conn_handle, data, len);
+    }
+  }
 }
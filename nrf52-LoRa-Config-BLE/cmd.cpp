@@ -0,0 +1,608 @@
+/**
+   @file cmd.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Binary command protocol on the BLE UART
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+   Request:  SOF, len, cmd, seq, payload, CRC16
+   Response: SOF, len, cmd | CMD_RESPONSE, seq, status, payload, CRC16
+   len counts the bytes from cmd to the end of the payload, the CRC16
+   (CCITT, init 0xFFFF, little endian) covers len to the end of the payload.
+   Several requests can be sent without waiting for the responses, the
+   responses carry the sequence number of the request. Commands that need
+   the radio are executed by the loop task and answered later.
+   Bytes outside of frames are collected as text commands, lines ending
+   with '\n'.
+   The log is sent in CMD_LOG_DATA frames without request, see log.cpp.
+   Every connection has its own parser, responses go to the connection
+   the request came from.
+*/
+
+#include "main.h"
+
+/** Start of a frame, not a printable character */
+#define CMD_SOF 0xA5
+/** Longest frame, SOF + len + 255 + CRC */
+#define CMD_MAX_FRAME 259
+/** Longest text command */
+#define CMD_MAX_LINE 32
+/** Incomplete frames are dropped after this time in ms */
+#define CMD_FRAME_TIMEOUT 500
+/** Version of the command protocol */
+#define CMD_VERSION 1
+
+/** Commands */
+#define CMD_PING 0x01
+#define CMD_GET_VERSION 0x02
+#define CMD_SEND_UPLINK 0x10
+#define CMD_READ_STATS 0x11
+#define CMD_SURVEY 0x12
+#define CMD_DUMP_LOG 0x13
+#define CMD_SPEED 0x14
+#define CMD_LOG_DATA 0x15
+#define CMD_BRIDGE_DATA 0x16
+#define CMD_BRIDGE_RECEIPT 0x17
+#define CMD_BRIDGE_STATS 0x18
+#define CMD_RESPONSE 0x80
+
+/** Number of RSSI samples of a survey if the request has no count */
+#define CMD_SURVEY_SAMPLES 10
+
+/** Sent or delivery receipt of a bridge message, payload of CMD_BRIDGE_RECEIPT */
+struct s_cmd_receipt
+{
+  uint16_t id;
+  uint8_t result;
+  uint32_t delay_ms;
+} __attribute__((packed));
+
+/** Statistics, payload of the CMD_READ_STATS response */
+struct s_cmd_stats
+{
+  uint32_t uptime;
+  uint8_t lorawan_enable;
+  uint8_t joined;
+  uint8_t packet_counter;
+  uint16_t listen_permille;
+  uint16_t windows;
+  uint16_t skipped;
+  uint16_t p2p_rx;
+  uint16_t p2p_err;
+  uint16_t cut_rx;
+  uint16_t mac_conflicts;
+} __attribute__((packed));
+
+/** Size of the receive FIFO of a connection, must be a power of 2 */
+#define CMD_RX_FIFO 512
+
+/** Receive FIFO and parser state of a connection */
+struct s_cmd_parser
+{
+  // Data from the BLE event task, parsed by the callback task
+  uint8_t fifo[CMD_RX_FIFO];
+  volatile uint16_t fifo_head;
+  volatile uint16_t fifo_tail;
+  // Receive buffer of the frame parser
+  uint8_t buf[CMD_MAX_FRAME];
+  // Number of bytes in buf
+  uint16_t pos;
+  // Time of the last received byte
+  uint32_t last_rx;
+  // Text command buffer
+  char line[CMD_MAX_LINE + 1];
+  // Number of characters in line
+  uint8_t line_pos;
+};
+/** Parser per connection */
+static s_cmd_parser cmd_parsers[BLE_MAX_CONN];
+/** Parser of the connection the current request came from */
+static s_cmd_parser *cmd_p = &cmd_parsers[0];
+/** Connection the current request came from */
+static uint16_t cmd_conn = 0;
+
+/** Pending commands for the loop task, sequence number + 1, 0 => nothing pending */
+static volatile uint16_t cmd_uplink_pending = 0;
+static volatile uint16_t cmd_survey_pending = 0;
+static uint8_t cmd_survey_samples = 0;
+/** Connections that sent the pending commands */
+static uint16_t cmd_uplink_conn = 0;
+static uint16_t cmd_survey_conn = 0;
+
+/**
+   @brief CRC16 CCITT
+
+   @param data data
+   @param len length of data
+   @return uint16_t CRC
+*/
+static uint16_t cmd_crc16(const uint8_t *data, uint16_t len)
+{
+  uint16_t crc = 0xFFFF;
+  for (int idx = 0; idx < len; idx++)
+  {
+    crc ^= (uint16_t)data[idx] << 8;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/**
+   @brief Build a response frame
+
+   @param frame frame buffer
+   @param cmd command of the request
+   @param seq sequence number of the request
+   @param status CMD_STATUS_xxx
+   @param data response payload, NULL if it is already in the frame buffer
+   @param len length of the payload
+   @return uint16_t length of the frame
+*/
+static uint16_t cmd_frame(uint8_t *frame, uint8_t cmd, uint8_t seq, uint8_t status, const void *data, uint8_t len)
+{
+  if (len > 252)
+  {
+    len = 252;
+  }
+  frame[0] = CMD_SOF;
+  frame[1] = len + 3;
+  frame[2] = cmd | CMD_RESPONSE;
+  frame[3] = seq;
+  frame[4] = status;
+  if ((data != NULL) && (len != 0))
+  {
+    memcpy(&frame[CMD_PAYLOAD_OFFSET], data, len);
+  }
+  uint16_t crc = cmd_crc16(&frame[1], len + 4);
+  frame[len + 5] = crc;
+  frame[len + 6] = crc >> 8;
+  return len + CMD_FRAME_OVERHEAD;
+}
+
+/**
+   @brief Send a response frame to a connection
+
+   @param conn_handle connection the request came from
+   @param cmd command of the request
+   @param seq sequence number of the request
+   @param status CMD_STATUS_xxx
+   @param data response payload
+   @param len length of the payload
+*/
+static void cmd_respond_to(uint16_t conn_handle, uint8_t cmd, uint8_t seq, uint8_t status, const void *data, uint8_t len)
+{
+  uint8_t frame[CMD_MAX_FRAME];
+  ble_uart.write(conn_handle, frame, cmd_frame(frame, cmd, seq, status, data, len));
+}
+
+/**
+   @brief Send a response frame to the connection of the current request
+
+   @param cmd command of the request
+   @param seq sequence number of the request
+   @param status CMD_STATUS_xxx
+   @param data response payload
+   @param len length of the payload
+*/
+static void cmd_respond(uint8_t cmd, uint8_t seq, uint8_t status, const void *data, uint8_t len)
+{
+  cmd_respond_to(cmd_conn, cmd, seq, status, data, len);
+}
+
+/**
+   @brief Build a log frame around the log text
+
+   @param frame frame buffer, the text starts at CMD_PAYLOAD_OFFSET
+   @param seq sequence number of the log frames
+   @param len length of the text
+   @return uint16_t length of the frame
+*/
+uint16_t cmd_log_frame(uint8_t *frame, uint8_t seq, uint8_t len)
+{
+  return cmd_frame(frame, CMD_LOG_DATA, seq, CMD_STATUS_OK, NULL, len);
+}
+
+/**
+   @brief Wake up the loop task for a pending command
+
+*/
+static void cmd_wake_loop(void)
+{
+  task_event(5);
+}
+
+/**
+   @brief Answer with the payload of the request
+*/
+static void cmd_ping(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  cmd_respond(CMD_PING, seq, CMD_STATUS_OK, data, len);
+}
+
+/**
+   @brief Answer with the protocol version and the firmware version * 100
+*/
+static void cmd_get_version(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  uint8_t version[3] = {CMD_VERSION, (uint8_t)(SW_VERSION * 100), (uint8_t)((uint16_t)(SW_VERSION * 100) >> 8)};
+  cmd_respond(CMD_GET_VERSION, seq, CMD_STATUS_OK, version, sizeof(version));
+}
+
+/**
+   @brief Send a packet now, answered by the loop task after sending
+*/
+static void cmd_send_uplink(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  if (!g_lorawan_initialized)
+  {
+    cmd_respond(CMD_SEND_UPLINK, seq, CMD_STATUS_NOT_AVAILABLE, NULL, 0);
+    return;
+  }
+  if (cmd_uplink_pending)
+  {
+    cmd_respond(CMD_SEND_UPLINK, seq, CMD_STATUS_BUSY, NULL, 0);
+    return;
+  }
+  cmd_uplink_conn = cmd_conn;
+  cmd_uplink_pending = seq + 1;
+  cmd_wake_loop();
+}
+
+/**
+   @brief Answer with s_cmd_stats
+*/
+static void cmd_read_stats(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  s_arb_stats arb;
+  arb_get_stats(&arb);
+
+  s_cmd_stats stats;
+  stats.uptime = millis() / 1000;
+  stats.lorawan_enable = g_lorawan_settings.lorawan_enable;
+  stats.joined = lpwan_has_joined;
+  stats.packet_counter = packet_counter;
+  stats.listen_permille = arb.total_ms ? (uint16_t)(((uint64_t)arb.listen_ms * 1000) / arb.total_ms) : 0;
+  stats.windows = arb.windows;
+  stats.skipped = arb.skipped;
+  stats.p2p_rx = arb.p2p_rx;
+  stats.p2p_err = arb.p2p_err;
+  stats.cut_rx = arb.cut_rx;
+  stats.mac_conflicts = arb.mac_conflicts;
+  cmd_respond(CMD_READ_STATS, seq, CMD_STATUS_OK, &stats, sizeof(stats));
+}
+
+/**
+   @brief Sample the RSSI on the P2P channel, payload is the number of samples
+   Answered by the loop task with min, average and max RSSI as int16
+*/
+static void cmd_survey(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  if (cmd_survey_pending)
+  {
+    cmd_respond(CMD_SURVEY, seq, CMD_STATUS_BUSY, NULL, 0);
+    return;
+  }
+  cmd_survey_samples = ((len > 0) && (data[0] > 0)) ? data[0] : CMD_SURVEY_SAMPLES;
+  cmd_survey_conn = cmd_conn;
+  cmd_survey_pending = seq + 1;
+  cmd_wake_loop();
+}
+
+/**
+   @brief Grant credits to send the log, payload is the number of frames as uint16
+   0 credits stop the log, without payload only the state is answered.
+   Answered with s_log_stats
+*/
+static void cmd_dump_log(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  if (len >= 2)
+  {
+    log_credit(cmd_conn, data[0] | (data[1] << 8));
+  }
+  s_log_stats stats;
+  log_get_stats(cmd_conn, &stats);
+  cmd_respond(CMD_DUMP_LOG, seq, CMD_STATUS_OK, &stats, sizeof(stats));
+}
+
+/**
+   @brief Start the BLE UART throughput test, payload is the number of bytes as uint32
+*/
+static void cmd_speed(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  uint32_t bytes = 0;
+  memcpy(&bytes, data, 4);
+  cmd_respond(CMD_SPEED, seq, CMD_STATUS_OK, NULL, 0);
+  ble_speed_test(cmd_conn, bytes);
+}
+
+/**
+   @brief Queue a message for the LoRa bridge, payload is the message
+   Answered with the message ID as uint16, the receipt follows after sending
+*/
+static void cmd_bridge_data(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  uint16_t id = 0;
+  uint8_t status = bridge_queue_msg(cmd_conn, data, len, &id);
+  cmd_respond(CMD_BRIDGE_DATA, seq, status, &id, status == CMD_STATUS_OK ? sizeof(id) : 0);
+}
+
+/**
+   @brief Answer with the bridge metrics s_bridge_stats
+*/
+static void cmd_bridge_stats(uint8_t seq, uint8_t *data, uint8_t len)
+{
+  s_bridge_stats stats;
+  bridge_get_stats(&stats);
+  cmd_respond(CMD_BRIDGE_STATS, seq, CMD_STATUS_OK, &stats, sizeof(stats));
+}
+
+/**
+   @brief Send the sent or delivery receipt of a bridge message
+
+   @param conn_handle connection the message came from
+   @param id message ID
+   @param result BRIDGE_RECEIPT_xxx
+   @param delay_ms time from queueing until the result
+*/
+void cmd_bridge_receipt(uint16_t conn_handle, uint16_t id, uint8_t result, uint32_t delay_ms)
+{
+  s_cmd_receipt receipt = {id, result, delay_ms};
+  cmd_respond_to(conn_handle, CMD_BRIDGE_RECEIPT, 0, CMD_STATUS_OK, &receipt, sizeof(receipt));
+}
+
+/** Command handler */
+typedef void (*cmd_handler_t)(uint8_t seq, uint8_t *data, uint8_t len);
+
+/** Entry of the dispatch table */
+struct s_cmd_entry
+{
+  uint8_t cmd;
+  uint8_t min_len;
+  cmd_handler_t handler;
+};
+
+/** Dispatch table */
+static const s_cmd_entry cmd_table[] = {
+  {CMD_PING, 0, cmd_ping},
+  {CMD_GET_VERSION, 0, cmd_get_version},
+  {CMD_SEND_UPLINK, 0, cmd_send_uplink},
+  {CMD_READ_STATS, 0, cmd_read_stats},
+  {CMD_SURVEY, 0, cmd_survey},
+  {CMD_DUMP_LOG, 0, cmd_dump_log},
+  {CMD_SPEED, 4, cmd_speed},
+  {CMD_BRIDGE_DATA, 1, cmd_bridge_data},
+  {CMD_BRIDGE_STATS, 0, cmd_bridge_stats},
+};
+
+/**
+   @brief Check and execute a complete frame
+
+*/
+static void cmd_dispatch(void)
+{
+  uint8_t len = cmd_p->buf[1];
+  uint8_t cmd = cmd_p->buf[2];
+  uint8_t seq = cmd_p->buf[3];
+  uint16_t crc = cmd_p->buf[len + 2] | (cmd_p->buf[len + 3] << 8);
+  if (crc != cmd_crc16(&cmd_p->buf[1], len + 1))
+  {
+    MYLOG("CMD", "CRC error cmd %02X seq %d", cmd, seq);
+    cmd_respond(cmd, seq, CMD_STATUS_CRC, NULL, 0);
+    return;
+  }
+
+  for (int idx = 0; idx < sizeof(cmd_table) / sizeof(cmd_table[0]); idx++)
+  {
+    if (cmd_table[idx].cmd == cmd)
+    {
+      if ((len - 2) < cmd_table[idx].min_len)
+      {
+        cmd_respond(cmd, seq, CMD_STATUS_BAD_LENGTH, NULL, 0);
+        return;
+      }
+      cmd_table[idx].handler(seq, &cmd_p->buf[4], len - 2);
+      return;
+    }
+  }
+  cmd_respond(cmd, seq, CMD_STATUS_UNKNOWN, NULL, 0);
+}
+
+/**
+   @brief Handle a text command
+
+*/
+static void cmd_text(void)
+{
+  MYLOG("CMD", "BLE Received %s", cmd_p->line);
+
+  // SPEED or SPEED=<bytes> measures the throughput of the BLE UART
+  if (strncasecmp(cmd_p->line, "SPEED", 5) == 0)
+  {
+    uint32_t bytes = cmd_p->line[5] == '=' ? atol(&cmd_p->line[6]) : 0;
+    ble_speed_test(cmd_conn, bytes);
+  }
+  // LOG shows the state of the log streaming
+  else if (strncasecmp(cmd_p->line, "LOG", 3) == 0)
+  {
+    s_log_stats stats;
+    log_get_stats(cmd_conn, &stats);
+    char line[96];
+    int len = snprintf(line, sizeof(line), "LOG used %ld dropped %ld sent %ld bytes, %ld B/s, credits %ld\n",
+                       stats.used, stats.dropped, stats.sent, stats.rate, stats.credits);
+    ble_uart.write(cmd_conn, (uint8_t *)line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+  }
+}
+
+/**
+   @brief Feed one received byte to the parser
+
+   @param c received byte
+*/
+static void cmd_rx_byte(uint8_t c)
+{
+  if (cmd_p->pos == 0)
+  {
+    if (c == CMD_SOF)
+    {
+      cmd_p->buf[cmd_p->pos++] = c;
+      return;
+    }
+    if ((c == '\n') || (c == '\r'))
+    {
+      if (cmd_p->line_pos != 0)
+      {
+        cmd_p->line[cmd_p->line_pos] = 0;
+        cmd_text();
+        cmd_p->line_pos = 0;
+      }
+      return;
+    }
+    if (cmd_p->line_pos < CMD_MAX_LINE)
+    {
+      cmd_p->line[cmd_p->line_pos++] = c;
+    }
+    return;
+  }
+
+  cmd_p->buf[cmd_p->pos++] = c;
+  // A frame has at least cmd and seq
+  if ((cmd_p->pos == 2) && (c < 2))
+  {
+    cmd_p->pos = 0;
+    return;
+  }
+  if ((cmd_p->pos > 2) && (cmd_p->pos == (cmd_p->buf[1] + 4)))
+  {
+    cmd_dispatch();
+    cmd_p->pos = 0;
+  }
+}
+
+/**
+   @brief Move the received BLE UART data into the FIFO of the connection
+   Called from the BLE UART RX callback in the BLE event task,
+   the shared RX FIFO of the BLE UART holds only data of this connection.
+
+   @param conn_handle connection handle
+*/
+void cmd_rx_copy(uint16_t conn_handle)
+{
+  s_cmd_parser *parser = &cmd_parsers[conn_handle < BLE_MAX_CONN ? conn_handle : 0];
+  while (ble_uart.available())
+  {
+    uint8_t c = ble_uart.read();
+    if (conn_handle >= BLE_MAX_CONN)
+    {
+      continue;
+    }
+    uint16_t next = (parser->fifo_head + 1) & (CMD_RX_FIFO - 1);
+    if (next == parser->fifo_tail)
+    {
+      // FIFO full, the frame CRC or the timeout discards the rest
+      continue;
+    }
+    parser->fifo[parser->fifo_head] = c;
+    parser->fifo_head = next;
+  }
+}
+
+/**
+   @brief Parse the received data of a connection
+   Called from the callback task after cmd_rx_copy()
+
+   @param conn_handle connection handle
+*/
+void cmd_rx(uint16_t conn_handle)
+{
+  if (conn_handle >= BLE_MAX_CONN)
+  {
+    return;
+  }
+  cmd_conn = conn_handle;
+  cmd_p = &cmd_parsers[conn_handle];
+  ble_activity(conn_handle);
+  if ((cmd_p->pos != 0) && ((millis() - cmd_p->last_rx) > CMD_FRAME_TIMEOUT))
+  {
+    MYLOG("CMD", "Incomplete frame dropped");
+    cmd_p->pos = 0;
+  }
+  while (cmd_p->fifo_tail != cmd_p->fifo_head)
+  {
+    uint8_t c = cmd_p->fifo[cmd_p->fifo_tail];
+    cmd_p->fifo_tail = (cmd_p->fifo_tail + 1) & (CMD_RX_FIFO - 1);
+    cmd_rx_byte(c);
+  }
+  cmd_p->last_rx = millis();
+}
+
+/**
+   @brief Reset the parser of a connection after a disconnect
+
+   @param conn_handle connection handle
+*/
+void cmd_disconnect(uint16_t conn_handle)
+{
+  if (conn_handle >= BLE_MAX_CONN)
+  {
+    return;
+  }
+  s_cmd_parser *parser = &cmd_parsers[conn_handle];
+  parser->fifo_tail = parser->fifo_head;
+  parser->pos = 0;
+  parser->line_pos = 0;
+}
+
+/**
+   @brief Execute the commands that need the radio
+   Called from the loop task
+*/
+void cmd_process(void)
+{
+  if (cmd_uplink_pending)
+  {
+    uint8_t seq = cmd_uplink_pending - 1;
+    bool result;
+    if (g_lorawan_settings.lorawan_enable)
+    {
+      result = send_lpwan_packet();
+    }
+    else
+    {
+      send_lora_packet();
+      result = true;
+    }
+    cmd_respond_to(cmd_uplink_conn, CMD_SEND_UPLINK, seq, result ? CMD_STATUS_OK : CMD_STATUS_FAILED, NULL, 0);
+    cmd_uplink_pending = 0;
+  }
+
+  if (cmd_survey_pending)
+  {
+    uint8_t seq = cmd_survey_pending - 1;
+    // The radio must be listening on the P2P channel
+    if (!g_lorawan_initialized || (g_lorawan_settings.lorawan_enable && !arb_p2p_listening()))
+    {
+      cmd_respond_to(cmd_survey_conn, CMD_SURVEY, seq, CMD_STATUS_NOT_AVAILABLE, NULL, 0);
+    }
+    else
+    {
+      int16_t rssi[3] = {0, 0, -200};
+      int32_t sum = 0;
+      for (int idx = 0; idx < cmd_survey_samples; idx++)
+      {
+        int16_t sample = Radio.Rssi(MODEM_LORA);
+        sum += sample;
+        rssi[0] = (idx == 0) || (sample < rssi[0]) ? sample : rssi[0];
+        rssi[2] = sample > rssi[2] ? sample : rssi[2];
+        delay(1);
+      }
+      rssi[1] = sum / cmd_survey_samples;
+      cmd_respond_to(cmd_survey_conn, CMD_SURVEY, seq, CMD_STATUS_OK, rssi, sizeof(rssi));
+    }
+    cmd_survey_pending = 0;
+  }
+}
@@ -66,6 +66,10 @@ static void lpwan_join_fail_handler(void);
 static void lpwan_rx_handler(lmh_app_data_t *app_data);
 /** LoRaWAN callback after class change request finished */
 static void lpwan_class_confirm_handler(DeviceClass_t Class);
+/** LoRaWAN callback after an unconfirmed uplink finished */
+static void lpwan_unconf_finished(void);
+/** LoRaWAN callback after a confirmed uplink finished */
+static void lpwan_conf_result(bool result);
 /** LoRaWAN Function to send a package */
 bool send_lpwan_packet(void);
 
@@ -85,7 +89,8 @@ static lmh_param_t lora_param_init;
 /** Structure containing LoRaWan callback functions, needed for lmh_init() */
 static lmh_callback_t lora_callbacks = {BoardGetBatteryLevel, BoardGetUniqueId, BoardGetRandomSeed,
                                         lpwan_rx_handler, lpwan_joined_handler,
-                                        lpwan_class_confirm_handler, lpwan_join_fail_handler
+                                        lpwan_class_confirm_handler, lpwan_join_fail_handler,
+                                        lpwan_unconf_finished, lpwan_conf_result
                                        };
 
 bool lpwan_has_joined = false;
@@ -255,8 +260,12 @@ void lora_task(void *pvParameters)
       {
         // Switch off the indicator lights
         digitalWrite(LED_BUILTIN, HIGH);
-        // Handle Radio events with special process command!!!!
-        Radio.IrqProcessAfterDeepSleep();
+        // P2P packets received in the LoRaWAN idle gaps are handled by the arbiter
+        if (!arb_irq())
+        {
+          // Handle Radio events with special process command!!!!
+          Radio.IrqProcessAfterDeepSleep();
+        }
       }
     }
   }
@@ -303,13 +312,9 @@ static void lpwan_joined_handler(void)
   else
   {
     // Wake up task to send initial packet
-    g_task_event_type = 1;
     // Notify task about the event
-    if (g_task_sem != NULL)
-    {
-      MYLOG("LORA", "Waking up loop task");
-      xSemaphoreGive(g_task_sem);
-    }
+    MYLOG("LORA", "Waking up loop task");
+    task_event(1);
 
     lpwan_has_joined = true;
   }
@@ -328,6 +333,8 @@ static void lpwan_rx_handler(lmh_app_data_t *app_data)
 {
   MYLOG("LORA", "LoRa Packet received on port %d, size:%d, rssi:%d, snr:%d",
         app_data->port, app_data->buffsize, app_data->rssi, app_data->snr);
+  adv_telemetry_rx(app_data->rssi, app_data->snr);
+  rx_stream_queue(app_data->port, app_data->buffer, app_data->buffsize, app_data->rssi, app_data->snr);
 
   switch (app_data->port)
   {
@@ -357,17 +364,17 @@ static void lpwan_rx_handler(lmh_app_data_t *app_data)
         }
       }
       break;
+    case ADV_DOWNLINK_PORT:
+      // Port 4 stops or wakes the BLE advertising
+      adv_schedule_downlink(app_data->buffer, app_data->buffsize);
+      break;
     case LORAWAN_APP_PORT:
       // Copy the data into loop data buffer
       memcpy(g_rx_lora_data, app_data->buffer, app_data->buffsize);
       g_rx_data_len = app_data->buffsize;
-      g_task_event_type = 0;
       // Notify task about the event
-      if (g_task_sem != NULL)
-      {
-        MYLOG("LORA", "Waking up loop task");
-        xSemaphoreGive(g_task_sem);
-      }
+      MYLOG("LORA", "Waking up loop task");
+      task_event(0);
   }
 }
 
@@ -381,16 +388,35 @@ static void lpwan_class_confirm_handler(DeviceClass_t Class)
   MYLOG("LORA", "switch to class %c done", "ABC"[Class]);
 
   // Wake up task to send initial packet
-  g_task_event_type = 1;
   // Notify task about the event
-  if (g_task_sem != NULL)
-  {
-    MYLOG("LORA", "Waking up loop task");
-    xSemaphoreGive(g_task_sem);
-  }
+  MYLOG("LORA", "Waking up loop task");
+  task_event(1);
   lpwan_has_joined = true;
 }
 
+/**
+   @brief Callback after an unconfirmed uplink and its receive windows finished
+
+*/
+static void lpwan_unconf_finished(void)
+{
+  MYLOG("LORA", "Uplink finished");
+  arb_mac_done();
+}
+
+/**
+   @brief Callback after a confirmed uplink finished
+   Called after the ACK or after the last retransmission
+
+   @param result true if the uplink was acknowledged
+*/
+static void lpwan_conf_result(bool result)
+{
+  MYLOG("LORA", "Confirmed uplink %s", result ? "acknowledged" : "not acknowledged");
+  bridge_mac_result(result);
+  arb_mac_done();
+}
+
 uint8_t packet_counter = 0;
 
 /**
@@ -409,23 +435,16 @@ bool send_lpwan_packet(void)
       return false;
     }
 
-    m_lora_app_data.port = LORAWAN_APP_PORT;
-
     /// \todo here some more usefull data should be put into the package
-    uint8_t buffSize = 0;
-    m_lora_app_data_buffer[buffSize++] = packet_counter;
-    m_lora_app_data_buffer[buffSize++] = packet_counter;
-    m_lora_app_data_buffer[buffSize++] = packet_counter;
-    m_lora_app_data_buffer[buffSize++] = packet_counter;
-    m_lora_app_data_buffer[buffSize++] = packet_counter;
+    uint8_t data[5];
+    for (int idx = 0; idx < sizeof(data); idx++)
+    {
+      data[idx] = packet_counter;
+    }
 
     packet_counter++;
 
-    m_lora_app_data.buffsize = buffSize;
-
-    lmh_error_status error = lmh_send(&m_lora_app_data, g_lorawan_settings.confirmed_msg_enabled);
-
-    return (error == 0);
+    return send_lpwan_data(LORAWAN_APP_PORT, data, sizeof(data));
   }
   else
   {
@@ -433,6 +452,53 @@ bool send_lpwan_packet(void)
   }
 }
 
+/**
+   @brief Send a LoRaWan package with the given payload
+
+   @param port application port
+   @param data payload
+   @param len length of the payload
+   @return result of send request
+*/
+bool send_lpwan_data(uint8_t port, uint8_t *data, uint8_t len)
+{
+  if (lmh_join_status_get() != LMH_SET)
+  {
+    MYLOG("LORA", "Did not join network, skip sending frame");
+    return false;
+  }
+
+  m_lora_app_data.port = port;
+  memcpy(m_lora_app_data_buffer, data, len);
+  m_lora_app_data.buffsize = len;
+  adv_telemetry_tx();
+
+  // Get the radio back from P2P listening
+  arb_mac_request();
+
+  lmh_error_status error = lmh_send(&m_lora_app_data, g_lorawan_settings.confirmed_msg_enabled);
+  if (error != 0)
+  {
+    // No uplink, the MAC will not report the end of it
+    arb_mac_done();
+  }
+
+  return (error == 0);
+}
+
+/**
+   @brief Get the maximum payload of the next uplink
+
+   @return uint8_t maximum payload at the current data rate
+*/
+uint8_t lpwan_max_payload(void)
+{
+  LoRaMacTxInfo_t tx_info;
+  tx_info.MaxPossiblePayload = 0;
+  LoRaMacQueryTxPossible(0, &tx_info);
+  return tx_info.MaxPossiblePayload;
+}
+
 /**************************************************************/
 /* LoRa properties                                            */
 /**************************************************************/
@@ -442,6 +508,7 @@ bool send_lpwan_packet(void)
 void on_tx_done(void)
 {
   MYLOG("LORA", "OnTxDone");
+  bridge_tx_result(true);
   // Send LoRa handler back to sleep
   xSemaphoreTake(lora_sem, 10);
   Radio.Rx(0);
@@ -452,19 +519,17 @@ void on_tx_done(void)
 void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 {
   MYLOG("LORA", "OnRxDone");
+  adv_telemetry_rx(rssi, snr);
+  rx_stream_queue(RX_STREAM_PORT_P2P, payload, size, rssi, snr);
 
   delay(10);
 
   // Copy the data into loop data buffer
   memcpy(g_rx_lora_data, payload, size);
   g_rx_data_len = size;
-  g_task_event_type = 0;
   // Notify task about the event
-  if (g_task_sem != NULL)
-  {
-    MYLOG("LORA", "Waking up loop task");
-    xSemaphoreGive(g_task_sem);
-  }
+  MYLOG("LORA", "Waking up loop task");
+  task_event(0);
 
   Radio.Rx(0);
 }
@@ -474,6 +539,7 @@ void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 void on_tx_timeout(void)
 {
   MYLOG("LORA", "OnTxTimeout");
+  bridge_tx_result(false);
 
   Radio.Rx(0);
 }
@@ -500,6 +566,7 @@ void on_cad_done(bool cadResult)
 {
   if (cadResult)
   {
+    bridge_tx_result(false);
     Radio.Rx(0);
   }
   else
@@ -514,15 +581,36 @@ void on_cad_done(bool cadResult)
 */
 void send_lora_packet(void)
 {
-  g_tx_data_len = 0;
-  g_tx_lora_data[g_tx_data_len++] = packet_counter;
-  g_tx_lora_data[g_tx_data_len++] = packet_counter;
-  g_tx_lora_data[g_tx_data_len++] = packet_counter;
-  g_tx_lora_data[g_tx_data_len++] = packet_counter;
-  g_tx_lora_data[g_tx_data_len++] = packet_counter;
+  uint8_t data[5];
+  for (int idx = 0; idx < sizeof(data); idx++)
+  {
+    data[idx] = packet_counter;
+  }
 
   packet_counter++;
 
+  send_lora_data(data, sizeof(data));
+}
+
+/**
+   @brief Prepare a packet with the given payload and start CAD routine
+
+   @param data payload
+   @param len length of the payload
+   @return true if the CAD was started
+   @return false if the radio is still sending a bridge frame
+*/
+bool send_lora_data(uint8_t *data, uint8_t len)
+{
+  if (bridge_busy())
+  {
+    MYLOG("LORA", "Radio busy with a bridge frame, skip sending");
+    return false;
+  }
+  memcpy(g_tx_lora_data, data, len);
+  g_tx_data_len = len;
+  adv_telemetry_tx();
+
   // Prepare LoRa CAD
   Radio.Sleep();
   Radio.SetCadParams(LORA_CAD_08_SYMBOL, g_lorawan_settings.p2p_sf + 13, 10, LORA_CAD_ONLY, 0);
@@ -532,4 +620,5 @@ void send_lora_packet(void)
 
   // Start CAD
   Radio.StartCad();
+  return true;
 }
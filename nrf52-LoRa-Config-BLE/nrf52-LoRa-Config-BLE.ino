@@ -11,22 +11,52 @@
 
 #include "main.h"
 
-/** Semaphore used by events to wake up loop task */
-SemaphoreHandle_t g_task_sem = NULL;
+/** Handle of the loop task, events are bits of its task notification */
+static TaskHandle_t loop_task = NULL;
 
 /** Timer to wakeup task frequently and send message */
 SoftwareTimer g_task_wakeup_timer;
 
 /**
-   @brief Flag for the event type
-   -1 => no event
+   @brief Signal an event to the loop task
+   Each event is one bit of the task notification. Events that happen
+   while the loop task is busy are kept and handled in the next pass,
+   several events can be pending at the same time.
+   Called from tasks and timer callbacks, not from interrupts.
+
+   @param event event number
    0 => LoRaWan data received
    1 => Timer wakeup
-   3 => Received configuration over BLE
-   2 => tbd
-   ...
+   2 => Received configuration over BLE
+   3 => Start P2P listen after LoRaWAN receive windows
+   4 => LoRa P2P data received between LoRaWAN uplinks
+   5 => Command from BLE UART that needs the radio
+   6 => BLE to LoRa bridge has data, a TX result or a deadline
+   7 => Wake event for the BLE advertising
+   8 => Send the readings of the BLE beacon scanner
 */
-uint8_t g_task_event_type = -1;
+void task_event(uint8_t event)
+{
+  if (loop_task != NULL)
+  {
+    xTaskNotify(loop_task, 1UL << event, eSetBits);
+  }
+}
+
+/**
+   @brief Signal an event to the loop task from an interrupt
+
+   @param event event number, see task_event()
+*/
+void task_event_from_isr(uint8_t event)
+{
+  if (loop_task != NULL)
+  {
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(loop_task, 1UL << event, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
 
 /**
    @brief Timer event that wakes up the loop task frequently
@@ -37,8 +67,7 @@ void periodic_wakeup(TimerHandle_t unused)
 {
   // Switch on blue LED to show we are awake
   digitalWrite(LED_CONN, HIGH);
-  g_task_event_type = 1;
-  xSemaphoreGiveFromISR(g_task_sem, pdFALSE);
+  task_event(1);
 }
 
 /**
@@ -47,10 +76,8 @@ void periodic_wakeup(TimerHandle_t unused)
 */
 void setup()
 {
-  // Create the LoRaWan event semaphore
-  g_task_sem = xSemaphoreCreateBinary();
-  // Initialize semaphore
-  xSemaphoreGive(g_task_sem);
+  // setup() and loop() run in the loop task
+  loop_task = xTaskGetCurrentTaskHandle();
 
   // Initialize the built in LED
   pinMode(LED_BUILTIN, OUTPUT);
@@ -82,6 +109,9 @@ void setup()
 
   digitalWrite(LED_BUILTIN, HIGH);
 
+  // Start the log streaming over BLE
+  init_log();
+
   MYLOG("APP", "=====================================");
   MYLOG("APP", "RAK4631 LoRaWan BLE Config Test");
   MYLOG("APP", "=====================================");
@@ -118,83 +148,123 @@ void setup()
     MYLOG("APP", "Auto join is disabled, waiting for connect command");
     delay(100);
   }
-
-  // Take the semaphore so the loop will go to sleep until an event happens
-  xSemaphoreTake(g_task_sem, 10);
 }
 
 /**
-   @brief Arduino loop task. Called in a loop from the FreeRTOS task handler
+   @brief Handle one event of the loop task
 
+   @param event event number, see task_event()
 */
-void loop()
+static void handle_event(uint8_t event)
 {
-  // Sleep until we are woken up by an event
-  if (xSemaphoreTake(g_task_sem, portMAX_DELAY) == pdTRUE)
+  switch (event)
   {
-    // Switch on green LED to show we are awake
-    digitalWrite(LED_BUILTIN, HIGH);
-    switch (g_task_event_type)
-    {
-      case 0:
-        MYLOG("APP", "Received package over LoRaWan");
-        if (g_rx_lora_data[0] > 0x1F)
-        {
-          MYLOG("APP", "%s", (char *)g_rx_lora_data);
-        }
-        else
+    case 0:
+      MYLOG("APP", "Received package over LoRaWan");
+      if (g_rx_lora_data[0] > 0x1F)
+      {
+        MYLOG("APP", "%s", (char *)g_rx_lora_data);
+      }
+      else
+      {
+        for (int idx = 0; idx < g_rx_data_len; idx++)
         {
-          for (int idx = 0; idx < g_rx_data_len; idx++)
-          {
-            MYLOG("APP", "%X ", g_rx_lora_data[idx]);
-          }
+          MYLOG("APP", "%X ", g_rx_lora_data[idx]);
         }
+      }
+
+      break;
+    case 1:
+      MYLOG("APP", "Timer wakeup");
+      /// \todo read sensor or whatever you need to do frequently
+      rx_stream_log_stats();
+      scan_log_stats();
 
-        break;
-      case 1:
-        MYLOG("APP", "Timer wakeup");
-        /// \todo read sensor or whatever you need to do frequently
-
-        if (g_lorawan_settings.lorawan_enable)
-        { // Send the data package
-          if (send_lpwan_packet())
-          {
-            MYLOG("APP", "LoRaWan package sent successfully");
-          }
-          else
-          {
-            MYLOG("APP", "LoRaWan package send failed");
-            /// \todo maybe you need to retry here?
-          }
+      if (g_lorawan_settings.lorawan_enable)
+      {
+        arb_log_stats();
+        bridge_log_stats();
+        // Send the data package
+        if (send_lpwan_packet())
+        {
+          MYLOG("APP", "LoRaWan package sent successfully");
         }
         else
         {
-          send_lora_packet();
-          MYLOG("APP", "LoRa package sent");
+          MYLOG("APP", "LoRaWan package send failed");
+          /// \todo maybe you need to retry here?
         }
+      }
+      else
+      {
+        send_lora_packet();
+        MYLOG("APP", "LoRa package sent");
+      }
 
-        break;
-      case 2:
-        MYLOG("APP", "Config received over BLE");
-        delay(100);
+      break;
+    case 2:
+      MYLOG("APP", "Config received over BLE");
+      delay(100);
 
-        // Inform connected device about new settings
-        lorawan_data.write((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
-        lorawan_data.notify((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+      // Inform connected devices about new settings
+      lorawan_data.write((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+      settings_notify_all((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
 
-        // Check if auto connect is enabled
-        if ((g_lorawan_settings.auto_join) && !g_lorawan_initialized)
-        {
-          init_lora();
-        }
-        break;
-      default:
-        MYLOG("APP", "This should never happen ;-)");
-        break;
+      // Check if auto connect is enabled
+      if ((g_lorawan_settings.auto_join) && !g_lorawan_initialized)
+      {
+        init_lora();
+      }
+      break;
+    case 3:
+      arb_process();
+      break;
+    case 4:
+      MYLOG("APP", "Received P2P package between LoRaWan uplinks");
+      for (int idx = 0; idx < g_rx_data_len; idx++)
+      {
+        MYLOG("APP", "%X ", g_rx_lora_data[idx]);
+      }
+      break;
+    case 5:
+      cmd_process();
+      break;
+    case 6:
+      bridge_process();
+      break;
+    case 7:
+      adv_schedule_process();
+      break;
+    case 8:
+      scan_process();
+      break;
+    default:
+      MYLOG("APP", "This should never happen ;-)");
+      break;
+  }
+}
+
+/**
+   @brief Arduino loop task. Called in a loop from the FreeRTOS task handler
+
+*/
+void loop()
+{
+  uint32_t events = 0;
+  // Sleep until we are woken up by one or more events
+  if (xTaskNotifyWait(0, 0xFFFFFFFF, &events, portMAX_DELAY) == pdTRUE)
+  {
+    // Switch on green LED to show we are awake
+    digitalWrite(LED_BUILTIN, HIGH);
+    for (uint8_t event = 0; event < 32; event++)
+    {
+      if (events & (1UL << event))
+      {
+        handle_event(event);
+      }
     }
-    delay(500); // Only so we can see the blue LED
-    // Go back to sleep
-    xSemaphoreTake(g_task_sem, 10);
+    // Only so we can see the blue LED, events during the delay stay pending
+    delay(500);
     // Switch off blue LED to show we go to sleep
     digitalWrite(LED_CONN, LOW);
     delay(10);
@@ -0,0 +1,403 @@
+/**
+   @file scanner.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Scan for BLE sensor beacons and forward changed readings over LoRa
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+   The node scans passively with scan_interval and scan_window next to the
+   advertising and the connections. Advertisements are accepted if their
+   manufacturer data company ID or 16 bit service data UUID is in scan_allow,
+   an empty allowlist accepts all.
+
+   Accepted devices are kept in a fixed size hash table, keyed by the BLE
+   address, with the last seen time and a hash of the data. Only devices
+   whose data changed are marked for the next uplink. A full table replaces
+   the device that was not seen for the longest time within the probe range.
+
+   Every SCAN_UPLINK_TIME the changed readings are packed into one frame up
+   to the maximum payload (LoRaWAN port SCAN_PORT or a P2P packet). While a
+   send fails or more readings wait the period is SCAN_RETRY. A reading is
+   only marked as sent if its slot still holds the same device and data
+   after the send, a newer reading goes out with the next frame.
+   Record in the frame:
+   0..2   last 3 bytes of the BLE address
+   3      RSSI
+   4      age of the reading in seconds, max 255
+   5      length of the data
+   6..    manufacturer data or service data, including company ID or UUID
+*/
+
+#include "main.h"
+
+/** Number of devices in the table, must be a power of 2 */
+#define SCAN_TABLE_SIZE 64
+/** Number of slots checked for a device */
+#define SCAN_PROBE 8
+/** Longest forwarded data, longer data is cut */
+#define SCAN_MAX_DATA 24
+/** Length of a record without the data */
+#define SCAN_RECORD_HEADER 6
+/** Time between two uplinks in ms */
+#define SCAN_UPLINK_TIME 60000
+/** Retry time if LoRaWAN is busy or more records are waiting in ms */
+#define SCAN_RETRY 10000
+/** LoRaWAN port of the scanner frames */
+#define SCAN_PORT 11
+/** Largest P2P packet */
+#define SCAN_P2P_MAX 255
+
+/** Device in the table */
+struct s_scan_device
+{
+  uint8_t addr[6];
+  bool used;
+  // Flag if the data changed since the last uplink
+  bool changed;
+  int8_t rssi;
+  uint8_t len;
+  uint32_t last_seen;
+  uint32_t data_hash;
+  uint8_t data[SCAN_MAX_DATA];
+};
+
+/** Record in the frame that is sent */
+struct s_scan_sent
+{
+  s_scan_device *device;
+  uint8_t addr[6];
+  uint32_t data_hash;
+};
+
+/** Device table */
+static s_scan_device scan_table[SCAN_TABLE_SIZE];
+/** Records of the frame that is sent, only used by the loop task */
+static s_scan_sent scan_sent[SCAN_TABLE_SIZE];
+/** Protects the table, written by the BLE task and read by the loop task */
+static SemaphoreHandle_t scan_mutex = NULL;
+
+/** Timer for the uplinks */
+SoftwareTimer g_scan_timer;
+/** Current period of the uplink timer in ms */
+static uint32_t scan_period = SCAN_UPLINK_TIME;
+
+/** Metrics */
+static s_scan_stats scan_stats;
+/** Start of the metrics in ms */
+static uint32_t scan_stats_start = 0;
+
+/**
+   @brief FNV-1a hash
+
+   @param data data to hash
+   @param len length of the data
+   @return uint32_t hash
+*/
+static uint32_t scan_hash(const uint8_t *data, uint8_t len)
+{
+  uint32_t hash = 2166136261UL;
+  for (int idx = 0; idx < len; idx++)
+  {
+    hash = (hash ^ data[idx]) * 16777619UL;
+  }
+  return hash;
+}
+
+/**
+   @brief Check the company ID or service UUID against the allowlist
+
+   @param id company ID or 16 bit service UUID
+   @return true if the ID is allowed
+*/
+static bool scan_allowed(uint16_t id)
+{
+  bool empty = true;
+  for (int idx = 0; idx < SCAN_ALLOW_NUM; idx++)
+  {
+    if (g_lorawan_settings.scan_allow[idx] == 0)
+    {
+      continue;
+    }
+    empty = false;
+    if (g_lorawan_settings.scan_allow[idx] == id)
+    {
+      return true;
+    }
+  }
+  return empty;
+}
+
+/**
+   @brief Find a device in the table or a slot for it
+   Called with the table locked
+
+   @param addr BLE address
+   @return s_scan_device* the device, a free slot or the oldest device in the probe range
+*/
+static s_scan_device *scan_find(const uint8_t *addr)
+{
+  uint32_t slot = scan_hash(addr, 6);
+  s_scan_device *oldest = NULL;
+  uint32_t now = millis();
+  for (int probe = 0; probe < SCAN_PROBE; probe++)
+  {
+    s_scan_device *device = &scan_table[(slot + probe) & (SCAN_TABLE_SIZE - 1)];
+    if (!device->used || (memcmp(device->addr, addr, 6) == 0))
+    {
+      return device;
+    }
+    if ((oldest == NULL) || ((now - device->last_seen) > (now - oldest->last_seen)))
+    {
+      oldest = device;
+    }
+  }
+  return oldest;
+}
+
+/**
+   @brief Handle an advertisement report
+   Called in the BLE task for every received advertisement
+
+   @param report advertisement report
+*/
+void scan_callback(ble_gap_evt_adv_report_t *report)
+{
+  uint32_t start = micros();
+  uint8_t data[SCAN_MAX_DATA];
+  uint8_t len = Bluefruit.Scanner.parseReportByType(report, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, data, sizeof(data));
+  if (len < 2)
+  {
+    len = Bluefruit.Scanner.parseReportByType(report, BLE_GAP_AD_TYPE_SERVICE_DATA, data, sizeof(data));
+  }
+
+  scan_stats.reports++;
+  if ((len >= 2) && scan_allowed(data[0] | (data[1] << 8)))
+  {
+    scan_stats.accepted++;
+    scan_stats.raw_bytes += report->data.len + 6 + 1;
+    uint32_t hash = scan_hash(data, len);
+
+    xSemaphoreTake(scan_mutex, portMAX_DELAY);
+    s_scan_device *device = scan_find(report->peer_addr.addr);
+    if (!device->used || (memcmp(device->addr, report->peer_addr.addr, 6) != 0))
+    {
+      if (device->used)
+      {
+        scan_stats.evicted++;
+      }
+      else
+      {
+        scan_stats.devices++;
+      }
+      memcpy(device->addr, report->peer_addr.addr, 6);
+      device->used = true;
+      device->data_hash = ~hash;
+    }
+    device->last_seen = millis();
+    device->rssi = report->rssi;
+    if (device->data_hash != hash)
+    {
+      device->data_hash = hash;
+      device->len = len;
+      memcpy(device->data, data, len);
+      device->changed = true;
+      scan_stats.changed++;
+    }
+    xSemaphoreGive(scan_mutex);
+  }
+
+  scan_stats.process_us += micros() - start;
+  // Required to receive the next report
+  Bluefruit.Scanner.resume();
+}
+
+/**
+   @brief Timer callback for the uplinks
+
+   @param unused
+*/
+void scan_timer_cb(TimerHandle_t unused)
+{
+  task_event(8);
+}
+
+/**
+   @brief Start scanning if it is enabled in the settings
+   Called from init_ble(), Bluefruit must be started with a central connection
+*/
+void init_scanner(void)
+{
+  if (!g_lorawan_settings.scan_enable)
+  {
+    return;
+  }
+  scan_mutex = xSemaphoreCreateMutex();
+
+  uint16_t window = g_lorawan_settings.scan_window;
+  uint16_t interval = g_lorawan_settings.scan_interval;
+  if (window > interval)
+  {
+    window = interval;
+  }
+  Bluefruit.Scanner.setRxCallback(scan_callback);
+  Bluefruit.Scanner.restartOnDisconnect(true);
+  Bluefruit.Scanner.setInterval(interval, window);
+  // Sensor beacons have their data in the advertising packet
+  Bluefruit.Scanner.useActiveScan(false);
+  Bluefruit.Scanner.start(0);
+
+  scan_stats_start = millis();
+  scan_period = SCAN_UPLINK_TIME;
+  g_scan_timer.begin(SCAN_UPLINK_TIME, scan_timer_cb);
+  g_scan_timer.start();
+
+  MYLOG("SCAN", "Scanning %d.%03d ms of %d.%03d ms, duty %d%%",
+        (window * 625) / 1000, (window * 625) % 1000, (interval * 625) / 1000, (interval * 625) % 1000,
+        interval ? (window * 100) / interval : 0);
+}
+
+/**
+   @brief Change the period of the uplink timer if it is different
+
+   @param time_ms period in milliseconds
+*/
+static void scan_set_period(uint32_t time_ms)
+{
+  if (time_ms != scan_period)
+  {
+    scan_period = time_ms;
+    g_scan_timer.setPeriod(time_ms);
+  }
+}
+
+/**
+   @brief Send the changed readings
+   Called from the loop task by the uplink timer
+*/
+void scan_process(void)
+{
+  if (scan_mutex == NULL)
+  {
+    return;
+  }
+
+  uint8_t max_len = g_lorawan_settings.lorawan_enable ? lpwan_max_payload() : SCAN_P2P_MAX;
+  uint8_t frame[256];
+  uint8_t len = 0;
+  uint8_t num = 0;
+  bool more = false;
+  uint32_t now = millis();
+
+  // Changed flags are cleared only after the frame is accepted by the radio
+  xSemaphoreTake(scan_mutex, portMAX_DELAY);
+  for (int idx = 0; idx < SCAN_TABLE_SIZE; idx++)
+  {
+    s_scan_device *device = &scan_table[idx];
+    if (!device->used || !device->changed)
+    {
+      continue;
+    }
+    // A reading that does not fit into an empty frame would block all others
+    if ((SCAN_RECORD_HEADER + device->len) > max_len)
+    {
+      device->changed = false;
+      scan_stats.too_long++;
+      MYLOG("SCAN", "Reading of %d bytes does not fit into %d bytes, skipped %ld", SCAN_RECORD_HEADER + device->len, max_len, scan_stats.too_long);
+      continue;
+    }
+    if ((len + SCAN_RECORD_HEADER + device->len) > max_len)
+    {
+      more = true;
+      break;
+    }
+    uint32_t age = (now - device->last_seen) / 1000;
+    frame[len++] = device->addr[2];
+    frame[len++] = device->addr[1];
+    frame[len++] = device->addr[0];
+    frame[len++] = device->rssi;
+    frame[len++] = age > 255 ? 255 : age;
+    frame[len++] = device->len;
+    memcpy(&frame[len], device->data, device->len);
+    len += device->len;
+    scan_sent[num].device = device;
+    memcpy(scan_sent[num].addr, device->addr, 6);
+    scan_sent[num].data_hash = device->data_hash;
+    num++;
+  }
+  xSemaphoreGive(scan_mutex);
+
+  if (num == 0)
+  {
+    scan_set_period(SCAN_UPLINK_TIME);
+    return;
+  }
+
+  bool result;
+  if (g_lorawan_settings.lorawan_enable)
+  {
+    result = send_lpwan_data(SCAN_PORT, frame, len);
+  }
+  else
+  {
+    result = send_lora_data(frame, len);
+  }
+  if (!result)
+  {
+    MYLOG("SCAN", "Send failed, retry in %d ms", SCAN_RETRY);
+    scan_set_period(SCAN_RETRY);
+    return;
+  }
+
+  // The BLE task can replace the device or its data while the frame is sent
+  xSemaphoreTake(scan_mutex, portMAX_DELAY);
+  for (int idx = 0; idx < num; idx++)
+  {
+    s_scan_device *device = scan_sent[idx].device;
+    if (device->used && (memcmp(device->addr, scan_sent[idx].addr, 6) == 0) && (device->data_hash == scan_sent[idx].data_hash))
+    {
+      device->changed = false;
+    }
+  }
+  xSemaphoreGive(scan_mutex);
+
+  scan_stats.frames++;
+  scan_stats.records += num;
+  scan_stats.frame_bytes += len;
+  MYLOG("SCAN", "Frame with %d readings, %d of %d bytes", num, len, max_len);
+  scan_set_period(more ? SCAN_RETRY : SCAN_UPLINK_TIME);
+}
+
+/**
+   @brief Get the scanner metrics
+
+   @param stats filled with the metrics since scanning started
+*/
+void scan_get_stats(s_scan_stats *stats)
+{
+  *stats = scan_stats;
+  stats->time = scan_stats_start ? (millis() - scan_stats_start) / 1000 : 0;
+}
+
+/**
+   @brief Log the scan processing throughput and the uplink compression
+
+*/
+void scan_log_stats(void)
+{
+  if (scan_stats_start == 0)
+  {
+    return;
+  }
+  uint32_t time = (millis() - scan_stats_start) / 1000;
+  MYLOG("SCAN", "%ld adv in %ld s = %ld adv/s, accepted %ld, changed %ld, devices %ld evicted %ld",
+        scan_stats.reports, time, time ? scan_stats.reports / time : 0,
+        scan_stats.accepted, scan_stats.changed, scan_stats.devices, scan_stats.evicted);
+  MYLOG("SCAN", "Processing %ld us/adv, capacity %ld adv/s",
+        scan_stats.reports ? scan_stats.process_us / scan_stats.reports : 0,
+        scan_stats.process_us ? (uint32_t)(((uint64_t)scan_stats.reports * 1000000) / scan_stats.process_us) : 0);
+  MYLOG("SCAN", "%ld readings in %ld frames, %ld bytes for %ld bytes of accepted adv = 1:%ld, %ld readings too long",
+        scan_stats.records, scan_stats.frames, scan_stats.frame_bytes, scan_stats.raw_bytes,
+        scan_stats.frame_bytes ? scan_stats.raw_bytes / scan_stats.frame_bytes : 0, scan_stats.too_long);
+}
@@ -18,6 +18,123 @@ BLECharacteristic lorawan_data = BLECharacteristic(0xF0A1);
 
 // Command callback
 void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len);
+// Notify enable callback
+void settings_cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t value);
+
+/**
+   TLV settings protocol
+   Request:  marker, version, op, then TLVs (write) or tags (read)
+   Response: marker, version, op | SETT_OP_RESPONSE, status, then TLVs (read) or the failed tag (write)
+   TLV:      tag, length, value in little endian
+*/
+/** First byte of a TLV frame, the old settings blob starts with 0xAA */
+#define SETT_TLV_MARKER 0xBB
+/** Version of the TLV protocol */
+#define SETT_TLV_VERSION 1
+/** Length of the request header */
+#define SETT_TLV_HEADER_LEN 3
+/** Length of the response header */
+#define SETT_TLV_RESP_LEN 4
+/** Maximum length of a write, one ATT write with the maximum MTU */
+#define SETT_TLV_MAX_LEN 244
+
+/** Operations */
+#define SETT_OP_WRITE 0x01
+#define SETT_OP_READ 0x02
+#define SETT_OP_RESPONSE 0x80
+
+/** Response status, SETT_STATUS_MORE is set if more read responses follow */
+#define SETT_STATUS_OK 0x00
+#define SETT_STATUS_UNKNOWN_TAG 0x01
+#define SETT_STATUS_BAD_LENGTH 0x02
+#define SETT_STATUS_BAD_VALUE 0x03
+#define SETT_STATUS_BAD_VERSION 0x04
+#define SETT_STATUS_MALFORMED 0x05
+#define SETT_STATUS_BAD_OP 0x06
+#define SETT_STATUS_MORE 0x80
+
+/** Field flags */
+#define SETT_FLAG_BOOL 0x01
+#define SETT_FLAG_WRITE_ONLY 0x02
+
+/** Tag of resetRequest, writing 1 restarts the device */
+#define SETT_TAG_RESET 29
+
+/** Description of one setting */
+struct s_sett_field
+{
+  // Tag on the air, never reused
+  uint8_t tag;
+  // Offset in s_lorawan_settings
+  uint8_t offset;
+  // Length on the air
+  uint8_t wire_len;
+  // Length in s_lorawan_settings, can be longer for enums
+  uint8_t mem_len;
+  // SETT_FLAG_xxx
+  uint8_t flags;
+};
+
+#define SETT_FIELD(tag, field, wire_len, flags) \
+  {tag, offsetof(s_lorawan_settings, field), wire_len, sizeof(((s_lorawan_settings *)0)->field), flags}
+
+/** Settings accessible by TLV, the tag is the index + 1 */
+static const s_sett_field sett_fields[] = {
+  SETT_FIELD(1, node_device_eui, 8, 0),
+  SETT_FIELD(2, node_app_eui, 8, 0),
+  SETT_FIELD(3, node_app_key, 16, SETT_FLAG_WRITE_ONLY),
+  SETT_FIELD(4, node_dev_addr, 4, 0),
+  SETT_FIELD(5, node_nws_key, 16, SETT_FLAG_WRITE_ONLY),
+  SETT_FIELD(6, node_apps_key, 16, SETT_FLAG_WRITE_ONLY),
+  SETT_FIELD(7, otaa_enabled, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(8, adr_enabled, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(9, public_network, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(10, duty_cycle_enabled, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(11, send_repeat_time, 4, 0),
+  SETT_FIELD(12, join_trials, 1, 0),
+  SETT_FIELD(13, tx_power, 1, 0),
+  SETT_FIELD(14, data_rate, 1, 0),
+  SETT_FIELD(15, lora_class, 1, 0),
+  SETT_FIELD(16, subband_channels, 1, 0),
+  SETT_FIELD(17, auto_join, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(18, app_port, 1, 0),
+  SETT_FIELD(19, confirmed_msg_enabled, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(20, lorawan_region, 1, 0),
+  SETT_FIELD(21, lorawan_enable, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(22, p2p_frequency, 4, 0),
+  SETT_FIELD(23, p2p_tx_power, 1, 0),
+  SETT_FIELD(24, p2p_bandwidth, 1, 0),
+  SETT_FIELD(25, p2p_sf, 1, 0),
+  SETT_FIELD(26, p2p_cr, 1, 0),
+  SETT_FIELD(27, p2p_preamble_len, 1, 0),
+  SETT_FIELD(28, p2p_symbol_timeout, 2, 0),
+  SETT_FIELD(SETT_TAG_RESET, resetRequest, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(30, p2p_listen, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(31, adv_fast_time, 2, 0),
+  SETT_FIELD(32, adv_slow_time, 2, 0),
+  SETT_FIELD(33, adv_slow_interval, 2, 0),
+  SETT_FIELD(34, adv_wake_pin, 1, 0),
+  SETT_FIELD(35, scan_enable, 1, SETT_FLAG_BOOL),
+  SETT_FIELD(36, scan_interval, 2, 0),
+  SETT_FIELD(37, scan_window, 2, 0),
+  SETT_FIELD(38, scan_allow, 8, 0),
+};
+#define SETT_NUM_FIELDS (sizeof(sett_fields) / sizeof(sett_fields[0]))
+
+/**
+   @brief Find the description of a setting
+
+   @param tag tag of the setting
+   @return const s_sett_field* description, NULL if the tag is unknown
+*/
+static const s_sett_field *sett_find(uint8_t tag)
+{
+  if ((tag == 0) || (tag > SETT_NUM_FIELDS))
+  {
+    return NULL;
+  }
+  return &sett_fields[tag - 1];
+}
 
 /**
    @brief Initialize the settings characteristic
@@ -29,14 +146,233 @@ void init_settings_characteristic(void)
   lorawan_service.begin();
   lorawan_data.setProperties(CHR_PROPS_NOTIFY | CHR_PROPS_READ | CHR_PROPS_WRITE);
   lorawan_data.setPermission(SECMODE_OPEN, SECMODE_OPEN);
-  lorawan_data.setFixedLen(sizeof(s_lorawan_settings) + 1);
+  // The old settings blob or a TLV frame
+  lorawan_data.setMaxLen(SETT_TLV_MAX_LEN);
   lorawan_data.setWriteCallback(settings_rx_callback);
+  lorawan_data.setCccdWriteCallback(settings_cccd_callback);
 
   lorawan_data.begin();
 
   lorawan_data.write((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
 }
 
+/**
+   @brief Callback if a central enables or disables the settings notifications
+
+   @param conn_hdl connection handle
+   @param chr the characteristic
+   @param value new CCCD value
+*/
+void settings_cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t value)
+{
+  ble_subscribe(conn_hdl, BLE_SUB_SETTINGS, value & BLE_GATT_HVX_NOTIFICATION);
+}
+
+/**
+   @brief Notify the settings to all subscribed centrals
+   Every connection gets the same buffer, the SoftDevice copies it into its queue.
+
+   @param data data to send
+   @param len length of the data
+*/
+void settings_notify_all(const void *data, uint16_t len)
+{
+  for (uint16_t conn_hdl = 0; conn_hdl < BLE_MAX_CONN; conn_hdl++)
+  {
+    if (ble_subscribed(conn_hdl, BLE_SUB_SETTINGS))
+    {
+      lorawan_data.notify(conn_hdl, data, len);
+    }
+  }
+}
+
+/**
+   @brief Send a TLV response
+   The characteristic value is set back to the settings blob for clients
+   that only read the characteristic.
+
+   @param conn_hdl connection handle
+   @param frame response frame
+   @param len length of the response
+*/
+static void settings_tlv_respond(uint16_t conn_hdl, uint8_t *frame, uint16_t len)
+{
+  lorawan_data.notify(conn_hdl, frame, len);
+  lorawan_data.write((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+}
+
+/**
+   @brief Write one or more settings
+   All TLVs are checked before the settings are changed, a batch is
+   either applied completely or not at all.
+
+   @param conn_hdl connection handle
+   @param data request frame
+   @param len length of the request
+*/
+static void settings_tlv_write(uint16_t conn_hdl, uint8_t *data, uint16_t len)
+{
+  uint8_t response[SETT_TLV_RESP_LEN + 1] = {SETT_TLV_MARKER, SETT_TLV_VERSION, SETT_OP_WRITE | SETT_OP_RESPONSE, SETT_STATUS_OK, 0};
+  s_lorawan_settings new_settings = g_lorawan_settings;
+  uint8_t *settings = (uint8_t *)&new_settings;
+  bool reset = false;
+  uint16_t pos = SETT_TLV_HEADER_LEN;
+
+  while (pos < len)
+  {
+    if ((pos + 2) > len)
+    {
+      response[3] = SETT_STATUS_MALFORMED;
+      break;
+    }
+    uint8_t tag = data[pos];
+    uint8_t tlv_len = data[pos + 1];
+    uint8_t *value = &data[pos + 2];
+    response[4] = tag;
+    if ((pos + 2 + tlv_len) > len)
+    {
+      response[3] = SETT_STATUS_MALFORMED;
+      break;
+    }
+    const s_sett_field *field = sett_find(tag);
+    if (field == NULL)
+    {
+      response[3] = SETT_STATUS_UNKNOWN_TAG;
+      break;
+    }
+    if (tlv_len != field->wire_len)
+    {
+      response[3] = SETT_STATUS_BAD_LENGTH;
+      break;
+    }
+    if ((field->flags & SETT_FLAG_BOOL) && (value[0] > 1))
+    {
+      response[3] = SETT_STATUS_BAD_VALUE;
+      break;
+    }
+    // Little endian, shorter values are extended with zeros
+    memset(&settings[field->offset], 0, field->mem_len);
+    memcpy(&settings[field->offset], value, tlv_len);
+    if (tag == SETT_TAG_RESET)
+    {
+      reset = value[0];
+    }
+    pos += 2 + tlv_len;
+  }
+
+  if (response[3] != SETT_STATUS_OK)
+  {
+    MYLOG("APP", "TLV write failed at tag %d, status %d", response[4], response[3]);
+    settings_tlv_respond(conn_hdl, response, sizeof(response));
+    return;
+  }
+
+  g_lorawan_settings = new_settings;
+  save_settings();
+  settings_tlv_respond(conn_hdl, response, SETT_TLV_RESP_LEN);
+  ble_settings_written(conn_hdl);
+
+  if (reset)
+  {
+    MYLOG("APP", "Initiate reset");
+    delay(1000);
+    sd_nvic_SystemReset();
+  }
+
+  // Notify task about the event
+  MYLOG("APP", "Waking up loop task");
+  task_event(2);
+}
+
+/**
+   @brief Read a subset of the settings
+   Without tags all settings are read. Unknown and write only tags are
+   answered with an empty TLV. Responses are split at TLV boundaries to
+   fit into one notification each.
+
+   @param conn_hdl connection handle
+   @param data request frame
+   @param len length of the request
+*/
+static void settings_tlv_read(uint16_t conn_hdl, uint8_t *data, uint16_t len)
+{
+  uint8_t frame[SETT_TLV_MAX_LEN];
+  uint16_t max_len = ble_payload_size(conn_hdl);
+  if (max_len > sizeof(frame))
+  {
+    max_len = sizeof(frame);
+  }
+
+  uint8_t *settings = (uint8_t *)&g_lorawan_settings;
+  bool all = (len == SETT_TLV_HEADER_LEN);
+  uint16_t num_tags = all ? SETT_NUM_FIELDS : len - SETT_TLV_HEADER_LEN;
+
+  frame[0] = SETT_TLV_MARKER;
+  frame[1] = SETT_TLV_VERSION;
+  frame[2] = SETT_OP_READ | SETT_OP_RESPONSE;
+  uint16_t pos = SETT_TLV_RESP_LEN;
+
+  for (int idx = 0; idx < num_tags; idx++)
+  {
+    uint8_t tag = all ? sett_fields[idx].tag : data[SETT_TLV_HEADER_LEN + idx];
+    const s_sett_field *field = sett_find(tag);
+    uint8_t value_len = 0;
+    if ((field != NULL) && !(field->flags & SETT_FLAG_WRITE_ONLY))
+    {
+      value_len = field->wire_len;
+    }
+    if ((pos + 2 + value_len) > max_len)
+    {
+      frame[3] = SETT_STATUS_OK | SETT_STATUS_MORE;
+      settings_tlv_respond(conn_hdl, frame, pos);
+      pos = SETT_TLV_RESP_LEN;
+    }
+    frame[pos++] = tag;
+    frame[pos++] = value_len;
+    if (value_len != 0)
+    {
+      memcpy(&frame[pos], &settings[field->offset], value_len);
+      pos += value_len;
+    }
+  }
+  frame[3] = SETT_STATUS_OK;
+  settings_tlv_respond(conn_hdl, frame, pos);
+}
+
+/**
+   @brief Handle a TLV settings request
+
+   @param conn_hdl connection handle
+   @param data request frame
+   @param len length of the request
+*/
+void settings_tlv_request(uint16_t conn_hdl, uint8_t *data, uint16_t len)
+{
+  if (data[1] != SETT_TLV_VERSION)
+  {
+    uint8_t response[SETT_TLV_RESP_LEN] = {SETT_TLV_MARKER, SETT_TLV_VERSION, (uint8_t)(data[2] | SETT_OP_RESPONSE), SETT_STATUS_BAD_VERSION};
+    MYLOG("APP", "TLV version %d not supported", data[1]);
+    settings_tlv_respond(conn_hdl, response, sizeof(response));
+    return;
+  }
+
+  switch (data[2])
+  {
+    case SETT_OP_WRITE:
+      settings_tlv_write(conn_hdl, data, len);
+      break;
+    case SETT_OP_READ:
+      settings_tlv_read(conn_hdl, data, len);
+      break;
+    default:
+    {
+      uint8_t response[SETT_TLV_RESP_LEN] = {SETT_TLV_MARKER, SETT_TLV_VERSION, (uint8_t)(data[2] | SETT_OP_RESPONSE), SETT_STATUS_BAD_OP};
+      settings_tlv_respond(conn_hdl, response, sizeof(response));
+    }
+    break;
+  }
+}
+
 /**
    Callback if data has been sent from the connected client
    @param conn_hdl
@@ -51,13 +387,20 @@ void init_settings_characteristic(void)
 void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len)
 {
   MYLOG("APP", "Settings received");
-
-  delay(1000);
+  ble_activity(conn_hdl);
 
   // Check the characteristic
   if (chr->uuid == lorawan_data.uuid)
   {
-    if (len != sizeof(s_lorawan_settings))
+    if ((len >= SETT_TLV_HEADER_LEN) && (data[0] == SETT_TLV_MARKER))
+    {
+      settings_tlv_request(conn_hdl, data, len);
+      return;
+    }
+
+    delay(1000);
+
+    if ((len != sizeof(s_lorawan_settings)) && (len != LORAWAN_LEGACY_LEN))
     {
       MYLOG("APP", "Received settings have wrong size %d should be %d", len, sizeof(s_lorawan_settings));
       return;
@@ -71,7 +414,17 @@ void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *da
     }
 
     // Save new LoRaWAN settings
-    memcpy((void *)&g_lorawan_settings, data, sizeof(s_lorawan_settings));
+    if (len == LORAWAN_LEGACY_LEN)
+    {
+      // Apps of the first release do not know the later settings, they get the defaults
+      s_lorawan_settings legacy_settings;
+      memcpy((void *)&legacy_settings, data, LORAWAN_LEGACY_DATA);
+      g_lorawan_settings = legacy_settings;
+    }
+    else
+    {
+      memcpy((void *)&g_lorawan_settings, data, sizeof(s_lorawan_settings));
+    }
 
     // Save new settings
     save_settings();
@@ -79,8 +432,9 @@ void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *da
     // Update settings
     lorawan_data.write((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
 
-    // Inform connected device about new settings
-    lorawan_data.notify((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+    // Inform connected devices about new settings
+    settings_notify_all((void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+    ble_settings_written(conn_hdl);
 
     if (g_lorawan_settings.resetRequest)
     {
@@ -90,11 +444,7 @@ void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *da
     }
 
     // Notify task about the event
-    if (g_task_sem != NULL)
-    {
-      g_task_event_type = 2;
-      MYLOG("APP", "Waking up loop task");
-      xSemaphoreGive(g_task_sem);
-    }
+    MYLOG("APP", "Waking up loop task");
+    task_event(2);
   }
 }
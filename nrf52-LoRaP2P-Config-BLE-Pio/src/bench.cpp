@@ -0,0 +1,667 @@
+/**
+ * @file bench.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Ping-pong, flood and sweep benchmark between two nodes
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Benchmark operations */
+#define BENCH_OP_PING 1
+#define BENCH_OP_PONG 2
+#define BENCH_OP_START 3
+#define BENCH_OP_DATA 4
+#define BENCH_OP_END 5
+#define BENCH_OP_REPORT 6
+#define BENCH_OP_SWITCH 7
+#define BENCH_OP_SWITCH_ACK 8
+
+/** Benchmark modes */
+#define BENCH_MODE_PING 1
+#define BENCH_MODE_FLOOD 2
+#define BENCH_MODE_SWEEP 3
+
+/** Default number of packets per test */
+#define BENCH_DEF_COUNT 20
+/** Default payload size of flood packets */
+#define BENCH_DEF_LEN 32
+/** Largest payload of flood packets */
+#define BENCH_MAX_LEN 200
+/** Time the responder needs to answer, includes the loop delay */
+#define BENCH_REPLY_TIME 1500
+/** Repeats of END and SWITCH without answer */
+#define BENCH_RETRIES 3
+/** Gap between ping packets in milliseconds */
+#define BENCH_PING_GAP 100
+
+/** Benchmark frame, payload of P2P_TYPE_BENCH, flood packets are padded */
+struct s_bench_frame
+{
+	// BENCH_OP_xxx
+	uint8_t op;
+	// Test number of the initiator
+	uint8_t test_id;
+	// Packet index
+	uint16_t idx;
+	// Packets in the test, received packets in the report
+	uint16_t count;
+	// Turnaround time of the responder, receive time span or revert timeout in milliseconds
+	uint32_t time;
+	// Modulation for BENCH_OP_SWITCH
+	uint8_t sf;
+	uint8_t bw;
+	uint8_t cr;
+	// Average RSSI and SNR in the report
+	int8_t rssi;
+	int8_t snr;
+} __attribute__((packed));
+
+/** Pending request of the initiator */
+static bool bench_request = false;
+static uint8_t bench_mode = 0;
+static uint16_t bench_count = BENCH_DEF_COUNT;
+static uint8_t bench_len = BENCH_DEF_LEN;
+static uint16_t bench_peer = P2P_BROADCAST;
+static volatile bool bench_abort = false;
+
+/** Initiator state, answers are filled in by the LoRa task */
+static bool bench_active = false;
+static uint8_t bench_test_id = 0;
+static volatile bool bench_answer = false;
+static volatile uint32_t bench_answer_time = 0;
+static s_bench_frame bench_rx;
+
+/** Responder state */
+static uint8_t bench_resp_id = 0;
+static uint16_t bench_resp_src = 0;
+static uint16_t bench_resp_count = 0;
+static int32_t bench_resp_rssi = 0;
+static int32_t bench_resp_snr = 0;
+static uint32_t bench_resp_first = 0;
+static uint32_t bench_resp_last = 0;
+/** Answer the responder has to send */
+static volatile bool bench_reply = false;
+static s_bench_frame bench_reply_frame;
+static uint32_t bench_reply_rx_time = 0;
+/** Responder runs on a test modulation until this time */
+static bool bench_switched = false;
+static uint32_t bench_revert_time = 0;
+
+/** Timer to revert the modulation of the responder */
+SoftwareTimer g_bench_timer;
+/** Flag if the benchmark timer was initialized */
+static bool bench_timer_init = false;
+
+/**
+ * @brief Timer event to revert the modulation
+ *
+ * @param unused
+ */
+void bench_timeout(TimerHandle_t unused)
+{
+	task_event(12);
+}
+
+/**
+ * @brief Start the benchmark timer
+ *
+ * @param delay_ms time until the timer fires in milliseconds
+ */
+static void bench_start_timer(uint32_t delay_ms)
+{
+	if (!bench_timer_init)
+	{
+		g_bench_timer.begin(delay_ms, bench_timeout, NULL, false);
+		bench_timer_init = true;
+	}
+	else
+	{
+		g_bench_timer.stop();
+		g_bench_timer.setPeriod(delay_ms);
+	}
+	g_bench_timer.start();
+}
+
+/**
+ * @brief Notify the loop task
+ *
+ */
+static void bench_wakeup(void)
+{
+	task_event(12);
+}
+
+/**
+ * @brief Send a report line to the log and the BLE UART
+ *
+ * @param line report line
+ */
+static void bench_report(const char *line)
+{
+	MYLOG("BENCH", "%s", line);
+	if (ble_uart_is_connected)
+	{
+		ble_uart.printf("%s\n", line);
+	}
+}
+
+/**
+ * @brief Switch to a modulation
+ *
+ * @param sf spreading factor 7 .. 12
+ * @param bw bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+ * @param cr coding rate 1: 4/5 .. 4: 4/8
+ */
+static void bench_set_modulation(uint8_t sf, uint8_t bw, uint8_t cr)
+{
+	Radio.Standby();
+	g_p2p_cr = cr;
+	set_p2p_modulation(sf, bw, g_lorap2p_settings.p2p_tx_power);
+	restart_rx();
+}
+
+/**
+ * @brief Go back to the modulation of the settings
+ *
+ */
+static void bench_revert(void)
+{
+	bench_set_modulation(g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_bandwidth, g_lorap2p_settings.p2p_cr);
+}
+
+/**
+ * @brief Start a benchmark as initiator
+ * Command from the BLE UART, the part after BENCH=
+ * PING,<count>,<node>  FLOOD,<count>,<len>,<node>  SWEEP,<count>,<len>,<node>  STOP
+ * Count, length and node ID in hex are optional.
+ *
+ * @param cmd command
+ */
+void bench_command(const char *cmd)
+{
+	if (strncmp(cmd, "STOP", 4) == 0)
+	{
+		bench_abort = true;
+		return;
+	}
+	if (bench_active || bench_request)
+	{
+		MYLOG("BENCH", "Benchmark already running");
+		return;
+	}
+
+	uint8_t mode;
+	if (strncmp(cmd, "PING", 4) == 0)
+	{
+		mode = BENCH_MODE_PING;
+	}
+	else if (strncmp(cmd, "FLOOD", 5) == 0)
+	{
+		mode = BENCH_MODE_FLOOD;
+	}
+	else if (strncmp(cmd, "SWEEP", 5) == 0)
+	{
+		mode = BENCH_MODE_SWEEP;
+	}
+	else
+	{
+		MYLOG("BENCH", "Unknown benchmark %s", cmd);
+		return;
+	}
+
+	bench_count = BENCH_DEF_COUNT;
+	bench_len = BENCH_DEF_LEN;
+	bench_peer = P2P_BROADCAST;
+	const char *arg = strchr(cmd, ',');
+	if (arg != NULL)
+	{
+		char *next;
+		long value = strtol(arg + 1, &next, 10);
+		if ((value > 0) && (value < 1000))
+		{
+			bench_count = value;
+		}
+		arg = strchr(next, ',');
+	}
+	if ((arg != NULL) && (mode != BENCH_MODE_PING))
+	{
+		char *next;
+		long value = strtol(arg + 1, &next, 10);
+		if (value > 0)
+		{
+			bench_len = value < (long)sizeof(s_bench_frame) ? sizeof(s_bench_frame) : value > BENCH_MAX_LEN ? BENCH_MAX_LEN : value;
+		}
+		arg = strchr(next, ',');
+	}
+	if (arg != NULL)
+	{
+		bench_peer = strtol(arg + 1, NULL, 16);
+	}
+
+	bench_mode = mode;
+	bench_abort = false;
+	bench_request = true;
+	bench_wakeup();
+}
+
+/**
+ * @brief Handle a benchmark packet
+ * Called from the LoRa task
+ *
+ * @param header header of the packet
+ * @param data payload
+ * @param len length of the payload
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void bench_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr)
+{
+	if (len < sizeof(s_bench_frame))
+	{
+		return;
+	}
+	s_bench_frame frame;
+	memcpy(&frame, data, sizeof(s_bench_frame));
+	s_bench_frame reply = frame;
+
+	switch (frame.op)
+	{
+	// Answers for the initiator
+	case BENCH_OP_PONG:
+	case BENCH_OP_REPORT:
+	case BENCH_OP_SWITCH_ACK:
+		if (bench_active && (frame.test_id == bench_test_id) && !bench_answer)
+		{
+			bench_rx = frame;
+			bench_answer_time = millis();
+			bench_answer = true;
+		}
+		return;
+
+	// Requests for the responder
+	case BENCH_OP_PING:
+		reply.op = BENCH_OP_PONG;
+		break;
+	case BENCH_OP_START:
+	case BENCH_OP_DATA:
+		if ((frame.test_id != bench_resp_id) || (header->src != bench_resp_src) || (frame.op == BENCH_OP_START))
+		{
+			bench_resp_id = frame.test_id;
+			bench_resp_src = header->src;
+			bench_resp_count = 0;
+			bench_resp_rssi = 0;
+			bench_resp_snr = 0;
+		}
+		if (frame.op == BENCH_OP_DATA)
+		{
+			if (bench_resp_count == 0)
+			{
+				bench_resp_first = millis();
+			}
+			bench_resp_last = millis();
+			bench_resp_count++;
+			bench_resp_rssi += rssi;
+			bench_resp_snr += snr;
+		}
+		return;
+	case BENCH_OP_END:
+		reply.op = BENCH_OP_REPORT;
+		if ((frame.test_id == bench_resp_id) && (header->src == bench_resp_src) && (bench_resp_count != 0))
+		{
+			reply.count = bench_resp_count;
+			reply.time = bench_resp_last - bench_resp_first;
+			reply.rssi = bench_resp_rssi / bench_resp_count;
+			reply.snr = bench_resp_snr / bench_resp_count;
+		}
+		else
+		{
+			reply.count = 0;
+			reply.time = 0;
+		}
+		break;
+	case BENCH_OP_SWITCH:
+		if (g_link_active || g_hop_active)
+		{
+			MYLOG("BENCH", "Switch refused, link adaptation or hopping active");
+			return;
+		}
+		reply.op = BENCH_OP_SWITCH_ACK;
+		break;
+	default:
+		return;
+	}
+
+	if (bench_reply)
+	{
+		return;
+	}
+	bench_reply_frame = reply;
+	bench_reply_rx_time = millis();
+	bench_resp_src = header->src;
+	bench_reply = true;
+	bench_wakeup();
+}
+
+/**
+ * @brief Send a benchmark packet and wait until it is sent
+ *
+ * @param dst node ID of the destination
+ * @param frame benchmark frame
+ * @param len packet length, padded after the frame
+ * @return true if the packet was sent
+ * @return false if the radio was busy or the channel was not free
+ */
+static bool bench_send(uint16_t dst, s_bench_frame *frame, uint8_t len)
+{
+	uint8_t payload[BENCH_MAX_LEN];
+
+	memcpy(payload, frame, sizeof(s_bench_frame));
+	for (int idx = sizeof(s_bench_frame); idx < len; idx++)
+	{
+		payload[idx] = idx;
+	}
+
+	uint32_t start = millis();
+	while (g_p2p_tx_busy && ((millis() - start) < 5000))
+	{
+		delay(1);
+	}
+
+	uint32_t tx_count = g_p2p_tx_count;
+	if (!send_p2p_packet(P2P_TYPE_BENCH, dst, payload, len))
+	{
+		return false;
+	}
+	uint32_t timeout = p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), len + sizeof(s_p2p_header) + P2P_CRYPTO_OVERHEAD) / 1000 + 1000;
+	start = millis();
+	while (g_p2p_tx_busy && ((millis() - start) < timeout))
+	{
+		delay(1);
+	}
+	return g_p2p_tx_count != tx_count;
+}
+
+/**
+ * @brief Wait for an answer of the responder
+ *
+ * @param op expected operation
+ * @param len length of the answer
+ * @return true if the answer arrived
+ */
+static bool bench_wait_answer(uint8_t op, uint8_t len)
+{
+	uint32_t timeout = 2 * p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), len + sizeof(s_p2p_header) + P2P_CRYPTO_OVERHEAD) / 1000 + BENCH_REPLY_TIME;
+	uint32_t start = millis();
+	while ((millis() - start) < timeout)
+	{
+		if (bench_answer)
+		{
+			if (bench_rx.op == op)
+			{
+				return true;
+			}
+			bench_answer = false;
+		}
+		if (bench_abort)
+		{
+			return false;
+		}
+		delay(1);
+	}
+	return false;
+}
+
+/**
+ * @brief Round trip time test
+ *
+ */
+static void bench_ping(void)
+{
+	uint16_t received = 0;
+	uint32_t rtt_min = 0xFFFFFFFF;
+	uint32_t rtt_max = 0;
+	uint32_t rtt_sum = 0;
+	uint32_t turn_sum = 0;
+
+	for (uint16_t idx = 0; (idx < bench_count) && !bench_abort; idx++)
+	{
+		s_bench_frame frame = {};
+		frame.op = BENCH_OP_PING;
+		frame.test_id = bench_test_id;
+		frame.idx = idx;
+		frame.count = bench_count;
+
+		bench_answer = false;
+		uint32_t start = millis();
+		if (bench_send(bench_peer, &frame, sizeof(s_bench_frame)) && bench_wait_answer(BENCH_OP_PONG, sizeof(s_bench_frame)) && (bench_rx.idx == idx))
+		{
+			// The responder answers from its loop task, the time the answer waited there is not part of the link
+			uint32_t measured = bench_answer_time - start;
+			uint32_t turn = bench_rx.time < measured ? bench_rx.time : measured;
+			uint32_t rtt = measured - turn;
+			received++;
+			rtt_sum += rtt;
+			turn_sum += turn;
+			rtt_min = rtt < rtt_min ? rtt : rtt_min;
+			rtt_max = rtt > rtt_max ? rtt : rtt_max;
+		}
+		delay(BENCH_PING_GAP);
+	}
+
+	char line[128];
+	if (received == 0)
+	{
+		snprintf(line, sizeof(line), "PING SF%d BW%d CR%d n=%d rx=0", g_p2p_sf, g_p2p_bw, g_p2p_cr, bench_count);
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "PING SF%d BW%d CR%d n=%d rx=%d rtt=%ld/%ld/%ld ms turn=%ld ms", g_p2p_sf, g_p2p_bw, g_p2p_cr,
+				 bench_count, received, rtt_min, rtt_sum / received, rtt_max, turn_sum / received);
+	}
+	bench_report(line);
+}
+
+/**
+ * @brief Goodput and packet error rate test
+ * Sends bench_count packets back to back and asks the responder how many arrived
+ *
+ */
+static void bench_flood(void)
+{
+	s_bench_frame frame = {};
+	frame.test_id = bench_test_id;
+	frame.count = bench_count;
+
+	frame.op = BENCH_OP_START;
+	bench_send(bench_peer, &frame, sizeof(s_bench_frame));
+
+	uint16_t sent = 0;
+	uint32_t start = millis();
+	frame.op = BENCH_OP_DATA;
+	for (uint16_t idx = 0; (idx < bench_count) && !bench_abort; idx++)
+	{
+		frame.idx = idx;
+		if (bench_send(bench_peer, &frame, bench_len))
+		{
+			sent++;
+		}
+	}
+	uint32_t duration = millis() - start;
+
+	bool answer = false;
+	frame.op = BENCH_OP_END;
+	for (int retry = 0; (retry < BENCH_RETRIES) && !answer && !bench_abort; retry++)
+	{
+		bench_answer = false;
+		answer = bench_send(bench_peer, &frame, sizeof(s_bench_frame)) && bench_wait_answer(BENCH_OP_REPORT, sizeof(s_bench_frame));
+	}
+
+	char line[128];
+	if (!answer || (sent == 0))
+	{
+		snprintf(line, sizeof(line), "FLOOD SF%d BW%d CR%d len=%d tx=%d no report", g_p2p_sf, g_p2p_bw, g_p2p_cr, bench_len, sent);
+	}
+	else
+	{
+		uint16_t received = bench_rx.count > sent ? sent : bench_rx.count;
+		uint16_t per = ((sent - received) * 1000) / sent;
+		uint32_t goodput = duration ? (received * bench_len * 1000) / duration : 0;
+		snprintf(line, sizeof(line), "FLOOD SF%d BW%d CR%d len=%d tx=%d rx=%d per=%d.%d%% gp=%ld B/s rssi=%d snr=%d", g_p2p_sf, g_p2p_bw, g_p2p_cr,
+				 bench_len, sent, received, per / 10, per % 10, goodput, bench_rx.rssi, bench_rx.snr);
+	}
+	bench_report(line);
+}
+
+/**
+ * @brief Flood test for all combinations of SF, bandwidth and coding rate
+ * Every step is negotiated with the modulation of the settings. The responder
+ * goes back to it after the report or when the step takes too long.
+ *
+ */
+static void bench_sweep(void)
+{
+	for (uint8_t sf = 7; (sf <= 12) && !bench_abort; sf++)
+	{
+		for (uint8_t bw = 0; (bw <= 2) && !bench_abort; bw++)
+		{
+			for (uint8_t cr = 1; (cr <= 4) && !bench_abort; cr++)
+			{
+				uint8_t saved_cr = g_p2p_cr;
+				g_p2p_cr = cr;
+				uint32_t toa = p2p_time_on_air_us(sf, bw, p2p_tx_preamble_len(), bench_len + sizeof(s_p2p_header) + P2P_CRYPTO_OVERHEAD) / 1000;
+				g_p2p_cr = saved_cr;
+
+				s_bench_frame frame = {};
+				frame.op = BENCH_OP_SWITCH;
+				frame.test_id = ++bench_test_id;
+				frame.sf = sf;
+				frame.bw = bw;
+				frame.cr = cr;
+				frame.time = (bench_count + 2 * BENCH_RETRIES) * (toa + 100) + 2 * BENCH_RETRIES * BENCH_REPLY_TIME;
+
+				bool answer = false;
+				for (int retry = 0; (retry < BENCH_RETRIES) && !answer && !bench_abort; retry++)
+				{
+					bench_answer = false;
+					answer = bench_send(bench_peer, &frame, sizeof(s_bench_frame)) && bench_wait_answer(BENCH_OP_SWITCH_ACK, sizeof(s_bench_frame));
+				}
+				if (!answer)
+				{
+					char line[64];
+					snprintf(line, sizeof(line), "FLOOD SF%d BW%d CR%d no peer", sf, bw, cr);
+					bench_report(line);
+					continue;
+				}
+
+				// The responder switches after its answer is sent
+				delay(toa + 100);
+				uint32_t step_start = millis();
+				bench_set_modulation(sf, bw, cr);
+				bench_flood();
+				bench_revert();
+
+				// Wait until the responder is back if the report was lost
+				if (!bench_answer || (bench_rx.op != BENCH_OP_REPORT))
+				{
+					while (((millis() - step_start) < frame.time) && !bench_abort)
+					{
+						delay(10);
+					}
+				}
+			}
+		}
+	}
+	bench_report("SWEEP done");
+}
+
+/**
+ * @brief Run a benchmark as initiator
+ *
+ */
+static void bench_run(void)
+{
+	bench_request = false;
+	if (!g_lorap2p_initialized || g_link_active || g_hop_active)
+	{
+		bench_report("BENCH not possible with link adaptation or hopping");
+		return;
+	}
+	bench_active = true;
+	bench_test_id++;
+
+	switch (bench_mode)
+	{
+	case BENCH_MODE_PING:
+		bench_ping();
+		break;
+	case BENCH_MODE_FLOOD:
+		bench_flood();
+		break;
+	case BENCH_MODE_SWEEP:
+		bench_sweep();
+		break;
+	}
+	bench_active = false;
+	if (bench_abort)
+	{
+		bench_report("BENCH stopped");
+	}
+}
+
+/**
+ * @brief Send the answer of the responder
+ *
+ */
+static void bench_send_reply(void)
+{
+	bench_reply_frame.time = bench_reply_frame.op == BENCH_OP_PONG ? millis() - bench_reply_rx_time : bench_reply_frame.time;
+	uint8_t op = bench_reply_frame.op;
+	bool sent = bench_send(bench_resp_src, &bench_reply_frame, sizeof(s_bench_frame));
+	bench_reply = false;
+
+	if (op == BENCH_OP_REPORT)
+	{
+		if (bench_switched)
+		{
+			bench_switched = false;
+			g_bench_timer.stop();
+			bench_revert();
+		}
+	}
+	else if ((op == BENCH_OP_SWITCH_ACK) && sent)
+	{
+		bench_switched = true;
+		bench_revert_time = millis() + bench_reply_frame.time;
+		bench_set_modulation(bench_reply_frame.sf, bench_reply_frame.bw, bench_reply_frame.cr);
+		bench_start_timer(bench_reply_frame.time);
+		MYLOG("BENCH", "Test modulation SF%d BW%d CR%d", g_p2p_sf, g_p2p_bw, g_p2p_cr);
+	}
+}
+
+/**
+ * @brief Handle pending benchmark work
+ * Called from the loop task
+ *
+ */
+void bench_process(void)
+{
+	if (bench_reply)
+	{
+		bench_send_reply();
+	}
+	if (bench_switched && ((int32_t)(millis() - bench_revert_time) >= 0))
+	{
+		MYLOG("BENCH", "Test step timed out");
+		bench_switched = false;
+		bench_revert();
+	}
+	if (bench_request)
+	{
+		bench_run();
+	}
+}
@@ -0,0 +1,573 @@
+/**
+ * @file cad.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief CAD parameters per SF and bandwidth and their calibration
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Default detection minimum */
+#define CAD_DET_MIN 10
+/** CAD runs per candidate during calibration */
+#define CAD_CAL_RUNS 20
+/** Accepted false detections on the noise in percent */
+#define CAD_MAX_FP 5
+/** Accepted missed detections on a preamble in percent */
+#define CAD_MAX_FN 5
+/** Highest detection peak above the default that is tried */
+#define CAD_PEAK_RANGE 8
+/** Timeout for one CAD in milliseconds */
+#define CAD_TIMEOUT 1000
+/** Time between the probe request and the preamble of the peer in milliseconds */
+#define CAD_PROBE_DELAY 1000
+/** Longest probe preamble in milliseconds */
+#define CAD_PROBE_MAX 15000
+/** Longest search for the parameters on the channel noise in milliseconds */
+#define CAD_CAL_MAX_TIME 45000
+/** Rate is not known */
+#define CAD_RATE_UNKNOWN 0xFF
+
+/** CAD parameters */
+struct s_cad_params
+{
+	// LORA_CAD_xx_SYMBOL
+	uint8_t symbols;
+	uint8_t det_peak;
+	uint8_t det_min;
+};
+
+/** Probe request, payload of P2P_TYPE_CAD_PROBE */
+struct s_cad_probe
+{
+	// Modulation the preamble is expected with
+	uint8_t sf;
+	uint8_t bw;
+	// Time from the reception of the request to the start of the preamble in milliseconds
+	uint16_t delay_ms;
+	// Length of the preamble in milliseconds
+	uint16_t duration_ms;
+} __attribute__((packed));
+
+/**
+ * @brief Detection peak for 2 symbols at 125 kHz, Semtech AN1200.48
+ *
+ * @param sf spreading factor 7 .. 12
+ * @return detection peak
+ */
+static constexpr uint8_t cad_peak_2(uint8_t sf)
+{
+	return sf <= 8 ? 22 : sf == 9 ? 24 : sf == 10 ? 25 : sf == 11 ? 26 : 30;
+}
+
+/**
+ * @brief Detection peak for 4 symbols at 125 kHz, Semtech AN1200.48
+ *
+ * @param sf spreading factor 7 .. 12
+ * @return detection peak
+ */
+static constexpr uint8_t cad_peak_4(uint8_t sf)
+{
+	return sf == 7 ? 21 : sf <= 9 ? 22 : sf == 10 ? 23 : sf == 11 ? 25 : 28;
+}
+
+/**
+ * @brief Default detection peak
+ * Wider bandwidths add noise, the peak goes up by one per step.
+ * 8 symbols average better and allow one less than 4 symbols.
+ *
+ * @param sf spreading factor 7 .. 12
+ * @param bw bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+ * @param symbols LORA_CAD_xx_SYMBOL
+ * @return detection peak
+ */
+static constexpr uint8_t cad_default_peak(uint8_t sf, uint8_t bw, uint8_t symbols)
+{
+	return bw + (symbols == LORA_CAD_02_SYMBOL ? cad_peak_2(sf) : symbols == LORA_CAD_04_SYMBOL ? cad_peak_4(sf) : cad_peak_4(sf) - 1);
+}
+
+/**
+ * @brief Default CAD parameters
+ * SF7 and SF8 use 4 symbols, the slower SF 2 symbols to keep the CAD short
+ *
+ * @param sf spreading factor 7 .. 12
+ * @param bw bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+ * @return s_cad_params
+ */
+static constexpr s_cad_params cad_default(uint8_t sf, uint8_t bw)
+{
+	return {static_cast<uint8_t>(sf <= 8 ? LORA_CAD_04_SYMBOL : LORA_CAD_02_SYMBOL),
+			cad_default_peak(sf, bw, sf <= 8 ? LORA_CAD_04_SYMBOL : LORA_CAD_02_SYMBOL),
+			CAD_DET_MIN};
+}
+
+/** One SF of the default table, 125, 250 and 500 kHz */
+#define CAD_LUT_ROW(sf) {cad_default(sf, 0), cad_default(sf, 1), cad_default(sf, 2)}
+
+/** Default CAD parameters for SF7 .. SF12 and 125, 250, 500 kHz, built by the compiler */
+static constexpr s_cad_params cad_lut[6][3] = {CAD_LUT_ROW(7), CAD_LUT_ROW(8), CAD_LUT_ROW(9), CAD_LUT_ROW(10), CAD_LUT_ROW(11), CAD_LUT_ROW(12)};
+
+static_assert(cad_lut[0][0].det_peak == 21, "CAD table SF7 125 kHz");
+static_assert(cad_lut[5][2].det_peak == 32, "CAD table SF12 500 kHz");
+
+/** Symbol counts that are calibrated */
+static const uint8_t cad_cal_symbols[] = {LORA_CAD_02_SYMBOL, LORA_CAD_04_SYMBOL, LORA_CAD_08_SYMBOL};
+#define CAD_CAL_SYMBOL_NUM (sizeof(cad_cal_symbols) / sizeof(cad_cal_symbols[0]))
+/** Detection minimums that are tried */
+static const uint8_t cad_cal_min[] = {8, 10, 12};
+#define CAD_CAL_MIN_NUM (sizeof(cad_cal_min) / sizeof(cad_cal_min[0]))
+
+/** Flag if a calibration runs, CAD results go to the calibration */
+volatile bool g_cad_calibrating = false;
+
+/** Result of the last calibration CAD */
+static volatile bool cad_pending = false;
+static volatile bool cad_busy = false;
+
+/** Calibration requested, destination of the probe request */
+static bool cad_cal_request = false;
+static uint16_t cad_cal_peer = P2P_BROADCAST;
+
+/** Probe request from a peer */
+static bool cad_probe_request = false;
+static s_cad_probe cad_probe;
+static uint32_t cad_probe_rx_time = 0;
+
+/**
+ * @brief Get the CAD parameters for a modulation
+ * Uses the calibrated values if they were measured for this SF and bandwidth
+ *
+ * @param sf spreading factor 7 .. 12
+ * @param bw bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+ * @return s_cad_params
+ */
+static s_cad_params cad_params(uint8_t sf, uint8_t bw)
+{
+	if ((g_lorap2p_settings.cad_sf == sf) && (g_lorap2p_settings.cad_bw == bw))
+	{
+		return {g_lorap2p_settings.cad_symbols, g_lorap2p_settings.cad_det_peak, g_lorap2p_settings.cad_det_min};
+	}
+	if ((sf < 7) || (sf > 12))
+	{
+		sf = 7;
+	}
+	if (bw > 2)
+	{
+		bw = 0;
+	}
+	return cad_lut[sf - 7][bw];
+}
+
+/**
+ * @brief Set the CAD parameters for the modulation in use
+ *
+ */
+void cad_set_params(void)
+{
+	s_cad_params params = cad_params(g_p2p_sf, g_p2p_bw);
+	power_set_cad_params(params.symbols, params.det_peak, params.det_min);
+}
+
+/**
+ * @brief CAD result during a calibration
+ * Called from the LoRa task
+ *
+ * @param busy true if LoRa activity was detected
+ */
+void cad_calibration_done(bool busy)
+{
+	cad_busy = busy;
+	cad_pending = false;
+}
+
+/**
+ * @brief Run one CAD
+ *
+ * @param params CAD parameters
+ * @return int8_t 1 if LoRa activity was detected, 0 if not, -1 on timeout
+ */
+static int8_t cad_run(s_cad_params *params)
+{
+	Radio.Standby();
+	power_set_cad_params(params->symbols, params->det_peak, params->det_min);
+	cad_pending = true;
+	Radio.StartCad();
+	uint32_t start = millis();
+	while (cad_pending && ((millis() - start) < CAD_TIMEOUT))
+	{
+		delay(1);
+	}
+	if (cad_pending)
+	{
+		return -1;
+	}
+	return cad_busy ? 1 : 0;
+}
+
+/**
+ * @brief Get the time of one CAD
+ *
+ * @param symbols LORA_CAD_xx_SYMBOL
+ * @return uint32_t time in milliseconds
+ */
+static uint32_t cad_time_ms(uint8_t symbols)
+{
+	// Symbols plus processing of about half a symbol and the SPI commands
+	return (((1 << symbols) * 2 + 1) * p2p_symbol_time_us(g_p2p_sf, g_p2p_bw)) / 2000 + 2;
+}
+
+/**
+ * @brief Request a calibration of the CAD parameters for the modulation in use
+ *
+ * @param peer node that sends the probe preamble, P2P_BROADCAST for any node
+ */
+void cad_calibrate_request(uint16_t peer)
+{
+	cad_cal_request = true;
+	cad_cal_peer = peer;
+
+	// Notify task about the event
+	task_event(11);
+}
+
+/**
+ * @brief Handle a probe request from a node that calibrates its CAD
+ * Called from the LoRa task
+ *
+ * @param header header of the packet
+ * @param data payload
+ * @param len length of the payload
+ */
+void cad_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len)
+{
+	if ((len != sizeof(s_cad_probe)) || g_cad_calibrating || cad_probe_request)
+	{
+		return;
+	}
+	// A probe blocks the channel for seconds, only follow authenticated or addressed requests
+	if ((header->dst != g_p2p_node_id) && !g_lorap2p_settings.encrypt_enable)
+	{
+		MYLOG("CAD", "Broadcast probe request from %04X ignored", header->src);
+		return;
+	}
+	memcpy(&cad_probe, data, sizeof(s_cad_probe));
+	if ((cad_probe.sf != g_p2p_sf) || (cad_probe.bw != g_p2p_bw) || (cad_probe.duration_ms > CAD_PROBE_MAX) || (cad_probe.delay_ms > (2 * CAD_PROBE_DELAY)))
+	{
+		MYLOG("CAD", "Probe request from %04X for SF%d BW%d ignored", header->src, cad_probe.sf, cad_probe.bw);
+		return;
+	}
+	cad_probe_rx_time = millis();
+	cad_probe_request = true;
+	MYLOG("CAD", "Probe request from %04X, %d ms preamble", header->src, cad_probe.duration_ms);
+
+	// Notify task about the event
+	task_event(11);
+}
+
+/**
+ * @brief Wait until the radio is free and reserve it
+ *
+ * @return true if the radio is reserved
+ * @return false if the radio stayed busy
+ */
+static bool cad_take_radio(void)
+{
+	uint32_t wait_start = millis();
+	while (g_p2p_tx_busy)
+	{
+		if ((millis() - wait_start) > 5000)
+		{
+			MYLOG("CAD", "Radio busy");
+			return false;
+		}
+		delay(10);
+	}
+	g_p2p_tx_busy = true;
+	return true;
+}
+
+/**
+ * @brief Release the radio and go back to receive
+ *
+ */
+static void cad_release_radio(void)
+{
+	Radio.Standby();
+	g_cad_calibrating = false;
+	g_p2p_tx_busy = false;
+	restart_rx();
+}
+
+/**
+ * @brief Send a continuous preamble for a node that calibrates its CAD
+ *
+ */
+static void cad_send_probe(void)
+{
+	cad_probe_request = false;
+	if (!cad_take_radio())
+	{
+		return;
+	}
+	uint32_t start = cad_probe_rx_time + cad_probe.delay_ms;
+	while ((int32_t)(millis() - start) < 0)
+	{
+		delay(1);
+	}
+	// Keep the schedule of the requester, even if the loop was late
+	uint32_t end = start + cad_probe.duration_ms;
+	Radio.Standby();
+	SX126xSetTxInfinitePreamble();
+	while ((int32_t)(millis() - end) < 0)
+	{
+		delay(10);
+	}
+	cad_release_radio();
+	MYLOG("CAD", "Probe sent");
+}
+
+/**
+ * @brief Calibrate the CAD parameters for the modulation in use
+ * First the false detections on the channel noise are counted and the most
+ * sensitive detection peak and minimum with less than CAD_MAX_FP % false
+ * detections is searched for each symbol count. Then a peer is asked to send
+ * a continuous preamble and the missed detections of these parameters are
+ * counted. The shortest CAD with less than CAD_MAX_FN % missed detections
+ * is stored with the settings.
+ * The search on the noise stops after CAD_CAL_MAX_TIME, symbol counts
+ * that were not tested by then are not used.
+ *
+ */
+static void cad_calibrate(void)
+{
+	cad_cal_request = false;
+	if (!g_lorap2p_initialized || g_hop_active)
+	{
+		MYLOG("CAD", "Calibration not possible");
+		return;
+	}
+	if (!cad_take_radio())
+	{
+		return;
+	}
+	g_cad_calibrating = true;
+
+	s_cad_params candidate[CAD_CAL_SYMBOL_NUM];
+	uint8_t fp_rate[CAD_CAL_SYMBOL_NUM];
+	uint8_t fn_rate[CAD_CAL_SYMBOL_NUM];
+
+	// Noise floor
+	Radio.Standby();
+	Radio.Rx(0);
+	delay(1);
+	int32_t rssi_sum = 0;
+	int16_t rssi_max = -128;
+	uint16_t samples = 0;
+	uint32_t start = millis();
+	while ((millis() - start) < 100)
+	{
+		int16_t rssi = Radio.Rssi(MODEM_LORA);
+		rssi_sum += rssi;
+		if (rssi > rssi_max)
+		{
+			rssi_max = rssi;
+		}
+		samples++;
+		delay(1);
+	}
+	int16_t noise = rssi_sum / samples;
+	MYLOG("CAD", "SF%d BW%d noise floor %d dBm, max %d dBm", g_p2p_sf, g_p2p_bw, noise, rssi_max);
+
+	// False detections on the noise, most sensitive parameters first
+	uint32_t search_start = millis();
+	bool time_left = true;
+	for (uint8_t sym = 0; sym < CAD_CAL_SYMBOL_NUM; sym++)
+	{
+		uint8_t default_peak = cad_default_peak(g_p2p_sf, g_p2p_bw, cad_cal_symbols[sym]);
+		candidate[sym] = {cad_cal_symbols[sym], (uint8_t)(default_peak + CAD_PEAK_RANGE), cad_cal_min[CAD_CAL_MIN_NUM - 1]};
+		fp_rate[sym] = CAD_RATE_UNKNOWN;
+		bool found = false;
+		for (uint8_t peak = default_peak - 2; (peak <= default_peak + CAD_PEAK_RANGE) && !found && time_left; peak++)
+		{
+			for (uint8_t min_idx = 0; (min_idx < CAD_CAL_MIN_NUM) && !found && time_left; min_idx++)
+			{
+				s_cad_params params = {cad_cal_symbols[sym], peak, cad_cal_min[min_idx]};
+				uint8_t runs = 0;
+				uint8_t detected = 0;
+				if ((millis() - search_start) > CAD_CAL_MAX_TIME)
+				{
+					MYLOG("CAD", "Search time limit reached");
+					time_left = false;
+					break;
+				}
+				while ((runs < CAD_CAL_RUNS) && ((detected * 100) <= (CAD_MAX_FP * CAD_CAL_RUNS)))
+				{
+					int8_t result = cad_run(&params);
+					if (result < 0)
+					{
+						MYLOG("CAD", "CAD timeout");
+						cad_release_radio();
+						return;
+					}
+					detected += result;
+					runs++;
+				}
+				if ((detected * 100) <= (CAD_MAX_FP * CAD_CAL_RUNS))
+				{
+					candidate[sym] = params;
+					fp_rate[sym] = (detected * 100) / runs;
+					found = true;
+				}
+			}
+		}
+	}
+
+	// Missed detections on the preamble of a peer
+	uint32_t window = 200;
+	for (uint8_t sym = 0; sym < CAD_CAL_SYMBOL_NUM; sym++)
+	{
+		fn_rate[sym] = CAD_RATE_UNKNOWN;
+		window += CAD_CAL_RUNS * cad_time_ms(cad_cal_symbols[sym]);
+	}
+	if ((cad_cal_peer == P2P_BROADCAST) && !g_lorap2p_settings.encrypt_enable)
+	{
+		MYLOG("CAD", "Probe needs the node ID of the peer without encryption, skipped");
+	}
+	else if (window <= CAD_PROBE_MAX)
+	{
+		s_cad_probe probe = {g_p2p_sf, g_p2p_bw, CAD_PROBE_DELAY, (uint16_t)window};
+		uint32_t tx_count = g_p2p_tx_count;
+		g_cad_calibrating = false;
+		g_p2p_tx_busy = false;
+		bool sent = send_p2p_packet(P2P_TYPE_CAD_PROBE, cad_cal_peer, (uint8_t *)&probe, sizeof(s_cad_probe));
+		start = millis();
+		while (sent && g_p2p_tx_busy && ((millis() - start) < 5000))
+		{
+			delay(1);
+		}
+		// The CAD before the request can find the channel busy
+		sent = sent && (g_p2p_tx_count != tx_count);
+		uint32_t tx_done = millis();
+		if (!cad_take_radio())
+		{
+			return;
+		}
+		g_cad_calibrating = true;
+		if (!sent)
+		{
+			MYLOG("CAD", "Probe request not sent");
+		}
+		else
+		{
+			// Start after the peer started and stop before it ends
+			start = tx_done + CAD_PROBE_DELAY + 50;
+			uint32_t end = tx_done + CAD_PROBE_DELAY + window - 50;
+			while ((int32_t)(millis() - start) < 0)
+			{
+				delay(1);
+			}
+
+			// Check that a peer sends
+			Radio.Standby();
+			Radio.Rx(0);
+			delay(1);
+			int16_t probe_rssi = Radio.Rssi(MODEM_LORA);
+			if (probe_rssi < (noise + 6))
+			{
+				MYLOG("CAD", "No probe preamble, RSSI %d dBm", probe_rssi);
+			}
+			else
+			{
+				for (uint8_t sym = 0; sym < CAD_CAL_SYMBOL_NUM; sym++)
+				{
+					uint8_t runs = 0;
+					uint8_t detected = 0;
+					while ((runs < CAD_CAL_RUNS) && ((int32_t)(millis() - end) < 0))
+					{
+						int8_t result = cad_run(&candidate[sym]);
+						if (result < 0)
+						{
+							break;
+						}
+						detected += result;
+						runs++;
+					}
+					if (runs != 0)
+					{
+						fn_rate[sym] = ((runs - detected) * 100) / runs;
+					}
+				}
+			}
+		}
+	}
+	else
+	{
+		MYLOG("CAD", "Probe would take %ld ms, skipped", window);
+	}
+
+	// Shortest CAD that detects reliably, without a peer the default symbol count
+	uint8_t best = CAD_RATE_UNKNOWN;
+	for (uint8_t sym = 0; sym < CAD_CAL_SYMBOL_NUM; sym++)
+	{
+		if (ble_uart_is_connected)
+		{
+			ble_uart.printf("CAD %d sym peak %d min %d FP %d%% FN %d%%\n", 1 << candidate[sym].symbols, candidate[sym].det_peak, candidate[sym].det_min, fp_rate[sym], fn_rate[sym]);
+		}
+		MYLOG("CAD", "%d symbols: peak %d min %d, false detections %d%%, missed detections %d%%",
+			  1 << candidate[sym].symbols, candidate[sym].det_peak, candidate[sym].det_min, fp_rate[sym], fn_rate[sym]);
+		if (fp_rate[sym] == CAD_RATE_UNKNOWN)
+		{
+			continue;
+		}
+		if (fn_rate[sym] == CAD_RATE_UNKNOWN)
+		{
+			if ((best == CAD_RATE_UNKNOWN) && (cad_cal_symbols[sym] == cad_default(g_p2p_sf, 0).symbols))
+			{
+				best = sym;
+			}
+		}
+		else if ((best == CAD_RATE_UNKNOWN) || ((fn_rate[best] > CAD_MAX_FN) && (fn_rate[sym] < fn_rate[best])))
+		{
+			best = sym;
+		}
+	}
+
+	if (best == CAD_RATE_UNKNOWN)
+	{
+		MYLOG("CAD", "No usable CAD parameters, keeping the defaults");
+	}
+	else
+	{
+		MYLOG("CAD", "Using %d symbols, peak %d, min %d", 1 << candidate[best].symbols, candidate[best].det_peak, candidate[best].det_min);
+		g_lorap2p_settings.cad_sf = g_p2p_sf;
+		g_lorap2p_settings.cad_bw = g_p2p_bw;
+		g_lorap2p_settings.cad_symbols = candidate[best].symbols;
+		g_lorap2p_settings.cad_det_peak = candidate[best].det_peak;
+		g_lorap2p_settings.cad_det_min = candidate[best].det_min;
+		save_settings();
+		settings_publish(true);
+	}
+
+	cad_release_radio();
+}
+
+/**
+ * @brief Handle pending calibration and probe requests
+ * Called from the loop task
+ *
+ */
+void cad_process(void)
+{
+	if (cad_probe_request)
+	{
+		cad_send_probe();
+	}
+	if (cad_cal_request)
+	{
+		cad_calibrate();
+	}
+}
@@ -0,0 +1,588 @@
+/**
+ * @file crypto.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief AES-CTR encryption and CMAC authentication of LoRa P2P packets
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+#if defined(NRF52_SERIES)
+// AES ECB block encryption of the SoftDevice, runs on the nRF52 ECB peripheral
+#include <nrf_soc.h>
+#define CRYPTO_HW_AES 1
+#else
+#define CRYPTO_HW_AES 0
+#endif
+
+/** Length of the MIC appended to encrypted packets */
+#define CRYPTO_MIC_LEN 4
+/** Length of the address high word and the counter high word in front of the payload */
+#define CRYPTO_NONCE_LEN 6
+/** Number of originators tracked for replay protection */
+#define CRYPTO_REPLAY_NODES 16
+/** Size of the replay window */
+#define CRYPTO_REPLAY_WINDOW 32
+
+/** Entry of the replay protection table */
+struct s_replay_entry
+{
+	uint16_t src;
+	uint32_t addr_hi;
+	uint32_t last_cnt;
+	uint32_t window;
+	uint32_t last_used;
+};
+
+/** Key for the payload encryption, derived from p2p_key */
+static uint8_t crypto_enc_key[16];
+/** Key for the authentication, derived from p2p_key */
+static uint8_t crypto_mac_key[16];
+/** Expanded round keys for the software AES */
+static uint8_t crypto_enc_rk[176];
+static uint8_t crypto_mac_rk[176];
+/** CMAC subkeys */
+static uint8_t crypto_k1[16];
+static uint8_t crypto_k2[16];
+/** Flag if the hardware AES is used */
+static bool crypto_use_hw = false;
+
+/** Upper 32 bit of the own device address, the lower 16 bit are the node ID */
+static uint32_t crypto_addr_hi = 0;
+/** Upper 16 bit of the own frame counter, the lower 16 bit are the sequence number */
+static uint16_t crypto_cnt_hi = 0;
+/** Last sequence number, to detect the wrap around */
+static uint16_t crypto_last_seq = 0;
+
+/** Replay protection table */
+static s_replay_entry replay_table[CRYPTO_REPLAY_NODES];
+static uint32_t replay_clock = 0;
+
+/** Number of packets rejected by the MIC check */
+static uint32_t crypto_mic_fail = 0;
+/** Number of packets rejected by the replay protection */
+static uint32_t crypto_replayed = 0;
+/** Number of originators found with the node ID of another node */
+static uint32_t crypto_id_collisions = 0;
+
+/**************************************************************/
+/* Software AES-128, encryption only                          */
+/**************************************************************/
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
+
+/**
+ * @brief Multiply by x in GF(2^8)
+ */
+static inline uint8_t aes_xtime(uint8_t value)
+{
+	return (value << 1) ^ ((value & 0x80) ? 0x1b : 0x00);
+}
+
+/**
+ * @brief Expand a 128 bit key into the 11 round keys
+ *
+ * @param key AES key
+ * @param round_keys buffer for 176 bytes of round keys
+ */
+static void aes_sw_expand_key(const uint8_t *key, uint8_t *round_keys)
+{
+	uint8_t rcon = 0x01;
+	memcpy(round_keys, key, 16);
+	for (int idx = 16; idx < 176; idx += 4)
+	{
+		uint8_t temp[4];
+		memcpy(temp, &round_keys[idx - 4], 4);
+		if ((idx % 16) == 0)
+		{
+			uint8_t first = temp[0];
+			temp[0] = aes_sbox[temp[1]] ^ rcon;
+			temp[1] = aes_sbox[temp[2]];
+			temp[2] = aes_sbox[temp[3]];
+			temp[3] = aes_sbox[first];
+			rcon = aes_xtime(rcon);
+		}
+		for (int byte = 0; byte < 4; byte++)
+		{
+			round_keys[idx + byte] = round_keys[idx - 16 + byte] ^ temp[byte];
+		}
+	}
+}
+
+/**
+ * @brief Encrypt one block with the software AES
+ *
+ * @param round_keys expanded key
+ * @param in plain text block
+ * @param out cipher text block, can be the same as in
+ */
+static void aes_sw_encrypt(const uint8_t *round_keys, const uint8_t *in, uint8_t *out)
+{
+	uint8_t state[16];
+	for (int idx = 0; idx < 16; idx++)
+	{
+		state[idx] = in[idx] ^ round_keys[idx];
+	}
+
+	for (int round = 1; round <= 10; round++)
+	{
+		uint8_t temp[16];
+		// SubBytes and ShiftRows
+		for (int col = 0; col < 4; col++)
+		{
+			for (int row = 0; row < 4; row++)
+			{
+				temp[col * 4 + row] = aes_sbox[state[((col + row) % 4) * 4 + row]];
+			}
+		}
+		// MixColumns, not in the last round
+		if (round != 10)
+		{
+			for (int col = 0; col < 4; col++)
+			{
+				uint8_t *column = &temp[col * 4];
+				uint8_t all = column[0] ^ column[1] ^ column[2] ^ column[3];
+				uint8_t first = column[0];
+				column[0] ^= all ^ aes_xtime(column[0] ^ column[1]);
+				column[1] ^= all ^ aes_xtime(column[1] ^ column[2]);
+				column[2] ^= all ^ aes_xtime(column[2] ^ column[3]);
+				column[3] ^= all ^ aes_xtime(column[3] ^ first);
+			}
+		}
+		// AddRoundKey
+		for (int idx = 0; idx < 16; idx++)
+		{
+			state[idx] = temp[idx] ^ round_keys[round * 16 + idx];
+		}
+	}
+	memcpy(out, state, 16);
+}
+
+/**************************************************************/
+/* Block cipher selection                                     */
+/**************************************************************/
+/**
+ * @brief Encrypt one block with the hardware AES if available
+ *
+ * @param key AES key
+ * @param round_keys expanded key for the software fallback
+ * @param in plain text block
+ * @param out cipher text block
+ * @param use_hw true to use the hardware AES
+ */
+static void aes_encrypt_block(const uint8_t *key, const uint8_t *round_keys, const uint8_t *in, uint8_t *out, bool use_hw)
+{
+#if CRYPTO_HW_AES > 0
+	if (use_hw)
+	{
+		nrf_ecb_hal_data_t ecb_data;
+		memcpy(ecb_data.key, key, 16);
+		memcpy(ecb_data.cleartext, in, 16);
+		if (sd_ecb_block_encrypt(&ecb_data) == NRF_SUCCESS)
+		{
+			memcpy(out, ecb_data.ciphertext, 16);
+			return;
+		}
+	}
+#else
+	(void)key;
+	(void)use_hw;
+#endif
+	aes_sw_encrypt(round_keys, in, out);
+}
+
+/**************************************************************/
+/* AES-CTR and AES-CMAC                                       */
+/**************************************************************/
+/**
+ * @brief En- or decrypt data with AES-CTR
+ *
+ * @param data buffer, en- or decrypted in place
+ * @param len length of the data
+ * @param src originator node ID
+ * @param addr_hi upper 32 bit of the originator device address
+ * @param cnt 32 bit frame counter of the originator
+ * @param use_hw true to use the hardware AES
+ */
+static void aes_ctr(uint8_t *data, uint8_t len, uint16_t src, uint32_t addr_hi, uint32_t cnt, bool use_hw)
+{
+	uint8_t ctr_block[16] = {0};
+	uint8_t key_stream[16];
+
+	// Nonce: full 48 bit address of the originator and frame counter, never repeats for the same key
+	ctr_block[0] = 0x01;
+	ctr_block[1] = src;
+	ctr_block[2] = src >> 8;
+	ctr_block[3] = addr_hi;
+	ctr_block[4] = addr_hi >> 8;
+	ctr_block[5] = addr_hi >> 16;
+	ctr_block[6] = addr_hi >> 24;
+	ctr_block[7] = cnt;
+	ctr_block[8] = cnt >> 8;
+	ctr_block[9] = cnt >> 16;
+	ctr_block[10] = cnt >> 24;
+
+	for (uint8_t block = 0; (block * 16) < len; block++)
+	{
+		ctr_block[15] = block;
+		aes_encrypt_block(crypto_enc_key, crypto_enc_rk, ctr_block, key_stream, use_hw);
+		for (int idx = 0; (idx < 16) && ((block * 16 + idx) < len); idx++)
+		{
+			data[block * 16 + idx] ^= key_stream[idx];
+		}
+	}
+}
+
+/**
+ * @brief Shift a block left by one bit and xor the CMAC constant on carry
+ */
+static void cmac_shift(const uint8_t *in, uint8_t *out)
+{
+	uint8_t carry = in[0] & 0x80;
+	for (int idx = 0; idx < 15; idx++)
+	{
+		out[idx] = (in[idx] << 1) | (in[idx + 1] >> 7);
+	}
+	out[15] = in[15] << 1;
+	if (carry)
+	{
+		out[15] ^= 0x87;
+	}
+}
+
+/**
+ * @brief Calculate the AES-CMAC of a buffer
+ *
+ * @param data buffer
+ * @param len length of the buffer
+ * @param mac buffer for the 16 byte MAC
+ * @param use_hw true to use the hardware AES
+ */
+static void aes_cmac(const uint8_t *data, uint16_t len, uint8_t *mac, bool use_hw)
+{
+	uint8_t state[16] = {0};
+	uint16_t blocks = (len + 15) / 16;
+	bool complete = (len != 0) && ((len % 16) == 0);
+	if (blocks == 0)
+	{
+		blocks = 1;
+	}
+
+	for (uint16_t block = 0; block < blocks; block++)
+	{
+		uint8_t input[16];
+		uint16_t offset = block * 16;
+		if (block == (blocks - 1))
+		{
+			// Last block is padded and xored with a subkey
+			memset(input, 0, 16);
+			uint16_t remaining = len - offset;
+			memcpy(input, &data[offset], remaining);
+			if (!complete)
+			{
+				input[remaining] = 0x80;
+			}
+			for (int idx = 0; idx < 16; idx++)
+			{
+				input[idx] ^= complete ? crypto_k1[idx] : crypto_k2[idx];
+			}
+		}
+		else
+		{
+			memcpy(input, &data[offset], 16);
+		}
+		for (int idx = 0; idx < 16; idx++)
+		{
+			state[idx] ^= input[idx];
+		}
+		aes_encrypt_block(crypto_mac_key, crypto_mac_rk, state, state, use_hw);
+	}
+	memcpy(mac, state, 16);
+}
+
+/**
+ * @brief Calculate the truncated MIC of a packet
+ * The hop fields and the TTL are changed by relays and not authenticated.
+ *
+ * @param frame packet including header, address and counter high words
+ * @param len length of the packet without MIC
+ * @param mic buffer for the MIC
+ * @param use_hw true to use the hardware AES
+ */
+static void p2p_mic(const uint8_t *frame, uint8_t len, uint8_t *mic, bool use_hw)
+{
+	uint8_t auth_data[256];
+	uint16_t auth_len = 0;
+	const s_p2p_header *header = (const s_p2p_header *)frame;
+
+	auth_data[auth_len++] = header->marker;
+	auth_data[auth_len++] = header->type;
+	memcpy(&auth_data[auth_len], &header->src, 6);
+	auth_len += 6;
+	memcpy(&auth_data[auth_len], &frame[sizeof(s_p2p_header)], len - sizeof(s_p2p_header));
+	auth_len += len - sizeof(s_p2p_header);
+
+	uint8_t mac[16];
+	aes_cmac(auth_data, auth_len, mac, use_hw);
+	memcpy(mic, mac, CRYPTO_MIC_LEN);
+}
+
+/**
+ * @brief Sign data with a truncated AES-CMAC
+ * A tag byte in front separates the signatures from the packet MICs,
+ * which always start with LORA_P2P_FRAME_MARKER.
+ *
+ * @param data data to sign, max 255 bytes
+ * @param len length of the data
+ * @param signature buffer for P2P_SIGNATURE_LEN bytes
+ */
+void p2p_sign(const uint8_t *data, uint16_t len, uint8_t *signature)
+{
+	uint8_t sign_data[256];
+	if (len > (sizeof(sign_data) - 1))
+	{
+		len = sizeof(sign_data) - 1;
+	}
+	sign_data[0] = 0xF1;
+	memcpy(&sign_data[1], data, len);
+
+	uint8_t mac[16];
+	aes_cmac(sign_data, len + 1, mac, crypto_use_hw);
+	memcpy(signature, mac, P2P_SIGNATURE_LEN);
+}
+
+/**
+ * @brief Derive the keys from p2p_key and check the hardware AES
+ *
+ */
+void init_crypto(void)
+{
+	uint8_t master_rk[176];
+	uint8_t derive[16] = {0};
+
+	// Separate keys for encryption and authentication
+	aes_sw_expand_key(g_lorap2p_settings.p2p_key, master_rk);
+	derive[0] = 0x01;
+	aes_sw_encrypt(master_rk, derive, crypto_enc_key);
+	derive[0] = 0x02;
+	aes_sw_encrypt(master_rk, derive, crypto_mac_key);
+	aes_sw_expand_key(crypto_enc_key, crypto_enc_rk);
+	aes_sw_expand_key(crypto_mac_key, crypto_mac_rk);
+
+	// CMAC subkeys
+	uint8_t zero[16] = {0};
+	uint8_t l_block[16];
+	aes_sw_encrypt(crypto_mac_rk, zero, l_block);
+	cmac_shift(l_block, crypto_k1);
+	cmac_shift(crypto_k1, crypto_k2);
+
+#if CRYPTO_HW_AES > 0
+	// Use the hardware only if it gives the same result as the software
+	uint8_t sw_result[16];
+	uint8_t hw_result[16];
+	aes_sw_encrypt(crypto_enc_rk, zero, sw_result);
+	aes_encrypt_block(crypto_enc_key, crypto_enc_rk, zero, hw_result, true);
+	crypto_use_hw = (memcmp(sw_result, hw_result, 16) == 0);
+#endif
+	MYLOG("CRYP", "Using %s AES", crypto_use_hw ? "hardware" : "software");
+
+	// The node ID is only 16 bit, the nonce needs the full device address
+	crypto_addr_hi = (*((uint32_t *)(0x100000a4)) >> 16) | ((*((uint32_t *)(0x100000a8)) & 0x0000ffff) << 16);
+
+	// Frame counter must never repeat, even after a reboot
+	crypto_cnt_hi = flash_next_epoch();
+	memset(replay_table, 0, sizeof(replay_table));
+
+#if MY_DEBUG > 0
+	crypto_benchmark();
+#endif
+}
+
+/**
+ * @brief Encrypt an own packet and append the MIC
+ * Layout: header | address high word | counter high word | encrypted payload | MIC
+ *
+ * @param frame packet including the header, the buffer must have
+ *        room for P2P_CRYPTO_OVERHEAD more bytes
+ * @param len length of the packet
+ * @return uint8_t new length of the packet
+ */
+uint8_t p2p_encrypt_frame(uint8_t *frame, uint8_t len)
+{
+	s_p2p_header *header = (s_p2p_header *)frame;
+	uint8_t payload_len = len - sizeof(s_p2p_header);
+	uint8_t *payload = &frame[sizeof(s_p2p_header) + CRYPTO_NONCE_LEN];
+
+	if (header->seq < crypto_last_seq)
+	{
+		// Sequence number wrapped, start a new epoch
+		crypto_cnt_hi = flash_next_epoch();
+	}
+	crypto_last_seq = header->seq;
+
+	memmove(payload, &frame[sizeof(s_p2p_header)], payload_len);
+	uint8_t *nonce = &frame[sizeof(s_p2p_header)];
+	nonce[0] = crypto_addr_hi;
+	nonce[1] = crypto_addr_hi >> 8;
+	nonce[2] = crypto_addr_hi >> 16;
+	nonce[3] = crypto_addr_hi >> 24;
+	nonce[4] = crypto_cnt_hi;
+	nonce[5] = crypto_cnt_hi >> 8;
+	header->type |= P2P_FLAG_ENCRYPTED;
+
+	aes_ctr(payload, payload_len, header->src, crypto_addr_hi, ((uint32_t)crypto_cnt_hi << 16) | header->seq, crypto_use_hw);
+
+	len = sizeof(s_p2p_header) + CRYPTO_NONCE_LEN + payload_len;
+	p2p_mic(frame, len, &frame[len], crypto_use_hw);
+	return len + CRYPTO_MIC_LEN;
+}
+
+/**
+ * @brief Check if the frame counter of an originator is new
+ * Originators are identified by their full device address,
+ * nodes with the same node ID get separate entries.
+ *
+ * @param src originator node ID
+ * @param addr_hi upper 32 bit of the originator device address
+ * @param cnt 32 bit frame counter
+ * @return true if the counter was not seen before
+ */
+static bool replay_check(uint16_t src, uint32_t addr_hi, uint32_t cnt)
+{
+	replay_clock++;
+	uint8_t oldest = 0;
+	bool collision = (src == g_p2p_node_id) && (addr_hi != crypto_addr_hi);
+	for (int idx = 0; idx < CRYPTO_REPLAY_NODES; idx++)
+	{
+		s_replay_entry *entry = &replay_table[idx];
+		if ((entry->last_used != 0) && (entry->src == src) && (entry->addr_hi != addr_hi))
+		{
+			collision = true;
+		}
+		if ((entry->last_used != 0) && (entry->src == src) && (entry->addr_hi == addr_hi))
+		{
+			entry->last_used = replay_clock;
+			if (cnt > entry->last_cnt)
+			{
+				uint32_t shift = cnt - entry->last_cnt;
+				entry->window = (shift >= CRYPTO_REPLAY_WINDOW) ? 1 : ((entry->window << shift) | 1);
+				entry->last_cnt = cnt;
+				return true;
+			}
+			uint32_t age = entry->last_cnt - cnt;
+			if ((age >= CRYPTO_REPLAY_WINDOW) || (entry->window & (1UL << age)))
+			{
+				return false;
+			}
+			entry->window |= (1UL << age);
+			return true;
+		}
+		if (entry->last_used < replay_table[oldest].last_used)
+		{
+			oldest = idx;
+		}
+	}
+
+	if (collision)
+	{
+		// Relaying, addressing and duplicate detection still use the 16 bit node ID
+		crypto_id_collisions++;
+		MYLOG("CRYP", "Node ID %04X is used by more than one node, %ld collisions", src, crypto_id_collisions);
+	}
+
+	// Unknown originator, replace the least recently used entry
+	replay_table[oldest].src = src;
+	replay_table[oldest].addr_hi = addr_hi;
+	replay_table[oldest].last_cnt = cnt;
+	replay_table[oldest].window = 1;
+	replay_table[oldest].last_used = replay_clock;
+	return true;
+}
+
+/**
+ * @brief Check the MIC and the frame counter and decrypt a packet
+ * The packet is decrypted in place, the header stays in front.
+ *
+ * @param frame packet including the header
+ * @param len length of the packet
+ * @return int16_t length of the decrypted packet, -1 if it was rejected
+ */
+int16_t p2p_decrypt_frame(uint8_t *frame, uint8_t len)
+{
+	s_p2p_header *header = (s_p2p_header *)frame;
+	if (((header->type & P2P_FLAG_ENCRYPTED) == 0) || (len < (sizeof(s_p2p_header) + P2P_CRYPTO_OVERHEAD)))
+	{
+		MYLOG("CRYP", "Packet not encrypted");
+		return -1;
+	}
+
+	uint8_t mic[CRYPTO_MIC_LEN];
+	len -= CRYPTO_MIC_LEN;
+	p2p_mic(frame, len, mic, crypto_use_hw);
+	if (memcmp(mic, &frame[len], CRYPTO_MIC_LEN) != 0)
+	{
+		crypto_mic_fail++;
+		MYLOG("CRYP", "MIC failure, %ld packets rejected", crypto_mic_fail);
+		return -1;
+	}
+
+	uint8_t *nonce = &frame[sizeof(s_p2p_header)];
+	uint32_t addr_hi = (uint32_t)nonce[0] | ((uint32_t)nonce[1] << 8) | ((uint32_t)nonce[2] << 16) | ((uint32_t)nonce[3] << 24);
+	uint32_t cnt = ((uint32_t)nonce[4] | ((uint32_t)nonce[5] << 8)) << 16 | header->seq;
+	if (!replay_check(header->src, addr_hi, cnt))
+	{
+		crypto_replayed++;
+		MYLOG("CRYP", "Replayed packet, %ld packets rejected", crypto_replayed);
+		return -1;
+	}
+
+	uint8_t payload_len = len - sizeof(s_p2p_header) - CRYPTO_NONCE_LEN;
+	aes_ctr(&frame[sizeof(s_p2p_header) + CRYPTO_NONCE_LEN], payload_len, header->src, addr_hi, cnt, crypto_use_hw);
+	memmove(&frame[sizeof(s_p2p_header)], &frame[sizeof(s_p2p_header) + CRYPTO_NONCE_LEN], payload_len);
+	header->type &= ~P2P_FLAG_ENCRYPTED;
+	return sizeof(s_p2p_header) + payload_len;
+}
+
+/**
+ * @brief Measure encryption + MIC of a 64 byte payload with hardware and software AES
+ *
+ */
+void crypto_benchmark(void)
+{
+	const int rounds = 100;
+	const uint8_t payload_len = 64;
+	uint8_t frame[sizeof(s_p2p_header) + payload_len + CRYPTO_NONCE_LEN + CRYPTO_MIC_LEN];
+	memset(frame, 0x55, sizeof(frame));
+
+	for (int hw = 0; hw <= CRYPTO_HW_AES; hw++)
+	{
+		uint32_t start = micros();
+		for (int idx = 0; idx < rounds; idx++)
+		{
+			aes_ctr(&frame[sizeof(s_p2p_header) + CRYPTO_NONCE_LEN], payload_len, g_p2p_node_id, crypto_addr_hi, idx, hw);
+			p2p_mic(frame, sizeof(s_p2p_header) + CRYPTO_NONCE_LEN + payload_len, &frame[sizeof(s_p2p_header) + CRYPTO_NONCE_LEN + payload_len], hw);
+		}
+		uint32_t per_packet = (micros() - start) / rounds;
+		MYLOG("CRYP", "%s AES: %ld us per %d byte packet, %ld byte/s", hw ? "Hardware" : "Software",
+			  per_packet, payload_len, per_packet ? (payload_len * 1000000UL) / per_packet : 0);
+	}
+}
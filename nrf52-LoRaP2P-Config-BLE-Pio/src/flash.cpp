@@ -18,6 +18,7 @@ s_lorap2p_settings g_flash_content;
 using namespace Adafruit_LittleFS_Namespace;
 
 static const char settings_name[] = "RAK";
+static const char epoch_name[] = "CNT";
 
 File file(InternalFS);
 
@@ -41,7 +42,9 @@ void init_flash(void)
 		flash_reset();
 		return;
 	}
-	file.read((uint8_t *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
+	// Files of older firmware end before hop_enable, the new settings keep their defaults
+	uint16_t read_len = file.size() < sizeof(s_lorap2p_settings) ? offsetof(s_lorap2p_settings, hop_enable) : sizeof(s_lorap2p_settings);
+	file.read((uint8_t *)&g_lorap2p_settings, read_len);
 	file.close();
 	// Check if it is LoRa P2P settings
 	if ((g_lorap2p_settings.valid_mark_1 != 0xAA) || (g_lorap2p_settings.valid_mark_2 != LORA_P2P_DATA_MARKER))
@@ -111,6 +114,37 @@ void flash_reset(void)
 	}
 }
 
+/**
+ * @brief Get the next frame counter epoch
+ * The epoch is incremented on every call and saved, so the frame
+ * counter of encrypted packets never repeats after a reboot.
+ * 
+ * @return uint16_t new epoch
+ */
+uint16_t flash_next_epoch(void)
+{
+	uint16_t epoch = 0;
+	if (file.open(epoch_name, FILE_O_READ))
+	{
+		file.read((uint8_t *)&epoch, sizeof(uint16_t));
+		file.close();
+	}
+	epoch++;
+
+	InternalFS.remove(epoch_name);
+	if (file.open(epoch_name, FILE_O_WRITE))
+	{
+		file.write((uint8_t *)&epoch, sizeof(uint16_t));
+		file.flush();
+		file.close();
+	}
+	else
+	{
+		MYLOG("FLASH", "Failed to save frame counter epoch");
+	}
+	return epoch;
+}
+
 /**
  * @brief Printout of all settings
  * 
@@ -138,6 +172,62 @@ void log_settings(void)
 	MYLOG("FLASH", "%03d P2P Preamble %d", index, g_lorap2p_settings.p2p_preamble_len);
 	index += 1;
 	MYLOG("FLASH", "%03d P2P Auto Join %d", index, g_lorap2p_settings.auto_join);
+	index += 2;
+	MYLOG("FLASH", "%03d Hop enable %d", index, g_lorap2p_settings.hop_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d Hop channels %d", index, g_lorap2p_settings.hop_num_channels);
+	index += 2;
+	MYLOG("FLASH", "%03d Hop seed %04X", index, g_lorap2p_settings.hop_seed);
+	index += 2;
+	for (int idx = 0; idx < HOP_MAX_CHANNELS; idx++)
+	{
+		MYLOG("FLASH", "%03d Hop frequency %d %ld", index, idx, g_lorap2p_settings.hop_channels[idx]);
+		index += 4;
+	}
+	MYLOG("FLASH", "%03d Relay enable %d", index, g_lorap2p_settings.relay_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d Relay max hops %d", index, g_lorap2p_settings.relay_max_hops);
+	index += 1;
+	MYLOG("FLASH", "%03d Gateway enable %d", index, g_lorap2p_settings.gateway_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d RX duty cycle %d", index, g_lorap2p_settings.rx_duty_cycle);
+	index += 1;
+	MYLOG("FLASH", "%03d Long preamble %d", index, g_lorap2p_settings.long_preamble);
+	index += 1;
+	MYLOG("FLASH", "%03d Encrypt enable %d", index, g_lorap2p_settings.encrypt_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d P2P key %02X%02X..%02X%02X", index, g_lorap2p_settings.p2p_key[0], g_lorap2p_settings.p2p_key[1],
+		  g_lorap2p_settings.p2p_key[14], g_lorap2p_settings.p2p_key[15]);
+	index += 16;
+	MYLOG("FLASH", "%03d Adapt enable %d", index, g_lorap2p_settings.adapt_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d Adapt margin %d", index, g_lorap2p_settings.adapt_margin);
+	index += 1;
+	MYLOG("FLASH", "%03d Adapt hysteresis %d", index, g_lorap2p_settings.adapt_hysteresis);
+	index += 1;
+	MYLOG("FLASH", "%03d Fleet enable %d", index, g_lorap2p_settings.fleet_enable);
+	index += 1;
+	MYLOG("FLASH", "%03d Fleet master %d", index, g_lorap2p_settings.fleet_master);
+	index += 2;
+	MYLOG("FLASH", "%03d Config version %d", index, g_lorap2p_settings.config_version);
+	index += 2;
+	MYLOG("FLASH", "%03d CAD SF %d", index, g_lorap2p_settings.cad_sf);
+	index += 1;
+	MYLOG("FLASH", "%03d CAD bandwidth %d", index, g_lorap2p_settings.cad_bw);
+	index += 1;
+	MYLOG("FLASH", "%03d CAD symbols %d", index, g_lorap2p_settings.cad_symbols);
+	index += 1;
+	MYLOG("FLASH", "%03d CAD detection peak %d", index, g_lorap2p_settings.cad_det_peak);
+	index += 1;
+	MYLOG("FLASH", "%03d CAD detection minimum %d", index, g_lorap2p_settings.cad_det_min);
+	index += 1;
+	MYLOG("FLASH", "%03d Time master %d", index, g_lorap2p_settings.timesync_master);
+	index += 1;
+	MYLOG("FLASH", "%03d Time beacon interval %d", index, g_lorap2p_settings.timesync_interval);
+	index += 2;
+	MYLOG("FLASH", "%03d TX only %d", index, g_lorap2p_settings.tx_only);
+	index += 1;
+	MYLOG("FLASH", "%03d Power policy %d", index, g_lorap2p_settings.power_policy);
 
 	uint8_t *raw_data = (uint8_t *)&g_lorap2p_settings.valid_mark_1;
 	MYLOG("FLASH", "Size %d", sizeof(s_lorap2p_settings));
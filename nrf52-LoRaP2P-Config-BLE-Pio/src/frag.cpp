@@ -0,0 +1,547 @@
+/**
+ * @file frag.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Fragmentation and reassembly of LoRa P2P payloads larger than one packet
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Maximum number of fragments of one blob */
+#define FRAG_MAX_FRAGS 128
+/** Number of data fragments protected by one parity fragment */
+#define FRAG_FEC_GROUP 4
+/** Number of blobs that can be reassembled at the same time */
+#define FRAG_SLOTS 3
+/** Time after the last fragment before an incomplete blob is dropped in milliseconds */
+#define FRAG_TIMEOUT 30000
+/** Size of the parity buffer of a reassembly slot */
+#define FRAG_PARITY_SIZE (P2P_BLOB_MAX / FRAG_FEC_GROUP + 2 * 256)
+
+/** Flag in the fragment header if parity fragments are sent */
+#define FRAG_FLAG_FEC 0x01
+
+/** Fragment header, payload of P2P_TYPE_FRAG, fragment data follows */
+struct s_frag_header
+{
+	// Blob ID, increments with every blob of the sender
+	uint8_t blob_id;
+	// Fragment index, parity fragments follow the data fragments
+	uint8_t idx;
+	// Number of data fragments
+	uint8_t cnt;
+	// Size of a data fragment, the last one can be shorter
+	uint8_t frag_size;
+	// FRAG_FLAG_xxx
+	uint8_t flags;
+	// Size of the blob
+	uint16_t total_len;
+} __attribute__((packed));
+
+/** Blob in reassembly */
+struct s_frag_slot
+{
+	bool used;
+	bool complete;
+	uint16_t src;
+	uint8_t blob_id;
+	uint8_t cnt;
+	uint8_t frag_size;
+	uint8_t flags;
+	uint16_t total_len;
+	uint32_t last_rx;
+	uint8_t rx_mask[FRAG_MAX_FRAGS / 8];
+	uint8_t parity_mask[FRAG_MAX_FRAGS / FRAG_FEC_GROUP / 8];
+	uint8_t data[P2P_BLOB_MAX];
+	uint8_t parity[FRAG_PARITY_SIZE];
+};
+
+/** Reassembly table */
+static s_frag_slot frag_slots[FRAG_SLOTS];
+
+/** Blob that is sent */
+static uint8_t frag_tx_data[P2P_BLOB_MAX];
+static uint16_t frag_tx_len = 0;
+static uint16_t frag_tx_dst = P2P_BROADCAST;
+static uint8_t frag_tx_id = 0;
+static uint8_t frag_tx_cnt = 0;
+static uint8_t frag_tx_size = 0;
+static uint8_t frag_tx_flags = 0;
+/** Next fragment to send, 0xFFFF if nothing to send */
+static uint16_t frag_tx_next = 0xFFFF;
+static uint32_t frag_tx_start = 0;
+
+/** Statistics */
+static uint32_t frag_blobs_rx = 0;
+static uint32_t frag_recovered = 0;
+static uint32_t frag_timeouts = 0;
+
+/** Timer for the fragment pacing */
+SoftwareTimer g_frag_timer;
+/** Flag if the fragment timer was initialized */
+static bool frag_timer_init = false;
+
+/**
+ * @brief Timer event when the next fragment is due
+ *
+ * @param unused
+ */
+void frag_timeout(TimerHandle_t unused)
+{
+	task_event(9);
+}
+
+/**
+ * @brief Start the fragment timer
+ *
+ * @param delay_ms time until the next fragment in milliseconds
+ */
+static void frag_start_timer(uint32_t delay_ms)
+{
+	if (!frag_timer_init)
+	{
+		g_frag_timer.begin(delay_ms, frag_timeout, NULL, false);
+		frag_timer_init = true;
+	}
+	else
+	{
+		g_frag_timer.stop();
+		g_frag_timer.setPeriod(delay_ms);
+	}
+	g_frag_timer.start();
+}
+
+/**
+ * @brief Get the fragment size for the spreading factor in use
+ * Limits the packet to the LoRaWAN maximum payload of the SF,
+ * which keeps the time on air reasonable
+ *
+ * @return uint8_t bytes of blob data per fragment
+ */
+static uint8_t frag_payload_size(void)
+{
+	uint8_t max_packet;
+	if (g_p2p_sf >= 10)
+	{
+		max_packet = 51;
+	}
+	else if (g_p2p_sf == 9)
+	{
+		max_packet = 115;
+	}
+	else
+	{
+		max_packet = 222;
+	}
+	return max_packet - sizeof(s_p2p_header) - P2P_CRYPTO_OVERHEAD - sizeof(s_frag_header);
+}
+
+/**
+ * @brief Get the time between two fragments
+ *
+ * @return uint32_t time in milliseconds
+ */
+static uint32_t frag_interval(void)
+{
+	uint8_t len = sizeof(s_p2p_header) + sizeof(s_frag_header) + frag_tx_size + P2P_CRYPTO_OVERHEAD;
+	// Time on air plus CAD and processing
+	return p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), len) / 1000 + 100;
+}
+
+/**
+ * @brief XOR a data fragment into a parity buffer
+ *
+ * @param parity parity buffer of frag_size bytes
+ * @param data blob data
+ * @param total_len length of the blob
+ * @param frag_size size of a data fragment
+ * @param idx index of the data fragment
+ */
+static void frag_xor(uint8_t *parity, uint8_t *data, uint16_t total_len, uint8_t frag_size, uint8_t idx)
+{
+	uint16_t offset = idx * frag_size;
+	for (uint16_t byte = 0; (byte < frag_size) && ((offset + byte) < total_len); byte++)
+	{
+		parity[byte] ^= data[offset + byte];
+	}
+}
+
+/**
+ * @brief Start sending a blob in fragments
+ * The blob is copied, the buffer can be reused after the call.
+ *
+ * @param dst node ID of the destination, P2P_BROADCAST for all nodes
+ * @param data blob
+ * @param len length of the blob, max P2P_BLOB_MAX
+ * @param fec true to send a parity fragment after every FRAG_FEC_GROUP data fragments
+ * @return true if sending started
+ * @return false if a blob is still being sent or the blob is too large
+ */
+bool send_p2p_blob(uint16_t dst, uint8_t *data, uint16_t len, bool fec)
+{
+	if (frag_tx_next != 0xFFFF)
+	{
+		MYLOG("FRAG", "Still sending blob %d", frag_tx_id);
+		return false;
+	}
+	uint8_t frag_size = frag_payload_size();
+	if ((len == 0) || (len > P2P_BLOB_MAX) || (((len + frag_size - 1) / frag_size) > FRAG_MAX_FRAGS))
+	{
+		MYLOG("FRAG", "Blob size %d not supported", len);
+		return false;
+	}
+
+	memcpy(frag_tx_data, data, len);
+	frag_tx_len = len;
+	frag_tx_dst = dst;
+	frag_tx_id++;
+	frag_tx_size = frag_size;
+	frag_tx_cnt = (len + frag_size - 1) / frag_size;
+	frag_tx_flags = fec ? FRAG_FLAG_FEC : 0;
+	frag_tx_next = 0;
+	frag_tx_start = millis();
+
+	MYLOG("FRAG", "Sending blob %d, %d bytes in %d fragments of %d bytes", frag_tx_id, len, frag_tx_cnt, frag_size);
+	frag_start_timer(10);
+	return true;
+}
+
+/**
+ * @brief Send the next fragment
+ * Called from the loop task after the fragment timer expired.
+ * With FEC the parity fragment of a group is sent after its data fragments.
+ *
+ */
+void frag_send_next(void)
+{
+	if (frag_tx_next == 0xFFFF)
+	{
+		return;
+	}
+
+	uint8_t groups = (frag_tx_cnt + FRAG_FEC_GROUP - 1) / FRAG_FEC_GROUP;
+	uint16_t total = frag_tx_cnt + ((frag_tx_flags & FRAG_FLAG_FEC) ? groups : 0);
+
+	// Order: data of group 0, parity of group 0, data of group 1, ...
+	uint8_t idx;
+	uint16_t step = frag_tx_next;
+	if (frag_tx_flags & FRAG_FLAG_FEC)
+	{
+		uint8_t group = step / (FRAG_FEC_GROUP + 1);
+		uint8_t pos = step % (FRAG_FEC_GROUP + 1);
+		uint8_t group_size = ((group + 1) * FRAG_FEC_GROUP <= frag_tx_cnt) ? FRAG_FEC_GROUP : (frag_tx_cnt - group * FRAG_FEC_GROUP);
+		idx = (pos < group_size) ? (group * FRAG_FEC_GROUP + pos) : (frag_tx_cnt + group);
+		if ((pos >= group_size) && (pos != FRAG_FEC_GROUP))
+		{
+			// Short last group, skip the unused positions
+			frag_tx_next = (group + 1) * (FRAG_FEC_GROUP + 1) - 1;
+		}
+	}
+	else
+	{
+		idx = step;
+	}
+
+	uint8_t payload[sizeof(s_frag_header) + 256];
+	s_frag_header header;
+	header.blob_id = frag_tx_id;
+	header.idx = idx;
+	header.cnt = frag_tx_cnt;
+	header.frag_size = frag_tx_size;
+	header.flags = frag_tx_flags;
+	header.total_len = frag_tx_len;
+	memcpy(payload, &header, sizeof(s_frag_header));
+
+	uint8_t *frag_data = &payload[sizeof(s_frag_header)];
+	uint8_t frag_len;
+	if (idx < frag_tx_cnt)
+	{
+		uint16_t offset = idx * frag_tx_size;
+		frag_len = (frag_tx_len - offset) < frag_tx_size ? (frag_tx_len - offset) : frag_tx_size;
+		memcpy(frag_data, &frag_tx_data[offset], frag_len);
+	}
+	else
+	{
+		uint8_t group = idx - frag_tx_cnt;
+		frag_len = frag_tx_size;
+		memset(frag_data, 0, frag_len);
+		for (uint8_t data_idx = group * FRAG_FEC_GROUP; (data_idx < (group + 1) * FRAG_FEC_GROUP) && (data_idx < frag_tx_cnt); data_idx++)
+		{
+			frag_xor(frag_data, frag_tx_data, frag_tx_len, frag_tx_size, data_idx);
+		}
+	}
+
+	if (send_p2p_packet(P2P_TYPE_FRAG, frag_tx_dst, payload, sizeof(s_frag_header) + frag_len))
+	{
+		frag_tx_next++;
+	}
+
+	uint16_t last_step = (frag_tx_flags & FRAG_FLAG_FEC) ? groups * (FRAG_FEC_GROUP + 1) : frag_tx_cnt;
+	if (frag_tx_next >= last_step)
+	{
+		uint32_t duration = millis() - frag_tx_start;
+		MYLOG("FRAG", "Blob %d sent, %d packets in %ld ms, %ld byte/s", frag_tx_id, total, duration,
+			  duration ? (frag_tx_len * 1000UL) / duration : 0);
+		frag_tx_next = 0xFFFF;
+		return;
+	}
+	frag_start_timer(frag_interval());
+}
+
+/**
+ * @brief Check if a fragment was received
+ */
+static inline bool frag_has(uint8_t *mask, uint8_t idx)
+{
+	return (mask[idx / 8] & (1 << (idx % 8))) != 0;
+}
+
+/**
+ * @brief Mark a fragment as received
+ */
+static inline void frag_set(uint8_t *mask, uint8_t idx)
+{
+	mask[idx / 8] |= (1 << (idx % 8));
+}
+
+/**
+ * @brief Try to recover a missing data fragment with the parity of its group
+ *
+ * @param slot reassembly slot
+ * @param group FEC group
+ */
+static void frag_recover(s_frag_slot *slot, uint8_t group)
+{
+	if (!frag_has(slot->parity_mask, group))
+	{
+		return;
+	}
+
+	uint8_t missing = 0xFF;
+	uint8_t first = group * FRAG_FEC_GROUP;
+	for (uint8_t idx = first; (idx < first + FRAG_FEC_GROUP) && (idx < slot->cnt); idx++)
+	{
+		if (!frag_has(slot->rx_mask, idx))
+		{
+			if (missing != 0xFF)
+			{
+				// More than one missing, parity can not help
+				return;
+			}
+			missing = idx;
+		}
+	}
+	if (missing == 0xFF)
+	{
+		return;
+	}
+
+	uint8_t rebuilt[256];
+	memcpy(rebuilt, &slot->parity[group * slot->frag_size], slot->frag_size);
+	for (uint8_t idx = first; (idx < first + FRAG_FEC_GROUP) && (idx < slot->cnt); idx++)
+	{
+		if (idx != missing)
+		{
+			frag_xor(rebuilt, slot->data, slot->total_len, slot->frag_size, idx);
+		}
+	}
+	uint16_t offset = missing * slot->frag_size;
+	uint16_t len = (slot->total_len - offset) < slot->frag_size ? (slot->total_len - offset) : slot->frag_size;
+	memcpy(&slot->data[offset], rebuilt, len);
+	frag_set(slot->rx_mask, missing);
+	frag_recovered++;
+	MYLOG("FRAG", "Recovered fragment %d of blob %d", missing, slot->blob_id);
+}
+
+/**
+ * @brief Drop incomplete blobs without fragments for FRAG_TIMEOUT
+ *
+ */
+static void frag_expire(void)
+{
+	uint32_t now = millis();
+	for (int idx = 0; idx < FRAG_SLOTS; idx++)
+	{
+		if (frag_slots[idx].used && !frag_slots[idx].complete && ((now - frag_slots[idx].last_rx) > FRAG_TIMEOUT))
+		{
+			MYLOG("FRAG", "Blob %d from %04X timed out", frag_slots[idx].blob_id, frag_slots[idx].src);
+			frag_slots[idx].used = false;
+			frag_timeouts++;
+		}
+	}
+}
+
+/**
+ * @brief Find the reassembly slot of a blob or allocate a new one
+ * If the table is full, the blob with the oldest fragment is dropped.
+ *
+ * @param src originator
+ * @param header fragment header
+ * @return s_frag_slot* slot, NULL if all slots hold complete blobs
+ */
+static s_frag_slot *frag_get_slot(uint16_t src, s_frag_header *header)
+{
+	s_frag_slot *free_slot = NULL;
+	s_frag_slot *oldest = NULL;
+	for (int idx = 0; idx < FRAG_SLOTS; idx++)
+	{
+		s_frag_slot *slot = &frag_slots[idx];
+		if (!slot->used)
+		{
+			free_slot = slot;
+			continue;
+		}
+		if ((slot->src == src) && (slot->blob_id == header->blob_id))
+		{
+			return slot;
+		}
+		if (!slot->complete && ((oldest == NULL) || ((int32_t)(slot->last_rx - oldest->last_rx) < 0)))
+		{
+			oldest = slot;
+		}
+	}
+	if (free_slot == NULL)
+	{
+		if (oldest == NULL)
+		{
+			return NULL;
+		}
+		MYLOG("FRAG", "Table full, dropping blob %d from %04X", oldest->blob_id, oldest->src);
+		frag_timeouts++;
+		free_slot = oldest;
+	}
+
+	memset(free_slot->rx_mask, 0, sizeof(free_slot->rx_mask));
+	memset(free_slot->parity_mask, 0, sizeof(free_slot->parity_mask));
+	free_slot->used = true;
+	free_slot->complete = false;
+	free_slot->src = src;
+	free_slot->blob_id = header->blob_id;
+	free_slot->cnt = header->cnt;
+	free_slot->frag_size = header->frag_size;
+	free_slot->flags = header->flags;
+	free_slot->total_len = header->total_len;
+	return free_slot;
+}
+
+/**
+ * @brief Handle a received fragment
+ * Called from the LoRa task. Fragments can arrive in any order.
+ *
+ * @param header header of the received packet
+ * @param data payload of the packet
+ * @param len length of the payload
+ */
+void frag_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len)
+{
+	if (len <= sizeof(s_frag_header))
+	{
+		return;
+	}
+	s_frag_header frag;
+	memcpy(&frag, data, sizeof(s_frag_header));
+	uint8_t *frag_data = &data[sizeof(s_frag_header)];
+	uint8_t frag_len = len - sizeof(s_frag_header);
+
+	uint8_t groups = (frag.cnt + FRAG_FEC_GROUP - 1) / FRAG_FEC_GROUP;
+	if ((frag.total_len == 0) || (frag.total_len > P2P_BLOB_MAX) || (frag.cnt == 0) || (frag.cnt > FRAG_MAX_FRAGS) || (frag.frag_size == 0) || ((frag.cnt * frag.frag_size) < frag.total_len) || (frag.idx >= (frag.cnt + groups)))
+	{
+		MYLOG("FRAG", "Invalid fragment");
+		return;
+	}
+
+	frag_expire();
+	s_frag_slot *slot = frag_get_slot(header->src, &frag);
+	if ((slot == NULL) || slot->complete || (slot->total_len != frag.total_len) || (slot->frag_size != frag.frag_size))
+	{
+		return;
+	}
+	slot->last_rx = millis();
+
+	uint8_t group;
+	if (frag.idx < frag.cnt)
+	{
+		if (frag_has(slot->rx_mask, frag.idx))
+		{
+			return;
+		}
+		uint16_t offset = frag.idx * frag.frag_size;
+		uint16_t expected = (frag.total_len - offset) < frag.frag_size ? (frag.total_len - offset) : frag.frag_size;
+		if (frag_len < expected)
+		{
+			return;
+		}
+		memcpy(&slot->data[offset], frag_data, expected);
+		frag_set(slot->rx_mask, frag.idx);
+		group = frag.idx / FRAG_FEC_GROUP;
+	}
+	else
+	{
+		group = frag.idx - frag.cnt;
+		if ((frag_len < frag.frag_size) || (((group + 1) * frag.frag_size) > FRAG_PARITY_SIZE))
+		{
+			return;
+		}
+		memcpy(&slot->parity[group * frag.frag_size], frag_data, frag.frag_size);
+		frag_set(slot->parity_mask, group);
+	}
+
+	if (slot->flags & FRAG_FLAG_FEC)
+	{
+		frag_recover(slot, group);
+	}
+
+	for (uint8_t idx = 0; idx < slot->cnt; idx++)
+	{
+		if (!frag_has(slot->rx_mask, idx))
+		{
+			return;
+		}
+	}
+
+	// Complete, hand it to the loop task
+	slot->complete = true;
+	frag_blobs_rx++;
+	task_event(10);
+}
+
+/** Text of a delivered blob, header line and 3 characters per byte */
+static char frag_text[32 + P2P_BLOB_MAX * 3 + 1];
+
+/**
+ * @brief Deliver the complete blobs and free their slots
+ * Called from the loop task
+ *
+ */
+void frag_deliver(void)
+{
+	for (int idx = 0; idx < FRAG_SLOTS; idx++)
+	{
+		s_frag_slot *slot = &frag_slots[idx];
+		if (!slot->used || !slot->complete)
+		{
+			continue;
+		}
+		MYLOG("FRAG", "Blob %d from %04X, %d bytes", slot->blob_id, slot->src, slot->total_len);
+		MYLOG("FRAG", "Blobs %ld, recovered fragments %ld, timeouts %ld", frag_blobs_rx, frag_recovered, frag_timeouts);
+		if (ble_uart_is_connected)
+		{
+			// Hex dump in one write, single bytes would make one notification each
+			static const char hex_digits[] = "0123456789ABCDEF";
+			int len = snprintf(frag_text, sizeof(frag_text), "Blob %04X %d bytes\n", slot->src, slot->total_len);
+			for (int byte = 0; byte < slot->total_len; byte++)
+			{
+				frag_text[len++] = hex_digits[slot->data[byte] >> 4];
+				frag_text[len++] = hex_digits[slot->data[byte] & 0x0F];
+				frag_text[len++] = ' ';
+			}
+			frag_text[len++] = '\n';
+			ble_uart.write((uint8_t *)frag_text, len);
+		}
+		slot->used = false;
+	}
+}
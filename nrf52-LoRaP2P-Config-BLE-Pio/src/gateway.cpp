@@ -0,0 +1,165 @@
+/**
+ * @file gateway.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Stream received LoRa P2P packets as binary frames over BLE UART
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Size of the frame buffer, must be a power of 2 */
+#define GW_BUFFER_SIZE 2048
+/** Maximum time a partial batch waits for more frames in milliseconds */
+#define GW_FLUSH_TIME 100
+/** Frame type for a received LoRa packet */
+#define GW_FRAME_PACKET 0x01
+/** Flag in the frame type for packets that were encrypted and are forwarded decrypted */
+#define GW_FLAG_DECRYPTED 0x80
+
+/**
+ * Frame layout, all values little endian
+ * 0      length of the following bytes
+ * 1      frame type GW_FRAME_PACKET, GW_FLAG_DECRYPTED set for decrypted packets
+ * 2..5   timestamp in milliseconds since boot
+ * 6..7   RSSI
+ * 8      SNR
+ * 9..    received packet
+ */
+#define GW_FRAME_HEADER_LEN 9
+
+/** Buffer for frames waiting to be sent */
+static uint8_t gw_buffer[GW_BUFFER_SIZE];
+/** Write index, only changed by the LoRa task */
+static volatile uint16_t gw_head = 0;
+/** Read index, only changed by the loop task */
+static volatile uint16_t gw_tail = 0;
+
+/** Number of frames queued */
+static uint32_t gw_frames = 0;
+/** Number of frames dropped because the buffer was full */
+static uint32_t gw_dropped = 0;
+
+/** Timer to flush a partial batch */
+SoftwareTimer g_gw_timer;
+/** Flag if the flush timer was initialized */
+static bool gw_timer_init = false;
+
+/**
+ * @brief Timer event to send a partial batch
+ *
+ * @param unused
+ */
+void gw_flush_timeout(TimerHandle_t unused)
+{
+	task_event(5);
+}
+
+/**
+ * @brief Put a byte into the frame buffer
+ *
+ * @param data byte to add
+ */
+static inline void gw_put(uint8_t data)
+{
+	gw_buffer[gw_head] = data;
+	gw_head = (gw_head + 1) & (GW_BUFFER_SIZE - 1);
+}
+
+/**
+ * @brief Queue a received packet for the BLE UART
+ * Called from the LoRa task
+ *
+ * @param frame received packet
+ * @param len length of the packet
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param decrypted true if the packet was encrypted and passed the MIC check
+ */
+void gateway_queue(uint8_t *frame, uint8_t len, int16_t rssi, int8_t snr, bool decrypted)
+{
+	if (!ble_uart_is_connected)
+	{
+		return;
+	}
+
+	uint16_t frame_len = GW_FRAME_HEADER_LEN + len;
+	// Limited by the 1 byte length field
+	if (frame_len > 256)
+	{
+		len = 256 - GW_FRAME_HEADER_LEN;
+		frame_len = 256;
+	}
+	uint16_t used = (gw_head - gw_tail) & (GW_BUFFER_SIZE - 1);
+	if ((GW_BUFFER_SIZE - 1 - used) < frame_len)
+	{
+		gw_dropped++;
+		return;
+	}
+
+	uint32_t timestamp = millis();
+	gw_put(frame_len - 1);
+	gw_put(decrypted ? (GW_FRAME_PACKET | GW_FLAG_DECRYPTED) : GW_FRAME_PACKET);
+	gw_put(timestamp);
+	gw_put(timestamp >> 8);
+	gw_put(timestamp >> 16);
+	gw_put(timestamp >> 24);
+	gw_put(rssi);
+	gw_put(rssi >> 8);
+	gw_put(snr);
+	for (int idx = 0; idx < len; idx++)
+	{
+		gw_put(frame[idx]);
+	}
+	gw_frames++;
+
+	if (!gw_timer_init)
+	{
+		g_gw_timer.begin(GW_FLUSH_TIME, gw_flush_timeout, NULL, false);
+		gw_timer_init = true;
+	}
+	g_gw_timer.start();
+}
+
+/**
+ * @brief Send the queued frames over BLE UART
+ * Frames are packed into notifications of the negotiated MTU size,
+ * a frame can be split over two notifications.
+ *
+ * @param force true to send a partial batch as well
+ */
+void gateway_flush(bool force)
+{
+	uint8_t batch[BLE_GATT_ATT_MTU_MAX];
+	uint16_t batch_size = ble_uart_payload_size();
+
+	if (!ble_uart_is_connected)
+	{
+		gw_tail = gw_head;
+		return;
+	}
+
+	while (true)
+	{
+		uint16_t used = (gw_head - gw_tail) & (GW_BUFFER_SIZE - 1);
+		if ((used == 0) || ((used < batch_size) && !force))
+		{
+			break;
+		}
+		uint16_t batch_len = used < batch_size ? used : batch_size;
+		for (int idx = 0; idx < batch_len; idx++)
+		{
+			batch[idx] = gw_buffer[(gw_tail + idx) & (GW_BUFFER_SIZE - 1)];
+		}
+		ble_uart.write(batch, batch_len);
+		gw_tail = (gw_tail + batch_len) & (GW_BUFFER_SIZE - 1);
+	}
+
+	if (force)
+	{
+		MYLOG("GW", "Frames %ld, dropped %ld", gw_frames, gw_dropped);
+	}
+}
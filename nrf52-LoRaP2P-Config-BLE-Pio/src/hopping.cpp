@@ -0,0 +1,377 @@
+/**
+ * @file hopping.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief LoRa P2P frequency hopping over a configurable channel list
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Minimum number of samples before a channel can be blacklisted */
+#define HOP_MIN_SAMPLES 8
+/** Percentage of busy/failed samples that blacklists a channel */
+#define HOP_BLACKLIST_PCT 50
+/** Number of samples after which the statistics are aged */
+#define HOP_AGE_SAMPLES 64
+/** Number of own packets after which blacklisted channels are probed again */
+#define HOP_PROBE_PACKETS 256
+/** Number of missed packets before the receiver gives up the sync */
+#define HOP_MAX_MISSED 4
+/** Margin added to the packet interval of the transmitter in milliseconds */
+#define HOP_RX_MARGIN 1000
+
+/** Per channel quality statistics */
+struct s_hop_stats
+{
+	uint16_t tx;
+	uint16_t busy;
+	uint16_t rx;
+	uint16_t err;
+};
+
+/** Hop sequence, permutation of the channel indexes */
+static uint8_t hop_sequence[HOP_MAX_CHANNELS];
+/** Number of channels in use */
+static uint8_t hop_num = 0;
+/** Channel quality statistics */
+static s_hop_stats hop_stats[HOP_MAX_CHANNELS];
+/** Own blacklist, sent with every packet */
+static uint8_t hop_own_mask = 0;
+
+/** Node ID of the transmitter we are synced to */
+static uint16_t hop_peer_src = 0;
+/** Blacklist of the transmitter we are synced to */
+static uint8_t hop_peer_mask = 0;
+/** Last packet counter received from the transmitter */
+static uint16_t hop_peer_cnt = 0;
+/** Time of the last packet received from the transmitter */
+static uint32_t hop_peer_time = 0;
+/** Measured packet interval of the transmitter in milliseconds, 0 if unknown */
+static uint32_t hop_peer_interval = 0;
+/** Flag if the receiver follows a transmitter */
+static bool hop_synced = false;
+/** Number of consecutive missed packets */
+static uint8_t hop_missed = 0;
+/** Channel index the receiver listens on */
+static uint8_t hop_rx_idx = 0;
+/** Channel index of the last transmission */
+static uint8_t hop_tx_idx = 0;
+
+/** Timer to detect missed packets */
+SoftwareTimer g_hop_timer;
+/** Flag if hopping is running, hop_enable can not be used with less than 2 channels */
+bool g_hop_active = false;
+
+/**
+ * @brief Timer event when no packet was received in the expected time
+ *
+ * @param unused
+ */
+void hop_timeout(TimerHandle_t unused)
+{
+	task_event(3);
+}
+
+/**
+ * @brief Get the channel index for a packet counter
+ * Walks the hop sequence from the counter position and skips
+ * the channels blacklisted in mask
+ *
+ * @param hop_cnt packet counter of the transmitter
+ * @param mask blacklist of the transmitter
+ * @return uint8_t index into hop_channels
+ */
+static uint8_t hop_channel_index(uint16_t hop_cnt, uint8_t mask)
+{
+	for (uint8_t step = 0; step < hop_num; step++)
+	{
+		uint8_t idx = hop_sequence[(hop_cnt + step) % hop_num];
+		if ((mask & (1 << idx)) == 0)
+		{
+			return idx;
+		}
+	}
+	// All channels blacklisted, ignore the blacklist
+	return hop_sequence[hop_cnt % hop_num];
+}
+
+/**
+ * @brief Set the missed packet timeout from the packet interval
+ *
+ * @param interval expected time between two packets in milliseconds
+ */
+static void hop_set_timeout(uint32_t interval)
+{
+	g_hop_timer.setPeriod(interval + interval / 10 + HOP_RX_MARGIN);
+}
+
+/**
+ * @brief Get the channel the receiver listens on while not synced
+ *
+ * @return uint8_t index into hop_channels
+ */
+static uint8_t hop_acquisition_index(void)
+{
+	return hop_channel_index(0, hop_own_mask);
+}
+
+/**
+ * @brief Initialize the hop sequence from the shared seed
+ *
+ */
+void init_hopping(void)
+{
+	hop_num = g_lorap2p_settings.hop_num_channels;
+	if (hop_num > HOP_MAX_CHANNELS)
+	{
+		hop_num = HOP_MAX_CHANNELS;
+	}
+	if (hop_num < 2)
+	{
+		MYLOG("HOP", "Less than 2 channels, hopping not started");
+		g_hop_active = false;
+		return;
+	}
+
+	// Fisher-Yates shuffle with a xorshift generator, identical on all nodes with the same seed
+	uint32_t rnd = g_lorap2p_settings.hop_seed | 0x10000;
+	for (uint8_t idx = 0; idx < hop_num; idx++)
+	{
+		hop_sequence[idx] = idx;
+	}
+	for (uint8_t idx = hop_num - 1; idx > 0; idx--)
+	{
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+		uint8_t swap_idx = rnd % (idx + 1);
+		uint8_t temp = hop_sequence[idx];
+		hop_sequence[idx] = hop_sequence[swap_idx];
+		hop_sequence[swap_idx] = temp;
+	}
+
+	memset(hop_stats, 0, sizeof(hop_stats));
+	hop_own_mask = 0;
+	hop_synced = false;
+	hop_rx_idx = hop_acquisition_index();
+	g_hop_active = true;
+
+	for (uint8_t idx = 0; idx < hop_num; idx++)
+	{
+		MYLOG("HOP", "Hop %d => %ld Hz", idx, g_lorap2p_settings.hop_channels[hop_sequence[idx]]);
+	}
+
+	// Until the interval of the transmitter is measured expect a packet once per send interval
+	g_hop_timer.begin(g_lorap2p_settings.send_repeat_time + g_lorap2p_settings.send_repeat_time / 10 + HOP_RX_MARGIN, hop_timeout);
+}
+
+/**
+ * @brief Get the frequency the receiver should listen on
+ *
+ * @return uint32_t frequency in Hz
+ */
+uint32_t hop_rx_frequency(void)
+{
+	return g_lorap2p_settings.hop_channels[hop_rx_idx];
+}
+
+/**
+ * @brief Get the frequency for a transmission
+ *
+ * @param hop_cnt own packet counter
+ * @return uint32_t frequency in Hz
+ */
+uint32_t hop_tx_frequency(uint16_t hop_cnt)
+{
+	// Give blacklisted channels a new chance from time to time
+	if ((hop_cnt % HOP_PROBE_PACKETS) == 0)
+	{
+		for (uint8_t idx = 0; idx < hop_num; idx++)
+		{
+			if (hop_own_mask & (1 << idx))
+			{
+				memset(&hop_stats[idx], 0, sizeof(s_hop_stats));
+			}
+		}
+		hop_own_mask = 0;
+	}
+	hop_tx_idx = hop_channel_index(hop_cnt, hop_own_mask);
+	return g_lorap2p_settings.hop_channels[hop_tx_idx];
+}
+
+/**
+ * @brief Get the own channel blacklist
+ *
+ * @return uint8_t bit mask of blacklisted channels
+ */
+uint8_t hop_blacklist(void)
+{
+	return hop_own_mask;
+}
+
+/**
+ * @brief Age the statistics of a channel and update the blacklist
+ *
+ * @param idx channel index
+ */
+static void hop_update_channel(uint8_t idx)
+{
+	s_hop_stats *stats = &hop_stats[idx];
+	uint16_t samples = stats->tx + stats->busy + stats->rx + stats->err;
+
+	if (samples > HOP_AGE_SAMPLES)
+	{
+		stats->tx /= 2;
+		stats->busy /= 2;
+		stats->rx /= 2;
+		stats->err /= 2;
+		samples = stats->tx + stats->busy + stats->rx + stats->err;
+	}
+
+	if ((samples < HOP_MIN_SAMPLES) || (hop_own_mask & (1 << idx)))
+	{
+		return;
+	}
+
+	uint16_t bad = stats->busy + stats->err;
+	if ((bad * 100) < (samples * HOP_BLACKLIST_PCT))
+	{
+		return;
+	}
+
+	// Keep at least 2 channels to hop on
+	uint8_t active = 0;
+	for (uint8_t chan = 0; chan < hop_num; chan++)
+	{
+		if ((hop_own_mask & (1 << chan)) == 0)
+		{
+			active++;
+		}
+	}
+	if (active <= 2)
+	{
+		return;
+	}
+
+	hop_own_mask |= (1 << idx);
+	MYLOG("HOP", "Blacklisted %ld Hz, %d of %d samples bad", g_lorap2p_settings.hop_channels[idx], bad, samples);
+}
+
+/**
+ * @brief Sync the receiver to a received packet
+ * The receiver can follow only one transmitter. It syncs to the first
+ * node it hears and ignores the hop counters of other nodes until
+ * it lost the sync.
+ *
+ * @param header header of the received packet
+ */
+void hop_rx_done(s_p2p_header *header)
+{
+	hop_stats[hop_rx_idx].rx++;
+	hop_update_channel(hop_rx_idx);
+
+	// Relayed packets carry the hop counter of the relay, not of the originator
+	if (header->ttl != g_lorap2p_settings.relay_max_hops)
+	{
+		return;
+	}
+
+	uint32_t now = millis();
+	if (!hop_synced || (header->src != hop_peer_src))
+	{
+		if (hop_synced)
+		{
+			// Packet of another transmitter, stay with the one we follow
+			return;
+		}
+		MYLOG("HOP", "Synced to node %04X", header->src);
+		hop_peer_src = header->src;
+		hop_peer_interval = 0;
+		hop_set_timeout(g_lorap2p_settings.send_repeat_time);
+	}
+	else
+	{
+		// Measure the packet interval of the transmitter, hop_rx_missed() advanced hop_peer_cnt for missed packets
+		uint16_t packets = header->hop_cnt - (uint16_t)(hop_peer_cnt - hop_missed);
+		if ((packets != 0) && (packets <= HOP_MAX_MISSED + 1))
+		{
+			uint32_t interval = (now - hop_peer_time) / packets;
+			hop_peer_interval = hop_peer_interval == 0 ? interval : (hop_peer_interval * 3 + interval) / 4;
+			hop_set_timeout(hop_peer_interval);
+		}
+	}
+
+	hop_peer_cnt = header->hop_cnt;
+	hop_peer_mask = header->hop_mask;
+	hop_peer_time = now;
+	hop_synced = true;
+	hop_missed = 0;
+
+	// Listen where the transmitter sends its next packet
+	hop_rx_idx = hop_channel_index(hop_peer_cnt + 1, hop_peer_mask);
+
+	g_hop_timer.stop();
+	g_hop_timer.start();
+}
+
+/**
+ * @brief Count a CRC error on the receive channel
+ *
+ */
+void hop_rx_error(void)
+{
+	hop_stats[hop_rx_idx].err++;
+	hop_update_channel(hop_rx_idx);
+}
+
+/**
+ * @brief Count the CAD result on the transmit channel
+ *
+ * @param busy true if CAD found the channel busy
+ */
+void hop_cad_result(bool busy)
+{
+	if (busy)
+	{
+		hop_stats[hop_tx_idx].busy++;
+	}
+	else
+	{
+		hop_stats[hop_tx_idx].tx++;
+	}
+	hop_update_channel(hop_tx_idx);
+}
+
+/**
+ * @brief Advance the receiver when the expected packet was missed
+ * Called from the loop task after the hop timer expired
+ *
+ */
+void hop_rx_missed(void)
+{
+	if (!hop_synced)
+	{
+		return;
+	}
+
+	hop_missed++;
+	if (hop_missed > HOP_MAX_MISSED)
+	{
+		MYLOG("HOP", "Lost sync, back to acquisition channel");
+		hop_synced = false;
+		hop_rx_idx = hop_acquisition_index();
+	g_hop_active = true;
+		g_hop_timer.stop();
+	}
+	else
+	{
+		// Assume the transmitter sent a packet we did not hear
+		hop_peer_cnt++;
+		hop_rx_idx = hop_channel_index(hop_peer_cnt + 1, hop_peer_mask);
+	}
+	restart_rx();
+}
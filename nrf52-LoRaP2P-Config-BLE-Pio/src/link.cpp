@@ -0,0 +1,554 @@
+/**
+ * @file link.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief LoRa P2P link adaptation of SF, bandwidth and TX power
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Margin change per SF/bandwidth or TX power step in dB */
+#define LINK_STEP_DB 3
+/** Number of link reports before a decision */
+#define LINK_REPORTS 4
+/** Number of unacknowledged packets before falling back to the rendezvous settings */
+#define LINK_MAX_UNACKED 3
+/** Lowest TX power used by the link adaptation in dBm */
+#define LINK_MIN_TX_POWER 2
+/** SNR above which the SNR is not a good measure for the margin in dB */
+#define LINK_SNR_SATURATION 5
+/** Noise figure of the SX1262 receiver in dB */
+#define LINK_NOISE_FIGURE 6
+
+/** Link report, payload of P2P_TYPE_ACK */
+struct s_link_report
+{
+	// Acknowledged sequence number
+	uint16_t seq;
+	// Link margin of the acknowledged packet in dB
+	int8_t margin;
+	// Spreading factor the receiver uses from now on
+	uint8_t sf;
+	// Bandwidth the receiver uses from now on
+	uint8_t bw;
+} __attribute__((packed));
+
+/** Request to change SF and bandwidth, payload of P2P_TYPE_LINK_CMD */
+struct s_link_cmd
+{
+	uint8_t sf;
+	uint8_t bw;
+} __attribute__((packed));
+
+/** Node we adapt the link to, learned from the first ACK */
+static uint16_t link_peer = P2P_BROADCAST;
+
+/** ACK waiting to be sent */
+static bool link_ack_pending = false;
+static uint16_t link_ack_dst = 0;
+static s_link_report link_ack;
+/** Flag if the ACK is in CAD or TX */
+static bool link_ack_in_flight = false;
+/** SF and bandwidth to switch to after the ACK of a LINK_CMD was sent */
+static bool link_switch_pending = false;
+static s_link_cmd link_switch;
+
+/** LINK_CMD waiting to be sent */
+static bool link_cmd_due = false;
+/** LINK_CMD sent, waiting for the ACK */
+static bool link_cmd_pending = false;
+static s_link_cmd link_cmd;
+
+/** Number of own packets without ACK */
+static uint8_t link_unacked = 0;
+/** Lowest margin of the collected link reports */
+static int8_t link_min_margin = 127;
+/** Number of collected link reports */
+static uint8_t link_reports = 0;
+
+/** Flag if the receive timeout expired */
+static volatile bool link_timer_expired = false;
+/** Timer to fall back to the rendezvous settings if the peer is lost */
+SoftwareTimer g_link_timer;
+/** Flag if the link timer was initialized */
+static bool link_timer_init = false;
+/** Flag if the link adaptation is running, adapt_enable can not be used with hopping */
+bool g_link_active = false;
+
+/** Airtime and charge of own packets */
+static float link_airtime_s = 0.0;
+static float link_charge_mc = 0.0;
+/** Airtime and charge the same packets need with the rendezvous settings */
+static float link_rdv_airtime_s = 0.0;
+static float link_rdv_charge_mc = 0.0;
+
+/**
+ * @brief Wake up the loop task to handle the link adaptation
+ *
+ */
+static void link_wake_loop(void)
+{
+	task_event(6);
+}
+
+/**
+ * @brief Timer event when nothing was received from the peer
+ *
+ * @param unused
+ */
+void link_timeout(TimerHandle_t unused)
+{
+	link_timer_expired = true;
+	task_event(6);
+}
+
+/**
+ * @brief Check if the rendezvous settings are in use
+ *
+ * @return true if SF, bandwidth and TX power are the configured ones
+ */
+static bool link_at_rendezvous(void)
+{
+	return (g_p2p_sf == g_lorap2p_settings.p2p_sf) && (g_p2p_bw == g_lorap2p_settings.p2p_bandwidth);
+}
+
+/**
+ * @brief Restart the receive timeout, only needed away from the rendezvous settings
+ *
+ */
+static void link_restart_timer(void)
+{
+	g_link_timer.stop();
+	if (!link_at_rendezvous())
+	{
+		g_link_timer.start();
+	}
+}
+
+/**
+ * @brief Go back to the configured settings
+ * Both ends do this when they lose each other, so they meet again.
+ *
+ */
+static void link_fallback(void)
+{
+	MYLOG("LINK", "Link lost, back to SF%d BW%d %d dBm", g_lorap2p_settings.p2p_sf,
+		  g_lorap2p_settings.p2p_bandwidth, g_lorap2p_settings.p2p_tx_power);
+	set_p2p_modulation(g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_bandwidth, g_lorap2p_settings.p2p_tx_power);
+	link_cmd_due = false;
+	link_cmd_pending = false;
+	link_switch_pending = false;
+	link_unacked = 0;
+	link_reports = 0;
+	link_min_margin = 127;
+	g_link_timer.stop();
+}
+
+/**
+ * @brief Initialize the link adaptation
+ *
+ */
+void init_link(void)
+{
+	if (g_hop_active)
+	{
+		MYLOG("LINK", "Not supported with frequency hopping, link adaptation not started");
+		g_link_active = false;
+		return;
+	}
+
+	link_peer = P2P_BROADCAST;
+	link_ack_pending = false;
+	link_ack_in_flight = false;
+	link_cmd_due = false;
+	link_cmd_pending = false;
+	link_switch_pending = false;
+	link_unacked = 0;
+	link_reports = 0;
+	link_min_margin = 127;
+
+	if (!link_timer_init)
+	{
+		// One send interval more than the sender needs to detect a lost link
+		g_link_timer.begin((LINK_MAX_UNACKED + 1) * g_lorap2p_settings.send_repeat_time, link_timeout, NULL, false);
+		link_timer_init = true;
+	}
+	g_link_active = true;
+}
+
+/**
+ * @brief Get the SNR the demodulator needs for a spreading factor
+ *
+ * @param sf spreading factor 7 .. 12
+ * @return int16_t SNR limit in 0.1 dB
+ */
+static int16_t link_snr_limit(uint8_t sf)
+{
+	// -7.5 dB at SF7, 2.5 dB less per SF step
+	return -75 - 25 * (sf - 7);
+}
+
+/**
+ * @brief Calculate the link margin of a received packet
+ * The SNR saturates for strong signals, then the RSSI above the
+ * sensitivity is used.
+ *
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @return int8_t margin in dB
+ */
+static int8_t link_margin(int16_t rssi, int8_t snr)
+{
+	int16_t margin = (snr * 10 - link_snr_limit(g_p2p_sf)) / 10;
+	if (snr >= LINK_SNR_SATURATION)
+	{
+		// Sensitivity = -174 dBm + 10 log(BW) + NF + SNR limit
+		int16_t bw_db = 51 + 3 * g_p2p_bw;
+		int16_t sensitivity = -174 + bw_db + LINK_NOISE_FIGURE + link_snr_limit(g_p2p_sf) / 10;
+		if ((rssi - sensitivity) > margin)
+		{
+			margin = rssi - sensitivity;
+		}
+	}
+	if (margin > 127)
+	{
+		margin = 127;
+	}
+	return margin;
+}
+
+/**
+ * @brief Get the TX current of the SX1262 for a TX power
+ * Estimation from the datasheet values, DC-DC mode
+ *
+ * @param tx_power TX power in dBm
+ * @return float current in mA
+ */
+static float link_tx_current_ma(int8_t tx_power)
+{
+	const int8_t power_dbm[] = {LINK_MIN_TX_POWER, 8, 14, 17, 20, 22};
+	const float current_ma[] = {26.0, 35.0, 52.0, 70.0, 95.0, 118.0};
+	const uint8_t points = sizeof(power_dbm);
+
+	if (tx_power <= power_dbm[0])
+	{
+		return current_ma[0];
+	}
+	for (int idx = 1; idx < points; idx++)
+	{
+		if (tx_power <= power_dbm[idx])
+		{
+			return current_ma[idx - 1] + (current_ma[idx] - current_ma[idx - 1]) * (tx_power - power_dbm[idx - 1]) / (power_dbm[idx] - power_dbm[idx - 1]);
+		}
+	}
+	return current_ma[points - 1];
+}
+
+/**
+ * @brief Queue an ACK with the link margin for a received data packet
+ * Called from the LoRa task, the ACK is sent from the loop task
+ *
+ * @param header header of the received packet
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void link_rx_data(s_p2p_header *header, int16_t rssi, int8_t snr)
+{
+	link_restart_timer();
+
+	// Only packets directly from the originator tell something about the link
+	if ((header->dst == P2P_BROADCAST) && (header->ttl != g_lorap2p_settings.relay_max_hops))
+	{
+		return;
+	}
+
+	link_ack_dst = header->src;
+	link_ack.seq = header->seq;
+	link_ack.margin = link_margin(rssi, snr);
+	link_ack.sf = g_p2p_sf;
+	link_ack.bw = g_p2p_bw;
+	link_ack_pending = true;
+}
+
+/**
+ * @brief Step SF, bandwidth and TX power towards the target margin
+ * Like LoRaWAN ADR, first the data rate is increased, then the TX power reduced.
+ * To increase the margin, first the TX power is increased, then the data rate reduced.
+ *
+ * @param margin lowest margin of the last link reports
+ */
+static void link_evaluate(int8_t margin)
+{
+	int8_t target = g_lorap2p_settings.adapt_margin;
+	int8_t hysteresis = g_lorap2p_settings.adapt_hysteresis;
+	uint8_t new_sf = g_p2p_sf;
+	uint8_t new_bw = g_p2p_bw;
+	int8_t new_power = g_p2p_tx_power;
+
+	if (margin > (target + hysteresis))
+	{
+		int8_t steps = (margin - target) / LINK_STEP_DB;
+		while (steps > 0)
+		{
+			if (new_sf > 7)
+			{
+				new_sf--;
+			}
+			else if (new_bw < 2)
+			{
+				new_bw++;
+			}
+			else if (new_power - LINK_STEP_DB >= LINK_MIN_TX_POWER)
+			{
+				new_power -= LINK_STEP_DB;
+			}
+			else
+			{
+				break;
+			}
+			steps--;
+		}
+	}
+	else if (margin < (target - hysteresis))
+	{
+		int8_t steps = (target - margin + LINK_STEP_DB - 1) / LINK_STEP_DB;
+		while (steps > 0)
+		{
+			if (new_power < g_lorap2p_settings.p2p_tx_power)
+			{
+				new_power += LINK_STEP_DB;
+				if (new_power > g_lorap2p_settings.p2p_tx_power)
+				{
+					new_power = g_lorap2p_settings.p2p_tx_power;
+				}
+			}
+			else if (new_bw > 0)
+			{
+				new_bw--;
+			}
+			else if (new_sf < 12)
+			{
+				new_sf++;
+			}
+			else
+			{
+				break;
+			}
+			steps--;
+		}
+	}
+
+	if (new_power != g_p2p_tx_power)
+	{
+		// TX power is our own business
+		MYLOG("LINK", "Margin %d dB, TX power %d => %d dBm", margin, g_p2p_tx_power, new_power);
+		set_p2p_modulation(g_p2p_sf, g_p2p_bw, new_power);
+	}
+	if ((new_sf != g_p2p_sf) || (new_bw != g_p2p_bw))
+	{
+		// SF and bandwidth must be changed on both ends
+		MYLOG("LINK", "Margin %d dB, request SF%d BW%d => SF%d BW%d", margin, g_p2p_sf, g_p2p_bw, new_sf, new_bw);
+		link_cmd.sf = new_sf;
+		link_cmd.bw = new_bw;
+		link_cmd_due = true;
+		link_wake_loop();
+	}
+}
+
+/**
+ * @brief Handle a received link control packet
+ * Called from the LoRa task
+ *
+ * @param header header of the received packet
+ * @param data payload of the packet
+ * @param len length of the payload
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void link_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr)
+{
+	if (header->dst != g_p2p_node_id)
+	{
+		return;
+	}
+
+	if ((header->type == P2P_TYPE_ACK) && (len >= sizeof(s_link_report)))
+	{
+		s_link_report report;
+		memcpy(&report, data, sizeof(s_link_report));
+
+		if (link_peer == P2P_BROADCAST)
+		{
+			MYLOG("LINK", "Adapting link to node %04X", header->src);
+			link_peer = header->src;
+		}
+		if (header->src != link_peer)
+		{
+			return;
+		}
+		link_unacked = 0;
+		link_restart_timer();
+
+		if (link_cmd_pending)
+		{
+			if ((report.sf == link_cmd.sf) && (report.bw == link_cmd.bw))
+			{
+				// Peer confirmed the change and switches after this ACK
+				MYLOG("LINK", "Switching to SF%d BW%d", link_cmd.sf, link_cmd.bw);
+				set_p2p_modulation(link_cmd.sf, link_cmd.bw, g_p2p_tx_power);
+				link_cmd_pending = false;
+				link_reports = 0;
+				link_min_margin = 127;
+				link_restart_timer();
+			}
+			return;
+		}
+
+		if (report.margin < link_min_margin)
+		{
+			link_min_margin = report.margin;
+		}
+		link_reports++;
+		if (link_reports >= LINK_REPORTS)
+		{
+			link_evaluate(link_min_margin);
+			link_reports = 0;
+			link_min_margin = 127;
+		}
+	}
+	else if ((header->type == P2P_TYPE_LINK_CMD) && (len >= sizeof(s_link_cmd)))
+	{
+		s_link_cmd cmd;
+		memcpy(&cmd, data, sizeof(s_link_cmd));
+		if ((cmd.sf < 7) || (cmd.sf > 12) || (cmd.bw > 2))
+		{
+			MYLOG("LINK", "Invalid request SF%d BW%d", cmd.sf, cmd.bw);
+			return;
+		}
+		link_restart_timer();
+
+		// Confirm with the new settings, switch after the ACK is sent
+		link_ack_dst = header->src;
+		link_ack.seq = header->seq;
+		link_ack.margin = link_margin(rssi, snr);
+		link_ack.sf = cmd.sf;
+		link_ack.bw = cmd.bw;
+		link_ack_pending = true;
+		link_switch = cmd;
+		link_switch_pending = true;
+		link_wake_loop();
+	}
+}
+
+/**
+ * @brief Account an own packet and detect a lost link
+ *
+ * @param type frame type of the packet
+ * @param len length of the packet
+ */
+void link_packet_sent(uint8_t type, uint8_t len)
+{
+	float airtime_s = p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), len) / 1000000.0;
+	float rdv_airtime_s = p2p_time_on_air_us(g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_bandwidth, p2p_tx_preamble_len(), len) / 1000000.0;
+	link_airtime_s += airtime_s;
+	link_charge_mc += airtime_s * link_tx_current_ma(g_p2p_tx_power);
+	link_rdv_airtime_s += rdv_airtime_s;
+	link_rdv_charge_mc += rdv_airtime_s * link_tx_current_ma(g_lorap2p_settings.p2p_tx_power);
+
+	if (type != P2P_TYPE_DATA)
+	{
+		return;
+	}
+
+	link_unacked++;
+	if (link_unacked > LINK_MAX_UNACKED)
+	{
+		if (!link_at_rendezvous() || link_cmd_pending || (g_p2p_tx_power != g_lorap2p_settings.p2p_tx_power))
+		{
+			link_fallback();
+		}
+		link_unacked = 0;
+	}
+}
+
+/**
+ * @brief Switch the modulation after the ACK of a LINK_CMD was sent
+ * Called from the LoRa task
+ *
+ */
+void link_tx_done(void)
+{
+	if (link_ack_in_flight)
+	{
+		link_ack_in_flight = false;
+		if (link_switch_pending)
+		{
+			MYLOG("LINK", "Peer requested SF%d BW%d", link_switch.sf, link_switch.bw);
+			set_p2p_modulation(link_switch.sf, link_switch.bw, g_p2p_tx_power);
+			link_switch_pending = false;
+			link_restart_timer();
+		}
+	}
+	if (link_ack_pending || link_cmd_due)
+	{
+		link_wake_loop();
+	}
+}
+
+/**
+ * @brief Send pending link packets and handle the receive timeout
+ * Called from the loop task
+ *
+ */
+void link_process(void)
+{
+	if (link_timer_expired)
+	{
+		link_timer_expired = false;
+		if (!link_at_rendezvous())
+		{
+			link_fallback();
+			restart_rx();
+		}
+	}
+
+	if (link_ack_pending)
+	{
+		if (send_p2p_packet(P2P_TYPE_ACK, link_ack_dst, (uint8_t *)&link_ack, sizeof(s_link_report)))
+		{
+			link_ack_pending = false;
+			link_ack_in_flight = true;
+		}
+		return;
+	}
+
+	if (link_cmd_due && (link_peer != P2P_BROADCAST))
+	{
+		if (send_p2p_packet(P2P_TYPE_LINK_CMD, link_peer, (uint8_t *)&link_cmd, sizeof(s_link_cmd)))
+		{
+			link_cmd_due = false;
+			link_cmd_pending = true;
+		}
+	}
+}
+
+/**
+ * @brief Printout of the link settings and the saved airtime and energy
+ *
+ */
+void link_log_stats(void)
+{
+	MYLOG("LINK", "SF%d BW%d %d dBm, %d packets without ACK", g_p2p_sf, g_p2p_bw, g_p2p_tx_power, link_unacked);
+	MYLOG("LINK", "Airtime %.2f s, %.2f s with SF%d BW%d", link_airtime_s, link_rdv_airtime_s,
+		  g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_bandwidth);
+	MYLOG("LINK", "TX charge %.1f mC, %.1f mC with %d dBm", link_charge_mc, link_rdv_charge_mc, g_lorap2p_settings.p2p_tx_power);
+	if (link_rdv_charge_mc > 0.0)
+	{
+		MYLOG("LINK", "Saved %.0f%% airtime, %.0f%% energy", 100.0 * (1.0 - link_airtime_s / link_rdv_airtime_s),
+			  100.0 * (1.0 - link_charge_mc / link_rdv_charge_mc));
+	}
+}
@@ -34,7 +34,26 @@ void init_settings_characteristic(void)
 
 	lora_data.begin();
 
-	lora_data.write((void *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
+	settings_publish(false);
+}
+
+/**
+ * @brief Update the settings characteristic
+ * The characteristic is open, so the encryption key is replaced by zeros.
+ * A client that writes the settings back with the zeros keeps the key.
+ *
+ * @param notify true to notify the connected devices as well
+ */
+void settings_publish(bool notify)
+{
+	s_lorap2p_settings masked = g_lorap2p_settings;
+	memset(masked.p2p_key, 0, sizeof(masked.p2p_key));
+
+	lora_data.write((void *)&masked, sizeof(s_lorap2p_settings));
+	if (notify)
+	{
+		lora_data.notify((void *)&masked, sizeof(s_lorap2p_settings));
+	}
 }
 
 /**
@@ -57,44 +76,72 @@ void settings_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *da
 	// Check the characteristic
 	if (chr->uuid == lora_data.uuid)
 	{
-		if (len != sizeof(s_lorap2p_settings))
-		{
-			MYLOG("SETT", "Received settings have wrong size %d", len);
-			return;
-		}
-
-		s_lorap2p_settings *rcvdSettings = (s_lorap2p_settings *)data;
-		if ((rcvdSettings->valid_mark_1 != 0xAA) || (rcvdSettings->valid_mark_2 != LORA_P2P_DATA_MARKER))
-		{
-			MYLOG("SETT", "Received settings data do not have required markers");
-			return;
-		}
-
-		// Save new LoRa settings
-		memcpy((void *)&g_lorap2p_settings, data, sizeof(s_lorap2p_settings));
+		apply_settings(data, len);
+	}
+}
 
-		// Save new settings
-		save_settings();
+/**
+ * @brief Check, save and activate new settings
+ * Used for settings from BLE and from the P2P fleet configuration
+ *
+ * @param data new settings
+ * @param len length of the settings
+ * @return true if the settings were accepted
+ * @return false if the settings are invalid
+ */
+bool apply_settings(uint8_t *data, uint16_t len)
+{
+	// Older apps do not know the fields added after resetRequest
+	if ((len < offsetof(s_lorap2p_settings, hop_enable)) || (len > sizeof(s_lorap2p_settings)))
+	{
+		MYLOG("SETT", "Received settings have wrong size %d", len);
+		return false;
+	}
 
-		// Update settings
-		lora_data.write((void *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
+	s_lorap2p_settings *rcvdSettings = (s_lorap2p_settings *)data;
+	if ((rcvdSettings->valid_mark_1 != 0xAA) || (rcvdSettings->valid_mark_2 != LORA_P2P_DATA_MARKER))
+	{
+		MYLOG("SETT", "Received settings data do not have required markers");
+		return false;
+	}
 
-		// Inform connected device about new settings
-		lora_data.notify((void *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
+	// Save new LoRa settings
+	// Older apps send the padded original structure, the padding byte must not end up in hop_enable
+	uint16_t copy_len = len < sizeof(s_lorap2p_settings) ? offsetof(s_lorap2p_settings, hop_enable) : len;
+	uint8_t key[sizeof(g_lorap2p_settings.p2p_key)];
+	memcpy(key, g_lorap2p_settings.p2p_key, sizeof(key));
+	memcpy((void *)&g_lorap2p_settings, data, copy_len);
 
-		if (g_lorap2p_settings.resetRequest)
+	// The key is read as zeros, zeros keep the current key
+	bool key_empty = true;
+	for (int idx = 0; idx < sizeof(key); idx++)
+	{
+		if (g_lorap2p_settings.p2p_key[idx] != 0)
 		{
-			MYLOG("SETT", "Initiate reset");
-			delay(1000);
-			sd_nvic_SystemReset();
+			key_empty = false;
+			break;
 		}
+	}
+	if (key_empty)
+	{
+		memcpy(g_lorap2p_settings.p2p_key, key, sizeof(key));
+	}
 
-		// Notify task about the event
-		if (g_task_sem != NULL)
-		{
-			g_task_event_type = 2;
-			MYLOG("SETT", "Waking up loop task");
-			xSemaphoreGive(g_task_sem);
-		}
+	// Save new settings
+	save_settings();
+
+	// Update settings and inform connected device about new settings
+	settings_publish(true);
+
+	if (g_lorap2p_settings.resetRequest)
+	{
+		MYLOG("SETT", "Initiate reset");
+		delay(1000);
+		sd_nvic_SystemReset();
 	}
+
+	// Notify task about the event
+	MYLOG("SETT", "Waking up loop task");
+	task_event(2);
+	return true;
 }
\ No newline at end of file
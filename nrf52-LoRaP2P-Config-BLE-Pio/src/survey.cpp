@@ -0,0 +1,421 @@
+/**
+ * @file survey.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief RSSI and CAD survey of a frequency range to find a quiet channel
+ * @version 0.1
+ * @date 2021-01-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include "main.h"
+
+/** Maximum number of surveyed channels */
+#define SURVEY_MAX_CHANNELS 32
+/** Time for one RSSI sample in milliseconds */
+#define SURVEY_SAMPLE_TIME 1
+/** Timeout for one CAD in milliseconds */
+#define SURVEY_CAD_TIMEOUT 100
+/** Longest dwell time per channel in milliseconds, the loop task is blocked while a channel is measured */
+#define SURVEY_MAX_DWELL 1000
+/** Delay between two channels in milliseconds */
+#define SURVEY_STEP_TIME 10
+/** Retry time while the radio is busy in milliseconds */
+#define SURVEY_RETRY_TIME 100
+/** Number of retries before the survey gives up on a busy radio */
+#define SURVEY_MAX_RETRIES 50
+
+/** Survey status in the result table */
+#define SURVEY_IDLE 0
+#define SURVEY_RUNNING 1
+#define SURVEY_DONE 2
+#define SURVEY_ERROR 3
+
+/** Flag in the request to write the quietest channel to the settings */
+#define SURVEY_FLAG_APPLY 0x01
+
+/** Survey request, written to the survey characteristic */
+struct s_survey_request
+{
+	// First frequency in Hz
+	uint32_t start_freq;
+	// Last frequency in Hz
+	uint32_t stop_freq;
+	// Step in Hz
+	uint32_t step;
+	// Time per channel in milliseconds, half RSSI sampling, half CAD
+	uint16_t dwell_time;
+	// RSSI above this counts as occupied in dBm
+	int8_t threshold;
+	// SURVEY_FLAG_xxx
+	uint8_t flags;
+} __attribute__((packed));
+
+/** Result for one channel */
+struct s_survey_channel
+{
+	// Average RSSI in dBm
+	int8_t rssi_avg;
+	// Maximum RSSI in dBm
+	int8_t rssi_max;
+	// Percentage of RSSI samples above the threshold
+	uint8_t occupancy;
+	// Percentage of CAD runs that detected LoRa activity
+	uint8_t cad_busy;
+} __attribute__((packed));
+
+/** Result table, read from or notified by the survey characteristic */
+struct s_survey_result
+{
+	// SURVEY_xxx
+	uint8_t status;
+	// Number of channels in the table
+	uint8_t count;
+	// First frequency in Hz
+	uint32_t start_freq;
+	// Step in Hz
+	uint32_t step;
+	// Index of the quietest channel
+	uint8_t best;
+	// Threshold used for the occupancy in dBm
+	int8_t threshold;
+	s_survey_channel channel[SURVEY_MAX_CHANNELS];
+} __attribute__((packed));
+
+/** Survey characteristic 0xF0A2 */
+BLECharacteristic survey_data = BLECharacteristic(0xF0A2);
+
+/** Flag if a survey is running, CAD results go to the survey */
+volatile bool g_survey_active = false;
+
+/** Last request */
+static s_survey_request survey_request;
+/** Result table */
+static s_survey_result survey_result;
+
+/** Flag if a request waits to be started */
+static volatile bool survey_requested = false;
+/** Number of channels to survey */
+static uint8_t survey_count = 0;
+/** Next channel to survey */
+static uint8_t survey_idx = 0;
+/** Number of retries while the radio is busy */
+static uint8_t survey_retries = 0;
+
+/** Timer for the next channel */
+SoftwareTimer g_survey_timer;
+/** Flag if the survey timer was initialized */
+static bool survey_timer_init = false;
+
+/** Result of the last CAD */
+static volatile bool survey_cad_pending = false;
+static volatile bool survey_cad_busy = false;
+
+// Request callback
+void survey_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len);
+
+/**
+ * @brief Get the length of the result table
+ *
+ * @return uint16_t length in bytes
+ */
+static uint16_t survey_result_len(void)
+{
+	return offsetof(s_survey_result, channel) + survey_result.count * sizeof(s_survey_channel);
+}
+
+/**
+ * @brief Initialize the survey characteristic
+ *
+ */
+void init_survey_characteristic(void)
+{
+	survey_data.setProperties(CHR_PROPS_NOTIFY | CHR_PROPS_READ | CHR_PROPS_WRITE);
+	survey_data.setPermission(SECMODE_OPEN, SECMODE_OPEN);
+	survey_data.setMaxLen(sizeof(s_survey_result));
+	survey_data.setWriteCallback(survey_rx_callback);
+
+	survey_data.begin();
+
+	survey_result.status = SURVEY_IDLE;
+	survey_result.count = 0;
+	survey_data.write((void *)&survey_result, survey_result_len());
+}
+
+/**
+ * Callback if a survey request has been sent from the connected client
+ * @param conn_hdl
+ * 		The connection handle
+ * @param chr
+ *      The called characteristic
+ * @param data
+ *      Pointer to received data
+ * @param len
+ *      Length of the received data
+ */
+void survey_rx_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len)
+{
+	if (len != sizeof(s_survey_request))
+	{
+		MYLOG("SURV", "Request has wrong size %d", len);
+		return;
+	}
+	if (g_survey_active || survey_requested)
+	{
+		MYLOG("SURV", "Survey already running");
+		return;
+	}
+	memcpy(&survey_request, data, sizeof(s_survey_request));
+	survey_requested = true;
+	survey_retries = 0;
+
+	// Notify task about the event
+	task_event(8);
+}
+
+/**
+ * @brief Timer event to survey the next channel
+ *
+ * @param unused
+ */
+void survey_timeout(TimerHandle_t unused)
+{
+	task_event(8);
+}
+
+/**
+ * @brief Schedule the next survey step
+ *
+ * @param delay_ms delay in milliseconds
+ */
+static void survey_schedule(uint32_t delay_ms)
+{
+	if (!survey_timer_init)
+	{
+		g_survey_timer.begin(delay_ms, survey_timeout, NULL, false);
+		survey_timer_init = true;
+	}
+	else
+	{
+		g_survey_timer.setPeriod(delay_ms);
+	}
+	g_survey_timer.start();
+}
+
+/**
+ * @brief CAD result during a survey
+ * Called from the LoRa task
+ *
+ * @param busy true if LoRa activity was detected
+ */
+void survey_cad_done(bool busy)
+{
+	survey_cad_busy = busy;
+	survey_cad_pending = false;
+}
+
+/**
+ * @brief Publish the result table
+ *
+ */
+static void survey_publish(void)
+{
+	survey_data.write((void *)&survey_result, survey_result_len());
+	survey_data.notify((void *)&survey_result, survey_result_len());
+}
+
+/**
+ * @brief Measure one channel
+ *
+ * @param freq frequency in Hz
+ * @param result buffer for the result
+ */
+static void survey_channel(uint32_t freq, s_survey_channel *result)
+{
+	uint16_t rssi_time = survey_request.dwell_time / 2;
+	int32_t rssi_sum = 0;
+	int16_t rssi_max = -128;
+	uint16_t samples = 0;
+	uint16_t occupied = 0;
+
+	Radio.Standby();
+	power_set_channel(freq);
+	Radio.Rx(0);
+	delay(SURVEY_SAMPLE_TIME);
+
+	// Instantaneous RSSI
+	uint32_t start = millis();
+	while ((millis() - start) < rssi_time)
+	{
+		int16_t rssi = Radio.Rssi(MODEM_LORA);
+		rssi_sum += rssi;
+		if (rssi > rssi_max)
+		{
+			rssi_max = rssi;
+		}
+		if (rssi > survey_request.threshold)
+		{
+			occupied++;
+		}
+		samples++;
+		delay(SURVEY_SAMPLE_TIME);
+	}
+
+	// LoRa activity with the own modulation
+	uint16_t cad_runs = 0;
+	uint16_t cad_busy = 0;
+	start = millis();
+	while ((millis() - start) < (survey_request.dwell_time - rssi_time))
+	{
+		Radio.Standby();
+		cad_set_params();
+		survey_cad_pending = true;
+		Radio.StartCad();
+		uint32_t cad_start = millis();
+		while (survey_cad_pending && ((millis() - cad_start) < SURVEY_CAD_TIMEOUT))
+		{
+			delay(1);
+		}
+		if (survey_cad_pending)
+		{
+			break;
+		}
+		cad_runs++;
+		if (survey_cad_busy)
+		{
+			cad_busy++;
+		}
+	}
+
+	result->rssi_avg = samples ? rssi_sum / samples : -128;
+	result->rssi_max = rssi_max;
+	result->occupancy = samples ? (occupied * 100) / samples : 0;
+	result->cad_busy = cad_runs ? (cad_busy * 100) / cad_runs : 0;
+}
+
+/**
+ * @brief Start the requested survey
+ *
+ */
+static void survey_start(void)
+{
+	survey_result.status = SURVEY_ERROR;
+	survey_result.count = 0;
+
+	if (!g_lorap2p_initialized || (survey_request.step == 0) || (survey_request.stop_freq < survey_request.start_freq) || (survey_request.start_freq < 150000000) || (survey_request.stop_freq > 960000000) || (survey_request.dwell_time < 2) || (survey_request.dwell_time > SURVEY_MAX_DWELL))
+	{
+		MYLOG("SURV", "Invalid survey request");
+		survey_requested = false;
+		survey_publish();
+		return;
+	}
+
+	// Wait for a running transmission, then keep others out
+	if (g_p2p_tx_busy)
+	{
+		if (survey_retries++ >= SURVEY_MAX_RETRIES)
+		{
+			MYLOG("SURV", "Radio busy");
+			survey_requested = false;
+			survey_publish();
+			return;
+		}
+		survey_schedule(SURVEY_RETRY_TIME);
+		return;
+	}
+	survey_requested = false;
+	g_p2p_tx_busy = true;
+	g_survey_active = true;
+
+	uint32_t count = (survey_request.stop_freq - survey_request.start_freq) / survey_request.step + 1;
+	if (count > SURVEY_MAX_CHANNELS)
+	{
+		count = SURVEY_MAX_CHANNELS;
+	}
+	survey_count = count;
+	survey_idx = 0;
+
+	survey_result.status = SURVEY_RUNNING;
+	survey_result.start_freq = survey_request.start_freq;
+	survey_result.step = survey_request.step;
+	survey_result.threshold = survey_request.threshold;
+	survey_result.best = 0;
+	survey_publish();
+
+	MYLOG("SURV", "Survey of %ld channels from %ld Hz", count, survey_request.start_freq);
+	survey_schedule(SURVEY_STEP_TIME);
+}
+
+/**
+ * @brief Finish the survey and go back to normal operation
+ *
+ */
+static void survey_finish(void)
+{
+	survey_result.status = SURVEY_DONE;
+
+	uint32_t best_freq = survey_request.start_freq + survey_result.best * survey_request.step;
+	MYLOG("SURV", "Quietest channel %ld Hz", best_freq);
+	// Only this node changes its frequency, the other nodes keep theirs
+	if ((survey_request.flags & SURVEY_FLAG_APPLY) && (best_freq != g_lorap2p_settings.p2p_frequency))
+	{
+		MYLOG("SURV", "Switching to %ld Hz", best_freq);
+		g_lorap2p_settings.p2p_frequency = best_freq;
+		save_settings();
+		settings_publish(true);
+	}
+
+	// Back to normal operation
+	Radio.Standby();
+	power_set_channel(g_lorap2p_settings.p2p_frequency);
+	g_survey_active = false;
+	g_p2p_tx_busy = false;
+	restart_rx();
+
+	survey_publish();
+}
+
+/**
+ * @brief Run the survey, one channel per call
+ * Called from the loop task for the request and for every timer
+ * event of the survey. LoRa TX and RX are paused during the survey.
+ *
+ */
+void survey_run(void)
+{
+	if (survey_requested)
+	{
+		survey_start();
+		return;
+	}
+	if (!g_survey_active)
+	{
+		return;
+	}
+
+	uint8_t idx = survey_idx++;
+	s_survey_channel *channel = &survey_result.channel[idx];
+	survey_channel(survey_request.start_freq + idx * survey_request.step, channel);
+	// Nothing is received between the channels
+	Radio.Standby();
+	survey_result.count = idx + 1;
+	MYLOG("SURV", "%ld Hz: avg %d max %d dBm, occupied %d%%, CAD busy %d%%",
+		  survey_request.start_freq + idx * survey_request.step, channel->rssi_avg, channel->rssi_max, channel->occupancy, channel->cad_busy);
+
+	// Quietest channel: least activity, then lowest noise
+	s_survey_channel *best_channel = &survey_result.channel[survey_result.best];
+	uint16_t activity = channel->occupancy + channel->cad_busy;
+	uint16_t best_activity = best_channel->occupancy + best_channel->cad_busy;
+	if ((activity < best_activity) || ((activity == best_activity) && (channel->rssi_avg < best_channel->rssi_avg)))
+	{
+		survey_result.best = idx;
+	}
+
+	if (survey_idx >= survey_count)
+	{
+		survey_finish();
+		return;
+	}
+	survey_schedule(SURVEY_STEP_TIME);
+}
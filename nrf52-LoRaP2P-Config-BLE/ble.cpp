@@ -22,6 +22,8 @@ extern BLEService lorap2p_service;
 
 /** Flag if BLE UART is connected */
 bool ble_uart_is_connected = false;
+/** Handle of the current connection */
+uint16_t ble_conn_handle = BLE_CONN_HANDLE_INVALID;
 
 // Connect callback
 void connect_callback(uint16_t conn_handle);
@@ -92,6 +94,9 @@ void init_ble(void)
   // Initialize the LoRa setting service
   init_settings_characteristic();
 
+  // Initialize the channel survey
+  init_survey_characteristic();
+
   // Advertising packet
   Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE); //
   Bluefruit.Advertising.addService(lorap2p_service);
@@ -119,7 +124,7 @@ void init_ble(void)
 */
 void connect_callback(uint16_t conn_handle)
 {
-  (void)conn_handle;
+  ble_conn_handle = conn_handle;
   ble_uart_is_connected = true;
 }
 
@@ -132,9 +137,29 @@ void disconnect_callback(uint16_t conn_handle, uint8_t reason)
 {
   (void)conn_handle;
   (void)reason;
+  ble_conn_handle = BLE_CONN_HANDLE_INVALID;
   ble_uart_is_connected = false;
 }
 
+/**
+   @brief Get the maximum number of bytes that fit into one notification
+
+   @return uint16_t negotiated ATT MTU - 3
+*/
+uint16_t ble_uart_payload_size(void)
+{
+  if (ble_conn_handle == BLE_CONN_HANDLE_INVALID)
+  {
+    return BLE_GATT_ATT_MTU_DEFAULT - 3;
+  }
+  BLEConnection *connection = Bluefruit.Connection(ble_conn_handle);
+  if (connection == NULL)
+  {
+    return BLE_GATT_ATT_MTU_DEFAULT - 3;
+  }
+  return connection->getMtu() - 3;
+}
+
 /**
    Callback if data has been sent from the connected client
    @param conn_handle
@@ -150,4 +175,49 @@ void bleuart_rx_callback(uint16_t conn_handle)
   uart_rx_buff.toUpperCase();
 
   MYLOG("BLE", "BLE Received %s", uart_rx_buff.c_str());
+
+  // BLOB=<len> sends a test pattern of <len> bytes in fragments
+  if (uart_rx_buff.startsWith("BLOB="))
+  {
+    static uint8_t test_blob[P2P_BLOB_MAX];
+    uint16_t blob_len = uart_rx_buff.substring(5).toInt();
+    if (blob_len > P2P_BLOB_MAX)
+    {
+      blob_len = P2P_BLOB_MAX;
+    }
+    for (int idx = 0; idx < blob_len; idx++)
+    {
+      test_blob[idx] = idx;
+    }
+    send_p2p_blob(P2P_BROADCAST, test_blob, blob_len, true);
+  }
+
+  // CAD or CAD=<node id in hex> calibrates the CAD parameters with the help of a peer
+  if (uart_rx_buff.startsWith("CAD"))
+  {
+    uint16_t peer = P2P_BROADCAST;
+    if (uart_rx_buff.startsWith("CAD="))
+    {
+      peer = strtol(uart_rx_buff.substring(4).c_str(), NULL, 16);
+    }
+    cad_calibrate_request(peer);
+  }
+
+  // BENCH=PING|FLOOD|SWEEP,<count>,<len>,<node id in hex> or BENCH=STOP
+  if (uart_rx_buff.startsWith("BENCH="))
+  {
+    bench_command(uart_rx_buff.substring(6).c_str());
+  }
+
+  // TIME shows the network time and the sync error
+  if (uart_rx_buff.startsWith("TIME"))
+  {
+    timesync_report();
+  }
+
+  // POWER shows the wake up latency and energy per packet of the radio power states
+  if (uart_rx_buff.startsWith("POWER"))
+  {
+    power_report();
+  }
 }
@@ -0,0 +1,544 @@
+/**
+   @file fleet.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Distribute settings to a fleet of LoRa P2P nodes over the air
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+*/
+
+#include "main.h"
+
+/** Payload bytes per fragment */
+#define FLEET_FRAG_SIZE 48
+/** Maximum number of fragments, one bit per fragment in the NACK */
+#define FLEET_MAX_FRAGS 8
+/** Maximum size of a configuration */
+#define FLEET_MAX_BLOB (FLEET_FRAG_SIZE * FLEET_MAX_FRAGS)
+/** Maximum number of repair rounds */
+#define FLEET_MAX_ROUNDS 5
+/** Time window in which receivers send their NACKs in milliseconds */
+#define FLEET_NACK_WINDOW 5000
+/** Time window in which receivers send their ACKs in milliseconds */
+#define FLEET_ACK_WINDOW 30000
+/** Number of acknowledging nodes the master keeps track of */
+#define FLEET_MAX_NODES 128
+/** Differences closer than this are merged into one run */
+#define FLEET_RUN_GAP 2
+/** Time a step may be late before the round is aborted in milliseconds */
+#define FLEET_WATCHDOG_TIME 10000
+
+/** Fragment header, payload of P2P_TYPE_FLEET_FRAG, fragment data follows */
+struct s_fleet_frag
+{
+  uint16_t version;
+  uint8_t idx;
+  uint8_t cnt;
+  uint16_t total_len;
+} __attribute__((packed));
+
+/** Missing fragments, payload of P2P_TYPE_FLEET_NACK */
+struct s_fleet_nack
+{
+  uint16_t version;
+  uint16_t master;
+  uint8_t missing;
+} __attribute__((packed));
+
+/** Applied configuration, payload of P2P_TYPE_FLEET_ACK */
+struct s_fleet_ack
+{
+  uint16_t version;
+} __attribute__((packed));
+
+/** State of the fleet configuration */
+enum fleet_states
+{
+  FLEET_IDLE = 0,
+  FLEET_SENDING,	  // Master sends fragments
+  FLEET_COLLECTING, // Master collects NACKs
+  FLEET_RECEIVING,  // Receiver collects fragments
+  FLEET_ACK_DUE	  // Receiver applied the settings and waits to send the ACK
+};
+static volatile fleet_states fleet_state = FLEET_IDLE;
+
+/** Default settings, the configuration is sent as difference to them */
+static s_lorap2p_settings fleet_defaults;
+
+/** Configuration: version | runs of offset, length, data | signature */
+static uint8_t fleet_blob[FLEET_MAX_BLOB];
+static uint16_t fleet_blob_len = 0;
+static uint16_t fleet_version = 0;
+static uint8_t fleet_frag_cnt = 0;
+
+/** Master: last published version */
+static uint16_t fleet_published = 0;
+/** Master: fragments to send in this round */
+static uint8_t fleet_send_mask = 0;
+/** Master: fragments requested by NACKs */
+static uint8_t fleet_nack_mask = 0;
+/** Master: current round */
+static uint8_t fleet_round = 0;
+/** Master: nodes that acknowledged the configuration */
+static uint16_t fleet_acked[FLEET_MAX_NODES];
+static uint8_t fleet_acked_cnt = 0;
+
+/** Receiver: node ID of the master */
+static uint16_t fleet_master_id = 0;
+/** Receiver: received fragments */
+static uint8_t fleet_rx_mask = 0;
+/** Receiver: fragments other nodes requested already */
+static uint8_t fleet_nack_heard = 0;
+
+/** Timer for fragments, NACKs and ACKs */
+SoftwareTimer g_fleet_timer;
+/** Flag if the fleet timer was initialized */
+static bool fleet_timer_init = false;
+/** Watchdog that aborts a round if its next step does not happen */
+SoftwareTimer g_fleet_watchdog;
+/** Flag if the watchdog expired */
+static volatile bool fleet_watchdog_expired = false;
+
+/**
+   @brief Timer event for the next fleet step
+
+   @param unused
+*/
+void fleet_timeout(TimerHandle_t unused)
+{
+  task_event(7);
+}
+
+/**
+   @brief Watchdog event, the last step is overdue
+
+   @param unused
+*/
+void fleet_watchdog_timeout(TimerHandle_t unused)
+{
+  fleet_watchdog_expired = true;
+  task_event(7);
+}
+
+/**
+   @brief Start the fleet timer
+
+   @param delay_ms time until the next step in milliseconds
+*/
+static void fleet_start_timer(uint32_t delay_ms)
+{
+  if (delay_ms == 0)
+  {
+    delay_ms = 1;
+  }
+  if (!fleet_timer_init)
+  {
+    g_fleet_timer.begin(delay_ms, fleet_timeout, NULL, false);
+    g_fleet_watchdog.begin(delay_ms + FLEET_WATCHDOG_TIME, fleet_watchdog_timeout, NULL, false);
+    fleet_timer_init = true;
+  }
+  else
+  {
+    g_fleet_timer.stop();
+    g_fleet_timer.setPeriod(delay_ms);
+    g_fleet_watchdog.stop();
+    g_fleet_watchdog.setPeriod(delay_ms + FLEET_WATCHDOG_TIME);
+  }
+  fleet_watchdog_expired = false;
+  g_fleet_timer.start();
+  g_fleet_watchdog.start();
+}
+
+/**
+   @brief Get the time between two fragments
+
+   @return uint32_t time in milliseconds
+*/
+static uint32_t fleet_frag_interval(void)
+{
+  uint8_t len = sizeof(s_p2p_header) + sizeof(s_fleet_frag) + FLEET_FRAG_SIZE + P2P_CRYPTO_OVERHEAD;
+  // Time on air plus CAD and processing
+  return p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), len) / 1000 + 100;
+}
+
+/**
+   @brief Check if a settings byte belongs to the node and is not distributed
+
+   @param offset offset in s_lorap2p_settings
+   @return true if the byte is node specific
+*/
+static bool fleet_is_local(uint16_t offset)
+{
+  return (offset == offsetof(s_lorap2p_settings, resetRequest)) || (offset == offsetof(s_lorap2p_settings, fleet_enable)) || (offset == offsetof(s_lorap2p_settings, fleet_master)) || ((offset >= offsetof(s_lorap2p_settings, p2p_key)) && (offset < (offsetof(s_lorap2p_settings, p2p_key) + sizeof(g_lorap2p_settings.p2p_key)))) || ((offset >= offsetof(s_lorap2p_settings, cad_sf)) && (offset <= offsetof(s_lorap2p_settings, cad_det_min))) || (offset == offsetof(s_lorap2p_settings, timesync_master)) || (offset == offsetof(s_lorap2p_settings, tx_only));
+}
+
+/**
+   @brief Start distributing the own settings if config_version changed
+   Called on the master after LoRa init
+
+*/
+void fleet_check_publish(void)
+{
+  if (!g_lorap2p_settings.fleet_master || (g_lorap2p_settings.config_version == 0) || (g_lorap2p_settings.config_version == fleet_published))
+  {
+    return;
+  }
+
+  uint8_t *settings = (uint8_t *)&g_lorap2p_settings;
+  uint8_t *defaults = (uint8_t *)&fleet_defaults;
+  uint16_t len = 0;
+
+  fleet_blob[len++] = g_lorap2p_settings.config_version;
+  fleet_blob[len++] = g_lorap2p_settings.config_version >> 8;
+
+  // Runs of bytes that differ from the defaults
+  uint16_t offset = offsetof(s_lorap2p_settings, p2p_symbol_timeout);
+  while (offset < sizeof(s_lorap2p_settings))
+  {
+    if (fleet_is_local(offset) || (settings[offset] == defaults[offset]))
+    {
+      offset++;
+      continue;
+    }
+    uint16_t run_end = offset + 1;
+    uint16_t last_diff = offset;
+    while ((run_end < sizeof(s_lorap2p_settings)) && ((run_end - last_diff) <= FLEET_RUN_GAP) && !fleet_is_local(run_end))
+    {
+      if (settings[run_end] != defaults[run_end])
+      {
+        last_diff = run_end;
+      }
+      run_end++;
+    }
+    uint8_t run_len = last_diff - offset + 1;
+    if ((len + 2 + run_len + P2P_SIGNATURE_LEN) > FLEET_MAX_BLOB)
+    {
+      MYLOG("FLEET", "Configuration too large");
+      return;
+    }
+    fleet_blob[len++] = offset;
+    fleet_blob[len++] = run_len;
+    memcpy(&fleet_blob[len], &settings[offset], run_len);
+    len += run_len;
+    offset = last_diff + 1;
+  }
+
+  p2p_sign(fleet_blob, len, &fleet_blob[len]);
+  len += P2P_SIGNATURE_LEN;
+
+  fleet_blob_len = len;
+  fleet_version = g_lorap2p_settings.config_version;
+  fleet_frag_cnt = (len + FLEET_FRAG_SIZE - 1) / FLEET_FRAG_SIZE;
+  fleet_published = fleet_version;
+  fleet_send_mask = (1 << fleet_frag_cnt) - 1;
+  fleet_round = 1;
+  fleet_acked_cnt = 0;
+  fleet_state = FLEET_SENDING;
+
+  MYLOG("FLEET", "Publishing version %d, %d bytes in %d fragments", fleet_version, len, fleet_frag_cnt);
+  fleet_start_timer(10);
+}
+
+/**
+   @brief Check the signature and apply a complete configuration
+   Called from the LoRa task
+
+*/
+static void fleet_complete(void)
+{
+  fleet_state = FLEET_IDLE;
+  g_fleet_timer.stop();
+  g_fleet_watchdog.stop();
+
+  if (fleet_blob_len < (2 + P2P_SIGNATURE_LEN))
+  {
+    return;
+  }
+  uint16_t data_len = fleet_blob_len - P2P_SIGNATURE_LEN;
+  uint8_t signature[P2P_SIGNATURE_LEN];
+  p2p_sign(fleet_blob, data_len, signature);
+  if (memcmp(signature, &fleet_blob[data_len], P2P_SIGNATURE_LEN) != 0)
+  {
+    MYLOG("FLEET", "Version %d has an invalid signature", fleet_version);
+    return;
+  }
+
+  // Rebuild the settings from the defaults and the runs
+  s_lorap2p_settings image;
+  uint8_t *image_data = (uint8_t *)&image;
+  memcpy(image_data, &fleet_defaults, sizeof(s_lorap2p_settings));
+  uint16_t idx = 2;
+  while ((idx + 2) <= data_len)
+  {
+    uint8_t offset = fleet_blob[idx++];
+    uint8_t run_len = fleet_blob[idx++];
+    if (((offset + run_len) > sizeof(s_lorap2p_settings)) || ((idx + run_len) > data_len))
+    {
+      MYLOG("FLEET", "Version %d is corrupt", fleet_version);
+      return;
+    }
+    memcpy(&image_data[offset], &fleet_blob[idx], run_len);
+    idx += run_len;
+  }
+  if (image.config_version != fleet_version)
+  {
+    MYLOG("FLEET", "Version mismatch %d %d", image.config_version, fleet_version);
+    return;
+  }
+
+  // Node specific settings stay as they are
+  image.resetRequest = false;
+  image.fleet_enable = g_lorap2p_settings.fleet_enable;
+  image.fleet_master = g_lorap2p_settings.fleet_master;
+  memcpy(image.p2p_key, g_lorap2p_settings.p2p_key, sizeof(image.p2p_key));
+  image.cad_sf = g_lorap2p_settings.cad_sf;
+  image.cad_bw = g_lorap2p_settings.cad_bw;
+  image.cad_symbols = g_lorap2p_settings.cad_symbols;
+  image.cad_det_peak = g_lorap2p_settings.cad_det_peak;
+  image.cad_det_min = g_lorap2p_settings.cad_det_min;
+  image.timesync_master = g_lorap2p_settings.timesync_master;
+  image.tx_only = g_lorap2p_settings.tx_only;
+
+  MYLOG("FLEET", "Applying version %d", fleet_version);
+  if (!apply_settings(image_data, sizeof(s_lorap2p_settings)))
+  {
+    return;
+  }
+
+  // Acknowledge, then restart with the new settings
+  fleet_state = FLEET_ACK_DUE;
+  fleet_start_timer(random(FLEET_ACK_WINDOW));
+}
+
+/**
+   @brief Handle a received fleet packet
+   Called from the LoRa task
+
+   @param header header of the received packet
+   @param data payload of the packet
+   @param len length of the payload
+*/
+void fleet_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len)
+{
+  if ((header->type == P2P_TYPE_FLEET_FRAG) && (len > sizeof(s_fleet_frag)))
+  {
+    if (g_lorap2p_settings.fleet_master || !g_lorap2p_settings.fleet_enable)
+    {
+      return;
+    }
+    s_fleet_frag frag;
+    memcpy(&frag, data, sizeof(s_fleet_frag));
+    if ((frag.version <= g_lorap2p_settings.config_version) || (frag.idx >= frag.cnt) || (frag.cnt > FLEET_MAX_FRAGS) || (frag.total_len > FLEET_MAX_BLOB))
+    {
+      return;
+    }
+
+    if ((fleet_state != FLEET_RECEIVING) || (frag.version != fleet_version) || (header->src != fleet_master_id))
+    {
+      if (fleet_state == FLEET_ACK_DUE)
+      {
+        return;
+      }
+      MYLOG("FLEET", "Receiving version %d from %04X", frag.version, header->src);
+      fleet_state = FLEET_RECEIVING;
+      fleet_version = frag.version;
+      fleet_master_id = header->src;
+      fleet_frag_cnt = frag.cnt;
+      fleet_blob_len = frag.total_len;
+      fleet_rx_mask = 0;
+      fleet_nack_heard = 0;
+      fleet_round = 0;
+    }
+
+    uint16_t frag_len = len - sizeof(s_fleet_frag);
+    uint16_t frag_offset = frag.idx * FLEET_FRAG_SIZE;
+    if (frag_offset >= fleet_blob_len)
+    {
+      return;
+    }
+    if (frag_len > FLEET_FRAG_SIZE)
+    {
+      frag_len = FLEET_FRAG_SIZE;
+    }
+    if ((frag_offset + frag_len) > fleet_blob_len)
+    {
+      frag_len = fleet_blob_len - frag_offset;
+    }
+    memcpy(&fleet_blob[frag_offset], &data[sizeof(s_fleet_frag)], frag_len);
+    fleet_rx_mask |= (1 << frag.idx);
+
+    if (fleet_rx_mask == ((1 << fleet_frag_cnt) - 1))
+    {
+      fleet_complete();
+      return;
+    }
+    // NACK after the remaining fragments of this round, spread over the NACK window
+    fleet_start_timer((fleet_frag_cnt - frag.idx) * fleet_frag_interval() + random(FLEET_NACK_WINDOW));
+  }
+  else if ((header->type == P2P_TYPE_FLEET_NACK) && (len >= sizeof(s_fleet_nack)))
+  {
+    s_fleet_nack nack;
+    memcpy(&nack, data, sizeof(s_fleet_nack));
+    if (g_lorap2p_settings.fleet_master && (nack.master == g_p2p_node_id) && (nack.version == fleet_published))
+    {
+      fleet_nack_mask |= nack.missing;
+    }
+    else if ((fleet_state == FLEET_RECEIVING) && (nack.version == fleet_version))
+    {
+      // Another node asked already, no need to repeat it
+      fleet_nack_heard |= nack.missing;
+    }
+  }
+  else if ((header->type == P2P_TYPE_FLEET_ACK) && (len >= sizeof(s_fleet_ack)))
+  {
+    s_fleet_ack ack;
+    memcpy(&ack, data, sizeof(s_fleet_ack));
+    if (!g_lorap2p_settings.fleet_master || (ack.version != fleet_published))
+    {
+      return;
+    }
+    for (int idx = 0; idx < fleet_acked_cnt; idx++)
+    {
+      if (fleet_acked[idx] == header->src)
+      {
+        return;
+      }
+    }
+    if (fleet_acked_cnt < FLEET_MAX_NODES)
+    {
+      fleet_acked[fleet_acked_cnt++] = header->src;
+    }
+    MYLOG("FLEET", "Node %04X applied version %d, %d nodes", header->src, ack.version, fleet_acked_cnt);
+  }
+}
+
+/**
+   @brief Send a fragment of the configuration
+
+   @param idx fragment index
+   @return true if the fragment was sent
+*/
+static bool fleet_send_frag(uint8_t idx)
+{
+  uint8_t payload[sizeof(s_fleet_frag) + FLEET_FRAG_SIZE];
+  s_fleet_frag frag;
+  frag.version = fleet_version;
+  frag.idx = idx;
+  frag.cnt = fleet_frag_cnt;
+  frag.total_len = fleet_blob_len;
+
+  uint16_t frag_offset = idx * FLEET_FRAG_SIZE;
+  uint16_t frag_len = fleet_blob_len - frag_offset;
+  if (frag_len > FLEET_FRAG_SIZE)
+  {
+    frag_len = FLEET_FRAG_SIZE;
+  }
+  memcpy(payload, &frag, sizeof(s_fleet_frag));
+  memcpy(&payload[sizeof(s_fleet_frag)], &fleet_blob[frag_offset], frag_len);
+  return send_p2p_packet(P2P_TYPE_FLEET_FRAG, P2P_BROADCAST, payload, sizeof(s_fleet_frag) + frag_len);
+}
+
+/**
+   @brief Next step of the fleet configuration
+   Called from the loop task after the fleet timer expired
+
+*/
+void fleet_process(void)
+{
+  if (fleet_watchdog_expired)
+  {
+    fleet_watchdog_expired = false;
+    if (fleet_state != FLEET_IDLE)
+    {
+      MYLOG("FLEET", "Step %d of version %d overdue, round aborted", fleet_state, fleet_version);
+      g_fleet_timer.stop();
+      fleet_state = FLEET_IDLE;
+    }
+    return;
+  }
+
+  switch (fleet_state)
+  {
+    case FLEET_SENDING:
+      for (uint8_t idx = 0; idx < fleet_frag_cnt; idx++)
+      {
+        if (fleet_send_mask & (1 << idx))
+        {
+          if (fleet_send_frag(idx))
+          {
+            fleet_send_mask &= ~(1 << idx);
+          }
+          break;
+        }
+      }
+      if (fleet_send_mask == 0)
+      {
+        fleet_nack_mask = 0;
+        fleet_state = FLEET_COLLECTING;
+        fleet_start_timer(fleet_frag_interval() * fleet_frag_cnt + FLEET_NACK_WINDOW);
+      }
+      else
+      {
+        fleet_start_timer(fleet_frag_interval());
+      }
+      break;
+    case FLEET_COLLECTING:
+      if ((fleet_nack_mask != 0) && (fleet_round < FLEET_MAX_ROUNDS))
+      {
+        fleet_round++;
+        MYLOG("FLEET", "Round %d, repeating fragments %02X", fleet_round, fleet_nack_mask);
+        fleet_send_mask = fleet_nack_mask;
+        fleet_state = FLEET_SENDING;
+        fleet_start_timer(10);
+      }
+      else
+      {
+        MYLOG("FLEET", "Version %d sent in %d rounds, %d nodes acknowledged so far", fleet_version, fleet_round, fleet_acked_cnt);
+        fleet_state = FLEET_IDLE;
+      }
+      break;
+    case FLEET_RECEIVING:
+    {
+      uint8_t missing = ((1 << fleet_frag_cnt) - 1) & ~fleet_rx_mask;
+      if (fleet_round >= FLEET_MAX_ROUNDS)
+      {
+        MYLOG("FLEET", "Giving up version %d, fragments %02X missing", fleet_version, missing);
+        fleet_state = FLEET_IDLE;
+        break;
+      }
+      fleet_round++;
+      if ((missing & ~fleet_nack_heard) != 0)
+      {
+        s_fleet_nack nack;
+        nack.version = fleet_version;
+        nack.master = fleet_master_id;
+        nack.missing = missing;
+        MYLOG("FLEET", "NACK fragments %02X", missing);
+        send_p2p_packet(P2P_TYPE_FLEET_NACK, P2P_BROADCAST, (uint8_t *)&nack, sizeof(s_fleet_nack));
+      }
+      fleet_nack_heard = 0;
+      // Wait for the repair round
+      fleet_start_timer(fleet_frag_interval() * fleet_frag_cnt * 2 + FLEET_NACK_WINDOW + random(FLEET_NACK_WINDOW));
+      break;
+    }
+    case FLEET_ACK_DUE:
+    {
+      s_fleet_ack ack;
+      ack.version = fleet_version;
+      if (!send_p2p_packet(P2P_TYPE_FLEET_ACK, fleet_master_id, (uint8_t *)&ack, sizeof(s_fleet_ack)))
+      {
+        fleet_start_timer(fleet_frag_interval());
+        break;
+      }
+      // Restart with the new settings after the ACK is sent
+      delay(fleet_frag_interval() + 500);
+      MYLOG("FLEET", "Restart with version %d", fleet_version);
+      sd_nvic_SystemReset();
+      break;
+    }
+    default:
+      break;
+  }
+}
@@ -42,6 +42,40 @@ uint8_t g_tx_data_len = 0;
 /** Flag if LoRa is initialized and started */
 bool g_lorap2p_initialized = false;
 
+/** Packet counter, drives the hop sequence */
+uint16_t g_p2p_packet_cnt = 0;
+/** Sequence number of own packets */
+uint16_t g_p2p_seq = 0;
+/** Node ID, lower 16 bit of the device address */
+uint16_t g_p2p_node_id = 0;
+/** Flag if a packet is in CAD or TX */
+volatile bool g_p2p_tx_busy = false;
+/** Number of finished transmissions */
+volatile uint32_t g_p2p_tx_count = 0;
+
+/** Spreading factor in use, can differ from p2p_sf with link adaptation */
+uint8_t g_p2p_sf = 7;
+/** Bandwidth in use, can differ from p2p_bandwidth with link adaptation */
+uint8_t g_p2p_bw = 0;
+/** TX power in use, can differ from p2p_tx_power with link adaptation */
+int8_t g_p2p_tx_power = 22;
+/** Coding rate in use, can differ from p2p_cr during a benchmark */
+uint8_t g_p2p_cr = 1;
+
+/** Long preamble is this factor times p2p_preamble_len */
+#define P2P_LONG_PREAMBLE_FACTOR 8
+/** Symbols the receiver needs to detect a preamble */
+#define P2P_DC_DETECT_SYMBOLS 2
+/** Wakeup and settling time of the SX126x in microseconds */
+#define P2P_DC_WAKEUP_US 1000
+
+/** RX window for the duty cycle in 15.625 us steps */
+static uint32_t dc_rx_ticks = 0;
+/** Sleep time for the duty cycle in 15.625 us steps */
+static uint32_t dc_sleep_ticks = 0;
+/** Flag if the RX duty cycle is used with the current modulation */
+static bool dc_active = false;
+
 /**************************************************************/
 /* LoRa properties                                            */
 /**************************************************************/
@@ -53,6 +87,7 @@ void on_tx_timeout(void);
 void on_rx_timeout(void);
 void on_rx_crc_error(void);
 void on_cad_done(bool cadResult);
+void init_rx_duty_cycle(void);
 
 /**
    @brief SX126x interrupt handler
@@ -62,6 +97,8 @@ void on_cad_done(bool cadResult);
 */
 void lora_interrupt_handler(void)
 {
+  // Timestamp for the network time
+  g_lora_irq_us = micros();
   // SX126x set IRQ
   if (lora_sem != NULL)
   {
@@ -80,6 +117,9 @@ void lora_interrupt_handler(void)
 */
 int8_t init_lora(void)
 {
+  g_p2p_node_id = (uint16_t)(*((uint32_t *)(0x100000a4)));
+  MYLOG("LORA", "Node ID %04X", g_p2p_node_id);
+
   // Create the LoRa event semaphore
   lora_sem = xSemaphoreCreateBinary();
   // Initialize semaphore
@@ -106,19 +146,31 @@ int8_t init_lora(void)
 
   Radio.Init(&RadioEvents);
 
-  Radio.Sleep(); // Radio.Standby();
+  // Configuration follows immediately
+  power_idle(0);
 
-  Radio.SetChannel(g_lorap2p_settings.p2p_frequency);
+  if (g_lorap2p_settings.hop_enable)
+  {
+    init_hopping();
+  }
 
-  Radio.SetTxConfig(MODEM_LORA, g_lorap2p_settings.p2p_tx_power, 0, g_lorap2p_settings.p2p_bandwidth,
-                    g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_cr,
-                    g_lorap2p_settings.p2p_preamble_len, false,
-                    true, 0, 0, false, 5000);
+  // Fleet configurations are signed with the P2P key
+  if (g_lorap2p_settings.encrypt_enable || g_lorap2p_settings.fleet_enable || g_lorap2p_settings.fleet_master)
+  {
+    init_crypto();
+  }
 
-  Radio.SetRxConfig(MODEM_LORA, g_lorap2p_settings.p2p_bandwidth, g_lorap2p_settings.p2p_sf,
-                    g_lorap2p_settings.p2p_cr, 0, g_lorap2p_settings.p2p_preamble_len,
-                    g_lorap2p_settings.p2p_symbol_timeout, false,
-                    0, true, 0, 0, false, true);
+  power_set_channel(g_lorap2p_settings.p2p_frequency);
+
+  g_p2p_cr = g_lorap2p_settings.p2p_cr;
+  set_p2p_modulation(g_lorap2p_settings.p2p_sf, g_lorap2p_settings.p2p_bandwidth, g_lorap2p_settings.p2p_tx_power);
+
+  if (g_lorap2p_settings.adapt_enable)
+  {
+    init_link();
+  }
+
+  init_timesync();
 
   // In deep sleep we need to hijack the SX126x IRQ to trigger a wakeup of the nRF52
   attachInterrupt(PIN_LORA_DIO_1, lora_interrupt_handler, RISING);
@@ -135,14 +187,35 @@ int8_t init_lora(void)
   g_task_wakeup_timer.begin(g_lorap2p_settings.send_repeat_time, periodic_wakeup);
   g_task_wakeup_timer.start();
 
-  Radio.Rx(0);
+  restart_rx();
 
   digitalWrite(LED_BUILTIN, LOW);
 
   g_lorap2p_initialized = true;
+
+  fleet_check_publish();
   return 0;
 }
 
+/**
+   @brief Configure the radio again after a cold sleep
+   Radio.Init() takes the TX and RX timeout timers from the fixed timer
+   pool of the library on every call and would run out of timers after
+   a few wake ups. Radio.ReInit() wakes the SX126x and sets up TCXO, RF
+   switch, regulator and interrupts without touching the timers.
+   Channel and modulation are written again from the settings in use,
+   power_wake() has invalidated the register shadow before.
+
+*/
+void p2p_radio_restore(void)
+{
+  Radio.ReInit(&RadioEvents);
+  // Radio.ReInit() attaches the library IRQ handler again
+  attachInterrupt(PIN_LORA_DIO_1, lora_interrupt_handler, RISING);
+  power_set_channel(g_lorap2p_settings.p2p_frequency);
+  set_p2p_modulation(g_p2p_sf, g_p2p_bw, g_p2p_tx_power);
+}
+
 /**
    @brief Independent task to handle LoRa events
 
@@ -166,6 +239,159 @@ void lora_task(void *pvParameters)
   }
 }
 
+/**
+   @brief Get the LoRa symbol time
+
+   @param sf spreading factor 7 .. 12
+   @param bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+   @return uint32_t symbol time in microseconds
+*/
+uint32_t p2p_symbol_time_us(uint8_t sf, uint8_t bandwidth)
+{
+  uint32_t bw_khz = 125 << bandwidth;
+  return ((1UL << sf) * 1000UL) / bw_khz;
+}
+
+/**
+   @brief Get the time on air of a packet
+   Explicit header and CRC on, see SX1262 datasheet chapter 6.1.4
+
+   @param sf spreading factor 7 .. 12
+   @param bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+   @param preamble_len preamble length in symbols
+   @param len packet length
+   @return uint32_t time on air in microseconds
+*/
+uint32_t p2p_time_on_air_us(uint8_t sf, uint8_t bandwidth, uint16_t preamble_len, uint8_t len)
+{
+  uint32_t symbol_us = p2p_symbol_time_us(sf, bandwidth);
+  // Low data rate optimization for symbols longer than 16 ms
+  int32_t low_dr = symbol_us >= 16000 ? 1 : 0;
+  int32_t numerator = 8 * len - 4 * sf + 28 + 16;
+  int32_t denominator = 4 * (sf - 2 * low_dr);
+  uint32_t payload_symbols = 8;
+  if (numerator > 0)
+  {
+    payload_symbols += ((numerator + denominator - 1) / denominator) * (g_p2p_cr + 4);
+  }
+  return ((preamble_len * 4 + 17) * symbol_us) / 4 + payload_symbols * symbol_us;
+}
+
+/**
+   @brief Set the modulation parameters for TX and RX
+
+   @param sf spreading factor 7 .. 12
+   @param bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz
+   @param tx_power TX power in dBm
+*/
+void set_p2p_modulation(uint8_t sf, uint8_t bandwidth, int8_t tx_power)
+{
+  g_p2p_sf = sf;
+  g_p2p_bw = bandwidth;
+  g_p2p_tx_power = tx_power;
+
+  if (!power_modulation_changed(g_p2p_sf, g_p2p_bw, g_p2p_cr, g_p2p_tx_power, p2p_tx_preamble_len()))
+  {
+    return;
+  }
+
+  Radio.SetTxConfig(MODEM_LORA, g_p2p_tx_power, 0, g_p2p_bw,
+                    g_p2p_sf, g_p2p_cr,
+                    p2p_tx_preamble_len(), false,
+                    true, 0, 0, false, 5000);
+
+  Radio.SetRxConfig(MODEM_LORA, g_p2p_bw, g_p2p_sf,
+                    g_p2p_cr, 0, g_lorap2p_settings.p2p_preamble_len,
+                    g_lorap2p_settings.p2p_symbol_timeout, false,
+                    0, true, 0, 0, false, true);
+
+  dc_active = false;
+  if (g_lorap2p_settings.rx_duty_cycle)
+  {
+    init_rx_duty_cycle();
+  }
+}
+
+/**
+   @brief Get the preamble length used for sending
+
+   @return uint16_t preamble length in symbols
+*/
+uint16_t p2p_tx_preamble_len(void)
+{
+  if (g_lorap2p_settings.long_preamble)
+  {
+    return g_lorap2p_settings.p2p_preamble_len * P2P_LONG_PREAMBLE_FACTOR;
+  }
+  return g_lorap2p_settings.p2p_preamble_len;
+}
+
+/**
+   @brief Calculate the RX duty cycle timing
+   Senders use a preamble of P2P_LONG_PREAMBLE_FACTOR * p2p_preamble_len symbols.
+   The receiver wakes up often enough to catch the preamble while
+   p2p_preamble_len symbols are still left to lock on the packet.
+
+*/
+void init_rx_duty_cycle(void)
+{
+  uint32_t symbol_us = p2p_symbol_time_us(g_p2p_sf, g_p2p_bw);
+  uint32_t long_preamble = g_lorap2p_settings.p2p_preamble_len * P2P_LONG_PREAMBLE_FACTOR;
+
+  uint32_t rx_us = P2P_DC_DETECT_SYMBOLS * symbol_us + P2P_DC_WAKEUP_US;
+  uint32_t sleep_us = (long_preamble - g_lorap2p_settings.p2p_preamble_len) * symbol_us;
+  if (sleep_us <= rx_us)
+  {
+    MYLOG("LORA", "Preamble too short for RX duty cycle, using continuous RX");
+    return;
+  }
+  sleep_us -= rx_us;
+
+  // SX126x timer steps are 15.625 us
+  dc_rx_ticks = (rx_us * 64) / 1000;
+  dc_sleep_ticks = (sleep_us * 64) / 1000;
+  dc_active = true;
+
+  // Average current estimation
+  float avg_ua = ((float)rx_us * P2P_RX_CURRENT_UA + (float)sleep_us * P2P_SLEEP_CURRENT_UA) / (float)(rx_us + sleep_us);
+  MYLOG("LORA", "RX duty cycle: RX %ld us, sleep %ld us", rx_us, sleep_us);
+  MYLOG("LORA", "Average RX current %.1f uA instead of %d uA", avg_ua, P2P_RX_CURRENT_UA);
+  // Cost of the long preamble for the sender
+  float tx_extra_uc = (float)(long_preamble - g_lorap2p_settings.p2p_preamble_len) * symbol_us * P2P_TX_CURRENT_UA / 1000000.0;
+  MYLOG("LORA", "Long preamble costs the sender %.1f uC per packet", tx_extra_uc);
+}
+
+/**
+   @brief Put the radio back into receive mode
+   With frequency hopping enabled the radio is tuned to the
+   channel where the next packet is expected.
+   Nodes with tx_only set put the radio to sleep instead.
+
+*/
+void restart_rx(void)
+{
+  if (g_lorap2p_settings.tx_only)
+  {
+    // Nothing to receive, sleep until the next packet
+    power_idle(power_next_op_ms());
+    return;
+  }
+  power_listen();
+  if (g_hop_active)
+  {
+    Radio.Standby();
+    power_set_channel(hop_rx_frequency());
+  }
+  if (dc_active)
+  {
+    Radio.SetRxDutyCycle(dc_rx_ticks, dc_sleep_ticks);
+  }
+  else
+  {
+    Radio.Rx(0);
+  }
+}
+
 /**************************************************************/
 /* LoRa callbacks                                             */
 /**************************************************************/
@@ -175,31 +401,156 @@ void lora_task(void *pvParameters)
 void on_tx_done(void)
 {
   MYLOG("LORA", "OnTxDone");
+  uint32_t irq_us = g_lora_irq_us;
+  g_p2p_tx_busy = false;
+  g_p2p_tx_count++;
+  power_tx_done(irq_us);
+  s_p2p_header *header = (s_p2p_header *)g_tx_lora_data;
+  if ((header->marker == LORA_P2P_FRAME_MARKER) && ((header->type & ~P2P_FLAG_ENCRYPTED) == P2P_TYPE_TIME))
+  {
+    timesync_tx_done(header, irq_us);
+  }
   // Send LoRa handler back to sleep
   xSemaphoreTake(lora_sem, 10);
-  Radio.Rx(0);
+  if (g_link_active)
+  {
+    link_tx_done();
+  }
+  restart_rx();
 }
 
 /**@brief Function to be executed on Radio Rx Done event
 */
 void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 {
+  uint32_t irq_us = g_lora_irq_us;
   MYLOG("LORA", "OnRxDone");
 
   delay(10);
 
+  // Handle the header of framed packets
+  if ((size >= sizeof(s_p2p_header)) && (payload[0] == LORA_P2P_FRAME_MARKER))
+  {
+    s_p2p_header *header = (s_p2p_header *)payload;
+    if (g_hop_active)
+    {
+      hop_rx_done(header);
+    }
+
+    if (relay_is_duplicate(header))
+    {
+      restart_rx();
+      return;
+    }
+
+    if (g_lorap2p_settings.relay_enable && (header->dst != g_p2p_node_id))
+    {
+      relay_schedule(payload, size, rssi);
+    }
+
+    bool for_us = (header->dst == g_p2p_node_id) || (header->dst == P2P_BROADCAST);
+    if (!for_us && !g_lorap2p_settings.gateway_enable)
+    {
+      // Not for us
+      restart_rx();
+      return;
+    }
+
+    if (g_lorap2p_settings.encrypt_enable)
+    {
+      int16_t plain_len = p2p_decrypt_frame(payload, size);
+      if (plain_len < 0)
+      {
+        restart_rx();
+        return;
+      }
+      size = plain_len;
+    }
+
+    if (g_lorap2p_settings.gateway_enable)
+    {
+      // Only packets that passed the MIC check are forwarded
+      gateway_queue(payload, size, rssi, snr, g_lorap2p_settings.encrypt_enable);
+    }
+
+    if (!for_us)
+    {
+      restart_rx();
+      return;
+    }
+
+    if ((header->type >= P2P_TYPE_FLEET_FRAG) && (header->type <= P2P_TYPE_FLEET_ACK))
+    {
+      fleet_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header));
+      restart_rx();
+      return;
+    }
+
+    if (header->type == P2P_TYPE_FRAG)
+    {
+      frag_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header));
+      restart_rx();
+      return;
+    }
+
+    if (header->type == P2P_TYPE_CAD_PROBE)
+    {
+      cad_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header));
+      restart_rx();
+      return;
+    }
+
+    if (header->type == P2P_TYPE_TIME)
+    {
+      timesync_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header), irq_us);
+      restart_rx();
+      return;
+    }
+
+    if (header->type == P2P_TYPE_BENCH)
+    {
+      bench_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header), rssi, snr);
+      restart_rx();
+      return;
+    }
+
+    if (g_link_active)
+    {
+      if (header->type != P2P_TYPE_DATA)
+      {
+        // Link control packets are handled by the link adaptation
+        link_rx_frame(header, &payload[sizeof(s_p2p_header)], size - sizeof(s_p2p_header), rssi, snr);
+        restart_rx();
+        return;
+      }
+      link_rx_data(header, rssi, snr);
+    }
+
+    payload += sizeof(s_p2p_header);
+    size -= sizeof(s_p2p_header);
+  }
+  else
+  {
+    if (g_lorap2p_settings.encrypt_enable)
+    {
+      // Unframed packets can not be authenticated
+      restart_rx();
+      return;
+    }
+    if (g_lorap2p_settings.gateway_enable)
+    {
+      gateway_queue(payload, size, rssi, snr, false);
+    }
+  }
+
   // Copy the data into loop data buffer
   memcpy(g_rx_lora_data, payload, size);
   g_rx_data_len = size;
-  g_task_event_type = 0;
   // Notify task about the event
-  if (g_task_sem != NULL)
-  {
-    MYLOG("LORA", "Waking up loop task");
-    xSemaphoreGive(g_task_sem);
-  }
+  MYLOG("LORA", "Waking up loop task");
+  task_event(0);
 
-  Radio.Rx(0);
+  restart_rx();
 }
 
 /**@brief Function to be executed on Radio Tx Timeout event
@@ -207,8 +558,9 @@ void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 void on_tx_timeout(void)
 {
   MYLOG("LORA", "OnTxTimeout");
+  g_p2p_tx_busy = false;
 
-  Radio.Rx(0);
+  restart_rx();
 }
 
 /**@brief Function to be executed on Radio Rx Timeout event
@@ -217,46 +569,58 @@ void on_rx_timeout(void)
 {
   MYLOG("LORA", "OnRxTimeout");
 
-  Radio.Rx(0);
+  restart_rx();
 }
 
 /**@brief Function to be executed on Radio Rx Error event
 */
 void on_rx_crc_error(void)
 {
-  Radio.Rx(0);
+  if (g_hop_active)
+  {
+    hop_rx_error();
+  }
+  restart_rx();
 }
 
 /**@brief Function to be executed on Radio Rx Error event
 */
 void on_cad_done(bool cadResult)
 {
+  if (g_survey_active)
+  {
+    survey_cad_done(cadResult);
+    return;
+  }
+  if (g_cad_calibrating)
+  {
+    cad_calibration_done(cadResult);
+    return;
+  }
+  if (g_hop_active)
+  {
+    hop_cad_result(cadResult);
+  }
   if (cadResult)
   {
-    Radio.Rx(0);
+    g_p2p_tx_busy = false;
+    restart_rx();
   }
   else
   {
+    power_tx_start();
     Radio.Send(g_tx_lora_data, g_tx_data_len);
   }
 }
 
 /**
-   @brief Prepare packet to be sent and start CAD routine
+   @brief Start the CAD routine for the packet in g_tx_lora_data
 
 */
-void send_lora_packet(void)
+static void start_p2p_cad(void)
 {
-  g_tx_data_len = 0;
-  g_tx_lora_data[g_tx_data_len++] = 'H';
-  g_tx_lora_data[g_tx_data_len++] = 'e';
-  g_tx_lora_data[g_tx_data_len++] = 'l';
-  g_tx_lora_data[g_tx_data_len++] = 'l';
-  g_tx_lora_data[g_tx_data_len++] = 'o';
-
-  // Prepare LoRa CAD
-  Radio.Sleep();
-  Radio.SetCadParams(LORA_CAD_08_SYMBOL, g_lorap2p_settings.p2p_sf + 13, 10, LORA_CAD_ONLY, 0);
+  // Prepare LoRa CAD, only changed registers are written
+  cad_set_params();
 
   // Switch on Indicator lights
   digitalWrite(LED_BUILTIN, HIGH);
@@ -264,3 +628,133 @@ void send_lora_packet(void)
   // Start CAD
   Radio.StartCad();
 }
+
+/**
+   @brief Send a framed packet
+   Sets the hop fields of the header and starts the CAD routine.
+   The packet is copied, the buffer can be reused after the call.
+
+   @param frame packet including the header
+   @param len length of the packet
+   @return true if CAD was started
+   @return false if the radio is busy with another packet
+*/
+bool send_p2p_frame(uint8_t *frame, uint8_t len)
+{
+  if (g_p2p_tx_busy)
+  {
+    MYLOG("LORA", "Radio busy, packet not sent");
+    return false;
+  }
+  g_p2p_tx_busy = true;
+
+  memcpy(g_tx_lora_data, frame, len);
+  g_tx_data_len = len;
+
+  s_p2p_header *header = (s_p2p_header *)g_tx_lora_data;
+  header->hop_cnt = g_p2p_packet_cnt++;
+
+  power_wake();
+  if (g_hop_active)
+  {
+    power_set_channel(hop_tx_frequency(header->hop_cnt));
+    header->hop_mask = hop_blacklist();
+  }
+  start_p2p_cad();
+  return true;
+}
+
+/**
+   @brief Send a packet without header and start the CAD routine
+   Receivers with firmware older than the P2P header get the
+   same packets as before.
+
+   @param data packet
+   @param len length of the packet
+   @return true if CAD was started
+   @return false if the radio is busy with another packet
+*/
+bool send_p2p_raw(uint8_t *data, uint8_t len)
+{
+  if (g_p2p_tx_busy)
+  {
+    MYLOG("LORA", "Radio busy, packet not sent");
+    return false;
+  }
+  g_p2p_tx_busy = true;
+
+  memcpy(g_tx_lora_data, data, len);
+  g_tx_data_len = len;
+
+  power_wake();
+  start_p2p_cad();
+  return true;
+}
+
+/**
+   @brief Build an own packet and start the CAD routine
+   Adds the header and encrypts the packet if enabled
+
+   @param type frame type P2P_TYPE_xxx
+   @param dst node ID of the destination, P2P_BROADCAST for all nodes
+   @param data payload
+   @param len length of the payload
+   @return true if CAD was started
+   @return false if the radio is busy or the payload is too long
+*/
+bool send_p2p_packet(uint8_t type, uint16_t dst, uint8_t *data, uint8_t len)
+{
+  uint8_t frame[256];
+
+  // frame_len is uint8_t, a LoRa packet can not be longer than 255 bytes
+  if ((sizeof(s_p2p_header) + len + P2P_CRYPTO_OVERHEAD) > 255)
+  {
+    MYLOG("LORA", "Payload too long");
+    return false;
+  }
+
+  s_p2p_header header;
+  header.type = type;
+  header.src = g_p2p_node_id;
+  header.dst = dst;
+  header.seq = g_p2p_seq++;
+  header.ttl = g_lorap2p_settings.relay_max_hops;
+
+  memcpy(frame, &header, sizeof(s_p2p_header));
+  memcpy(&frame[sizeof(s_p2p_header)], data, len);
+  uint8_t frame_len = sizeof(s_p2p_header) + len;
+
+  if (g_lorap2p_settings.encrypt_enable)
+  {
+    frame_len = p2p_encrypt_frame(frame, frame_len);
+  }
+
+  if (!send_p2p_frame(frame, frame_len))
+  {
+    return false;
+  }
+  if (g_link_active)
+  {
+    link_packet_sent(type, frame_len);
+  }
+  return true;
+}
+
+/**
+   @brief Prepare packet to be sent and start CAD routine
+
+*/
+void send_lora_packet(void)
+{
+  uint8_t data[] = {'H', 'e', 'l', 'l', 'o'};
+
+  // Hopping, relaying, encryption and link adaptation need the header
+  if (g_hop_active || g_lorap2p_settings.relay_enable || g_lorap2p_settings.encrypt_enable || g_link_active)
+  {
+    send_p2p_packet(P2P_TYPE_DATA, P2P_BROADCAST, data, sizeof(data));
+  }
+  else
+  {
+    send_p2p_raw(data, sizeof(data));
+  }
+}
@@ -34,17 +34,20 @@
 
 // Main loop stuff
 void periodic_wakeup(TimerHandle_t unused);
-extern SemaphoreHandle_t g_task_sem;
-extern uint8_t g_task_event_type;
+void task_event(uint8_t event);
 extern SoftwareTimer g_task_wakeup_timer;
 
 // BLE
 #include <bluefruit.h>
 void init_ble(void);
 void init_settings_characteristic(void);
+bool apply_settings(uint8_t *data, uint16_t len);
+void settings_publish(bool notify);
+void init_survey_characteristic(void);
 extern BLECharacteristic lora_data;
 extern BLEUart ble_uart;
 extern bool ble_uart_is_connected;
+uint16_t ble_uart_payload_size(void);
 
 // LoRa
 #include <SX126x-RAK4630.h>
@@ -80,16 +83,236 @@ struct s_lorap2p_settings
   bool auto_join = false;
   // Command from BLE to reset device
   bool resetRequest = true;
+  // Flag to enable frequency hopping over hop_channels
+  bool hop_enable = false;
+  // Number of valid entries in hop_channels 2 .. 8
+  uint8_t hop_num_channels = 0;
+  // Seed for the hop sequence, must be the same on all nodes
+  uint16_t hop_seed = 0x4C52;
+  // Hop channel list, frequencies in Hz
+  uint32_t hop_channels[8] = {923200000, 923400000, 923600000, 923800000, 924000000, 924200000, 924400000, 924600000};
+  // Flag to enable relaying of packets for other nodes
+  bool relay_enable = false;
+  // Hop limit for own packets, 0 => packets are not relayed
+  uint8_t relay_max_hops = 3;
+  // Flag to stream all received packets to BLE UART
+  bool gateway_enable = false;
+  // Flag to use the SX126x RX duty cycle instead of continuous receive
+  bool rx_duty_cycle = false;
+  // Flag to send with a long preamble to wake up duty cycled receivers
+  bool long_preamble = false;
+  // Flag to encrypt and authenticate P2P packets
+  bool encrypt_enable = false;
+  // AES-128 key for encryption and authentication
+  uint8_t p2p_key[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+  // Flag to adapt SF, bandwidth and TX power to the link quality
+  bool adapt_enable = false;
+  // Target link margin in dB
+  int8_t adapt_margin = 10;
+  // Hysteresis around the target link margin in dB
+  uint8_t adapt_hysteresis = 3;
+  // Flag to accept settings from the P2P fleet configuration
+  bool fleet_enable = false;
+  // Flag to distribute the own settings to the fleet
+  bool fleet_master = false;
+  // Version of the settings, the fleet only accepts newer versions
+  uint16_t config_version = 0;
+  // SF the CAD parameters were calibrated for, 0 => not calibrated
+  uint8_t cad_sf = 0;
+  // Bandwidth the CAD parameters were calibrated for
+  uint8_t cad_bw = 0;
+  // Calibrated CAD symbol count, LORA_CAD_xx_SYMBOL
+  uint8_t cad_symbols = LORA_CAD_04_SYMBOL;
+  // Calibrated CAD detection peak
+  uint8_t cad_det_peak = 21;
+  // Calibrated CAD detection minimum
+  uint8_t cad_det_min = 10;
+  // Flag to send time beacons for the other nodes
+  bool timesync_master = false;
+  // Time beacon interval in seconds 10 .. 3600
+  uint16_t timesync_interval = 60;
+  // Flag to only send, the radio sleeps between the packets
+  bool tx_only = false;
+  // Radio idle state 0: auto, 1: standby, 2: warm sleep, 3: cold sleep
+  uint8_t power_policy = 0;
 };
 
+// P2P frame
+#define LORA_P2P_FRAME_MARKER 0x5A
+#define P2P_TYPE_DATA 0x01
+#define P2P_TYPE_ACK 0x02
+#define P2P_TYPE_LINK_CMD 0x03
+#define P2P_TYPE_FLEET_FRAG 0x04
+#define P2P_TYPE_FLEET_NACK 0x05
+#define P2P_TYPE_FLEET_ACK 0x06
+#define P2P_TYPE_FRAG 0x07
+#define P2P_TYPE_CAD_PROBE 0x08
+#define P2P_TYPE_BENCH 0x09
+#define P2P_TYPE_TIME 0x0A
+#define P2P_FLAG_ENCRYPTED 0x80
+#define P2P_BROADCAST 0xFFFF
+struct s_p2p_header
+{
+  // Marker for a framed P2P packet
+  uint8_t marker = LORA_P2P_FRAME_MARKER;
+  // Frame type P2P_TYPE_xxx, P2P_FLAG_ENCRYPTED for encrypted packets
+  uint8_t type = P2P_TYPE_DATA;
+  // Packet counter of the transmitter, drives the hop sequence
+  uint16_t hop_cnt = 0;
+  // Blacklisted hop channels of the transmitter
+  uint8_t hop_mask = 0;
+  // Node ID of the originator
+  uint16_t src = 0;
+  // Node ID of the destination, P2P_BROADCAST for all nodes
+  uint16_t dst = P2P_BROADCAST;
+  // Sequence number of the originator
+  uint16_t seq = 0;
+  // Remaining number of relay hops
+  uint8_t ttl = 0;
+} __attribute__((packed));
+
 extern s_lorap2p_settings g_lorap2p_settings;
 extern uint8_t g_rx_lora_data[];
 extern uint8_t g_rx_data_len;
 extern bool g_lorap2p_initialized;
+extern uint16_t g_p2p_packet_cnt;
+extern uint16_t g_p2p_node_id;
+extern uint8_t g_p2p_sf;
+extern uint8_t g_p2p_bw;
+extern int8_t g_p2p_tx_power;
+extern uint8_t g_p2p_cr;
+extern volatile bool g_p2p_tx_busy;
+extern volatile uint32_t g_p2p_tx_count;
+void restart_rx(void);
+uint32_t p2p_symbol_time_us(uint8_t sf, uint8_t bandwidth);
+uint32_t p2p_time_on_air_us(uint8_t sf, uint8_t bandwidth, uint16_t preamble_len, uint8_t len);
+void set_p2p_modulation(uint8_t sf, uint8_t bandwidth, int8_t tx_power);
+uint16_t p2p_tx_preamble_len(void);
+bool send_p2p_frame(uint8_t *frame, uint8_t len);
+bool send_p2p_raw(uint8_t *data, uint8_t len);
+bool send_p2p_packet(uint8_t type, uint16_t dst, uint8_t *data, uint8_t len);
+
+// Frequency hopping
+#define HOP_MAX_CHANNELS 8
+extern bool g_hop_active;
+void init_hopping(void);
+uint32_t hop_rx_frequency(void);
+uint32_t hop_tx_frequency(uint16_t hop_cnt);
+uint8_t hop_blacklist(void);
+void hop_rx_done(s_p2p_header *header);
+void hop_rx_error(void);
+void hop_cad_result(bool busy);
+void hop_rx_missed(void);
+
+// Relay
+struct s_relay_stats
+{
+  uint32_t relayed;
+  uint32_t deduplicated;
+  uint32_t expired;
+  uint32_t dropped;
+};
+extern s_relay_stats g_relay_stats;
+bool relay_is_duplicate(s_p2p_header *header);
+void relay_schedule(uint8_t *frame, uint8_t len, int16_t rssi);
+void relay_send_due(void);
+void relay_log_stats(void);
+
+// Encryption
+/** Bytes added to an encrypted packet, address and counter high words and MIC */
+#define P2P_CRYPTO_OVERHEAD 10
+void init_crypto(void);
+uint8_t p2p_encrypt_frame(uint8_t *frame, uint8_t len);
+int16_t p2p_decrypt_frame(uint8_t *frame, uint8_t len);
+/** Length of the signature of fleet configurations */
+#define P2P_SIGNATURE_LEN 8
+void p2p_sign(const uint8_t *data, uint16_t len, uint8_t *signature);
+void crypto_benchmark(void);
+
+// Link adaptation
+extern bool g_link_active;
+void init_link(void);
+void link_rx_data(s_p2p_header *header, int16_t rssi, int8_t snr);
+void link_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+void link_packet_sent(uint8_t type, uint8_t len);
+void link_tx_done(void);
+void link_process(void);
+void link_log_stats(void);
+
+// Fleet configuration
+void fleet_check_publish(void);
+void fleet_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len);
+void fleet_process(void);
+
+// Channel survey
+extern volatile bool g_survey_active;
+void survey_cad_done(bool busy);
+void survey_run(void);
+
+// Fragmentation
+/** Maximum size of a fragmented payload */
+#define P2P_BLOB_MAX 2048
+bool send_p2p_blob(uint16_t dst, uint8_t *data, uint16_t len, bool fec);
+void frag_send_next(void);
+void frag_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len);
+void frag_deliver(void);
+
+// CAD calibration
+extern volatile bool g_cad_calibrating;
+void cad_set_params(void);
+void cad_calibration_done(bool busy);
+void cad_calibrate_request(uint16_t peer);
+void cad_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len);
+void cad_process(void);
+
+// Benchmark
+void bench_command(const char *cmd);
+void bench_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+void bench_process(void);
+
+// Network time
+extern volatile uint32_t g_lora_irq_us;
+void init_timesync(void);
+bool timesync_synced(void);
+uint64_t timesync_now_us(void);
+uint64_t timesync_stamp_us(uint32_t stamp);
+void timesync_process(void);
+void timesync_tx_done(s_p2p_header *header, uint32_t irq_us);
+void timesync_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, uint32_t irq_us);
+void timesync_report(void);
+
+// Radio power management
+/** SX126x RX current in uA, DC-DC mode */
+#define P2P_RX_CURRENT_UA 4600
+/** SX126x standby current with RC oscillator in uA */
+#define P2P_STANDBY_CURRENT_UA 600
+/** SX126x sleep current with RC oscillator running in uA */
+#define P2P_SLEEP_CURRENT_UA 1.2
+/** SX126x cold sleep current in uA */
+#define P2P_COLD_SLEEP_CURRENT_UA 0.16
+/** SX126x TX current at 22 dBm in uA */
+#define P2P_TX_CURRENT_UA 118000
+void p2p_radio_restore(void);
+uint32_t power_next_op_ms(void);
+void power_idle(uint32_t next_ms);
+void power_listen(void);
+void power_wake(void);
+void power_tx_start(void);
+void power_tx_done(uint32_t irq_us);
+void power_reset_shadow(void);
+void power_set_channel(uint32_t freq);
+void power_set_cad_params(uint8_t symbols, uint8_t det_peak, uint8_t det_min);
+bool power_modulation_changed(uint8_t sf, uint8_t bandwidth, uint8_t cr, int8_t tx_power, uint16_t preamble_len);
+void power_report(void);
+
+// Gateway
+void gateway_queue(uint8_t *frame, uint8_t len, int16_t rssi, int8_t snr, bool decrypted);
+void gateway_flush(bool force);
 
 // Flash
 void init_flash(void);
 bool save_settings(void);
 void log_settings(void);
+uint16_t flash_next_epoch(void);
 
 #endif // MAIN_H
@@ -11,22 +11,42 @@
 
 #include "main.h"
 
-/** Semaphore used by events to wake up loop task */
-SemaphoreHandle_t g_task_sem = NULL;
+/** Handle of the loop task, events are bits of its task notification */
+static TaskHandle_t loop_task = NULL;
 
 /** Timer to wakeup task frequently and send message */
 SoftwareTimer g_task_wakeup_timer;
 
 /**
-   @brief Flag for the event type
-   -1 => no event
+   @brief Signal an event to the loop task
+   Each event is one bit of the task notification. Events that happen
+   while the loop task is busy are kept and handled in the next pass,
+   several events can be pending at the same time.
+   Called from tasks and timer callbacks, not from interrupts.
+
+   @param event event number
    0 => LoRa data received
    1 => Timer wakeup
-   3 => Received configuration over BLE
-   2 => tbd
-   ...
+   2 => Received configuration over BLE
+   3 => Frequency hopping receive timeout
+   4 => Relay packet due
+   5 => Gateway flush timeout
+   6 => Link adaptation
+   7 => Fleet configuration
+   8 => Channel survey requested or next channel due
+   9 => Next fragment due
+   10 => Reassembled blob complete
+   11 => CAD calibration
+   12 => Benchmark
+   13 => Time sync beacon due
 */
-uint8_t g_task_event_type = -1;
+void task_event(uint8_t event)
+{
+  if (loop_task != NULL)
+  {
+    xTaskNotify(loop_task, 1UL << event, eSetBits);
+  }
+}
 
 /**
    @brief Timer event that wakes up the loop task frequently
@@ -37,8 +57,7 @@ void periodic_wakeup(TimerHandle_t unused)
 {
   // Switch on blue LED to show we are awake
   digitalWrite(LED_CONN, HIGH);
-  g_task_event_type = 1;
-  xSemaphoreGiveFromISR(g_task_sem, pdFALSE);
+  task_event(1);
 }
 
 /**
@@ -47,10 +66,8 @@ void periodic_wakeup(TimerHandle_t unused)
 */
 void setup()
 {
-  // Create the task event semaphore
-  g_task_sem = xSemaphoreCreateBinary();
-  // Initialize semaphore
-  xSemaphoreGive(g_task_sem);
+  // setup() and loop() run in the loop task
+  loop_task = xTaskGetCurrentTaskHandle();
 
   // Initialize the built in LED
   pinMode(LED_BUILTIN, OUTPUT);
@@ -118,75 +135,139 @@ void setup()
     MYLOG("APP", "Auto join is disabled, waiting for connect command");
     delay(100);
   }
-
-  // Take the semaphore so the loop will go to sleep until an event happens
-  xSemaphoreTake(g_task_sem, 10);
 }
 
 /**
-   @brief Arduino loop task. Called in a loop from the FreeRTOS task handler
+   @brief Handle one event in the loop task
 
+   @param event event number
 */
-void loop()
+static void handle_event(uint8_t event)
 {
-  // Sleep until we are woken up by an event
-  if (xSemaphoreTake(g_task_sem, portMAX_DELAY) == pdTRUE)
+  switch (event)
   {
-    // Switch on green LED to show we are awake
-    digitalWrite(LED_BUILTIN, HIGH);
-    switch (g_task_event_type)
-    {
-      case 0:
-        MYLOG("APP", "Received package over LoRa");
-        if (g_rx_lora_data[0] > 0x1F)
-        {
-          MYLOG("APP", "%s", (char *)g_rx_lora_data);
-        }
-        else
+    case 0:
+      MYLOG("APP", "Received package over LoRa");
+      if (g_rx_lora_data[0] > 0x1F)
+      {
+        MYLOG("APP", "%s", (char *)g_rx_lora_data);
+      }
+      else
+      {
+        for (int idx = 0; idx < g_rx_data_len; idx++)
         {
-          for (int idx = 0; idx < g_rx_data_len; idx++)
-          {
-            MYLOG("APP", "%X ", g_rx_lora_data[idx]);
-          }
+          MYLOG("APP", "%X ", g_rx_lora_data[idx]);
         }
-        if (ble_uart_is_connected)
+      }
+      if (g_lorap2p_settings.gateway_enable)
+      {
+        gateway_flush(false);
+      }
+      else if (ble_uart_is_connected)
+      {
+        for (int idx = 0; idx < g_rx_data_len; idx++)
         {
-          for (int idx = 0; idx < g_rx_data_len; idx++)
-          {
-            ble_uart.printf("%02X ", g_rx_lora_data[idx]);
-          }
-          ble_uart.println("");
+          ble_uart.printf("%02X ", g_rx_lora_data[idx]);
         }
-        break;
-      case 1:
-        MYLOG("APP", "Timer wakeup");
-        /// \todo read sensor or whatever you need to do frequently
+        ble_uart.println("");
+      }
+      if (g_link_active)
+      {
+        link_process();
+      }
+      break;
+    case 1:
+      MYLOG("APP", "Timer wakeup");
+      /// \todo read sensor or whatever you need to do frequently
 
-        send_lora_packet();
-        MYLOG("APP", "LoRa package sent");
+      send_lora_packet();
+      MYLOG("APP", "LoRa package sent");
 
-        break;
-      case 2:
-        MYLOG("APP", "Config received over BLE");
-        delay(100);
+      if (g_lorap2p_settings.relay_enable)
+      {
+        relay_log_stats();
+      }
+      if (g_link_active)
+      {
+        link_log_stats();
+      }
 
-        // Inform connected device about new settings
-        lora_data.write((void *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
-        lora_data.notify((void *)&g_lorap2p_settings, sizeof(s_lorap2p_settings));
+      break;
+    case 2:
+      MYLOG("APP", "Config received over BLE");
+      delay(100);
 
-        // Check if auto connect is enabled
-        if ((g_lorap2p_settings.auto_join) && !g_lorap2p_initialized)
-        {
-          init_lora();
-        }
-        break;
-      default:
-        MYLOG("APP", "This should never happen ;-)");
-        break;
+      // Inform connected device about new settings
+      settings_publish(true);
+
+      // Check if auto connect is enabled
+      if ((g_lorap2p_settings.auto_join) && !g_lorap2p_initialized)
+      {
+        init_lora();
+      }
+      break;
+    case 3:
+      MYLOG("APP", "Hop timeout, packet missed");
+      hop_rx_missed();
+      break;
+    case 4:
+      relay_send_due();
+      break;
+    case 5:
+      gateway_flush(true);
+      break;
+    case 6:
+      link_process();
+      break;
+    case 7:
+      fleet_process();
+      break;
+    case 8:
+      MYLOG("APP", "Channel survey");
+      survey_run();
+      break;
+    case 9:
+      frag_send_next();
+      break;
+    case 10:
+      frag_deliver();
+      break;
+    case 11:
+      cad_process();
+      break;
+    case 12:
+      bench_process();
+      break;
+    case 13:
+      timesync_process();
+      break;
+    default:
+      MYLOG("APP", "This should never happen ;-)");
+      break;
+  }
+}
+
+/**
+   @brief Arduino loop task. Called in a loop from the FreeRTOS task handler
+
+*/
+void loop()
+{
+  uint32_t events = 0;
+  // Sleep until we are woken up by one or more events
+  if (xTaskNotifyWait(0, 0xFFFFFFFF, &events, portMAX_DELAY) == pdTRUE)
+  {
+    // Switch on green LED to show we are awake
+    digitalWrite(LED_BUILTIN, HIGH);
+    for (uint8_t event = 0; event < 32; event++)
+    {
+      if (events & (1UL << event))
+      {
+        handle_event(event);
+      }
     }
-    delay(500); // Only so we can see the blue LED
-    // Go back to sleep
-    xSemaphoreTake(g_task_sem, 10);
+    // Only so we can see the blue LED, events during the delay stay pending
+    delay(500);
     // Switch off blue LED to show we go to sleep
     digitalWrite(LED_CONN, LOW);
     delay(10);
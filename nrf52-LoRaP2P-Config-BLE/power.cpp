@@ -0,0 +1,403 @@
+/**
+   @file power.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief SX126x power management between transmissions
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+   When the radio is not needed it is put into standby, warm sleep or cold
+   sleep, depending on the time until the next scheduled radio operation.
+   - Standby keeps the oscillator running, the radio is ready immediately.
+   - Warm sleep keeps the configuration, waking up takes ~340 us.
+   - Cold sleep has the lowest current, but the radio has to be reset and
+     configured again.
+   Channel, modulation and CAD parameters are kept in a shadow and only
+   written to the radio if they changed.
+*/
+
+#include "main.h"
+
+/** Radio states between packets */
+#define PWR_RX 0
+#define PWR_STANDBY 1
+#define PWR_WARM 2
+#define PWR_COLD 3
+#define PWR_STATES 4
+
+/** Idle time in ms below which the radio stays in standby */
+#define PWR_STANDBY_MAX_MS 2
+/** Wake time from warm sleep in us until it is measured */
+#define PWR_WARM_WAKE_US 340
+/** Wake time from cold sleep in us until it is measured, includes reset and configuration */
+#define PWR_COLD_WAKE_US 5000
+/** Supply voltage for the energy estimation in mV */
+#define PWR_SUPPLY_MV 3300
+
+/** Names of the states for the report */
+static const char *pwr_names[PWR_STATES] = {"RX", "STANDBY", "WARM", "COLD"};
+/** Current of the states in uA */
+static const float pwr_current_ua[PWR_STATES] = {P2P_RX_CURRENT_UA, P2P_STANDBY_CURRENT_UA,
+                         P2P_SLEEP_CURRENT_UA, P2P_COLD_SLEEP_CURRENT_UA};
+
+/** Statistics per state the radio was woken up from */
+struct s_pwr_stats
+{
+  uint32_t packets;
+  uint32_t wake_us;
+  uint32_t tx_start_us;
+  float charge_uc;
+};
+static s_pwr_stats pwr_stats[PWR_STATES];
+
+/** Radio state, the radio is in standby after Radio.Init() */
+static uint8_t pwr_state = PWR_STANDBY;
+/** Start of the radio state in ms */
+static uint32_t pwr_state_start = 0;
+/** State before the last wake up */
+static uint8_t pwr_from = PWR_STANDBY;
+/** Start of the last wake up, micros() */
+static uint32_t pwr_wake_start = 0;
+/** Duration of the last wake up in us */
+static uint32_t pwr_wake_us = 0;
+/** Start of the transmission, micros() */
+static uint32_t pwr_tx_start = 0;
+/** Flag if a transmission follows the last wake up */
+static bool pwr_tx_pending = false;
+/** Charge used by the radio since the last packet in uC */
+static float pwr_idle_uc = 0;
+
+/** Shadow of the radio registers */
+static bool pwr_freq_valid = false;
+static uint32_t pwr_freq = 0;
+static bool pwr_cad_valid = false;
+static uint8_t pwr_cad_symbols = 0;
+static uint8_t pwr_cad_det_peak = 0;
+static uint8_t pwr_cad_det_min = 0;
+static bool pwr_mod_valid = false;
+static uint8_t pwr_mod_sf = 0;
+static uint8_t pwr_mod_bw = 0;
+static uint8_t pwr_mod_cr = 0;
+static int8_t pwr_mod_power = 0;
+static uint16_t pwr_mod_preamble = 0;
+
+/** Number of written and skipped register updates */
+static uint32_t pwr_reg_writes = 0;
+static uint32_t pwr_reg_skipped = 0;
+
+/**
+   @brief Add the charge of the current state since its start
+
+*/
+static void pwr_account_state(void)
+{
+  uint32_t now = millis();
+  pwr_idle_uc += (float)(now - pwr_state_start) * pwr_current_ua[pwr_state] / 1000.0;
+  pwr_state_start = now;
+}
+
+/**
+   @brief Get the average wake up time from a state
+
+   @param state PWR_WARM or PWR_COLD
+   @param default_us wake up time if there is no measurement yet
+   @return uint32_t wake up time in us
+*/
+static uint32_t pwr_avg_wake_us(uint8_t state, uint32_t default_us)
+{
+  if (pwr_stats[state].packets == 0)
+  {
+    return default_us;
+  }
+  return pwr_stats[state].wake_us / pwr_stats[state].packets;
+}
+
+/**
+   @brief Idle time above which cold sleep needs less energy than warm sleep
+   The longer wake up from cold sleep in standby current is compared
+   with the lower sleep current.
+
+   @return uint32_t break even time in ms
+*/
+static uint32_t pwr_cold_break_even_ms(void)
+{
+  uint32_t warm_us = pwr_avg_wake_us(PWR_WARM, PWR_WARM_WAKE_US);
+  uint32_t cold_us = pwr_avg_wake_us(PWR_COLD, PWR_COLD_WAKE_US);
+  if (cold_us <= warm_us)
+  {
+    return 0;
+  }
+  return (uint32_t)((float)(cold_us - warm_us) * P2P_STANDBY_CURRENT_UA / (P2P_SLEEP_CURRENT_UA - P2P_COLD_SLEEP_CURRENT_UA) / 1000.0);
+}
+
+/**
+   @brief Get the time until the next scheduled radio operation
+   The next operation is the next packet of the send timer
+
+   @return uint32_t time in ms
+*/
+uint32_t power_next_op_ms(void)
+{
+  TickType_t expiry = xTimerGetExpiryTime(g_task_wakeup_timer.getHandle());
+  int32_t ticks = (int32_t)(expiry - xTaskGetTickCount());
+  if (ticks <= 0)
+  {
+    return 0;
+  }
+  return ((uint32_t)ticks * 1000) / configTICK_RATE_HZ;
+}
+
+/**
+   @brief Put the radio into the best idle state
+   power_policy 1 .. 3 forces standby, warm or cold sleep
+
+   @param next_ms time until the radio is needed again in ms
+*/
+void power_idle(uint32_t next_ms)
+{
+  uint8_t state;
+  switch (g_lorap2p_settings.power_policy)
+  {
+    case 1:
+      state = PWR_STANDBY;
+      break;
+    case 2:
+      state = PWR_WARM;
+      break;
+    case 3:
+      state = PWR_COLD;
+      break;
+    default:
+      if (next_ms < PWR_STANDBY_MAX_MS)
+      {
+        state = PWR_STANDBY;
+      }
+      else if (next_ms < pwr_cold_break_even_ms())
+      {
+        state = PWR_WARM;
+      }
+      else
+      {
+        state = PWR_COLD;
+      }
+      break;
+  }
+
+  if (state == pwr_state)
+  {
+    return;
+  }
+  pwr_account_state();
+
+  switch (state)
+  {
+    case PWR_STANDBY:
+      Radio.Standby();
+      break;
+    case PWR_WARM:
+      Radio.Sleep();
+      break;
+    default:
+      SleepParams_t params;
+      params.Value = 0;
+      params.Fields.WarmStart = 0;
+      SX126xSetSleep(params);
+      break;
+  }
+  pwr_state = state;
+}
+
+/**
+   @brief The radio was put into RX
+   Called by restart_rx()
+*/
+void power_listen(void)
+{
+  if (pwr_state == PWR_RX)
+  {
+    return;
+  }
+  pwr_account_state();
+  pwr_state = PWR_RX;
+}
+
+/**
+   @brief Make the radio ready for a transmission
+   From cold sleep the radio is reset and configured again,
+   otherwise the configuration is still valid.
+*/
+void power_wake(void)
+{
+  pwr_account_state();
+  pwr_from = pwr_state;
+  pwr_wake_start = micros();
+  if (pwr_state == PWR_COLD)
+  {
+    // Registers are lost in cold sleep
+    power_reset_shadow();
+    p2p_radio_restore();
+  }
+  else
+  {
+    Radio.Standby();
+  }
+  pwr_wake_us = micros() - pwr_wake_start;
+  pwr_state = PWR_STANDBY;
+  pwr_tx_pending = true;
+}
+
+/**
+   @brief Transmission starts after the CAD
+   Called before Radio.Send()
+*/
+void power_tx_start(void)
+{
+  pwr_tx_start = micros();
+}
+
+/**
+   @brief Account the latency and energy of a finished transmission
+
+   @param irq_us micros() timestamp of the TX done interrupt
+*/
+void power_tx_done(uint32_t irq_us)
+{
+  if (!pwr_tx_pending)
+  {
+    return;
+  }
+  pwr_tx_pending = false;
+  pwr_account_state();
+
+  uint32_t tx_start_us = pwr_tx_start - pwr_wake_start;
+  uint32_t cad_us = tx_start_us - pwr_wake_us;
+  uint32_t tx_us = irq_us - pwr_tx_start;
+  // Standby time is already in pwr_idle_uc, add the difference for CAD and TX
+  float charge = pwr_idle_uc + ((float)cad_us * (P2P_RX_CURRENT_UA - P2P_STANDBY_CURRENT_UA) +
+                                (float)tx_us * (P2P_TX_CURRENT_UA - P2P_STANDBY_CURRENT_UA)) /
+                   1000000.0;
+  pwr_idle_uc = 0;
+
+  s_pwr_stats *stats = &pwr_stats[pwr_from];
+  stats->packets++;
+  stats->wake_us += pwr_wake_us;
+  stats->tx_start_us += tx_start_us;
+  stats->charge_uc += charge;
+
+  MYLOG("PWR", "From %s: wake %ld us, TX start %ld us, %.1f uJ", pwr_names[pwr_from],
+        pwr_wake_us, tx_start_us, charge * PWR_SUPPLY_MV / 1000.0);
+}
+
+/**
+   @brief Forget the shadow, all registers are written on the next change
+
+*/
+void power_reset_shadow(void)
+{
+  pwr_freq_valid = false;
+  pwr_cad_valid = false;
+  pwr_mod_valid = false;
+}
+
+/**
+   @brief Set the frequency if it changed
+
+   @param freq frequency in Hz
+*/
+void power_set_channel(uint32_t freq)
+{
+  if (pwr_freq_valid && (pwr_freq == freq))
+  {
+    pwr_reg_skipped++;
+    return;
+  }
+  Radio.SetChannel(freq);
+  pwr_freq = freq;
+  pwr_freq_valid = true;
+  pwr_reg_writes++;
+}
+
+/**
+   @brief Set the CAD parameters if they changed
+   The CAD interrupts are always enabled, RX uses different interrupts.
+
+   @param symbols LORA_CAD_xx_SYMBOL
+   @param det_peak detection peak
+   @param det_min detection minimum
+*/
+void power_set_cad_params(uint8_t symbols, uint8_t det_peak, uint8_t det_min)
+{
+  if (pwr_cad_valid && (pwr_cad_symbols == symbols) && (pwr_cad_det_peak == det_peak) && (pwr_cad_det_min == det_min))
+  {
+    SX126xSetDioIrqParams(IRQ_CAD_DONE | IRQ_CAD_ACTIVITY_DETECTED, IRQ_CAD_DONE | IRQ_CAD_ACTIVITY_DETECTED,
+                          IRQ_RADIO_NONE, IRQ_RADIO_NONE);
+    pwr_reg_skipped++;
+    return;
+  }
+  Radio.SetCadParams(symbols, det_peak, det_min, LORA_CAD_ONLY, 0);
+  pwr_cad_symbols = symbols;
+  pwr_cad_det_peak = det_peak;
+  pwr_cad_det_min = det_min;
+  pwr_cad_valid = true;
+  pwr_reg_writes++;
+}
+
+/**
+   @brief Check if the modulation differs from the one in the radio
+   The new modulation is stored in the shadow.
+
+   @return true if the modulation has to be written
+*/
+bool power_modulation_changed(uint8_t sf, uint8_t bandwidth, uint8_t cr, int8_t tx_power, uint16_t preamble_len)
+{
+  if (pwr_mod_valid && (pwr_mod_sf == sf) && (pwr_mod_bw == bandwidth) && (pwr_mod_cr == cr) &&
+      (pwr_mod_power == tx_power) && (pwr_mod_preamble == preamble_len))
+  {
+    pwr_reg_skipped++;
+    return false;
+  }
+  pwr_mod_sf = sf;
+  pwr_mod_bw = bandwidth;
+  pwr_mod_cr = cr;
+  pwr_mod_power = tx_power;
+  pwr_mod_preamble = preamble_len;
+  pwr_mod_valid = true;
+  pwr_reg_writes++;
+  return true;
+}
+
+/**
+   @brief Report wake up latency and energy per packet for each state
+   Sent to the BLE UART on the POWER command
+*/
+void power_report(void)
+{
+  static const char *policies[] = {"auto", "standby", "warm", "cold"};
+  char line[128];
+
+  snprintf(line, sizeof(line), "POWER policy %s, cold sleep after %ld ms, registers written %ld skipped %ld",
+           policies[g_lorap2p_settings.power_policy & 3], pwr_cold_break_even_ms(), pwr_reg_writes, pwr_reg_skipped);
+  MYLOG("PWR", "%s", line);
+  if (ble_uart_is_connected)
+  {
+    ble_uart.printf("%s\n", line);
+  }
+
+  for (int idx = 0; idx < PWR_STATES; idx++)
+  {
+    s_pwr_stats *stats = &pwr_stats[idx];
+    if (stats->packets == 0)
+    {
+      continue;
+    }
+    snprintf(line, sizeof(line), "%s n=%ld wake=%ld us tx=%ld us E=%.1f uJ/pkt", pwr_names[idx], stats->packets,
+             stats->wake_us / stats->packets, stats->tx_start_us / stats->packets,
+             stats->charge_uc * PWR_SUPPLY_MV / 1000.0 / stats->packets);
+    MYLOG("PWR", "%s", line);
+    if (ble_uart_is_connected)
+    {
+      ble_uart.printf("%s\n", line);
+    }
+  }
+}
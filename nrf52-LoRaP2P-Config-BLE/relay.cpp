@@ -0,0 +1,256 @@
+/**
+   @file relay.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief LoRa P2P store-and-forward relay with duplicate suppression
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+*/
+
+#include "main.h"
+
+/** Number of entries in the duplicate cache */
+#define RELAY_CACHE_SIZE 32
+/** Number of packets that can wait for their rebroadcast */
+#define RELAY_QUEUE_SIZE 4
+/** Minimum rebroadcast delay in milliseconds */
+#define RELAY_MIN_DELAY 50
+/** Additional rebroadcast delay per dB RSSI above the sensitivity in milliseconds */
+#define RELAY_DELAY_PER_DB 10
+/** Random jitter added to the rebroadcast delay in milliseconds */
+#define RELAY_JITTER 50
+/** RSSI that counts as the weakest receivable signal */
+#define RELAY_RSSI_FLOOR -140
+/** Retry time if the radio is busy in milliseconds */
+#define RELAY_RETRY_DELAY 100
+/** Time after which a (source, sequence) pair is forgotten in milliseconds
+    A node that reboots starts again with sequence 0, its new packets must not
+    be dropped as duplicates of the packets it sent before the reboot */
+#define RELAY_CACHE_AGE 30000
+
+/** Entry of the duplicate cache */
+struct s_relay_cache
+{
+  bool used;
+  uint16_t src;
+  uint16_t seq;
+  uint32_t seen_time;
+};
+
+/** Packet waiting for its rebroadcast */
+struct s_relay_entry
+{
+  bool pending;
+  uint32_t due_time;
+  uint8_t len;
+  uint8_t frame[256];
+};
+
+/** Relay statistics */
+s_relay_stats g_relay_stats;
+
+/** Recently seen (source, sequence) pairs */
+static s_relay_cache relay_cache[RELAY_CACHE_SIZE];
+/** Packets waiting for their rebroadcast */
+static s_relay_entry relay_queue[RELAY_QUEUE_SIZE];
+
+/** Timer for the rebroadcast delay */
+SoftwareTimer g_relay_timer;
+/** Flag if the relay timer was initialized */
+static bool relay_timer_init = false;
+
+/**
+   @brief Timer event when a rebroadcast is due
+
+   @param unused
+*/
+void relay_timeout(TimerHandle_t unused)
+{
+  task_event(4);
+}
+
+/**
+   @brief Start the relay timer for the next due packet
+
+*/
+static void relay_arm_timer(void)
+{
+  uint32_t now = millis();
+  uint32_t next_delay = 0xFFFFFFFF;
+  for (int idx = 0; idx < RELAY_QUEUE_SIZE; idx++)
+  {
+    if (relay_queue[idx].pending)
+    {
+      int32_t wait = (int32_t)(relay_queue[idx].due_time - now);
+      if (wait < 1)
+      {
+        wait = 1;
+      }
+      if ((uint32_t)wait < next_delay)
+      {
+        next_delay = wait;
+      }
+    }
+  }
+  if (next_delay == 0xFFFFFFFF)
+  {
+    return;
+  }
+
+  if (!relay_timer_init)
+  {
+    g_relay_timer.begin(next_delay, relay_timeout, NULL, false);
+    relay_timer_init = true;
+  }
+  else
+  {
+    g_relay_timer.stop();
+    g_relay_timer.setPeriod(next_delay);
+  }
+  g_relay_timer.start();
+}
+
+/**
+   @brief Check if a packet was seen before
+   Packets that were seen before are dropped. A pending rebroadcast of the
+   same packet is cancelled, because another relay forwarded it already.
+   Without relay_enable only our own relayed packets are dropped.
+
+   @param header header of the received packet
+   @return true if the packet is a duplicate
+*/
+bool relay_is_duplicate(s_p2p_header *header)
+{
+  // Our own packets relayed back to us
+  if (header->src == g_p2p_node_id)
+  {
+    g_relay_stats.deduplicated++;
+    return true;
+  }
+
+  if (!g_lorap2p_settings.relay_enable)
+  {
+    return false;
+  }
+
+  uint32_t now = millis();
+  uint8_t oldest = 0;
+  for (int idx = 0; idx < RELAY_CACHE_SIZE; idx++)
+  {
+    // Forget pairs that are too old, the originator might have rebooted
+    if (relay_cache[idx].used && ((now - relay_cache[idx].seen_time) > RELAY_CACHE_AGE))
+    {
+      relay_cache[idx].used = false;
+    }
+    if (relay_cache[idx].used && (relay_cache[idx].src == header->src) && (relay_cache[idx].seq == header->seq))
+    {
+      g_relay_stats.deduplicated++;
+
+      // Somebody else forwarded it first
+      for (int q_idx = 0; q_idx < RELAY_QUEUE_SIZE; q_idx++)
+      {
+        s_p2p_header *queued = (s_p2p_header *)relay_queue[q_idx].frame;
+        if (relay_queue[q_idx].pending && (queued->src == header->src) && (queued->seq == header->seq))
+        {
+          relay_queue[q_idx].pending = false;
+        }
+      }
+      return true;
+    }
+    if (!relay_cache[oldest].used)
+    {
+      continue;
+    }
+    if (!relay_cache[idx].used || ((now - relay_cache[idx].seen_time) > (now - relay_cache[oldest].seen_time)))
+    {
+      oldest = idx;
+    }
+  }
+
+  // New packet, replace a free or the oldest entry
+  relay_cache[oldest].used = true;
+  relay_cache[oldest].src = header->src;
+  relay_cache[oldest].seq = header->seq;
+  relay_cache[oldest].seen_time = now;
+  return false;
+}
+
+/**
+   @brief Queue a received packet for rebroadcast
+   The rebroadcast delay grows with the RSSI, so the relay that is farthest
+   away from the transmitter forwards first and the others can drop the packet.
+
+   @param frame received packet including the header
+   @param len length of the packet
+   @param rssi RSSI of the received packet
+*/
+void relay_schedule(uint8_t *frame, uint8_t len, int16_t rssi)
+{
+  s_p2p_header *header = (s_p2p_header *)frame;
+  if (header->ttl == 0)
+  {
+    g_relay_stats.expired++;
+    return;
+  }
+
+  for (int idx = 0; idx < RELAY_QUEUE_SIZE; idx++)
+  {
+    if (!relay_queue[idx].pending)
+    {
+      int32_t margin = rssi - RELAY_RSSI_FLOOR;
+      if (margin < 0)
+      {
+        margin = 0;
+      }
+      relay_queue[idx].due_time = millis() + RELAY_MIN_DELAY + margin * RELAY_DELAY_PER_DB + random(RELAY_JITTER);
+      relay_queue[idx].len = len;
+      memcpy(relay_queue[idx].frame, frame, len);
+      ((s_p2p_header *)relay_queue[idx].frame)->ttl--;
+      relay_queue[idx].pending = true;
+      relay_arm_timer();
+      return;
+    }
+  }
+  g_relay_stats.dropped++;
+}
+
+/**
+   @brief Rebroadcast the packets that are due
+   Called from the loop task after the relay timer expired
+
+*/
+void relay_send_due(void)
+{
+  uint32_t now = millis();
+  for (int idx = 0; idx < RELAY_QUEUE_SIZE; idx++)
+  {
+    if (relay_queue[idx].pending && ((int32_t)(now - relay_queue[idx].due_time) >= 0))
+    {
+      if (send_p2p_frame(relay_queue[idx].frame, relay_queue[idx].len))
+      {
+        relay_queue[idx].pending = false;
+        g_relay_stats.relayed++;
+      }
+      else
+      {
+        // Radio is busy, try again later
+        relay_queue[idx].due_time = now + RELAY_RETRY_DELAY;
+      }
+      // Only one packet at a time
+      break;
+    }
+  }
+  relay_arm_timer();
+}
+
+/**
+   @brief Printout of the relay statistics
+
+*/
+void relay_log_stats(void)
+{
+  MYLOG("RELAY", "Relayed %ld, deduplicated %ld, expired %ld, dropped %ld",
+        g_relay_stats.relayed, g_relay_stats.deduplicated, g_relay_stats.expired, g_relay_stats.dropped);
+}
@@ -0,0 +1,427 @@
+/**
+   @file timesync.cpp
+   @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+   @brief Network time from beacons of a time master, timestamped at the DIO1 interrupt
+   @version 0.1
+   @date 2021-01-10
+
+   @copyright Copyright (c) 2021
+
+*/
+
+#include "main.h"
+
+/** Number of beacons used for the clock model */
+#define TS_SAMPLES 8
+/** Beacon intervals without beacon before the master is dropped */
+#define TS_MASTER_TIMEOUT 3
+/** Longest beacon interval in seconds, the local clock must be read at least once per micros() wrap */
+#define TS_MAX_INTERVAL 3600
+
+/** Beacon, payload of P2P_TYPE_TIME */
+struct s_ts_beacon
+{
+  // Beacon number
+  uint8_t seq;
+  // Beacon interval in seconds
+  uint16_t interval;
+  // Master time when the beacon was sent in microseconds
+  uint64_t send_time;
+  // Master time of the TX done of beacon seq - 1 in microseconds, 0 if not known
+  uint64_t prev_tx_done;
+  // Hop limit the master sent the beacon with, a lower ttl in the header means it was relayed
+  uint8_t ttl;
+} __attribute__((packed));
+
+/** Time of the last DIO1 interrupt, micros() */
+volatile uint32_t g_lora_irq_us = 0;
+
+/** Extended local clock */
+static uint32_t ts_local_high = 0;
+static uint32_t ts_local_last = 0;
+
+/** Master state */
+static uint8_t ts_tx_seq = 0;
+static uint64_t ts_tx_done = 0;
+static bool ts_beacon_due = false;
+
+/** Client state */
+static uint16_t ts_master = 0;
+static uint16_t ts_master_interval = 0;
+static uint32_t ts_master_last_rx = 0;
+static bool ts_rx_valid = false;
+static uint8_t ts_rx_seq = 0;
+static uint64_t ts_rx_local = 0;
+
+/** Clock model, master time = local + ts_offset + ts_drift * (local - ts_ref) */
+static bool ts_synced = false;
+static bool ts_coarse = false;
+static uint64_t ts_ref = 0;
+static double ts_offset = 0;
+static double ts_drift = 0;
+static uint64_t ts_sample_local[TS_SAMPLES];
+static uint64_t ts_sample_master[TS_SAMPLES];
+static uint8_t ts_sample_num = 0;
+static uint8_t ts_sample_next = 0;
+
+/** Measured sync error in microseconds */
+static int32_t ts_err_last = 0;
+static uint32_t ts_err_max = 0;
+static uint32_t ts_err_sum = 0;
+static uint32_t ts_err_num = 0;
+
+/** Periodic timer for the beacons of the master */
+SoftwareTimer g_ts_timer;
+/** Flag if the beacon timer runs with the beacon interval */
+static bool ts_timer_periodic = false;
+
+/**
+   @brief Timer event when the next beacon is due
+
+   @param unused
+*/
+void ts_timeout(TimerHandle_t unused)
+{
+  ts_beacon_due = true;
+  task_event(13);
+}
+
+/**
+   @brief Get the beacon interval of the settings
+
+   @return uint16_t interval in seconds
+*/
+static uint16_t ts_interval(void)
+{
+  uint16_t interval = g_lorap2p_settings.timesync_interval;
+  if (interval < 10)
+  {
+    interval = 10;
+  }
+  if (interval > TS_MAX_INTERVAL)
+  {
+    interval = TS_MAX_INTERVAL;
+  }
+  return interval;
+}
+
+/**
+   @brief Extend a micros() timestamp to 64 bit
+   The timestamp must not be older than one micros() wrap
+
+   @param stamp micros() timestamp
+   @return uint64_t local time in microseconds
+*/
+static uint64_t ts_local_us(uint32_t stamp)
+{
+  taskENTER_CRITICAL();
+  uint32_t now = micros();
+  if (now < ts_local_last)
+  {
+    ts_local_high++;
+  }
+  ts_local_last = now;
+  uint64_t now64 = ((uint64_t)ts_local_high << 32) | now;
+  taskEXIT_CRITICAL();
+  return now64 - (uint32_t)(now - stamp);
+}
+
+/**
+   @brief Start the time service
+   The time master starts sending beacons
+
+*/
+void init_timesync(void)
+{
+  ts_local_us(micros());
+  if (g_lorap2p_settings.timesync_master)
+  {
+    MYLOG("TSYNC", "Time master, beacon every %d s", ts_interval());
+    // Random start, switched to the beacon interval with the first beacon
+    g_ts_timer.begin(random(1000, 5000), ts_timeout, NULL, true);
+    g_ts_timer.start();
+  }
+}
+
+/**
+   @brief Forget the clock model
+
+*/
+static void ts_reset(void)
+{
+  ts_synced = false;
+  ts_rx_valid = false;
+  ts_sample_num = 0;
+  ts_sample_next = 0;
+  ts_err_max = 0;
+  ts_err_sum = 0;
+  ts_err_num = 0;
+}
+
+/**
+   @brief Drop a master that went silent
+
+*/
+static void ts_check_master(void)
+{
+  if (ts_synced && ((millis() - ts_master_last_rx) > (TS_MASTER_TIMEOUT * ts_master_interval * 1000UL)))
+  {
+    MYLOG("TSYNC", "Master %04X lost", ts_master);
+    ts_reset();
+  }
+}
+
+/**
+   @brief Check if the network time is known
+
+   @return true if synchronized to a master or if this node is the master
+*/
+bool timesync_synced(void)
+{
+  ts_check_master();
+  return g_lorap2p_settings.timesync_master || ts_synced;
+}
+
+/**
+   @brief Convert a local timestamp to network time
+
+   @param local local time in microseconds
+   @return uint64_t network time in microseconds
+*/
+static uint64_t ts_to_network(uint64_t local)
+{
+  if (g_lorap2p_settings.timesync_master || !ts_synced)
+  {
+    return local;
+  }
+  double delta = (double)(int64_t)(local - ts_ref);
+  return local + (int64_t)(ts_offset + ts_drift * delta);
+}
+
+/**
+   @brief Get the network time
+   On the master and on nodes without sync this is the local time since boot
+
+   @return uint64_t network time in microseconds
+*/
+uint64_t timesync_now_us(void)
+{
+  ts_check_master();
+  return ts_to_network(ts_local_us(micros()));
+}
+
+/**
+   @brief Get the network time of a micros() timestamp
+   For example to stamp a measurement or a received packet
+
+   @param stamp micros() timestamp, not older than 71 minutes
+   @return uint64_t network time in microseconds
+*/
+uint64_t timesync_stamp_us(uint32_t stamp)
+{
+  return ts_to_network(ts_local_us(stamp));
+}
+
+/**
+   @brief Send a beacon
+   Called from the loop task
+
+*/
+void timesync_process(void)
+{
+  if (!ts_beacon_due || !g_lorap2p_settings.timesync_master)
+  {
+    return;
+  }
+  ts_beacon_due = false;
+  if (!ts_timer_periodic)
+  {
+    g_ts_timer.setPeriod(ts_interval() * 1000UL);
+    ts_timer_periodic = true;
+  }
+
+  s_ts_beacon beacon;
+  beacon.seq = ts_tx_seq + 1;
+  beacon.interval = ts_interval();
+  beacon.prev_tx_done = ts_tx_done;
+  beacon.ttl = g_lorap2p_settings.relay_max_hops;
+  beacon.send_time = ts_local_us(micros());
+  // Without TX done the next beacon can not follow up on this one
+  ts_tx_done = 0;
+  ts_tx_seq = beacon.seq;
+  if (!send_p2p_packet(P2P_TYPE_TIME, P2P_BROADCAST, (uint8_t *)&beacon, sizeof(s_ts_beacon)))
+  {
+    MYLOG("TSYNC", "Beacon not sent");
+  }
+}
+
+/**
+   @brief A packet was sent, take the DIO1 timestamp if it was a beacon
+   Called from the LoRa task
+
+   @param header header of the sent packet
+   @param irq_us DIO1 timestamp of the TX done
+*/
+void timesync_tx_done(s_p2p_header *header, uint32_t irq_us)
+{
+  if (g_lorap2p_settings.timesync_master && (header->src == g_p2p_node_id))
+  {
+    ts_tx_done = ts_local_us(irq_us);
+  }
+}
+
+/**
+   @brief Fit the clock model to the samples
+   Least squares fit of master - local over local
+
+*/
+static void ts_fit(void)
+{
+  uint8_t last = (ts_sample_next + TS_SAMPLES - 1) % TS_SAMPLES;
+  ts_ref = ts_sample_local[last];
+
+  double sum_x = 0;
+  double sum_y = 0;
+  double sum_xx = 0;
+  double sum_xy = 0;
+  for (uint8_t idx = 0; idx < ts_sample_num; idx++)
+  {
+    double x = (double)(int64_t)(ts_sample_local[idx] - ts_ref);
+    double y = (double)(int64_t)(ts_sample_master[idx] - ts_sample_local[idx]);
+    sum_x += x;
+    sum_y += y;
+    sum_xx += x * x;
+    sum_xy += x * y;
+  }
+  double n = ts_sample_num;
+  double denominator = n * sum_xx - sum_x * sum_x;
+  if ((ts_sample_num < 2) || (denominator == 0))
+  {
+    // Keep the last drift estimate
+    ts_offset = (double)(int64_t)(ts_sample_master[last] - ts_sample_local[last]);
+    return;
+  }
+  ts_drift = (n * sum_xy - sum_x * sum_y) / denominator;
+  ts_offset = (sum_y - ts_drift * sum_x) / n;
+}
+
+/**
+   @brief Add a pair of local RX done and master TX done time
+
+   @param local local time of the RX done
+   @param master master time of the TX done
+*/
+static void ts_add_sample(uint64_t local, uint64_t master)
+{
+  // Error of the model before it learns from this beacon
+  if (ts_synced && !ts_coarse)
+  {
+    ts_err_last = (int32_t)(int64_t)(master - ts_to_network(local));
+    uint32_t err_abs = ts_err_last < 0 ? -ts_err_last : ts_err_last;
+    ts_err_max = err_abs > ts_err_max ? err_abs : ts_err_max;
+    ts_err_sum += err_abs;
+    ts_err_num++;
+  }
+
+  ts_sample_local[ts_sample_next] = local;
+  ts_sample_master[ts_sample_next] = master;
+  ts_sample_next = (ts_sample_next + 1) % TS_SAMPLES;
+  if (ts_sample_num < TS_SAMPLES)
+  {
+    ts_sample_num++;
+  }
+  ts_fit();
+  ts_synced = true;
+  ts_coarse = false;
+  MYLOG("TSYNC", "Error %ld us, drift %ld ppb, %d samples", ts_err_last, (int32_t)(-ts_drift * 1e9), ts_sample_num);
+}
+
+/**
+   @brief Handle a beacon
+   Called from the LoRa task
+
+   @param header header of the packet
+   @param data payload
+   @param len length of the payload
+   @param irq_us DIO1 timestamp of the RX done
+*/
+void timesync_rx_frame(s_p2p_header *header, uint8_t *data, uint8_t len, uint32_t irq_us)
+{
+  if ((len != sizeof(s_ts_beacon)) || g_lorap2p_settings.timesync_master)
+  {
+    return;
+  }
+  s_ts_beacon beacon;
+  memcpy(&beacon, data, sizeof(s_ts_beacon));
+  // Relayed beacons have an unknown delay
+  if (header->ttl != beacon.ttl)
+  {
+    return;
+  }
+  uint64_t rx_local = ts_local_us(irq_us);
+
+  ts_check_master();
+  if (ts_synced && (header->src != ts_master))
+  {
+    return;
+  }
+  if (header->src != ts_master)
+  {
+    MYLOG("TSYNC", "New master %04X", header->src);
+    ts_master = header->src;
+    ts_reset();
+  }
+  ts_master_interval = beacon.interval;
+  ts_master_last_rx = millis();
+
+  if (ts_rx_valid && (beacon.prev_tx_done != 0) && (beacon.seq == (uint8_t)(ts_rx_seq + 1)))
+  {
+    // Follow up, TX done of the master and RX done of this node mark the same moment
+    ts_add_sample(ts_rx_local, beacon.prev_tx_done);
+  }
+  else if (!ts_synced)
+  {
+    // First beacon, the packet arrived one time on air after it was sent
+    uint8_t frame_len = sizeof(s_p2p_header) + sizeof(s_ts_beacon) + (g_lorap2p_settings.encrypt_enable ? P2P_CRYPTO_OVERHEAD : 0);
+    uint64_t master = beacon.send_time + p2p_time_on_air_us(g_p2p_sf, g_p2p_bw, p2p_tx_preamble_len(), frame_len);
+    ts_ref = rx_local;
+    ts_offset = (double)(int64_t)(master - rx_local);
+    ts_drift = 0;
+    ts_synced = true;
+    ts_coarse = true;
+    MYLOG("TSYNC", "Coarse sync to %04X", ts_master);
+  }
+
+  ts_rx_seq = beacon.seq;
+  ts_rx_local = rx_local;
+  ts_rx_valid = true;
+}
+
+/**
+   @brief Report the state of the time service to the log and the BLE UART
+
+*/
+void timesync_report(void)
+{
+  uint64_t now = timesync_now_us();
+  char line[128];
+  if (g_lorap2p_settings.timesync_master)
+  {
+    snprintf(line, sizeof(line), "TIME %lu.%06lu s master", (uint32_t)(now / 1000000), (uint32_t)(now % 1000000));
+  }
+  else if (!ts_synced)
+  {
+    snprintf(line, sizeof(line), "TIME %lu.%06lu s not synced", (uint32_t)(now / 1000000), (uint32_t)(now % 1000000));
+  }
+  else
+  {
+    snprintf(line, sizeof(line), "TIME %lu.%06lu s master %04X drift %ld ppb err %ld us avg %lu us max %lu us",
+             (uint32_t)(now / 1000000), (uint32_t)(now % 1000000), ts_master, (int32_t)(-ts_drift * 1e9),
+             ts_err_last, ts_err_num ? ts_err_sum / ts_err_num : 0, ts_err_max);
+  }
+  MYLOG("TSYNC", "%s", line);
+  if (ble_uart_is_connected)
+  {
+    ble_uart.printf("%s\n", line);
+  }
+}
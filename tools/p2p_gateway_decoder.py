@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Decoder for the binary frames the LoRa P2P example streams over BLE UART
+when gateway_enable is set.
+
+Frame layout, all values little endian
+    0      length of the following bytes
+    1      frame type, 0x01 => received LoRa packet
+           bit 7 set => the packet was encrypted and is forwarded decrypted
+    2..5   timestamp in milliseconds since boot of the node
+    6..7   RSSI
+    8      SNR
+    9..    received packet
+
+Frames can be split over several BLE notifications. Feed the raw bytes of
+all notifications in order, e.g. saved from a BLE UART terminal app:
+
+    python3 p2p_gateway_decoder.py capture.bin
+    cat capture.bin | python3 p2p_gateway_decoder.py
+"""
+import struct
+import sys
+
+FRAME_PACKET = 0x01
+FLAG_DECRYPTED = 0x80
+FRAME_HEADER = struct.Struct("<BIhb")
+P2P_MARKER = 0x5A
+P2P_HEADER = struct.Struct("<BBHBHHHB")
+
+
+class GatewayDecoder:
+    """Reassembles frames from a stream of notification payloads"""
+
+    def __init__(self):
+        self.buffer = bytearray()
+
+    def feed(self, data):
+        """Add received bytes and return the list of complete frames"""
+        self.buffer.extend(data)
+        frames = []
+        while self.buffer:
+            length = self.buffer[0]
+            if len(self.buffer) < length + 1:
+                break
+            frame = bytes(self.buffer[1:length + 1])
+            del self.buffer[:length + 1]
+            decoded = decode_frame(frame)
+            if decoded is not None:
+                frames.append(decoded)
+        return frames
+
+
+def decode_frame(frame):
+    """Decode one frame without the length byte"""
+    if len(frame) < FRAME_HEADER.size:
+        return None
+    frame_type, timestamp, rssi, snr = FRAME_HEADER.unpack_from(frame)
+    if (frame_type & ~FLAG_DECRYPTED) != FRAME_PACKET:
+        return None
+    packet = frame[FRAME_HEADER.size:]
+    result = {"timestamp": timestamp, "rssi": rssi, "snr": snr, "packet": packet,
+              "decrypted": bool(frame_type & FLAG_DECRYPTED)}
+    if len(packet) >= P2P_HEADER.size and packet[0] == P2P_MARKER:
+        _, p2p_type, _, _, src, dst, seq, ttl = P2P_HEADER.unpack_from(packet)
+        result.update({"type": p2p_type, "src": src, "dst": dst, "seq": seq, "ttl": ttl,
+                       "payload": packet[P2P_HEADER.size:]})
+    return result
+
+
+def main():
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "rb") as capture:
+            data = capture.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    decoder = GatewayDecoder()
+    for frame in decoder.feed(data):
+        line = "%10d ms RSSI %4d SNR %3d" % (frame["timestamp"], frame["rssi"], frame["snr"])
+        if frame["decrypted"]:
+            line += " decrypted"
+        if "src" in frame:
+            line += " src %04X dst %04X seq %5d type %02X: %s" % (
+                frame["src"], frame["dst"], frame["seq"], frame["type"], frame["payload"].hex(" "))
+        else:
+            line += " raw: %s" % frame["packet"].hex(" ")
+        print(line)
+    if decoder.buffer:
+        print("%d bytes of an incomplete frame left" % len(decoder.buffer), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,482 @@
+#!/usr/bin/env python3
+"""
+Simulated LoRa P2P channel to estimate what the P2P example delivers
+before going to the field.
+
+This is not the firmware code running on the host. The fragmentation,
+benchmark, network time and relay logic are written again in Python
+after frag.cpp, bench.cpp, timesync.cpp and relay.cpp, with the same
+constants. Changes of these files have to be repeated here.
+
+The timing follows the firmware: time on air as in p2p_time_on_air_us()
+(lora.cpp), 100 ms CAD and processing gap between packets, P2P header
+12 bytes, encryption overhead 10 bytes. Packets that are sent by the loop
+task, one per timer event, are at least 510 ms apart, because loop()
+waits with delay(500) and delay(10) after every event. Packets are lost
+independently with the given packet error rate.
+
+    python3 p2p_sim.py frag --blob 1000 --per 0 0.01 0.05 0.1
+    python3 p2p_sim.py bench sweep --count 20 --len 32 --snr 0
+    python3 p2p_sim.py timesync --interval 60 --drift 20 --per 0.1
+    python3 p2p_sim.py relay --topology line --nodes 6 --per 0.1
+
+The bench command prints the same report lines as the benchmark of the
+firmware (bench.cpp), so simulated and measured results can be compared
+line by line.
+"""
+import argparse
+import heapq
+import math
+import random
+
+P2P_HEADER_LEN = 12
+P2P_CRYPTO_OVERHEAD = 10
+PACKET_GAP_MS = 100
+LOOP_DELAY_MS = 500
+LOOP_WAKE_MS = LOOP_DELAY_MS + 10
+BW_KHZ = {0: 125, 1: 250, 2: 500}
+
+
+def symbol_time_us(sf, bw):
+    """Symbol time as in p2p_symbol_time_us()"""
+    return ((1 << sf) * 1000) // BW_KHZ[bw]
+
+
+def time_on_air_us(sf, bw, length, preamble=8, cr=1):
+    """Time on air as in p2p_time_on_air_us(), explicit header, CRC on"""
+    symbol_us = symbol_time_us(sf, bw)
+    low_dr = 1 if symbol_us >= 16000 else 0
+    numerator = 8 * length - 4 * sf + 28 + 16
+    denominator = 4 * (sf - 2 * low_dr)
+    payload_symbols = 8
+    if numerator > 0:
+        payload_symbols += -(-numerator // denominator) * (cr + 4)
+    return ((preamble * 4 + 17) * symbol_us) // 4 + payload_symbols * symbol_us
+
+
+def packet_time_s(sf, bw, length):
+    """Time on air plus the gap to the next packet"""
+    return time_on_air_us(sf, bw, length) / 1e6 + PACKET_GAP_MS / 1000.0
+
+
+def loop_packet_time_s(sf, bw, length):
+    """Time between packets sent by the loop task, the next timer event waits for the loop delay"""
+    return max(packet_time_s(sf, bw, length), LOOP_WAKE_MS / 1000.0)
+
+
+# Fragmentation, see frag.cpp
+FRAG_HEADER_LEN = 7
+FRAG_FEC_GROUP = 4
+FRAG_MAX_ATTEMPTS = 5
+
+
+def frag_payload_size(sf):
+    """Blob bytes per fragment as in frag_payload_size()"""
+    if sf >= 10:
+        max_packet = 51
+    elif sf == 9:
+        max_packet = 115
+    else:
+        max_packet = 222
+    return max_packet - P2P_HEADER_LEN - P2P_CRYPTO_OVERHEAD - FRAG_HEADER_LEN
+
+
+def frag_send_once(sf, bw, blob_len, per, fec, rng):
+    """Send a blob once, return (airtime in s, True if the receiver got it)"""
+    frag_size = frag_payload_size(sf)
+    count = -(-blob_len // frag_size)
+    packet_len = P2P_HEADER_LEN + FRAG_HEADER_LEN + frag_size + P2P_CRYPTO_OVERHEAD
+    airtime = 0.0
+    complete = True
+    for first in range(0, count, FRAG_FEC_GROUP):
+        group = min(FRAG_FEC_GROUP, count - first)
+        lost = sum(1 for _ in range(group) if rng.random() < per)
+        airtime += group * loop_packet_time_s(sf, bw, packet_len)
+        if fec:
+            airtime += loop_packet_time_s(sf, bw, packet_len)
+            parity_lost = rng.random() < per
+            if lost > 1 or (lost == 1 and parity_lost):
+                complete = False
+        elif lost:
+            complete = False
+    return airtime, complete
+
+
+def frag_goodput(sf, bw, blob_len, per, fec, runs, rng):
+    """Average goodput in byte/s, the whole blob is repeated until it arrives"""
+    total_time = 0.0
+    delivered = 0
+    for _ in range(runs):
+        for _ in range(FRAG_MAX_ATTEMPTS):
+            airtime, complete = frag_send_once(sf, bw, blob_len, per, fec, rng)
+            total_time += airtime
+            if complete:
+                delivered += blob_len
+                break
+    return delivered / total_time if total_time else 0.0
+
+
+def cmd_frag(args):
+    rng = random.Random(args.seed)
+    print("Blob %d bytes, BW %d kHz, %d runs, up to %d attempts per blob"
+          % (args.blob, BW_KHZ[args.bw], args.runs, FRAG_MAX_ATTEMPTS))
+    print("%-4s %-10s %-8s %s" % ("SF", "fragment", "PER", "goodput byte/s without / with FEC"))
+    for sf in range(7, 13):
+        for per in args.per:
+            plain = frag_goodput(sf, args.bw, args.blob, per, False, args.runs, rng)
+            fec = frag_goodput(sf, args.bw, args.blob, per, True, args.runs, rng)
+            print("%-4d %-10d %-8.3f %8.1f / %8.1f" % (sf, frag_payload_size(sf), per, plain, fec))
+
+
+# Benchmark, see bench.cpp
+BENCH_FRAME_LEN = 17
+BENCH_RETRIES = 3
+BENCH_REPLY_TIME = 1500
+BENCH_PING_GAP = 100
+# delay(10) in on_rx_done()
+RX_PROCESSING_MS = 10
+
+
+def cad_time_ms(sf, bw):
+    """CAD time with the default symbols of cad.cpp"""
+    symbols = 4 if sf <= 8 else 2
+    return ((symbols * 2 + 1) * symbol_time_us(sf, bw)) / 2000.0 + 2
+
+
+def link_per(sf, bw, cr, snr_125, per):
+    """Packet error rate, fixed or from the SNR margin above the demodulator limit"""
+    if per is not None:
+        return per
+    snr = snr_125 - 10 * math.log10(BW_KHZ[bw] / 125.0)
+    margin = snr - (-7.5 - 2.5 * (sf - 7)) + 0.5 * (cr - 1)
+    return 1.0 / (1.0 + math.exp(1.5 * margin))
+
+
+def frame_len(length, encrypt):
+    return P2P_HEADER_LEN + length + (P2P_CRYPTO_OVERHEAD if encrypt else 0)
+
+
+def send_time_ms(sf, bw, cr, length, encrypt):
+    """CAD, time on air and TX done handling of one packet"""
+    return cad_time_ms(sf, bw) + time_on_air_us(sf, bw, frame_len(length, encrypt), cr=cr) / 1000.0 + 1
+
+
+def bench_ping(args, sf, bw, cr, rng):
+    """The responder answers from its loop task, which waits LOOP_WAKE_MS after every event"""
+    per = link_per(sf, bw, cr, args.snr, args.per)
+    one_way = send_time_ms(sf, bw, cr, BENCH_FRAME_LEN, args.encrypt)
+    timeout = 2 * time_on_air_us(sf, bw, frame_len(BENCH_FRAME_LEN, args.encrypt), cr=cr) / 1000.0 + BENCH_REPLY_TIME
+    now = 0.0
+    responder_busy = 0.0
+    rtts = []
+    turns = []
+    for _ in range(args.count):
+        start = now
+        now = start + timeout
+        if rng.random() >= per:
+            ping_rx = start + one_way + RX_PROCESSING_MS
+            reply = max(ping_rx, responder_busy)
+            responder_busy = reply + one_way + LOOP_WAKE_MS
+            if rng.random() >= per:
+                now = reply + one_way + RX_PROCESSING_MS
+                rtts.append(int(now - start - (reply - ping_rx)))
+                turns.append(int(reply - ping_rx))
+        now += BENCH_PING_GAP
+    received = len(rtts)
+    if not received:
+        return "PING SF%d BW%d CR%d n=%d rx=0" % (sf, bw, cr, args.count)
+    return "PING SF%d BW%d CR%d n=%d rx=%d rtt=%d/%d/%d ms turn=%d ms" % (
+        sf, bw, cr, args.count, received, min(rtts), sum(rtts) // received, max(rtts), sum(turns) // received)
+
+
+def bench_flood(args, sf, bw, cr, rng):
+    per = link_per(sf, bw, cr, args.snr, args.per)
+    duration = args.count * send_time_ms(sf, bw, cr, args.len, args.encrypt)
+    received = sum(1 for _ in range(args.count) if rng.random() >= per)
+    report = False
+    for _ in range(BENCH_RETRIES):
+        if rng.random() >= per and rng.random() >= per:
+            report = True
+            break
+    if not report:
+        return "FLOOD SF%d BW%d CR%d len=%d tx=%d no report" % (sf, bw, cr, args.len, args.count)
+    per_permille = ((args.count - received) * 1000) // args.count
+    goodput = int(received * args.len * 1000 / duration)
+    snr = args.snr - 10 * math.log10(BW_KHZ[bw] / 125.0)
+    return "FLOOD SF%d BW%d CR%d len=%d tx=%d rx=%d per=%d.%d%% gp=%d B/s rssi=%d snr=%d" % (
+        sf, bw, cr, args.len, args.count, received, per_permille // 10, per_permille % 10, goodput, args.rssi, int(snr))
+
+
+def cmd_bench(args):
+    rng = random.Random(args.seed)
+    args.len = min(max(args.len, BENCH_FRAME_LEN), 200)
+    if args.test == "ping":
+        print(bench_ping(args, args.sf, args.bw, args.cr, rng))
+    elif args.test == "flood":
+        print(bench_flood(args, args.sf, args.bw, args.cr, rng))
+    else:
+        for sf in range(7, 13):
+            for bw in range(3):
+                for cr in range(1, 5):
+                    print(bench_flood(args, sf, bw, cr, rng))
+        print("SWEEP done")
+
+
+# Network time, see timesync.cpp
+TS_SAMPLES = 8
+
+
+class ClockModel:
+    """Clock model of timesync.cpp, master = local + offset + drift * (local - ref)"""
+
+    def __init__(self):
+        self.samples = []
+        self.synced = False
+        self.coarse = False
+        self.ref = 0
+        self.offset = 0.0
+        self.drift = 0.0
+
+    def to_network(self, local):
+        if not self.synced:
+            return local
+        return local + self.offset + self.drift * (local - self.ref)
+
+    def coarse_sync(self, local, master):
+        self.ref = local
+        self.offset = master - local
+        self.drift = 0.0
+        self.synced = True
+        self.coarse = True
+
+    def add_sample(self, local, master):
+        """Add a follow up pair, return the error of the model before the update"""
+        err = None
+        if self.synced and not self.coarse:
+            err = master - self.to_network(local)
+        self.samples = (self.samples + [(local, master)])[-TS_SAMPLES:]
+        self.ref = local
+        xs = [l - self.ref for l, _ in self.samples]
+        ys = [m - l for l, m in self.samples]
+        n = len(self.samples)
+        denominator = n * sum(x * x for x in xs) - sum(xs) ** 2
+        if n < 2 or denominator == 0:
+            self.offset = master - local
+        else:
+            self.drift = (n * sum(x * y for x, y in zip(xs, ys)) - sum(xs) * sum(ys)) / denominator
+            self.offset = (sum(ys) - self.drift * sum(xs)) / n
+        self.synced = True
+        self.coarse = False
+        return err
+
+
+def cmd_timesync(args):
+    rng = random.Random(args.seed)
+    drift = args.drift * 1e-6
+    boot_offset = rng.uniform(0, 3600e6)
+    model = ClockModel()
+    toa = time_on_air_us(args.sf, args.bw, P2P_HEADER_LEN + 20, cr=1)
+
+    def local_time(t):
+        return boot_offset + t * (1 + drift)
+
+    prev_tx_done = None
+    prev_rx = None
+    beacon_errors = []
+    true_errors = []
+    for k in range(1, args.beacons + 1):
+        t_send = k * args.interval * 1e6
+        t_tx_done = t_send + cad_time_ms(args.sf, args.bw) * 1000 + toa
+        tx_stamp = t_tx_done + rng.uniform(0, args.latency)
+        received = rng.random() >= args.per
+        if received:
+            rx_local = local_time(t_tx_done + args.bias + rng.uniform(0, args.latency))
+            if prev_rx is not None and prev_tx_done is not None and prev_rx[0] == k - 1:
+                err = model.add_sample(prev_rx[1], prev_tx_done)
+                if err is not None:
+                    beacon_errors.append(err)
+            elif not model.synced:
+                model.coarse_sync(rx_local, t_send + toa)
+            prev_rx = (k, rx_local)
+        prev_tx_done = tx_stamp
+        # Error an application sees at a random time until the next beacon
+        if model.synced and not model.coarse:
+            t = t_send + rng.uniform(0, args.interval * 1e6)
+            true_errors.append(model.to_network(local_time(t)) - t)
+
+    def stats(values):
+        if not values:
+            return "n/a"
+        return "avg %.1f us, max %.1f us" % (sum(abs(v) for v in values) / len(values), max(abs(v) for v in values))
+
+    print("%d beacons every %d s, SF%d, drift %.1f ppm, loss %.0f%%, IRQ latency 0..%d us"
+          % (args.beacons, args.interval, args.sf, args.drift, args.per * 100, args.latency))
+    print("Error at the beacons (as reported by TIME): %s" % stats(beacon_errors))
+    print("Error between the beacons:                  %s" % stats(true_errors))
+    print("Estimated drift %.3f ppm" % (-model.drift / (1 + model.drift) * 1e6 if model.synced else 0))
+
+
+# Relay, see relay.cpp
+RELAY_CACHE_SIZE = 32
+RELAY_QUEUE_SIZE = 4
+RELAY_MIN_DELAY = 50
+RELAY_DELAY_PER_DB = 10
+RELAY_JITTER = 50
+RELAY_RSSI_FLOOR = -140
+RELAY_PACKET_LEN = 32
+
+
+def relay_topology(kind, nodes):
+    """Node positions, node 0 is the collector"""
+    if kind == "line":
+        return [(float(idx), 0.0) for idx in range(nodes)]
+    side = int(math.ceil(math.sqrt(nodes)))
+    return [(float(idx % side), float(idx // side)) for idx in range(nodes)]
+
+
+def relay_links(positions, link_range, per):
+    """Links within range, the PER grows and the RSSI falls with the distance"""
+    links = {}
+    for a, pos_a in enumerate(positions):
+        for b, pos_b in enumerate(positions):
+            dist = math.hypot(pos_a[0] - pos_b[0], pos_a[1] - pos_b[1])
+            if a != b and dist <= link_range:
+                links.setdefault(a, []).append((b, min(1.0, per * dist), -100 - 20 * dist))
+    return links
+
+
+class RelayNode:
+    """Duplicate cache and rebroadcast queue of relay.cpp"""
+
+    def __init__(self):
+        self.cache = []
+        self.pending = {}
+
+    def is_duplicate(self, key):
+        if key in self.cache:
+            # Somebody else forwarded it first
+            self.pending.pop(key, None)
+            return True
+        self.cache = (self.cache + [key])[-RELAY_CACHE_SIZE:]
+        return False
+
+
+def relay_flood(src, seq, ttl, nodes, links, sf, bw, rng, stats):
+    """Flood one packet, return the number of hops to the collector or None"""
+    toa_ms = time_on_air_us(sf, bw, RELAY_PACKET_LEN) / 1000.0
+    events = [(0.0, src, ttl, 0)]
+    delivered = None
+    while events:
+        tx_time, sender, hops_left, hops = heapq.heappop(events)
+        if sender != src:
+            if (src, seq) not in nodes[sender].pending:
+                continue
+            del nodes[sender].pending[(src, seq)]
+            stats["relayed"] += 1
+        stats["tx"] += 1
+        rx_time = tx_time + toa_ms
+        for receiver, per, rssi in links.get(sender, []):
+            if rng.random() < per or receiver == src:
+                continue
+            if nodes[receiver].is_duplicate((src, seq)):
+                stats["deduplicated"] += 1
+                continue
+            if receiver == 0:
+                if delivered is None:
+                    delivered = hops
+                continue
+            if hops_left == 0:
+                stats["expired"] += 1
+                continue
+            if len(nodes[receiver].pending) >= RELAY_QUEUE_SIZE:
+                stats["dropped"] += 1
+                continue
+            margin = max(0, rssi + rng.uniform(-3, 3) - RELAY_RSSI_FLOOR)
+            due = rx_time + RELAY_MIN_DELAY + margin * RELAY_DELAY_PER_DB + rng.uniform(0, RELAY_JITTER)
+            # Broadcasts wake the loop task, the relay timer waits for its delay
+            due = max(due, rx_time + LOOP_DELAY_MS)
+            nodes[receiver].pending[(src, seq)] = True
+            heapq.heappush(events, (due + cad_time_ms(sf, bw), receiver, hops_left - 1, hops + 1))
+    return delivered
+
+
+def cmd_relay(args):
+    rng = random.Random(args.seed)
+    positions = relay_topology(args.topology, args.nodes)
+    links = relay_links(positions, args.range, args.per)
+    print("%s of %d nodes, collector is node 0, range %.1f, PER %.2f per unit distance, SF%d"
+          % (args.topology, args.nodes, args.range, args.per, args.sf))
+    print("%-4s %-10s %-10s %-12s %-12s %s" % ("ttl", "delivered", "avg hops", "tx/packet", "dedup/packet", "expired"))
+    for ttl in range(args.ttl + 1):
+        nodes = [RelayNode() for _ in positions]
+        stats = dict(tx=0, relayed=0, deduplicated=0, expired=0, dropped=0)
+        delivered = []
+        sent = 0
+        for seq in range(args.packets):
+            for src in range(1, args.nodes):
+                sent += 1
+                hops = relay_flood(src, seq, ttl, nodes, links, args.sf, args.bw, rng, stats)
+                if hops is not None:
+                    delivered.append(hops)
+        print("%-4d %-10s %-10s %-12.2f %-12.2f %d" % (
+            ttl, "%.1f%%" % (100.0 * len(delivered) / sent),
+            "%.2f" % (sum(delivered) / len(delivered)) if delivered else "n/a",
+            stats["tx"] / sent, stats["deduplicated"] / sent, stats["expired"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--seed", type=int, default=1)
+    commands = parser.add_subparsers(dest="command")
+
+    frag = commands.add_parser("frag", help="goodput of fragmented blobs with and without FEC")
+    frag.add_argument("--blob", type=int, default=1000, help="blob size in bytes, max 2048")
+    frag.add_argument("--bw", type=int, default=0, choices=[0, 1, 2], help="0: 125 kHz, 1: 250 kHz, 2: 500 kHz")
+    frag.add_argument("--per", type=float, nargs="+", default=[0.0, 0.01, 0.05, 0.1])
+    frag.add_argument("--runs", type=int, default=200)
+    frag.set_defaults(func=cmd_frag)
+
+    bench = commands.add_parser("bench", help="same tests as the BENCH command of the firmware")
+    bench.add_argument("test", choices=["ping", "flood", "sweep"])
+    bench.add_argument("--count", type=int, default=20, help="packets per test")
+    bench.add_argument("--len", type=int, default=32, help="payload size of flood packets")
+    bench.add_argument("--sf", type=int, default=7, choices=range(7, 13))
+    bench.add_argument("--bw", type=int, default=0, choices=[0, 1, 2], help="0: 125 kHz, 1: 250 kHz, 2: 500 kHz")
+    bench.add_argument("--cr", type=int, default=1, choices=range(1, 5), help="1: 4/5 .. 4: 4/8")
+    bench.add_argument("--snr", type=float, default=5.0, help="SNR of the link at 125 kHz in dB")
+    bench.add_argument("--rssi", type=int, default=-100, help="RSSI reported for the link in dBm")
+    bench.add_argument("--per", type=float, default=None, help="fixed packet error rate instead of the SNR model")
+    bench.add_argument("--encrypt", action="store_true", help="encrypt_enable is set")
+    bench.set_defaults(func=cmd_bench)
+
+    timesync = commands.add_parser("timesync", help="sync error of the network time")
+    timesync.add_argument("--beacons", type=int, default=100)
+    timesync.add_argument("--interval", type=int, default=60, help="beacon interval in seconds")
+    timesync.add_argument("--drift", type=float, default=20.0, help="clock drift of the node against the master in ppm")
+    timesync.add_argument("--per", type=float, default=0.0, help="beacon loss rate")
+    timesync.add_argument("--latency", type=int, default=30, help="DIO1 interrupt latency jitter in us")
+    timesync.add_argument("--bias", type=float, default=0.0, help="RX done later than TX done in us")
+    timesync.add_argument("--sf", type=int, default=7, choices=range(7, 13))
+    timesync.add_argument("--bw", type=int, default=0, choices=[0, 1, 2])
+    timesync.set_defaults(func=cmd_timesync)
+
+    relay = commands.add_parser("relay", help="delivery ratio of relayed packets on multi-hop topologies")
+    relay.add_argument("--topology", choices=["line", "grid"], default="line")
+    relay.add_argument("--nodes", type=int, default=6, help="number of nodes including the collector")
+    relay.add_argument("--range", type=float, default=1.5, help="radio range in node distances")
+    relay.add_argument("--per", type=float, default=0.1, help="packet error rate of a link with distance 1")
+    relay.add_argument("--ttl", type=int, default=3, help="highest relay_max_hops to simulate")
+    relay.add_argument("--packets", type=int, default=100, help="packets per node")
+    relay.add_argument("--sf", type=int, default=7, choices=range(7, 13))
+    relay.add_argument("--bw", type=int, default=0, choices=[0, 1, 2])
+    relay.set_defaults(func=cmd_relay)
+
+    args = parser.parse_args()
+    if not args.command:
+        parser.print_help()
+        return
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()